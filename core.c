@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <limits.h>
@@ -6,14 +8,28 @@
 #include <sys/mman.h>
 #include <semaphore.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <execinfo.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include "core.h"
 
 // Global Variables
 sem_t g_semProcessLock; // Lock to access resrouce that all threads share
 long int g_iPageSize = 0; // Page Size
-unsigned char* g_pProcessMetaData = NULL;  // The address of the first page of Process MetaData
-unsigned long int g_uiProcessMetaDataPageCounts = 0;  // The number of Process MetaData pages (How many pages are used to store Process MetaData)
-unsigned long int g_uiRegisteredThreadCounts = 0; // The number of thread Arenas that have been created (Each thread has its own Arena)
+unsigned char* g_pProcessMetaDirectory[MAX_PROCESS_META_PAGES];  // The address of each Process MetaData page by its index ( Set once, and never moved )
+unsigned long int g_uiRegisteredThreadCounts = 0; // The number of slots claimed in Process MetaData ( Each Thread Arena takes one. See RegisterArena() )
+
+// The Persistent Arenas the calling process has open, and the descriptor of the file of each ( NULL : A free slot )
+// A descriptor only means something in the process, so it is kept here rather than in the file. Both are accessed under g_semProcessLock.
+unsigned char* g_pPersistentArenaList[MAX_PERSISTENT_ARENAS];
+int g_iPersistentArenaFdList[MAX_PERSISTENT_ARENAS];
 
 // Offsets to each array in a Process Metadata page
 unsigned long int g_uiThreadList_Offset; // offset to the array of Thread IDs .
@@ -38,30 +54,153 @@ unsigned long int g_uiArenaSize_Offset;
 // Offset to where the number of Bins is stored 
 unsigned long int g_uiBinNums_Offset;
 
+// Offset to where the number of Thread Arena Metadata pages is stored
+unsigned long int g_uiMetaPageNums_Offset;
+
+// Offset to where the number of Bin Metadata pool entries ( TMO_BIN_META_POOL ) is stored
+unsigned long int g_uiBinMetaNums_Offset;
+
+// Offset to where the address of the lock of the Thread Arena is stored ( The lock itself is in Process Metadata )
+unsigned long int g_uiArenaLock_Offset;
+
+// Offset to where the number of threads using the Thread Arena is stored ( EAM_POOL )
+unsigned long int g_uiArenaThreadNums_Offset;
+
+// Offset to where the number of times the lock of the Thread Arena was found taken is stored
+unsigned long int g_uiArenaContentions_Offset;
+
+// Offsets to where the start, the size, the part handed out to Bins and the part made accessible of the address space reserved for the Thread Arena are stored ( See CommitArenaPages() )
+unsigned long int g_uiArenaReserveStart_Offset;
+unsigned long int g_uiArenaReserveSize_Offset;
+unsigned long int g_uiArenaReserveUsed_Offset;
+unsigned long int g_uiArenaReserveCommitted_Offset;
+
+// Offset to where the number of Bins mapped outside the reserved address space is stored
+unsigned long int g_uiArenaOutsideBins_Offset;
+
+// Offset to where the address of the instrumentation counters of the Thread Arena is stored ( See GetArenaStats() )
+unsigned long int g_uiArenaStats_Offset;
+
+// Offset to where the number of pages of the next Bin for small requests is stored ( See GetNewBinPageNums() )
+unsigned long int g_uiArenaNextBinPageNums_Offset;
+
+// Offset to where the lock of an explicit Arena is stored ( Explicit Arenas are not registered in Process Metadata )
+unsigned long int g_uiArenaOwnLock_Offset;
+
+#ifdef FIXED_PAGE_SIZE
+// Whether every call goes to the generic build linked into this library ( The system does not match the layout this build was compiled for )
+int g_iUseGenericBuild = 0;
+#else
+// Defined by the fixed page size build when this build is linked into libmalloc-4k.so ( See Makefile ), and NULL in libmalloc.so
+extern int g_iUseGenericBuild __attribute__((weak));
+#endif
+
+// Whether the constructor has set this build up ( See myconstructor() )
+int g_iConstructed = 0;
+
+// How Thread Arenas are assigned to threads ( ARENA_MODE )
+int g_iArenaMode = EAM_THREAD;
+
+// For EAM_PER_CPU, the Thread Arena of each CPU ( NULL until the first allocation on that CPU )
+unsigned char** g_pCpuArenaList = NULL;
+unsigned long int g_uiCpuArenaNums = 0;
+
+// For EAM_POOL, the maximum number of Thread Arenas
+unsigned long int g_uiMaxArenaNums = 0;
+
+// The key whose destructor detaches an exiting thread from its Thread Arena ( EAM_THREAD and EAM_POOL )
+pthread_key_t g_keyThreadArena;
+int g_iThreadArenaKeyCreated = 0;
+
+// The size of the address space each Thread Arena reserves for its Bins ( 0 : Each Bin is mapped on its own )
+unsigned long int g_uiArenaReserveSize = DEFAULT_ARENA_RESERVE_MB * 1024 * 1024;
+
+// The number of Bins created with each new Thread Arena, and whether their pages are faulted in ( See PrewarmArena() )
+unsigned long int g_uiPrewarmBins = 0;
+int g_iPrewarmPopulate = 0;
+
+// Whether allocations, releases and lock waits are measured ( See GetArenaStats() )
+int g_iInstrumentation = 0;
+
+// Which free block an allocation is carved from ( See PLACEMENT_POLICY )
+int g_iPlacementPolicy = EPP_FIRST_FIT;
+
+// Whether the destructor prints the fragmentation report ( See DumpFragmentation() )
+int g_iFragDumpAtExit = 0;
+
+// The background thread ( See BackgroundThreadMain() )
+pthread_t g_thBackground;
+int g_iBackgroundRunning = 0;
+int g_iBackgroundStop = 0;
+sem_t g_semBackgroundWake;
+unsigned long int g_uiBackgroundIntervalMs = DEFAULT_BACKGROUND_INTERVAL_MS;
+unsigned long int g_uiDecayTicks = 1;	// The number of rounds a Bin stays empty before its pages are purged
+unsigned long int g_uiBinReserveNums = DEFAULT_BIN_RESERVE;
+unsigned long int g_uiLargeCacheSize = DEFAULT_LARGE_CACHE_MB * 1024 * 1024;	// The bytes of empty large Bins each Arena keeps in memory ( See MaintainArena() )
+unsigned long int g_uiLargeCacheOverflowSize = DEFAULT_LARGE_CACHE_OVERFLOW_MB * 1024 * 1024;	// The bytes of them all Arenas keep together beyond that
+
+// The Guarded Pool ( See InitGuardedPool() )
+// The pool and the record of each slot ( GSO_MAX values per slot )
+unsigned long int g_uiGuardPoolStart = 0;
+unsigned long int g_uiGuardPoolSize = 0;
+unsigned long int* g_pGuardSlots = NULL;
+unsigned long int g_uiGuardSlotNums = 0;
+unsigned long int g_uiGuardNextSlot = 0;	// Where the search for a slot starts ( Freed slots are reused as late as possible )
+unsigned long int g_uiGuardSampleRate = 0;
+sem_t g_semGuardLock;
+struct sigaction g_saPrevSegv;
+
+// State transition tables of the binary tree ( Built in the Constructor of this library )
+// The status of the left and the right child that each state describes
+unsigned char g_ucChildStatus[EBBS_MAX][ECS_MAX];
+// The status that a node in each state shows to its parent
+unsigned char g_ucNodeStatus[EBBS_MAX];
+// The new state of a parent, indexed by (the current state of the parent, the side of the child, the new state of the child)
+unsigned char g_ucParentState[EBBS_MAX][ECS_MAX][EBBS_MAX];
+// Whether the high(bit 0) and the low(bit 1) 4 bits of a byte are a node with one free child and one child in use
+unsigned char g_ucFreeBuddyMask[UCHAR_MAX + 1];
+
+// The scan kernel FindFreeBuddyNode() uses ( Chosen in the Constructor of this library depending on the CPU )
+void (*g_pfnScanFreeBuddies)(const unsigned char*, unsigned int*, unsigned int*) = ScanFreeBuddiesScalar;
+
 
 // Thread Local Storage variables ( to access its own Thread Arena Metadata )
+// The counters of a Thread Arena are stored in its first Metadata page, so that any thread holding the lock of the Arena can add Bins to it.
 __thread unsigned char* t_pThreadMetaData = NULL; // The address of the first page of Thread MetaData
-__thread unsigned long int t_uiBinNums = 0; // The number of Bins that have been created
-__thread unsigned long int t_uiThreadMeataDataPageCounts = 0; // The number of pages used to store Thread Arena MetaData
-__thread unsigned long int t_uiBinMetaNums = 0; // The number of Bin MetaData
 
-//For malloc_stats()
-__thread unsigned long int* t_pBinNums = NULL; //  The number of Bins that have been created on this Thread Arena
-__thread unsigned long int* t_pArenaSize = NULL; // The size of this Thread Arena, which is the sum of the size of Bins on this Arena
+// Allocations left until the next one sampled into the Guarded Pool, and the random state to pick that number ( See NextGuardCountdown() )
+__thread unsigned long int t_uiGuardCountdown = 1;
+__thread unsigned long int t_uiGuardSeed = 0;
 
- 
-// Each thread allocates and frees memory from its own arena, so in most cases, there needs no lock.
-// However, a thread can still free memory allocated by another thread, so that is why t_pThreadLock is needed.
-__thread sem_t* t_pThreadLock; // 
+// Lock acquisitions on the Thread Arena since the last rebalancing, and how many of them had to wait ( See RebalancePoolArena() )
+__thread unsigned long int t_uiLockAcquires = 0;
+__thread unsigned long int t_uiLockContentions = 0;
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+#ifdef FIXED_PAGE_SIZE
+// The constructor of the generic build linked into this library ( See Makefile )
+void generic_myconstructor();
+#endif
+
 // Constructor ( before main)
+// The dynamic linker binds the constructor listed by each library to the first definition of myconstructor() it finds,
+// so with libmalloc-4k.so preloaded into a program linked against libmalloc.so, this runs twice. Only the first call sets the build up.
 __attribute__((constructor))
 void myconstructor() 
 {
+#ifndef FIXED_PAGE_SIZE
+	// Linked into libmalloc-4k.so, this build is set up by the fixed page size build, and only when it hands every call over to it
+	// Whichever order the two constructors run in, this one returns until then.
+	if (&g_iUseGenericBuild && 0 == g_iUseGenericBuild)
+		return;
+#endif
+	
+	if (g_iConstructed)
+		return;
+	g_iConstructed = 1;
+	
 	sem_init(&g_semProcessLock, 1, 1);
-	t_pThreadLock = NULL;
 	
 	// Get the page size the system uses
 	g_iPageSize = sysconf(_SC_PAGESIZE);
@@ -69,22 +208,45 @@ void myconstructor()
 		g_iPageSize = DEFAULT_PAGE_SIZE;
 	
 	// Set up offsets for Process Metadata
+	// Thread IDs and the addresses of Thread Arenas are packed, and the locks start on the next cache line, one per line. ( See LOCK_SLOT_SIZE )
 	unsigned long int uiTypeSize = sizeof(unsigned long int);
-	unsigned long int uiHeaderLength = uiTypeSize * 2; // Current Address + Next Address
-	unsigned long int uiEntrySize = uiHeaderLength + sizeof(sem_t);
+	unsigned long int uiHeaderLength = uiTypeSize * 2; // Current Address + Page Index
+	unsigned long int uiEntrySize = (uiTypeSize * 2) + LOCK_SLOT_SIZE;
 	
-	g_uiMaxThreadNums = (g_iPageSize - uiHeaderLength) / uiEntrySize;
+	g_uiMaxThreadNums = (g_iPageSize - uiHeaderLength - CACHE_LINE_SIZE) / uiEntrySize;
 	g_uiThreadList_Offset = uiHeaderLength;
 	g_uiThreadMetaList_Offset = g_uiThreadList_Offset + (uiTypeSize *g_uiMaxThreadNums);
-	g_uiThreadLockList_Offset = g_uiThreadMetaList_Offset + (uiTypeSize *g_uiMaxThreadNums);
+	g_uiThreadLockList_Offset = ROUND_UP_TO_CACHE_LINE(g_uiThreadMetaList_Offset + (uiTypeSize *g_uiMaxThreadNums));
 	
 	// Set up offsets for Thread Arena Metadata
+	// Current Address + Next Address + Arena Size + Bin Nums + Metadata Page Nums + Bin Metadata Nums + Address of Lock + Thread Nums
+	// + Reserved Start + Reserved Size + Reserved Used + Reserved Committed + Outside Bins + Stats + Next Bin Page Nums
+	// + Contentions + Own Lock
+	// The fields above are read on every allocation and rarely written. The last two are written by every thread that takes the lock,
+	// so they start on a cache line of their own, and the arrays after them start on the next one.
+	// The size of each array is also a multiple of a cache line, so counters written on every allocation ( TMO_BIN_USED_BYTES, ... )
+	// never share a cache line with the addresses of the Bins other threads look up to free memory.
 	g_uiArenaSize_Offset = uiHeaderLength;
 	g_uiBinNums_Offset = g_uiArenaSize_Offset + uiTypeSize;
+	g_uiMetaPageNums_Offset = g_uiBinNums_Offset + uiTypeSize;
+	g_uiBinMetaNums_Offset = g_uiMetaPageNums_Offset + uiTypeSize;
+	g_uiArenaLock_Offset = g_uiBinMetaNums_Offset + uiTypeSize;
+	g_uiArenaThreadNums_Offset = g_uiArenaLock_Offset + uiTypeSize;
+	g_uiArenaReserveStart_Offset = g_uiArenaThreadNums_Offset + uiTypeSize;
+	g_uiArenaReserveSize_Offset = g_uiArenaReserveStart_Offset + uiTypeSize;
+	g_uiArenaReserveUsed_Offset = g_uiArenaReserveSize_Offset + uiTypeSize;
+	g_uiArenaReserveCommitted_Offset = g_uiArenaReserveUsed_Offset + uiTypeSize;
+	g_uiArenaOutsideBins_Offset = g_uiArenaReserveCommitted_Offset + uiTypeSize;
+	g_uiArenaStats_Offset = g_uiArenaOutsideBins_Offset + uiTypeSize;
+	g_uiArenaNextBinPageNums_Offset = g_uiArenaStats_Offset + uiTypeSize;
+	g_uiArenaContentions_Offset = ROUND_UP_TO_CACHE_LINE(g_uiArenaNextBinPageNums_Offset + uiTypeSize);
+	g_uiArenaOwnLock_Offset = g_uiArenaContentions_Offset + uiTypeSize;
+	uiHeaderLength = ROUND_UP_TO_CACHE_LINE(g_uiArenaOwnLock_Offset + sizeof(sem_t));
+	
 	uiEntrySize = uiTypeSize * TMO_MAX;
-	g_uiMaxBinNums = (g_iPageSize - (uiHeaderLength * 2))  / uiEntrySize;
+	g_uiMaxBinNums = ((g_iPageSize - uiHeaderLength)  / uiEntrySize) & ~(CACHE_LINE_SIZE / uiTypeSize - 1);
 
-	g_uiOffset[TMO_BIN] = g_uiBinNums_Offset + uiTypeSize;
+	g_uiOffset[TMO_BIN] = uiHeaderLength;
 	
 	unsigned long int uiNewOffset = uiTypeSize * g_uiMaxBinNums;
 	for (int i = 1; i < TMO_MAX; ++i)
@@ -100,7 +262,123 @@ void myconstructor()
 	// In this way, there needs 256 * 2 blocks, so actually, 512 bytes are used to store Metadata for a Bin that uses a single page.
 	g_uiMetaDataUnitSize = g_iPageSize / MIN_BLOCK_SIZE; // in Byte
 	
-	CreateNewProcessMetaPage(NULL);
+#ifdef FIXED_PAGE_SIZE
+	if (FIXED_PAGE_SIZE != g_iPageSize || ARENA_HEADER_LENGTH != g_uiOffset[TMO_BIN])
+	{
+		g_iUseGenericBuild = 1;
+		generic_myconstructor();
+		return;
+	}
+#endif
+	
+	InitBuddyStateTables();
+	
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		g_pfnScanFreeBuddies = ScanFreeBuddiesAVX2;
+	else if (__builtin_cpu_supports("sse2"))
+		g_pfnScanFreeBuddies = ScanFreeBuddiesSSE2;
+#endif
+	
+	long int iCpuNums = sysconf(_SC_NPROCESSORS_CONF);
+	if (iCpuNums <= 0)
+		iCpuNums = 1;
+	
+	if (0 == pthread_key_create(&g_keyThreadArena, ReleaseThreadArena))
+		g_iThreadArenaKeyCreated = 1;
+	
+	const char* pArenaMode = getenv(ENV_ARENA_MODE);
+	// One Thread Arena per CPU instead of one per thread
+	if (pArenaMode && 0 == strcmp(pArenaMode, "percpu"))
+	{
+		void* pList = mmap(NULL, sizeof(unsigned char*) * iCpuNums, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if ((void *)(-1) != pList)
+		{
+			g_pCpuArenaList = (unsigned char**)pList;
+			g_uiCpuArenaNums = iCpuNums;
+			g_iArenaMode = EAM_PER_CPU;
+		}
+	}
+	// A bounded number of Thread Arenas shared by all threads
+	else if (pArenaMode && 0 == strcmp(pArenaMode, "pool"))
+	{
+		unsigned long int uiMaxPerCpu = DEFAULT_ARENA_MAX_PER_CPU;
+		const char* pMaxPerCpu = getenv(ENV_ARENA_MAX_PER_CPU);
+		if (pMaxPerCpu && strtoul(pMaxPerCpu, NULL, 10) > 0)
+			uiMaxPerCpu = strtoul(pMaxPerCpu, NULL, 10);
+		
+		g_uiMaxArenaNums = uiMaxPerCpu * iCpuNums;
+		if (g_iThreadArenaKeyCreated)
+			g_iArenaMode = EAM_POOL;
+	}
+	
+	InitGuardedPool();
+	
+	const char* pReserve = getenv(ENV_ARENA_RESERVE_MB);
+	if (pReserve)
+		g_uiArenaReserveSize = strtoul(pReserve, NULL, 10) * 1024 * 1024;
+	
+	const char* pPrewarmBins = getenv(ENV_PREWARM_BINS);
+	if (pPrewarmBins)
+		g_uiPrewarmBins = strtoul(pPrewarmBins, NULL, 10);
+	
+	const char* pPrewarmPopulate = getenv(ENV_PREWARM_POPULATE);
+	if (pPrewarmPopulate && 0 != strcmp(pPrewarmPopulate, "0"))
+		g_iPrewarmPopulate = 1;
+	
+	CreateNewProcessMetaPage(0);
+	
+	const char* pInstrument = getenv(ENV_INSTRUMENT);
+	if (pInstrument && 0 != strcmp(pInstrument, "0"))
+		g_iInstrumentation = 1;
+	
+	const char* pFragDump = getenv(ENV_FRAG_DUMP);
+	if (pFragDump && 0 != strcmp(pFragDump, "0"))
+		g_iFragDumpAtExit = 1;
+	
+	const char* pPlacement = getenv(ENV_PLACEMENT);
+	if (pPlacement && 0 == strcmp(pPlacement, "best"))
+		g_iPlacementPolicy = EPP_BEST_FIT;
+	
+	const char* pBackground = getenv(ENV_BACKGROUND_THREAD);
+	if (pBackground && 0 != strcmp(pBackground, "0"))
+		StartBackgroundThread();
+}
+
+// Destructor ( after main returns or exit() is called )
+__attribute__((destructor))
+void mydestructor()
+{
+	// Runs twice like the constructor, or for a build that was never set up ( See myconstructor() )
+	if (0 == g_iConstructed)
+		return;
+	g_iConstructed = 0;
+	
+	StopBackgroundThread();
+	
+	if (g_iFragDumpAtExit)
+		DumpFragmentation();
+}
+
+// Print the instrumentation counters of an Arena ( Nothing if it has never been measured )
+void MallocStatsArenaCounters(unsigned long int* pStats_)
+{
+	if (NULL == pStats_)
+		return;
+	
+	unsigned long int uiAllocCalls = pStats_[ASO_ALLOC_CALLS];
+	fprintf(stderr, "Lock Waits : %lu ( %lu cycles )\n", pStats_[ASO_LOCK_WAITS], pStats_[ASO_LOCK_WAIT_CYCLES]);
+	fprintf(stderr, "New Bins : %lu ( %lu mmap/mprotect calls )\n", pStats_[ASO_NEW_BINS], pStats_[ASO_MAP_CALLS]);
+	fprintf(stderr, "Bins Scanned per Allocation : %lu.%02lu\n", uiAllocCalls ? pStats_[ASO_BINS_SCANNED] / uiAllocCalls : 0,
+		uiAllocCalls ? ((pStats_[ASO_BINS_SCANNED] * 100) / uiAllocCalls) % 100 : 0);
+	
+	// Bucket i counts the calls that took [2^i, 2^(i+1)) cycles
+	for (unsigned long int i = 0; i < STATS_HISTOGRAM_BUCKETS; ++i)
+	{
+		if (pStats_[ASO_MALLOC_HISTOGRAM + i] || pStats_[ASO_FREE_HISTOGRAM + i])
+			fprintf(stderr, "Latency 2^%lu cycles : %lu malloc, %lu free\n", i, pStats_[ASO_MALLOC_HISTOGRAM + i], pStats_[ASO_FREE_HISTOGRAM + i]);
+	}
 }
 
 // Print Malloc Statistics of each Arena
@@ -115,32 +393,41 @@ void MallocStatsThreadArena(unsigned char* pThreadMetaData_)
 	
 	fprintf(stderr, "Total Size : %lu\n", uiArenaSize);
 	fprintf(stderr, "Number of Bins : %lu\n", uiTotalBins);
+	if (EAM_POOL == g_iArenaMode)
+		fprintf(stderr, "Number of Threads : %lu\n", *(unsigned long int*)(pCurrentMeta + g_uiArenaThreadNums_Offset));
+	
+	fprintf(stderr, "Lock Contentions : %lu\n", *(unsigned long int*)(pCurrentMeta + g_uiArenaContentions_Offset));
+	if (*(unsigned long int*)(pCurrentMeta + g_uiArenaReserveStart_Offset))
+		fprintf(stderr, "Reserved Space : %lu ( %lu used, %lu committed )\n", *(unsigned long int*)(pCurrentMeta + g_uiArenaReserveSize_Offset),
+			*(unsigned long int*)(pCurrentMeta + g_uiArenaReserveUsed_Offset), *(unsigned long int*)(pCurrentMeta + g_uiArenaReserveCommitted_Offset));
+	
+	MallocStatsArenaCounters(*(unsigned long int**)(pCurrentMeta + g_uiArenaStats_Offset));
 	
 	if (0 == uiTotalBins || 0 == uiArenaSize)
 		return;
 	
-	unsigned long int* pBinList = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN]);
-	unsigned long int* pBinPageNumList = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN_PAGE_NUM]);
-	unsigned long int* pBinUsedBytes = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN_USED_BYTES]);
-	unsigned long int* pBinAllocReqs = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_ALLOC_REQUESTS]);
-	unsigned long int* pBinFreeReqs = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_FREE_REQUESTS]);
+	unsigned long int* pBinList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN));
+	unsigned long int* pBinPageNumList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_PAGE_NUM));
+	unsigned long int* pBinUsedBytes = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_USED_BYTES));
+	unsigned long int* pBinAllocReqs = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_ALLOC_REQUESTS));
+	unsigned long int* pBinFreeReqs = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_FREE_REQUESTS));
 	unsigned long int uiBinIndex = 0;
 	unsigned long int uiActualBinIndex = 0;
 	
 	while (uiActualBinIndex < uiTotalBins)
 	{
-		if (uiBinIndex >= g_uiMaxBinNums)
+		if (uiBinIndex >= MAX_BIN_NUMS)
 		{
 			uiBinIndex = 0;
 			pCurrentMeta = (unsigned char*)*(((unsigned long int*)pCurrentMeta) + 1);
 			if (NULL == pCurrentMeta)
 				return;
 			
-			pBinList = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN]);
-			pBinPageNumList = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN_PAGE_NUM]);
-			pBinUsedBytes = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN_USED_BYTES]);
-			pBinAllocReqs = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_ALLOC_REQUESTS]);
-			pBinFreeReqs = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_FREE_REQUESTS]);
+			pBinList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN));
+			pBinPageNumList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_PAGE_NUM));
+			pBinUsedBytes = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_USED_BYTES));
+			pBinAllocReqs = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_ALLOC_REQUESTS));
+			pBinFreeReqs = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_FREE_REQUESTS));
 			
 		}
 			
@@ -148,9 +435,9 @@ void MallocStatsThreadArena(unsigned char* pThreadMetaData_)
 			return;
 		
 		fprintf(stderr, "Bin %lu Info\n", uiActualBinIndex);
-		fprintf(stderr, "Total Size : %lu\n", pBinPageNumList[uiBinIndex] * g_iPageSize);
+		fprintf(stderr, "Total Size : %lu\n", pBinPageNumList[uiBinIndex] * SYSTEM_PAGE_SIZE);
 		fprintf(stderr, "Used Space : %lu\n", pBinUsedBytes[uiBinIndex]);
-		fprintf(stderr, "Free Space : %lu\n", (pBinPageNumList[uiBinIndex] * g_iPageSize) - pBinUsedBytes[uiBinIndex]);
+		fprintf(stderr, "Free Space : %lu\n", (pBinPageNumList[uiBinIndex] * SYSTEM_PAGE_SIZE) - pBinUsedBytes[uiBinIndex]);
 		fprintf(stderr, "Total Allocation Requests : %lu\n", pBinAllocReqs[uiBinIndex]);
 		fprintf(stderr, "Total Free Requests : %lu\n", pBinFreeReqs[uiBinIndex]);
 		fprintf(stderr, "===========================================\n");
@@ -165,14 +452,33 @@ void MallocStatsThreadArena(unsigned char* pThreadMetaData_)
 // Allocates uiSize_ bytes. The returned memory address will be a multiple of uiAlignment_, which must be a power of two.
 void* AllocateMemory(size_t uiAlignment_, size_t uiSize_)
 {
+	// Only a sampled allocation takes the slow path ( Every allocation does if the Guarded Pool is off )
+	if (0 == --t_uiGuardCountdown)
+	{
+		void* pGuarded = AllocateGuarded(uiAlignment_, uiSize_);
+		if (pGuarded)
+			return pGuarded;
+	}
+	
 	void* pAllocated = NULL;
-	// If this is the first time to functions of this library in this thread, create a new Arena for this thread.
-	if (NULL == t_pThreadMetaData && NULL == CreateNewThreadArena())
-		return NULL;	
-		
-	sem_wait(t_pThreadLock);
-	pAllocated = MallocFromThreadArena(uiSize_, uiAlignment_);
-	sem_post(t_pThreadLock);
+	unsigned char* pArena = GetCurrentArena();
+	if (NULL == pArena)
+		return NULL;
+	
+	unsigned long int* pStats = GetArenaStats(pArena);
+	unsigned long int uiStartCycles = pStats ? ReadCycles() : 0;
+	
+	sem_t* pLock = LockArena(pArena);
+	pAllocated = MallocFromThreadArena(uiSize_, uiAlignment_, pArena);
+	sem_post(pLock);
+	
+	if (pStats)
+		RecordLatency(pStats + ASO_MALLOC_HISTOGRAM, uiStartCycles);
+	
+	MALLOC_PROBE4(alloc, uiSize_, uiAlignment_, pAllocated, pArena);
+	
+	if (t_uiLockAcquires >= ARENA_REBALANCE_INTERVAL)
+		RebalancePoolArena();
 	
 	return pAllocated;
 }
@@ -184,830 +490,3491 @@ void FreeMemory(void* ptr)
 	if (NULL == ptr)
 		return;
 	
-	// If this is the first time to functions of this library in this thread, create a new Arena for this thread.
-	if (NULL == t_pThreadMetaData && NULL == CreateNewThreadArena())
+	if ((unsigned long int)ptr - g_uiGuardPoolStart < g_uiGuardPoolSize)
+	{
+		FreeGuarded(ptr);
+		return;
+	}
+	
+	unsigned char* pArena = GetCurrentArena();
+	if (NULL == pArena)
 		return;	
 	
-	sem_wait(t_pThreadLock);
-	unsigned long int uiResult = FreeFromThreadArena(ptr, t_pThreadMetaData);
-	sem_post(t_pThreadLock);
+	unsigned long int* pStats = GetArenaStats(pArena);
+	unsigned long int uiStartCycles = pStats ? ReadCycles() : 0;
+	
+	sem_t* pLock = LockArena(pArena);
+	unsigned long int uiResult = FreeFromThreadArena(ptr, pArena);
+	sem_post(pLock);
 	
 	if (ULONG_MAX == uiResult)
-		FreeFromAllArenas(ptr);
+		uiResult = FreeFromAllArenas(ptr, pArena);
+	
+	MALLOC_PROBE3(free, ptr, pArena, uiResult);
+	
+	if (pStats)
+		RecordLatency(pStats + ASO_FREE_HISTOGRAM, uiStartCycles);
 	
 	return;
 }
 
-// Print malloc statistics
-void MallocStats()
+// Free the memory space pointed to by ptr, which was allocated with uiSize_ bytes ( The larger of the size and the alignment for an aligned allocation )
+// The block is found from its size in its Bin ( See FreeSizedFromBin() ). A wrong size only costs the usual search.
+void FreeMemorySized(void* ptr, size_t uiSize_)
 {
-	if (NULL == g_pProcessMetaData)
+	if (NULL == ptr)
 		return;
 	
-	// Process Metadata are accessed with read-only operations here, so this function does not acquire a lock for Process Metadata.
-	// As mentioned in FreeFromAllThreadArenas(), it is possible that when this function loads g_uiRegisteredThreadCounts, 
-	// other information of the new Thread Arena may have not been updated to memory yet ( Because of Processor Memory ordering and differnt cache lines)
-	// If the old value of g_uiRegisteredThreadCounts was loaded, then there is no issue.
-	// Even if the new value of g_uiRegisteredThreadCounts was loaded, 
-	// it is likely that other information of the new Thread Arena will have been updated to memory by the time, this function starts searching on that new Thread Arena.
-	// This is beacuse this function loads g_uiRegisteredThreadCounts at the begining and searchs all the Thread Arena starting from the oldest one.
-	// In addition, this function does not search on the new Thread Arena if any information of the new Thread Arena contains old values.
+	if ((unsigned long int)ptr - g_uiGuardPoolStart < g_uiGuardPoolSize)
+	{
+		FreeGuarded(ptr);
+		return;
+	}
+	
+	unsigned char* pArena = GetCurrentArena();
+	if (NULL == pArena)
+		return;
+	
+	unsigned long int* pStats = GetArenaStats(pArena);
+	unsigned long int uiStartCycles = pStats ? ReadCycles() : 0;
+	
+	unsigned long int uiResult = ULONG_MAX;
+	unsigned long int uiBinIndex = 0;
+	sem_t* pLock = LockArena(pArena);
+	unsigned char* pCurrentMeta = FindBinOfAddress(ptr, pArena, &uiBinIndex);
+	if (pCurrentMeta)
+		uiResult = FreeFromArenaBin(ptr, pCurrentMeta, uiBinIndex, uiSize_);
+	sem_post(pLock);
+	
+	if (ULONG_MAX == uiResult)
+		uiResult = FreeFromAllArenas(ptr, pArena);
+	
+	MALLOC_PROBE3(free, ptr, pArena, uiResult);
+	
+	if (pStats)
+		RecordLatency(pStats + ASO_FREE_HISTOGRAM, uiStartCycles);
+}
+
+// Allocates uiNums_ blocks of uiSize_ bytes with a single lock acquisition, and stores their addresses in pOut_.
+// Return the number of blocks allocated
+unsigned long int AllocateMemoryBatch(size_t uiSize_, unsigned long int uiNums_, void** pOut_)
+{
+	unsigned char* pArena = GetCurrentArena();
+	if (NULL == pArena)
+		return 0;
+	
+	sem_t* pLock = LockArena(pArena);
+	unsigned long int uiAllocNums = MallocBatchFromThreadArena(uiSize_, MIN_MEMORY_ALIGNMENT, uiNums_, pOut_, pArena, 0);
+	sem_post(pLock);
+	
+	if (t_uiLockAcquires >= ARENA_REBALANCE_INTERVAL)
+		RebalancePoolArena();
+	
+	return uiAllocNums;
+}
+
+// Allocates uiSize_ bytes for a block being moved out of a sparse Bin ( See GetDefragHint() )
+// The block is placed in a Bin that is used at least as much as the Arena on average, so that sparse Bins drain and can be purged.
+// Only if no such Bin has room, it is allocated as AllocateMemory() does.
+void* AllocateMemoryDense(size_t uiSize_)
+{
+	unsigned char* pArena = GetCurrentArena();
+	if (NULL == pArena)
+		return NULL;
+	
+	void* pAllocated = NULL;
+	sem_t* pLock = LockArena(pArena);
+	MallocBatchFromThreadArena(uiSize_, MIN_MEMORY_ALIGNMENT, 1, &pAllocated, pArena, 1);
+	if (NULL == pAllocated)
+		pAllocated = MallocFromThreadArena(uiSize_, MIN_MEMORY_ALIGNMENT, pArena);
+	sem_post(pLock);
+	
+	MALLOC_PROBE4(alloc, uiSize_, MIN_MEMORY_ALIGNMENT, pAllocated, pArena);
 	
-	unsigned long int uiRegisteredThreadCounts = g_uiRegisteredThreadCounts;
-	unsigned char* pCurrentMeta = g_pProcessMetaData;
-	pthread_t* pThreadList = (pthread_t*)(pCurrentMeta + g_uiThreadList_Offset);
-	unsigned long* pThreadMetaList = (unsigned long int*)(pCurrentMeta + g_uiThreadMetaList_Offset);
-	sem_t* pThreadLockList = (sem_t*)(pCurrentMeta + g_uiThreadLockList_Offset);
-	unsigned long int uiThreadIndex = 0;
-	unsigned long int uiActualThreadIndex = 0;
+	return pAllocated;
+}
 
+// Free uiNums_ memory spaces pointed to by pPtrs_
+// Pointers are handled FREE_BATCH_CHUNK at a time under one lock acquisition of its own Arena.
+// Consecutive pointers in the same Bin skip the search for the Bin.
+// Pointers not allocated from its own Arena are freed one by one afterwards, as FreeMemory() does.
+void FreeMemoryBatch(void** pPtrs_, unsigned long int uiNums_)
+{
+	if (NULL == pPtrs_ || 0 == uiNums_)
+		return;
+	
+	unsigned char* pArena = GetCurrentArena();
+	if (NULL == pArena)
+		return;
 	
-	while (uiActualThreadIndex < uiRegisteredThreadCounts)
+	for (unsigned long int uiChunk = 0; uiChunk < uiNums_; uiChunk += FREE_BATCH_CHUNK)
 	{
-		if (uiThreadIndex >= g_uiMaxThreadNums)
+		unsigned long int uiChunkNums = uiNums_ - uiChunk;
+		if (uiChunkNums > FREE_BATCH_CHUNK)
+			uiChunkNums = FREE_BATCH_CHUNK;
+		
+		// Which pointers in this chunk were not freed from its own Arena
+		unsigned char ucMissed[FREE_BATCH_CHUNK / CHAR_BIT] = { 0 };
+		int bMissed = 0;
+		
+		unsigned char* pBinMeta = NULL;
+		unsigned long int uiBinIndex = 0;
+		unsigned long int uiBinStart = 0;
+		unsigned long int uiBinEnd = 0;
+		
+		sem_t* pLock = LockArena(pArena);
+		for (unsigned long int i = 0; i < uiChunkNums; ++i)
 		{
-			uiThreadIndex = 0;
-			pCurrentMeta = (unsigned char*)*(((unsigned long int*)pCurrentMeta) + 1);
-			if (NULL == pCurrentMeta)
-				return;
+			unsigned long int uiAddr = (unsigned long int)pPtrs_[uiChunk + i];
+			if (0 == uiAddr)
+				continue;
+			
+			if (uiAddr < uiBinStart || uiAddr >= uiBinEnd)
+			{
+				pBinMeta = FindBinOfAddress((void*)uiAddr, pArena, &uiBinIndex);
+				if (pBinMeta)
+				{
+					uiBinStart = ((unsigned long int*)(pBinMeta + TMO_OFFSET(TMO_BIN)))[uiBinIndex % MAX_BIN_NUMS];
+					uiBinEnd = uiBinStart + (SYSTEM_PAGE_SIZE * ((unsigned long int*)(pBinMeta + TMO_OFFSET(TMO_BIN_PAGE_NUM)))[uiBinIndex % MAX_BIN_NUMS]);
+				}
+				else
+				{
+					uiBinStart = 0;
+					uiBinEnd = 0;
+				}
+			}
 			
-			pThreadList = (pthread_t*)(pCurrentMeta + g_uiThreadList_Offset);
-			pThreadMetaList = (unsigned long int*)(pCurrentMeta + g_uiThreadMetaList_Offset);
-			pThreadLockList = (sem_t*)(pCurrentMeta + g_uiThreadLockList_Offset);
+			if (NULL == pBinMeta || ULONG_MAX == FreeFromArenaBin((void*)uiAddr, pBinMeta, uiBinIndex, 0))
+			{
+				ucMissed[i / CHAR_BIT] |= (1 << (i % CHAR_BIT));
+				bMissed = 1;
+			}
 		}
+		sem_post(pLock);
 		
-		// Old value Checking
-		if (pthread_equal(0, pThreadList[uiThreadIndex]))
-			continue;
-		
-		// Old value Checking
-		if (-1 == sem_wait(pThreadLockList + uiThreadIndex))
+		if (0 == bMissed)
 			continue;
 		
-		fprintf(stderr, "===========================================\n");
-		fprintf(stderr, "Arena %lu Info\n", uiActualThreadIndex);
-		
-		MallocStatsThreadArena((unsigned char*)(pThreadMetaList[uiThreadIndex]));
-		sem_post(pThreadLockList + uiThreadIndex);
-
-		++uiThreadIndex;
-		++uiActualThreadIndex;
+		for (unsigned long int i = 0; i < uiChunkNums; ++i)
+		{
+			if (0 == (ucMissed[i / CHAR_BIT] & (1 << (i % CHAR_BIT))))
+				continue;
+			
+			if ((unsigned long int)pPtrs_[uiChunk + i] - g_uiGuardPoolStart < g_uiGuardPoolSize)
+				FreeGuarded(pPtrs_[uiChunk + i]);
+			else
+				FreeFromAllArenas(pPtrs_[uiChunk + i], pArena);
+		}
 	}
-	
-	return;
 }
 
-// Create a new metadata page for the Thread Arena
-// If pNew_ are provided, then use the address as a new metata page.
-unsigned char* CreateNewProcessMetaPage(unsigned char* pNew_)
+// Create an explicit Arena
+// It is not tied to any thread and not registered in Process Metadata, so it has its own lock in its header.
+// NULL : No memory for its first Metadata page
+unsigned char* CreateUserArena()
 {
-	unsigned char* pNewAddr = pNew_;
-	if (NULL == pNewAddr)
-	{
-		pNewAddr = (unsigned char*)mmap(NULL, g_iPageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-		if ((void *)(-1) == pNewAddr)
-		{
-			errno = ENOMEM;		
-			return NULL;
-		}
-	}
+	unsigned char* pNewArena = CreateNewThreadMeta(NULL, NULL);
+	if (NULL == pNewArena)
+		return NULL;
 	
-	*(unsigned long int*)pNewAddr = (unsigned long int)pNewAddr;
-	//*(((unsigned long int*)(pNewAddr)) + 1) = 0;
+	sem_t* pLock = (sem_t*)(pNewArena + g_uiArenaOwnLock_Offset);
+	sem_init(pLock, 1, 1);
+	*(sem_t**)(pNewArena + g_uiArenaLock_Offset) = pLock;
 	
-	unsigned char* pLastMeta = GetLastProcessMetaPage();
-	// If this is the first page of the ProcessMetadata
-	if (NULL == pLastMeta)
-		g_pProcessMetaData = pNewAddr;
-	else // Otherwise, add the newly created page to the end of the list
-		*(((unsigned long int*)(pLastMeta)) + 1) = (unsigned long int)pNewAddr;
+	return pNewArena;
+}
 
-	++g_uiProcessMetaDataPageCounts;
-	; 
+// Allocates uiSize_ bytes from an explicit Arena. The returned memory address will be a multiple of uiAlignment_, which must be a power of two.
+void* AllocateMemoryFromArena(unsigned char* pArena_, size_t uiAlignment_, size_t uiSize_)
+{
+	if (NULL == pArena_)
+		return NULL;
 	
-	return pNewAddr;
+	if (IsSharedArena(pArena_))
+		return AllocateFromSharedArena(pArena_, uiAlignment_, uiSize_);
+	
+	sem_t* pLock = LockArena(pArena_);
+	void* pAllocated = MallocFromThreadArena(uiSize_, uiAlignment_, pArena_);
+	sem_post(pLock);
+	
+	return pAllocated;
 }
 
+// Free memory allocated from an explicit Arena back to it
+// uiSize_ is the size it was allocated with ( The larger of the size and the alignment ), or 0 if it is not known.
+// ULONG_MAX : ptr was not allocated from the Arena
+// Otherwise, return the size of the freed memmory
+unsigned long int FreeMemoryToArena(unsigned char* pArena_, void* ptr, size_t uiSize_)
+{
+	if (NULL == pArena_ || NULL == ptr)
+		return ULONG_MAX;
+	
+	if (IsSharedArena(pArena_))
+		return FreeToSharedArena(pArena_, ptr, uiSize_);
+	
+	unsigned long int uiResult = ULONG_MAX;
+	unsigned long int uiBinIndex = 0;
+	sem_t* pLock = LockArena(pArena_);
+	unsigned char* pCurrentMeta = FindBinOfAddress(ptr, pArena_, &uiBinIndex);
+	if (pCurrentMeta)
+		uiResult = FreeFromArenaBin(ptr, pCurrentMeta, uiBinIndex, uiSize_);
+	sem_post(pLock);
+	
+	return uiResult;
+}
 
-// Create a new metadata page for the Thread Arena
-// If pNew_ are provided, then use the address as a new metata page.
-unsigned char* CreateNewThreadMeta(unsigned char* pNew_)
+// Destroy an explicit Arena and release all the memory allocated from it at once
+// Every Bin, every Bin Metadata page and every Thread Arena Metadata page is unmapped without looking at the blocks in it.
+// A Shared Arena is only unmapped from the calling process. Its blocks stay in the file for the other processes. ( See DetachSharedArena() )
+// No other thread must be using the Arena.
+void DestroyUserArena(unsigned char* pArena_)
 {
-	unsigned char* pNewAddr = pNew_;
-	if (NULL == pNewAddr)
+	if (NULL == pArena_)
+		return;
+	
+	if (IsSharedArena(pArena_))
 	{
-		pNewAddr = (unsigned char*)mmap(NULL, g_iPageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-		if ((void *)(-1) == pNewAddr)
+		DetachSharedArena(pArena_);
+		return;
+	}
+	
+	sem_destroy((sem_t*)(pArena_ + g_uiArenaOwnLock_Offset));
+	
+	void* pReserveStart = *(void**)(pArena_ + g_uiArenaReserveStart_Offset);
+	unsigned long int uiReserveSize = *(unsigned long int*)(pArena_ + g_uiArenaReserveSize_Offset);
+	void* pStats = *(void**)(pArena_ + g_uiArenaStats_Offset);
+	
+	// Pages inside the reserved address space go with it at the end.
+	// Unmapping them one by one first would leave holes that another thread could map something into before the reservation is unmapped.
+	unsigned char* pCurrentMeta = pArena_;
+	while (pCurrentMeta)
+	{
+		unsigned char* pNextMeta = (unsigned char*)*(((unsigned long int*)pCurrentMeta) + 1);
+		unsigned long int* pBinList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN));
+		unsigned long int* pBinPageNumList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_PAGE_NUM));
+		unsigned long int* pBinMetaPageList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_META_POOL));
+		unsigned long int* pBinMetaPageNumsList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_META_PAGE_NUM));
+		
+		// A Bin and the pages mapped with it are released separately, because munmap() works on any range of pages
+		for (unsigned long int i = 0; i < MAX_BIN_NUMS; ++i)
 		{
-			errno = ENOMEM;		
-			return NULL;
+			if (pBinList[i] && pBinList[i] - (unsigned long int)pReserveStart >= uiReserveSize)
+				munmap((void*)pBinList[i], SYSTEM_PAGE_SIZE * pBinPageNumList[i]);
+			
+			if (pBinMetaPageList[i] && pBinMetaPageList[i] - (unsigned long int)pReserveStart >= uiReserveSize)
+				munmap((void*)pBinMetaPageList[i], SYSTEM_PAGE_SIZE * pBinMetaPageNumsList[i]);
 		}
+		
+		if ((unsigned long int)pCurrentMeta - (unsigned long int)pReserveStart >= uiReserveSize)
+			munmap(pCurrentMeta, SYSTEM_PAGE_SIZE);
+		
+		pCurrentMeta = pNextMeta;
 	}
 	
-	*(unsigned long int*)pNewAddr = (unsigned long int)pNewAddr;
+	if (pReserveStart)
+		munmap(pReserveStart, uiReserveSize);
+	
+	if (pStats)
+		munmap(pStats, SYSTEM_PAGE_SIZE);
+}
 
-	unsigned char* pLastMeta = GetLastThreadMetaPage();
-	// If this is the first page of the ThreadMeta
-	if (NULL == pLastMeta)
+// Lay out a Shared Arena ( or a Persistent Arena if bPersistent_ is set ) that holds uiSize_ bytes in the empty file iFd_ ( See SHARED_ARENA_OFFSET )
+// The file is sized, and its header written and its lock set up.
+// Its single Bin serves requests of every size, so it tracks blocks of MIN_BLOCK_SIZE however large it is, unlike a coarse Bin. ( See GetBinMinBlockSize() )
+// -1 : The file could not be laid out ( errno is set )
+int LayOutSharedArena(int iFd_, size_t uiSize_, int bPersistent_)
+{
+	if (0 == uiSize_ || uiSize_ > MAX_REQUEST_SIZE)
 	{
-		t_pThreadMetaData = pNewAddr;
-		t_pArenaSize = (unsigned long int*)(t_pThreadMetaData + g_uiArenaSize_Offset);
-		t_pBinNums = (unsigned long int*)(t_pThreadMetaData + g_uiBinNums_Offset);
+		errno = EINVAL;
+		return -1;
 	}
-	// Otherwise, add the newly created page to the end of the list
-	else
-		*(((unsigned long int*)(pLastMeta)) + 1) = (unsigned long int)pNewAddr;
-
-	++t_uiThreadMeataDataPageCounts; 
 	
-	return pNewAddr;
+	unsigned long int uiBinPageNums = GetBinPageNums(uiSize_);
+	unsigned long int uiMinBlockSize = MIN_BLOCK_SIZE;
+	unsigned long int uiMetaPageNums = GetBinMetaPageNums(uiBinPageNums, uiMinBlockSize);
+	unsigned long int uiFileSize = SYSTEM_PAGE_SIZE * (1 + uiMetaPageNums + uiBinPageNums);
+	
+	// The file reads as zeros, so every block of the Bin starts free ( EBBS_FREE )
+	if (-1 == ftruncate(iFd_, uiFileSize))
+		return -1;
+	
+	unsigned long int* pHeader = (unsigned long int*)mmap(NULL, SYSTEM_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, iFd_, 0);
+	if ((void *)(-1) == pHeader)
+		return -1;
+	
+	pHeader[SAO_FILE_SIZE] = uiFileSize;
+	pHeader[SAO_PAGE_SIZE] = SYSTEM_PAGE_SIZE;
+	pHeader[SAO_META] = SYSTEM_PAGE_SIZE;
+	pHeader[SAO_BIN] = SYSTEM_PAGE_SIZE * (1 + uiMetaPageNums);
+	pHeader[SAO_BIN_PAGE_NUMS] = uiBinPageNums;
+	pHeader[SAO_MIN_BLOCK] = uiMinBlockSize;
+	pHeader[SAO_PERSISTENT] = bPersistent_ ? 1 : 0;
+	pHeader[SAO_VERSION] = SHARED_ARENA_VERSION;
+	sem_init((sem_t*)((unsigned char*)pHeader + SHARED_ARENA_LOCK_OFFSET), 1, 1);
+	
+	// A process that opens the file by its name meanwhile does not take it for an Arena until it is ready
+	__atomic_store_n(&pHeader[SAO_MAGIC], SHARED_ARENA_MAGIC, __ATOMIC_RELEASE);
+	munmap(pHeader, SYSTEM_PAGE_SIZE);
+	
+	return 0;
 }
 
-// Create a new Bin and Meta for that bin
-unsigned char* CreateNewBin(unsigned long int uiPageNums_, unsigned long int uiMetaPagesNums_)
+// Create a Shared Arena that holds uiSize_ bytes in a new shared memory file
+// pName_ is the name of a POSIX shared memory object to create ( shm_open() ), or NULL for an anonymous file ( memfd_create() ),
+// which other processes get by inheriting the descriptor or receiving it over a UNIX domain socket.
+// Each process then maps it with AttachSharedArena().
+// -1 : The file could not be created ( errno is set )
+// Otherwise, return the file descriptor
+int CreateSharedArena(const char* pName_, size_t uiSize_)
 {
-	unsigned long int uiMetadataSize = g_uiMetaDataUnitSize * uiPageNums_;
-	unsigned long int uiMetaPageIndex = t_uiBinNums  / g_uiMaxBinNums;
+	if (0 == uiSize_ || uiSize_ > MAX_REQUEST_SIZE)
+	{
+		errno = EINVAL;
+		return -1;
+	}
 	
-	unsigned long int uiPageNeeded = uiPageNums_;
-	if (uiMetaPageIndex >= t_uiThreadMeataDataPageCounts)
-		++uiPageNeeded;
+	int iFd = pName_ ? shm_open(pName_, O_RDWR | O_CREAT | O_EXCL, 0600) : memfd_create("libmalloc-arena", MFD_CLOEXEC);
+	if (-1 == iFd)
+		return -1;
 	
-	unsigned char* pBinMeta = GetLargeBinMetaPage(uiMetadataSize);
-	if (NULL == pBinMeta)
-		uiPageNeeded += uiMetaPagesNums_;
+	if (-1 == LayOutSharedArena(iFd, uiSize_, 0))
+	{
+		int iError = errno;
+		if (pName_)
+			shm_unlink(pName_);
+		close(iFd);
+		errno = iError;
+		return -1;
+	}
+	
+	return iFd;
+}
 
-	unsigned char* pNewAddr = (unsigned char*)mmap(NULL, g_iPageSize * uiPageNeeded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+// Map the Shared Arena of a file created by CreateSharedArena() into the calling process
+// The descriptor can be closed afterwards. Each call maps the file again, at another address.
+// With bPersistent_ set, the file must hold a Persistent Arena instead ( See OpenPersistentArena() ).
+// NULL : The file is not such an Arena laid out with the page size and the version of this library ( errno is set )
+unsigned char* AttachSharedArena(int iFd_, int bPersistent_)
+{
+	unsigned long int uiHeader[SAO_MAX];
+	struct stat stFile;
+	ssize_t iRead = pread(iFd_, uiHeader, sizeof(uiHeader), 0);
+	if (-1 == iRead || -1 == fstat(iFd_, &stFile))
+		return NULL;
 	
-	if ((void *)(-1) == pNewAddr)
+	if (sizeof(uiHeader) != iRead || SHARED_ARENA_MAGIC != uiHeader[SAO_MAGIC] || SHARED_ARENA_VERSION != uiHeader[SAO_VERSION] ||
+		(unsigned long int)SYSTEM_PAGE_SIZE != uiHeader[SAO_PAGE_SIZE] ||
+		(unsigned long int)stFile.st_size < uiHeader[SAO_FILE_SIZE] || (unsigned long int)(bPersistent_ ? 1 : 0) != uiHeader[SAO_PERSISTENT])
 	{
-		errno = ENOMEM;		
+		errno = EINVAL;
 		return NULL;
 	}
 	
-	if (uiMetaPageIndex >= t_uiThreadMeataDataPageCounts)
-	{
-		CreateNewThreadMeta(pNewAddr);
-		pNewAddr += g_iPageSize;
-	}
+	unsigned char* pArena = (unsigned char*)mmap(NULL, uiHeader[SAO_FILE_SIZE], PROT_READ | PROT_WRITE, MAP_SHARED, iFd_, 0);
+	if ((void *)(-1) == pArena)
+		return NULL;
 	
-	unsigned char* pBin = pNewAddr;
-	unsigned long int uiNewBinIndex =  t_uiBinNums  % g_uiMaxBinNums;
-	unsigned char* pCurrentThreadMeta = GetLastThreadMetaPage();
+	return pArena;
+}
+
+// Open the Persistent Arena of the file at pPath_, or create it to hold uiSize_ bytes if the file does not exist or is empty
+// A Persistent Arena is laid out as a Shared Arena, in a regular file. Blocks allocated from it and its root ( See SetArenaRoot() )
+// are still there when a process opens the file again, even after the previous one was killed, so a restarted process finds its data
+// where it was instead of rebuilding it, and only takes the page faults that read it back. uiSize_ is ignored for an existing Arena.
+// The file is locked ( flock() ) while it is open, so one process at a time has it. The lock goes with that process if it dies,
+// so the lock of the Arena is set up again here, and its counters are recounted from the tree of its Bin.
+// A process killed while it held that lock may have left the tree in the middle of a change. The change is journaled in the header,
+// and undone or finished here before anything else reads the tree. ( See RecoverPersistentArena() )
+// Whatever the kernel has not written to the disk yet is lost if the system goes down. SyncSharedArena() writes it at a point of the caller's choice.
+// NULL : The file could not be opened or created, is not a Persistent Arena, or another process has it open ( errno is set )
+//        EMFILE : The process has MAX_PERSISTENT_ARENAS open already
+unsigned char* OpenPersistentArena(const char* pPath_, size_t uiSize_)
+{
+	int iFd = open(pPath_, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (-1 == iFd)
+		return NULL;
 	
+	struct stat stFile;
+	unsigned char* pArena = NULL;
+	if (0 == flock(iFd, LOCK_EX | LOCK_NB) && 0 == fstat(iFd, &stFile) && (0 != stFile.st_size || 0 == LayOutSharedArena(iFd, uiSize_, 1)))
+		pArena = AttachSharedArena(iFd, 1);
 	
-	if (NULL == pBinMeta)
+	if (pArena && -1 == AddPersistentArena(pArena, iFd))
 	{
-		pBinMeta = pBin + (g_iPageSize * uiPageNums_);
-		unsigned long int uiPageIndex = t_uiBinMetaNums / g_uiMaxBinNums;
-		unsigned long int uiBinMetaIndex = t_uiBinMetaNums % g_uiMaxBinNums;
-		
-		unsigned char* pThreadMeta = GetThreadMetaPage(uiPageIndex);
-		unsigned long int* pBinMetaWholeList = (unsigned long int*)(pThreadMeta + g_uiOffset[TMO_BIN_META_POOL]);
-		unsigned long int* pBinMetaPageNumList = (unsigned long int*)(pThreadMeta + g_uiOffset[TMO_BIN_META_PAGE_NUM]);
-		unsigned long int* pBinMetaOffsetList = (unsigned long int*)(pThreadMeta + g_uiOffset[TMO_BIN_META_OFFSET]);
-		pBinMetaWholeList[uiBinMetaIndex] = (unsigned long int)pBinMeta;
-		pBinMetaPageNumList[uiBinMetaIndex] = uiMetaPagesNums_;
-		pBinMetaOffsetList[uiBinMetaIndex] = uiMetadataSize;
-		
-		++t_uiBinMetaNums;	
+		munmap(pArena, ((unsigned long int*)pArena)[SAO_FILE_SIZE]);
+		pArena = NULL;
+		errno = EMFILE;
 	}
-		
-
-	unsigned long int* pBinList = (unsigned long int*)(pCurrentThreadMeta + g_uiOffset[TMO_BIN]);
-	unsigned long int* pBinMetaList = (unsigned long int*)(pCurrentThreadMeta + g_uiOffset[TMO_BIN_META]);
-	unsigned long int* pBinPageNumList = (unsigned long int*)(pCurrentThreadMeta + g_uiOffset[TMO_BIN_PAGE_NUM]);
 	
-
-	pBinList[uiNewBinIndex] = (unsigned long int)pBin;
-	pBinPageNumList[uiNewBinIndex] = uiPageNums_;
-	pBinMetaList[uiNewBinIndex] = (unsigned long int)pBinMeta;
-
-	//memset(pBinMeta, 0, uiMetadataSize);
-		
-	++t_uiBinNums;
-	*t_pBinNums = t_uiBinNums;
-	*t_pArenaSize += (uiPageNums_ * g_iPageSize);
+	if (NULL == pArena)
+	{
+		int iError = errno;
+		close(iFd);
+		errno = iError;
+		return NULL;
+	}
 	
-	return pBin;
+	RecoverPersistentArena(pArena);
+	
+	unsigned long int* pHeader = (unsigned long int*)pArena;
+	unsigned long int uiStats[FSO_MAX];
+	memset(uiStats, 0, sizeof(uiStats));
+	AnalyzeBuddyNode(pArena + pHeader[SAO_META], 0, SYSTEM_PAGE_SIZE * pHeader[SAO_BIN_PAGE_NUMS], pHeader[SAO_MIN_BLOCK], uiStats);
+	
+	sem_init((sem_t*)(pArena + SHARED_ARENA_LOCK_OFFSET), 1, 1);
+	pHeader[SAO_USED_BYTES] = uiStats[FSO_USED_BYTES];
+	pHeader[SAO_SCAN_HINT] = 0;
+	
+	return pArena;
 }
 
+// Remember ptr, a block of a Shared Arena or a Persistent Arena ( NULL : None ), as the root of the Arena
+// The root is where a process that maps the Arena later starts finding the data structures in it. ( See GetArenaRoot() )
+// -1 : The Arena is not a Shared Arena or a Persistent Arena, or ptr is not in its Bin
+int SetArenaRoot(unsigned char* pArena_, void* ptr)
+{
+	if (NULL == pArena_ || 0 == IsSharedArena(pArena_))
+		return -1;
+	
+	unsigned long int* pHeader = (unsigned long int*)pArena_;
+	unsigned long int uiOffset = (unsigned char*)ptr - pArena_;
+	if (ptr && uiOffset - pHeader[SAO_BIN] >= SYSTEM_PAGE_SIZE * pHeader[SAO_BIN_PAGE_NUMS])
+		return -1;
+	
+	__atomic_store_n(&pHeader[SAO_ROOT], ptr ? uiOffset : 0, __ATOMIC_RELEASE);
+	return 0;
+}
 
-// Memory allocation is only managed with its own Arena
-// Allocate memory from its own Arena
-void* MallocFromThreadArena(size_t uiSize_, unsigned long int uiMinBlackSize_)
+// Get the root block of a Shared Arena or a Persistent Arena, at its address in the calling process ( See SetArenaRoot() )
+// NULL : The Arena has no root, or is not a Shared Arena or a Persistent Arena
+void* GetArenaRoot(unsigned char* pArena_)
 {
-	if (0 == uiSize_)
+	if (NULL == pArena_ || 0 == IsSharedArena(pArena_))
 		return NULL;
 	
-	if (uiSize_ < uiMinBlackSize_)
-		uiSize_ = uiMinBlackSize_;
+	unsigned long int uiOffset = __atomic_load_n(&((unsigned long int*)pArena_)[SAO_ROOT], __ATOMIC_ACQUIRE);
+	return uiOffset ? pArena_ + uiOffset : NULL;
+}
+
+// Write a Shared Arena or a Persistent Arena back to its file and wait for it ( A checkpoint )
+// The lock of the Arena is held meanwhile, so the tree of its Bin is written as it was between two allocations.
+// The blocks themselves are written as the caller left them.
+// -1 : The Arena is not a Shared Arena or a Persistent Arena, or msync() failed ( errno is set )
+int SyncSharedArena(unsigned char* pArena_)
+{
+	if (NULL == pArena_ || 0 == IsSharedArena(pArena_))
+	{
+		errno = EINVAL;
+		return -1;
+	}
 	
-	unsigned long int uiMinPageNums = MIN_NEW_PAGE_NUMS;
-	unsigned long int uiPageNums = 1;
-	while (uiSize_ > g_iPageSize * uiPageNums)
-		uiPageNums *= 2;
+	sem_t* pLock = (sem_t*)(pArena_ + SHARED_ARENA_LOCK_OFFSET);
+	sem_wait(pLock);
+	int iResult = msync(pArena_, ((unsigned long int*)pArena_)[SAO_FILE_SIZE], MS_SYNC);
+	sem_post(pLock);
 	
-	if (uiPageNums < uiMinPageNums)
-		uiPageNums = uiMinPageNums;
+	return iResult;
+}
+
+// Unmap a Shared Arena from the calling process ( Its blocks are not freed )
+// A Persistent Arena is closed as well, so that another process can open it.
+void DetachSharedArena(unsigned char* pArena_)
+{
+	unsigned long int* pHeader = (unsigned long int*)pArena_;
+	int iFd = pHeader[SAO_PERSISTENT] ? RemovePersistentArena(pArena_) : -1;
+	munmap(pArena_, pHeader[SAO_FILE_SIZE]);
+	
+	if (-1 != iFd)
+		close(iFd);
+}
+
+// Remember the descriptor of the file of a Persistent Arena the calling process has opened ( See DetachSharedArena() )
+// -1 : The process has MAX_PERSISTENT_ARENAS open already
+int AddPersistentArena(unsigned char* pArena_, int iFd_)
+{
+	int iResult = -1;
+	
+	sem_wait(&g_semProcessLock);
+	for (int i = 0; i < MAX_PERSISTENT_ARENAS; ++i)
+	{
+		if (NULL == g_pPersistentArenaList[i])
+		{
+			g_pPersistentArenaList[i] = pArena_;
+			g_iPersistentArenaFdList[i] = iFd_;
+			iResult = 0;
+			break;
+		}
+	}
+	sem_post(&g_semProcessLock);
+	
+	return iResult;
+}
+
+// Forget a Persistent Arena the calling process closes
+// -1 : The Arena is not open in the process
+// Otherwise, return the descriptor of its file
+int RemovePersistentArena(unsigned char* pArena_)
+{
+	int iFd = -1;
+	
+	sem_wait(&g_semProcessLock);
+	for (int i = 0; i < MAX_PERSISTENT_ARENAS; ++i)
+	{
+		if (pArena_ == g_pPersistentArenaList[i])
+		{
+			g_pPersistentArenaList[i] = NULL;
+			iFd = g_iPersistentArenaFdList[i];
+			break;
+		}
+	}
+	sem_post(&g_semProcessLock);
+	
+	return iFd;
+}
+
+// Whether an explicit Arena is a Shared Arena
+// 0 : An Arena created by CreateUserArena()
+int IsSharedArena(unsigned char* pArena_)
+{
+	return SHARED_ARENA_MAGIC == *(unsigned long int*)pArena_;
+}
+
+// Allocates uiSize_ bytes from a Shared Arena. The returned memory address will be a multiple of uiAlignment_, which must be a power of two.
+// Blocks are aligned to their size from the start of the Bin, which is only known to be on a page boundary wherever the file is mapped.
+// NULL : Not enough free space in the Arena ( A Shared Arena never grows ), or uiAlignment_ is larger than a page
+void* AllocateFromSharedArena(unsigned char* pArena_, size_t uiAlignment_, size_t uiSize_)
+{
+	if (0 == uiSize_ || uiSize_ > MAX_REQUEST_SIZE || uiAlignment_ > (size_t)SYSTEM_PAGE_SIZE)
+	{
+		errno = (0 == uiSize_ || uiSize_ > MAX_REQUEST_SIZE) ? ENOMEM : EINVAL;
+		return NULL;
+	}
+	
+	unsigned long int* pHeader = (unsigned long int*)pArena_;
+	unsigned long int uiBlockMinSize = (uiAlignment_ > pHeader[SAO_MIN_BLOCK]) ? uiAlignment_ : pHeader[SAO_MIN_BLOCK];
+	size_t uiRequestedSize = (uiSize_ < uiAlignment_) ? uiAlignment_ : uiSize_;
+	unsigned long int uiAllocSize = 0;
+	
+	sem_t* pLock = (sem_t*)(pArena_ + SHARED_ARENA_LOCK_OFFSET);
+	sem_wait(pLock);
+	unsigned char* pAllocated = NULL;
+	if (pHeader[SAO_PERSISTENT])
+		pAllocated = AllocateFromPersistentBin(pArena_, uiRequestedSize, uiBlockMinSize, &uiAllocSize);
+	else
+		pAllocated = AllocateFromBin(pArena_ + pHeader[SAO_BIN], pArena_ + pHeader[SAO_META], SYSTEM_PAGE_SIZE * pHeader[SAO_BIN_PAGE_NUMS],
+			uiRequestedSize, uiBlockMinSize, &pHeader[SAO_SCAN_HINT], &uiAllocSize);
+	
+	if (pAllocated)
+	{
+		pHeader[SAO_USED_BYTES] += uiAllocSize;
+		pHeader[SAO_REQUESTED_BYTES] += uiSize_;
+		pHeader[SAO_ROUNDED_BYTES] += uiAllocSize;
+	}
+	sem_post(pLock);
+	
+	if (NULL == pAllocated)
+		errno = ENOMEM;
+	
+	return pAllocated;
+}
+
+// Free memory allocated from a Shared Arena back to it ( By any process, through its own mapping )
+// uiSize_ is the size it was allocated with, or 0 if it is not known. ( See FreeFromArenaBin() )
+// A Persistent Arena does not use it, because the node of the block is found before the tree is changed. ( See FreeToPersistentBin() )
+// ULONG_MAX : ptr was not allocated from the Arena
+// Otherwise, return the size of the freed memmory
+unsigned long int FreeToSharedArena(unsigned char* pArena_, void* ptr, size_t uiSize_)
+{
+	unsigned long int* pHeader = (unsigned long int*)pArena_;
+	unsigned char* pBin = pArena_ + pHeader[SAO_BIN];
+	size_t uiBinSize = SYSTEM_PAGE_SIZE * pHeader[SAO_BIN_PAGE_NUMS];
+	if ((unsigned long int)((unsigned char*)ptr - pBin) >= uiBinSize)
+		return ULONG_MAX;
+	
+	unsigned long int uiResult = ULONG_MAX;
+	sem_t* pLock = (sem_t*)(pArena_ + SHARED_ARENA_LOCK_OFFSET);
+	sem_wait(pLock);
+	if (pHeader[SAO_PERSISTENT])
+		uiResult = FreeToPersistentBin(pArena_, (unsigned char*)ptr);
+	else if (uiSize_)
+		uiResult = FreeSizedFromBin((unsigned char*)ptr, pBin, pArena_ + pHeader[SAO_META], uiBinSize, pHeader[SAO_MIN_BLOCK], uiSize_);
+	else
+		uiResult = FreeFromBin((unsigned char*)ptr, pBin, pArena_ + pHeader[SAO_META], uiBinSize, pHeader[SAO_MIN_BLOCK]);
+	
+	if (ULONG_MAX != uiResult)
+		pHeader[SAO_USED_BYTES] -= uiResult;
+	sem_post(pLock);
+	
+	return uiResult;
+}
+
+// Allocate a block from the Bin of a Persistent Arena, journaling the change to its tree ( See JournalTreeChange() )
+// The block is found before the tree is changed, so it is found with FindFreeBlock() alone. ( AllocateNextToUsedBlock() changes the tree as it finds one )
+// Must be called under the lock of the Arena
+// NULL : Not enough free space in the Arena
+unsigned char* AllocateFromPersistentBin(unsigned char* pArena_, size_t uiRequestedSize_, size_t uiBlockMinSize_, unsigned long int* pAllocSize_)
+{
+	unsigned long int* pHeader = (unsigned long int*)pArena_;
+	unsigned char* pMeta = pArena_ + pHeader[SAO_META];
+	size_t uiBinSize = SYSTEM_PAGE_SIZE * pHeader[SAO_BIN_PAGE_NUMS];
+	if (uiBinSize < uiBlockMinSize_ || uiBinSize < uiRequestedSize_)
+		return NULL;
+	
+	size_t uiTargetSize = GetBlockSize(uiBinSize, uiRequestedSize_, uiBlockMinSize_);
+	unsigned char ucPathState[MAX_TREE_DEPTH];
+	unsigned long int uiDepth = 0;
+	size_t uiOffset = 0;
+	unsigned long int uiNode = FindFreeBlock(pMeta, uiBinSize, uiTargetSize, ucPathState, &uiDepth, &uiOffset, EPP_BEST_FIT == g_iPlacementPolicy);
+	if (ULONG_MAX == uiNode)
+		return NULL;
+	
+	JournalTreeChange(pHeader, uiNode, EPTO_ALLOCATE);
+	SetNodeState(uiNode, pMeta, EBBS_ALLOCATED_AT_ONCE);
+	UpdateParentStates(uiNode, EBBS_ALLOCATED_AT_ONCE, pMeta, ucPathState, uiDepth);
+	JournalTreeChange(pHeader, 0, EPTO_NONE);
+	
+	*pAllocSize_ = uiTargetSize;
+	return pArena_ + pHeader[SAO_BIN] + uiOffset;
+}
+
+// Free a block to the Bin of a Persistent Arena, journaling the change to its tree ( See JournalTreeChange() )
+// Must be called under the lock of the Arena
+// ULONG_MAX : pAddr_ is not the start address of a block allocated from the Arena
+// Otherwise, return the size of the freed memmory
+unsigned long int FreeToPersistentBin(unsigned char* pArena_, unsigned char* pAddr_)
+{
+	unsigned long int* pHeader = (unsigned long int*)pArena_;
+	unsigned char* pMeta = pArena_ + pHeader[SAO_META];
+	unsigned char ucPathState[MAX_TREE_DEPTH];
+	unsigned long int uiDepth = 0;
+	size_t uiNodeSize = 0;
+	unsigned long int uiNode = FindAllocatedNode(pAddr_, pArena_ + pHeader[SAO_BIN], pMeta, SYSTEM_PAGE_SIZE * pHeader[SAO_BIN_PAGE_NUMS], pHeader[SAO_MIN_BLOCK],
+		ucPathState, &uiDepth, &uiNodeSize);
+	if (ULONG_MAX == uiNode)
+		return ULONG_MAX;
+	
+	JournalTreeChange(pHeader, uiNode, EPTO_FREE);
+	SetNodeState(uiNode, pMeta, EBBS_FREE);
+	UpdateParentStates(uiNode, EBBS_FREE, pMeta, ucPathState, uiDepth);
+	JournalTreeChange(pHeader, 0, EPTO_NONE);
+	
+	return uiNodeSize;
+}
+
+// Store the change to the tree of the Bin of a Persistent Arena that is under way in its header ( EPTO_NONE : It is done )
+// The node is stored before the change is marked pending, and the change is marked done only after the tree is consistent again.
+// The stores are not reordered with those to the tree around them. ( A process that is killed has made every store it executed to the file )
+// This only covers a process that is killed. Nothing is written to the disk here ( No msync() ), so after a system crash or a power loss
+// the file holds whatever pages the kernel had written back, and the journal and the tree may not match. Only SyncSharedArena() is a point to rely on then.
+void JournalTreeChange(unsigned long int* pHeader_, unsigned long int uiNode_, unsigned long int uiOp_)
+{
+	if (EPTO_NONE != uiOp_)
+		pHeader_[SAO_PENDING_NODE] = uiNode_;
+	
+	__atomic_store_n(&pHeader_[SAO_PENDING_OP], uiOp_, __ATOMIC_SEQ_CST);
+}
+
+// Undo or finish the change to the tree of a Persistent Arena its last process was killed in the middle of ( See JournalTreeChange() )
+// Either way the node ends up free: a block being allocated was never returned, and a block being freed was being given back.
+// Everything below the node is free in both cases, so only the states of its parents have to be set again.
+void RecoverPersistentArena(unsigned char* pArena_)
+{
+	unsigned long int* pHeader = (unsigned long int*)pArena_;
+	if (EPTO_NONE == pHeader[SAO_PENDING_OP])
+		return;
+	
+	// A node past the end of the tree can only be a damaged file. The tree is left as it is.
+	unsigned long int uiNodeNums = ((SYSTEM_PAGE_SIZE * pHeader[SAO_BIN_PAGE_NUMS]) / pHeader[SAO_MIN_BLOCK]) * 2 - 1;
+	unsigned char* pMeta = pArena_ + pHeader[SAO_META];
+	if (pHeader[SAO_PENDING_NODE] < uiNodeNums)
+	{
+		SetNodeState(pHeader[SAO_PENDING_NODE], pMeta, EBBS_FREE);
+		RebuildParentStates(pHeader[SAO_PENDING_NODE], pMeta);
+	}
+	
+	pHeader[SAO_PENDING_OP] = EPTO_NONE;
+}
+
+// Analyze the Bin of a Shared Arena, and add the results to pOut_ ( FSO_MAX values. See AnalyzeArena() )
+// Return the number of Bins analyzed ( 0 if uiFirstBin_ is not 0, the only Bin )
+unsigned long int AnalyzeSharedArena(unsigned char* pArena_, unsigned long int uiFirstBin_, unsigned long int uiBinNums_, unsigned long int* pOut_)
+{
+	if (0 != uiFirstBin_ || 0 == uiBinNums_)
+		return 0;
+	
+	unsigned long int* pHeader = (unsigned long int*)pArena_;
+	sem_t* pLock = (sem_t*)(pArena_ + SHARED_ARENA_LOCK_OFFSET);
+	sem_wait(pLock);
+	AnalyzeBin(pArena_ + pHeader[SAO_BIN], pArena_ + pHeader[SAO_META], pHeader[SAO_BIN_PAGE_NUMS], pHeader[SAO_MIN_BLOCK], pOut_);
+	pOut_[FSO_REQUESTED_BYTES] += pHeader[SAO_REQUESTED_BYTES];
+	pOut_[FSO_ROUNDED_BYTES] += pHeader[SAO_ROUNDED_BYTES];
+	sem_post(pLock);
+	
+	return 1;
+}
+
+// Set up the Guarded Pool ( MALLOC_GUARD_SAMPLE_RATE )
+// The pool is reserved as PROT_NONE, and a slot page is only made accessible while it holds a block.
+// If the pool is off, g_uiGuardPoolSize stays 0, so no pointer is ever taken as one of its blocks.
+void InitGuardedPool()
+{
+	const char* pSampleRate = getenv(ENV_GUARD_SAMPLE_RATE);
+	if (NULL == pSampleRate || 0 == strtoul(pSampleRate, NULL, 10))
+		return;
+	
+	unsigned long int uiSlotNums = DEFAULT_GUARD_SLOTS;
+	const char* pSlotNums = getenv(ENV_GUARD_SLOTS);
+	if (pSlotNums && strtoul(pSlotNums, NULL, 10) > 0)
+		uiSlotNums = strtoul(pSlotNums, NULL, 10);
+	
+	unsigned long int uiPoolSize = SYSTEM_PAGE_SIZE * ((uiSlotNums * 2) + 1);
+	void* pPool = mmap(NULL, uiPoolSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if ((void *)(-1) == pPool)
+		return;
+	
+	void* pSlots = mmap(NULL, sizeof(unsigned long int) * GSO_MAX * uiSlotNums, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ((void *)(-1) == pSlots)
+	{
+		munmap(pPool, uiPoolSize);
+		return;
+	}
+	
+	// backtrace() loads libgcc on its first call, which allocates memory. Do it now rather than in the middle of a sampled allocation.
+	void* pStack[1];
+	backtrace(pStack, 1);
+	
+	struct sigaction saGuard;
+	memset(&saGuard, 0, sizeof(saGuard));
+	saGuard.sa_sigaction = GuardFaultHandler;
+	saGuard.sa_flags = SA_SIGINFO;
+	sigemptyset(&saGuard.sa_mask);
+	if (-1 == sigaction(SIGSEGV, &saGuard, &g_saPrevSegv))
+	{
+		munmap(pPool, uiPoolSize);
+		munmap(pSlots, sizeof(unsigned long int) * GSO_MAX * uiSlotNums);
+		return;
+	}
+	
+	sem_init(&g_semGuardLock, 1, 1);
+	g_pGuardSlots = (unsigned long int*)pSlots;
+	g_uiGuardSlotNums = uiSlotNums;
+	g_uiGuardSampleRate = strtoul(pSampleRate, NULL, 10);
+	g_uiGuardPoolStart = (unsigned long int)pPool;
+	g_uiGuardPoolSize = uiPoolSize;
+	
+	// Allocations made before this point found the pool off and stopped sampling in this thread
+	t_uiGuardCountdown = 1;
+}
+
+// Allocate a sampled block from the Guarded Pool
+// The block is placed at the end of its slot, so that reading or writing past it hits the guard page after the slot.
+// NULL : The pool is off, this is the first allocation of the thread, the request does not fit in a page or no slot is available.
+//        The caller allocates from its Arena instead.
+void* AllocateGuarded(size_t uiAlignment_, size_t uiSize_)
+{
+	if (0 == g_uiGuardSampleRate)
+	{
+		t_uiGuardCountdown = ULONG_MAX;
+		return NULL;
+	}
+	
+	// The first allocation of a thread only picks when its first sample is
+	if (0 == t_uiGuardSeed)
+	{
+		t_uiGuardSeed = ((unsigned long int)&t_uiGuardSeed) | 1;
+		t_uiGuardCountdown = NextGuardCountdown();
+		return NULL;
+	}
+	
+	t_uiGuardCountdown = NextGuardCountdown();
+	if (0 == uiSize_ || uiSize_ > SYSTEM_PAGE_SIZE || uiAlignment_ > SYSTEM_PAGE_SIZE)
+		return NULL;
+	
+	void* pStack[GUARD_STACK_DEPTH];
+	int iDepth = backtrace(pStack, GUARD_STACK_DEPTH);
+	
+	unsigned char* pAllocated = NULL;
+	
+	///////////////////////////////////////////////////////////////////////////////////
+	sem_wait(&g_semGuardLock);
+	for (unsigned long int i = 0; i < g_uiGuardSlotNums; ++i)
+	{
+		unsigned long int uiSlotIndex = (g_uiGuardNextSlot + i) % g_uiGuardSlotNums;
+		unsigned long int* pSlot = g_pGuardSlots + (uiSlotIndex * GSO_MAX);
+		if (EGS_ALLOCATED == pSlot[GSO_STATE])
+			continue;
+		
+		unsigned char* pPage = (unsigned char*)g_uiGuardPoolStart + (SYSTEM_PAGE_SIZE * ((uiSlotIndex * 2) + 1));
+		if (-1 == mprotect(pPage, SYSTEM_PAGE_SIZE, PROT_READ | PROT_WRITE))
+			break;
+		
+		pAllocated = pPage + ((SYSTEM_PAGE_SIZE - uiSize_) & ~(uiAlignment_ - 1));
+		pSlot[GSO_ADDR] = (unsigned long int)pAllocated;
+		pSlot[GSO_SIZE] = uiSize_;
+		pSlot[GSO_STATE] = EGS_ALLOCATED;
+		pSlot[GSO_ALLOC_DEPTH] = iDepth;
+		pSlot[GSO_FREE_DEPTH] = 0;
+		memcpy(pSlot + GSO_ALLOC_STACK, pStack, sizeof(void*) * iDepth);
+		
+		g_uiGuardNextSlot = uiSlotIndex + 1;
+		break;
+	}
+	sem_post(&g_semGuardLock);
+	///////////////////////////////////////////////////////////////////////////////////////
+	
+	return pAllocated;
+}
+
+// Free a block of the Guarded Pool
+// The slot is made PROT_NONE, so any later access to the block faults.
+// An address that is not the start of a block in use is reported, and the process is aborted.
+// 0 : ptr is not in the Guarded Pool
+int FreeGuarded(void* ptr)
+{
+	unsigned long int uiOffset = (unsigned long int)ptr - g_uiGuardPoolStart;
+	if (uiOffset >= g_uiGuardPoolSize)
+		return 0;
+	
+	void* pStack[GUARD_STACK_DEPTH];
+	int iDepth = backtrace(pStack, GUARD_STACK_DEPTH);
+	
+	unsigned long int uiPageIndex = uiOffset / SYSTEM_PAGE_SIZE;
+	unsigned long int* pSlot = g_pGuardSlots + ((uiPageIndex / 2) * GSO_MAX);
+	
+	///////////////////////////////////////////////////////////////////////////////////
+	sem_wait(&g_semGuardLock);
+	if (0 == (uiPageIndex & 1) || (unsigned long int)ptr != pSlot[GSO_ADDR] || EGS_ALLOCATED != pSlot[GSO_STATE])
+	{
+		ReportGuardError((EGS_FREED == pSlot[GSO_STATE] && (unsigned long int)ptr == pSlot[GSO_ADDR]) ? "double-free" : "invalid-free", (unsigned long int)ptr, (uiPageIndex & 1) ? pSlot : NULL);
+		abort();
+	}
+	
+	pSlot[GSO_STATE] = EGS_FREED;
+	pSlot[GSO_FREE_DEPTH] = iDepth;
+	memcpy(pSlot + GSO_FREE_STACK, pStack, sizeof(void*) * iDepth);
+	mprotect((void*)(pSlot[GSO_ADDR] & ~(SYSTEM_PAGE_SIZE - 1)), SYSTEM_PAGE_SIZE, PROT_NONE);
+	sem_post(&g_semGuardLock);
+	///////////////////////////////////////////////////////////////////////////////////////
+	
+	return 1;
+}
+
+// Get the size requested for a block of the Guarded Pool
+// realloc() uses it not to copy past the end of the block.
+// 0 : ptr is not in the Guarded Pool
+size_t GetGuardedSize(void* ptr)
+{
+	unsigned long int uiOffset = (unsigned long int)ptr - g_uiGuardPoolStart;
+	if (uiOffset >= g_uiGuardPoolSize)
+		return 0;
+	
+	return g_pGuardSlots[((uiOffset / SYSTEM_PAGE_SIZE) / 2) * GSO_MAX + GSO_SIZE];
+}
+
+// Get the number of allocations until the next sampled one
+// Uniform between 1 and twice the sample rate minus 1, so that samples do not line up with allocation patterns of the program. ( xorshift )
+unsigned long int NextGuardCountdown()
+{
+	unsigned long int uiSeed = t_uiGuardSeed;
+	uiSeed ^= uiSeed << 13;
+	uiSeed ^= uiSeed >> 7;
+	uiSeed ^= uiSeed << 17;
+	t_uiGuardSeed = uiSeed;
+	
+	return (uiSeed % ((g_uiGuardSampleRate * 2) - 1)) + 1;
+}
+
+// Print what a fault, an invalid free or a double free in the Guarded Pool hit
+// Called from the SIGSEGV handler, so only write() and backtrace_symbols_fd() are used to print, and numbers are formatted by AppendNumber().
+// pSlot_ is the slot of the block closest to uiAddr_ ( NULL if unknown )
+void ReportGuardError(const char* pError_, unsigned long int uiAddr_, unsigned long int* pSlot_)
+{
+	char szLine[256];
+	char* pEnd = AppendString(szLine, "*** Guarded Pool: ");
+	pEnd = AppendString(pEnd, pError_);
+	pEnd = AppendString(pEnd, " on address 0x");
+	pEnd = AppendNumber(pEnd, uiAddr_, 16);
+	pEnd = AppendString(pEnd, "\n");
+	write(STDERR_FILENO, szLine, pEnd - szLine);
+	
+	if (NULL == pSlot_ || EGS_EMPTY == pSlot_[GSO_STATE])
+		return;
+	
+	pEnd = AppendString(szLine, "The block of ");
+	pEnd = AppendNumber(pEnd, pSlot_[GSO_SIZE], 10);
+	pEnd = AppendString(pEnd, " bytes at 0x");
+	pEnd = AppendNumber(pEnd, pSlot_[GSO_ADDR], 16);
+	pEnd = AppendString(pEnd, " was allocated at:\n");
+	write(STDERR_FILENO, szLine, pEnd - szLine);
+	backtrace_symbols_fd((void* const*)(pSlot_ + GSO_ALLOC_STACK), pSlot_[GSO_ALLOC_DEPTH], STDERR_FILENO);
+	
+	if (EGS_FREED != pSlot_[GSO_STATE])
+		return;
+	
+	pEnd = AppendString(szLine, "and freed at:\n");
+	write(STDERR_FILENO, szLine, pEnd - szLine);
+	backtrace_symbols_fd((void* const*)(pSlot_ + GSO_FREE_STACK), pSlot_[GSO_FREE_DEPTH], STDERR_FILENO);
+}
+
+// Copy a string to pOut_ without its terminating NUL, and return where it ends ( Async-signal-safe. See ReportGuardError() )
+// The caller keeps the buffer large enough.
+char* AppendString(char* pOut_, const char* pString_)
+{
+	while (*pString_)
+		*pOut_++ = *pString_++;
+	
+	return pOut_;
+}
+
+// Write uiValue_ in base uiBase_ ( 10 or 16 ) to pOut_, and return where it ends ( Async-signal-safe. See ReportGuardError() )
+char* AppendNumber(char* pOut_, unsigned long int uiValue_, unsigned int uiBase_)
+{
+	char szDigits[sizeof(unsigned long int) * CHAR_BIT];
+	unsigned long int uiLength = 0;
+	do
+	{
+		szDigits[uiLength++] = "0123456789abcdef"[uiValue_ % uiBase_];
+		uiValue_ /= uiBase_;
+	} while (uiValue_);
+	
+	while (uiLength)
+		*pOut_++ = szDigits[--uiLength];
+	
+	return pOut_;
+}
+
+// SIGSEGV handler for the Guarded Pool
+// A fault in a slot page is a use after free. A fault in a guard page is an overflow of the block before it or an underflow of the block after it,
+// whichever is closer. Either way, the previous handler is put back, and the faulting access is retried to end the process as it would have.
+void GuardFaultHandler(int iSignal_, siginfo_t* pInfo_, void* pContext_)
+{
+	unsigned long int uiAddr = (unsigned long int)pInfo_->si_addr;
+	unsigned long int uiOffset = uiAddr - g_uiGuardPoolStart;
+	if (uiOffset < g_uiGuardPoolSize)
+	{
+		unsigned long int uiPageIndex = uiOffset / SYSTEM_PAGE_SIZE;
+		unsigned long int* pSlot = NULL;
+		if (uiPageIndex & 1)
+		{
+			pSlot = g_pGuardSlots + ((uiPageIndex / 2) * GSO_MAX);
+		}
+		else
+		{
+			unsigned long int* pBefore = (uiPageIndex > 0) ? g_pGuardSlots + (((uiPageIndex / 2) - 1) * GSO_MAX) : NULL;
+			unsigned long int* pAfter = (uiPageIndex / 2 < g_uiGuardSlotNums) ? g_pGuardSlots + ((uiPageIndex / 2) * GSO_MAX) : NULL;
+			if (pBefore && EGS_EMPTY == pBefore[GSO_STATE])
+				pBefore = NULL;
+			if (pAfter && EGS_EMPTY == pAfter[GSO_STATE])
+				pAfter = NULL;
+			
+			pSlot = pBefore ? pBefore : pAfter;
+			if (pBefore && pAfter && (pAfter[GSO_ADDR] - uiAddr) < (uiAddr - (pBefore[GSO_ADDR] + pBefore[GSO_SIZE])))
+				pSlot = pAfter;
+		}
+		
+		const char* pError = "wild-access";
+		if (pSlot && EGS_FREED == pSlot[GSO_STATE])
+			pError = "use-after-free";
+		else if (pSlot && uiAddr >= pSlot[GSO_ADDR] + pSlot[GSO_SIZE])
+			pError = "buffer-overflow";
+		else if (pSlot && uiAddr < pSlot[GSO_ADDR])
+			pError = "buffer-underflow";
+		
+		ReportGuardError(pError, uiAddr, pSlot);
+	}
+	
+	sigaction(SIGSEGV, &g_saPrevSegv, NULL);
+}
+
+// Walk the tree of a Bin and add what it holds to pOut_ ( FSO_MAX values )
+// Blocks of the same size are grouped by their order ( log2 of the size ). Resident pages are counted with mincore().
+// The caller must hold the lock of the Arena.
+void AnalyzeBin(unsigned char* pBin_, unsigned char* pMeta_, unsigned long int uiPageNums_, size_t uiBlockMinSize_, unsigned long int* pOut_)
+{
+	size_t uiBinSize = SYSTEM_PAGE_SIZE * uiPageNums_;
+	unsigned long int uiFreeBytes = pOut_[FSO_FREE_BYTES];
+	
+	AnalyzeBuddyNode(pMeta_, 0, uiBinSize, uiBlockMinSize_, pOut_);
+	
+	pOut_[FSO_BINS] += 1;
+	pOut_[FSO_TOTAL_BYTES] += uiBinSize;
+	pOut_[FSO_TOTAL_PAGES] += uiPageNums_;
+	if (pOut_[FSO_FREE_BYTES] - uiFreeBytes == uiBinSize)
+		pOut_[FSO_EMPTY_BINS] += 1;
+	
+	unsigned char ucResidency[FRAG_MINCORE_CHUNK];
+	for (unsigned long int uiPage = 0; uiPage < uiPageNums_; uiPage += FRAG_MINCORE_CHUNK)
+	{
+		unsigned long int uiChunkPages = uiPageNums_ - uiPage;
+		if (uiChunkPages > FRAG_MINCORE_CHUNK)
+			uiChunkPages = FRAG_MINCORE_CHUNK;
+		
+		if (-1 == mincore(pBin_ + (SYSTEM_PAGE_SIZE * uiPage), SYSTEM_PAGE_SIZE * uiChunkPages, ucResidency))
+			continue;
+		
+		for (unsigned long int i = 0; i < uiChunkPages; ++i)
+			pOut_[FSO_RESIDENT_PAGES] += (ucResidency[i] & 1);
+	}
+}
+
+// Add the free and allocated blocks under a Node of a Bin to pOut_ ( See AnalyzeBin() )
+// A free Node is one free block, and the Nodes under it are not looked at. The same goes for a Node allocated at once.
+void AnalyzeBuddyNode(unsigned char* pMeta_, unsigned long int uiNode_, size_t uiNodeSize_, size_t uiBlockMinSize_, unsigned long int* pOut_)
+{
+	unsigned char ucState = GetNodeState(uiNode_, pMeta_);
+	unsigned long int uiOrder = (sizeof(unsigned long int) * CHAR_BIT - 1) - __builtin_clzl(uiNodeSize_);
+	
+	if (EBBS_FREE == ucState)
+	{
+		pOut_[FSO_FREE_BYTES] += uiNodeSize_;
+		pOut_[FSO_FREE_BY_ORDER + uiOrder] += 1;
+		if (uiNodeSize_ > pOut_[FSO_LARGEST_FREE])
+			pOut_[FSO_LARGEST_FREE] = uiNodeSize_;
+		
+		return;
+	}
+	
+	if (EBBS_ALLOCATED_AT_ONCE == ucState)
+	{
+		pOut_[FSO_USED_BYTES] += uiNodeSize_;
+		pOut_[FSO_ALLOCATED_BY_ORDER + uiOrder] += 1;
+		return;
+	}
+	
+	if (uiNodeSize_ / 2 < uiBlockMinSize_)
+		return;
+	
+	AnalyzeBuddyNode(pMeta_, (uiNode_ * 2) + 1, uiNodeSize_ / 2, uiBlockMinSize_, pOut_);
+	AnalyzeBuddyNode(pMeta_, (uiNode_ * 2) + 2, uiNodeSize_ / 2, uiBlockMinSize_, pOut_);
+}
+
+// Analyze uiBinNums_ Bins of an Arena starting from the uiFirstBin_th one, and add the results to pOut_ ( FSO_MAX values )
+// ULONG_MAX for uiBinNums_ means all the Bins from uiFirstBin_. The lock of the Arena is taken here.
+// Return the number of Bins analyzed
+unsigned long int AnalyzeArena(unsigned char* pThreadMetaData_, unsigned long int uiFirstBin_, unsigned long int uiBinNums_, unsigned long int* pOut_)
+{
+	if (NULL == pThreadMetaData_)
+		return 0;
+	
+	if (IsSharedArena(pThreadMetaData_))
+		return AnalyzeSharedArena(pThreadMetaData_, uiFirstBin_, uiBinNums_, pOut_);
+	
+	sem_t* pLock = *(sem_t**)(pThreadMetaData_ + g_uiArenaLock_Offset);
+	sem_wait(pLock);
+	
+	unsigned long int uiTotalBins = *(unsigned long int*)(pThreadMetaData_ + g_uiBinNums_Offset);
+	unsigned long int uiAnalyzed = 0;
+	unsigned char* pCurrentMeta = GetThreadMetaPage(pThreadMetaData_, uiFirstBin_ / MAX_BIN_NUMS);
+	for (unsigned long int i = uiFirstBin_; i < uiTotalBins && uiAnalyzed < uiBinNums_ && pCurrentMeta; ++i)
+	{
+		unsigned long int uiBinIndex = i % MAX_BIN_NUMS;
+		if (i != uiFirstBin_ && 0 == uiBinIndex)
+		{
+			pCurrentMeta = (unsigned char*)*(((unsigned long int*)pCurrentMeta) + 1);
+			if (NULL == pCurrentMeta)
+				break;
+		}
+		
+		unsigned long int* pBinList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN));
+		unsigned long int* pBinMetaList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_META));
+		unsigned long int* pBinPageNumList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_PAGE_NUM));
+		unsigned long int* pBinMinBlockList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_MIN_BLOCK));
+		unsigned long int* pBinRequestedBytes = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_REQUESTED_BYTES));
+		unsigned long int* pBinRoundedBytes = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_ROUNDED_BYTES));
+		
+		AnalyzeBin((unsigned char*)pBinList[uiBinIndex], (unsigned char*)pBinMetaList[uiBinIndex], pBinPageNumList[uiBinIndex], pBinMinBlockList[uiBinIndex], pOut_);
+		pOut_[FSO_REQUESTED_BYTES] += pBinRequestedBytes[uiBinIndex];
+		pOut_[FSO_ROUNDED_BYTES] += pBinRoundedBytes[uiBinIndex];
+		++uiAnalyzed;
+	}
+	
+	sem_post(pLock);
+	
+	return uiAnalyzed;
+}
+
+// Analyze all the Bins of all registered Thread Arenas, and add the results to pOut_ ( FSO_MAX values )
+// Return the number of Thread Arenas analyzed
+unsigned long int AnalyzeAllArenas(unsigned long int* pOut_)
+{
+	unsigned long int uiAnalyzed = 0;
+	unsigned long int uiRegisteredThreadCounts = __atomic_load_n(&g_uiRegisteredThreadCounts, __ATOMIC_ACQUIRE);
+	for (unsigned long int uiArenaIndex = 0; uiArenaIndex < uiRegisteredThreadCounts; ++uiArenaIndex)
+	{
+		unsigned char* pArena = GetRegisteredArena(uiArenaIndex);
+		if (NULL == pArena)
+			continue;
+		
+		AnalyzeArena(pArena, 0, ULONG_MAX, pOut_);
+		++uiAnalyzed;
+	}
+	
+	return uiAnalyzed;
+}
+
+// Print the results of AnalyzeBin(), AnalyzeArena() or AnalyzeAllArenas()
+void PrintFragmentation(const unsigned long int* pStats_)
+{
+	unsigned long int uiFreeBytes = pStats_[FSO_FREE_BYTES];
+	unsigned long int uiRoundedBytes = pStats_[FSO_ROUNDED_BYTES];
+	
+	fprintf(stderr, "Bins : %lu ( %lu empty )\n", pStats_[FSO_BINS], pStats_[FSO_EMPTY_BINS]);
+	fprintf(stderr, "Total Size : %lu\n", pStats_[FSO_TOTAL_BYTES]);
+	fprintf(stderr, "Allocated Blocks : %lu bytes\n", pStats_[FSO_USED_BYTES]);
+	fprintf(stderr, "Free Blocks : %lu bytes ( Largest %lu )\n", uiFreeBytes, pStats_[FSO_LARGEST_FREE]);
+	fprintf(stderr, "External Fragmentation : %.4f\n", uiFreeBytes ? 1.0 - ((double)pStats_[FSO_LARGEST_FREE] / uiFreeBytes) : 0.0);
+	fprintf(stderr, "Internal Fragmentation : %.4f ( %lu requested / %lu rounded, all allocations so far )\n",
+		uiRoundedBytes ? 1.0 - ((double)pStats_[FSO_REQUESTED_BYTES] / uiRoundedBytes) : 0.0, pStats_[FSO_REQUESTED_BYTES], uiRoundedBytes);
+	fprintf(stderr, "Resident Pages : %lu / %lu\n", pStats_[FSO_RESIDENT_PAGES], pStats_[FSO_TOTAL_PAGES]);
+	
+	for (unsigned long int i = 0; i < FRAG_ORDER_NUMS; ++i)
+	{
+		if (pStats_[FSO_FREE_BY_ORDER + i] || pStats_[FSO_ALLOCATED_BY_ORDER + i])
+			fprintf(stderr, "Blocks of 2^%lu bytes : %lu free, %lu allocated\n", i, pStats_[FSO_FREE_BY_ORDER + i], pStats_[FSO_ALLOCATED_BY_ORDER + i]);
+	}
+}
+
+// Print the fragmentation report of the process, then of each registered Thread Arena, then of each of their Bins
+void DumpFragmentation()
+{
+	unsigned long int uiStats[FSO_MAX];
+	memset(uiStats, 0, sizeof(uiStats));
+	unsigned long int uiArenaNums = AnalyzeAllArenas(uiStats);
+	
+	fprintf(stderr, "===========================================\n");
+	fprintf(stderr, "Fragmentation of %lu Arenas\n", uiArenaNums);
+	PrintFragmentation(uiStats);
+	
+	unsigned long int uiRegisteredThreadCounts = __atomic_load_n(&g_uiRegisteredThreadCounts, __ATOMIC_ACQUIRE);
+	for (unsigned long int uiArenaIndex = 0; uiArenaIndex < uiRegisteredThreadCounts; ++uiArenaIndex)
+	{
+		unsigned char* pArena = GetRegisteredArena(uiArenaIndex);
+		if (NULL == pArena)
+			continue;
+		
+		memset(uiStats, 0, sizeof(uiStats));
+		AnalyzeArena(pArena, 0, ULONG_MAX, uiStats);
+		fprintf(stderr, "===========================================\n");
+		fprintf(stderr, "Arena %lu Fragmentation\n", uiArenaIndex);
+		PrintFragmentation(uiStats);
+		
+		for (unsigned long int uiBin = 0; ; ++uiBin)
+		{
+			memset(uiStats, 0, sizeof(uiStats));
+			if (0 == AnalyzeArena(pArena, uiBin, 1, uiStats))
+				break;
+			
+			fprintf(stderr, "-------------------------------------------\n");
+			fprintf(stderr, "Arena %lu Bin %lu Fragmentation\n", uiArenaIndex, uiBin);
+			PrintFragmentation(uiStats);
+		}
+	}
+	
+	fprintf(stderr, "===========================================\n");
+}
+
+// Write a snapshot of all registered Thread Arenas to a file ( See SNAPSHOT_RECORD )
+// Nothing is allocated: records are built on the stack, and the Bin Metadata is written straight from where it is.
+// Each Arena is locked while it is written, so the Bins of an Arena are consistent with each other, but not with the Bins of other Arenas.
+// -1 : The file could not be created or written ( errno is set )
+int WriteSnapshot(const char* pPath_)
+{
+	int iFd = open(pPath_, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (-1 == iFd)
+		return -1;
+	
+	unsigned long int uiHeader[SSH_MAX];
+	uiHeader[SSH_MAGIC] = SNAPSHOT_MAGIC;
+	uiHeader[SSH_VERSION] = SNAPSHOT_VERSION;
+	uiHeader[SSH_PAGE_SIZE] = SYSTEM_PAGE_SIZE;
+	uiHeader[SSH_TIME] = (unsigned long int)time(NULL);
+	uiHeader[SSH_PID] = (unsigned long int)getpid();
+	int iResult = WriteAll(iFd, uiHeader, sizeof(uiHeader));
+	
+	unsigned long int uiRegisteredThreadCounts = __atomic_load_n(&g_uiRegisteredThreadCounts, __ATOMIC_ACQUIRE);
+	for (unsigned long int uiArenaIndex = 0; 0 == iResult && uiArenaIndex < uiRegisteredThreadCounts; ++uiArenaIndex)
+	{
+		unsigned char* pArena = GetRegisteredArena(uiArenaIndex);
+		if (pArena)
+			iResult = WriteArenaSnapshot(iFd, pArena, uiArenaIndex);
+	}
+	
+	unsigned long int uiEnd[SSR_MAX] = { ESR_END };
+	if (0 == iResult)
+		iResult = WriteAll(iFd, uiEnd, sizeof(uiEnd));
+	
+	if (-1 == close(iFd))
+		iResult = -1;
+	
+	return iResult;
+}
+
+// Write the Arena record of a Thread Arena, followed by a Bin record and the Bin Metadata of each of its Bins
+int WriteArenaSnapshot(int iFd_, unsigned char* pThreadMetaData_, unsigned long int uiArenaIndex_)
+{
+	sem_t* pLock = *(sem_t**)(pThreadMetaData_ + g_uiArenaLock_Offset);
+	sem_wait(pLock);
+	
+	unsigned long int uiBinNums = *(unsigned long int*)(pThreadMetaData_ + g_uiBinNums_Offset);
+	unsigned long int uiRecord[SSR_MAX];
+	memset(uiRecord, 0, sizeof(uiRecord));
+	uiRecord[SSR_TYPE] = ESR_ARENA;
+	uiRecord[SSR_ARENA_ADDR] = (unsigned long int)pThreadMetaData_;
+	uiRecord[SSR_ARENA_INDEX] = uiArenaIndex_;
+	uiRecord[SSR_ARENA_BIN_NUMS] = uiBinNums;
+	int iResult = WriteAll(iFd_, uiRecord, sizeof(uiRecord));
+	
+	unsigned char* pCurrentMeta = pThreadMetaData_;
+	for (unsigned long int i = 0; 0 == iResult && i < uiBinNums; ++i)
+	{
+		unsigned long int uiBinIndex = i % MAX_BIN_NUMS;
+		if (0 != i && 0 == uiBinIndex)
+		{
+			pCurrentMeta = (unsigned char*)*(((unsigned long int*)pCurrentMeta) + 1);
+			if (NULL == pCurrentMeta)
+				break;
+		}
+		
+		unsigned long int uiPageNums = ((unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_PAGE_NUM)))[uiBinIndex];
+		unsigned long int uiMinBlockSize = ((unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_MIN_BLOCK)))[uiBinIndex];
+		unsigned long int uiMetadataSize = uiMinBlockSize ? (SYSTEM_PAGE_SIZE / uiMinBlockSize) * uiPageNums : 0;
+		
+		memset(uiRecord, 0, sizeof(uiRecord));
+		uiRecord[SSR_TYPE] = ESR_BIN;
+		uiRecord[SSR_BIN_INDEX] = i;
+		uiRecord[SSR_BIN_ADDR] = ((unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN)))[uiBinIndex];
+		uiRecord[SSR_BIN_PAGE_NUMS] = uiPageNums;
+		uiRecord[SSR_BIN_MIN_BLOCK] = uiMinBlockSize;
+		uiRecord[SSR_BIN_USED_BYTES] = ((unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_USED_BYTES)))[uiBinIndex];
+		uiRecord[SSR_BIN_META_SIZE] = uiMetadataSize;
+		iResult = WriteAll(iFd_, uiRecord, sizeof(uiRecord));
+		if (0 == iResult)
+			iResult = WriteAll(iFd_, (void*)((unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_META)))[uiBinIndex], uiMetadataSize);
+	}
+	
+	sem_post(pLock);
+	
+	return iResult;
+}
+
+// Write uiSize_ bytes to a file, however many write() calls it takes
+// -1 : write() failed
+int WriteAll(int iFd_, const void* pData_, unsigned long int uiSize_)
+{
+	const unsigned char* pData = (const unsigned char*)pData_;
+	while (uiSize_ > 0)
+	{
+		ssize_t iWritten = write(iFd_, pData, uiSize_);
+		if (-1 == iWritten)
+		{
+			if (EINTR == errno)
+				continue;
+			
+			return -1;
+		}
+		
+		pData += iWritten;
+		uiSize_ -= iWritten;
+	}
+	
+	return 0;
+}
+
+// Tell whether the block at ptr is worth moving to consolidate the heap
+// 1 : Its Bin is sparse ( See IsSparseBin() ), so moving the block with AllocateMemoryDense() helps to empty the Bin
+// 0 : Leave it where it is
+// -1 : ptr is not the start of a block allocated from a Thread Arena
+int GetDefragHint(void* ptr)
+{
+	if (NULL == ptr || (unsigned long int)ptr - g_uiGuardPoolStart < g_uiGuardPoolSize)
+		return -1;
+	
+	// The block is most likely in the Arena of the caller
+	unsigned char* pArena = GetCurrentArena();
+	int iResult = GetArenaDefragHint(ptr, pArena);
+	if (-1 != iResult)
+		return iResult;
+	
+	unsigned long int uiRegisteredThreadCounts = __atomic_load_n(&g_uiRegisteredThreadCounts, __ATOMIC_ACQUIRE);
+	for (unsigned long int uiArenaIndex = 0; uiArenaIndex < uiRegisteredThreadCounts; ++uiArenaIndex)
+	{
+		unsigned char* pOtherArena = GetRegisteredArena(uiArenaIndex);
+		if (NULL == pOtherArena || pOtherArena == pArena || 0 == IsInArenaRange(ptr, pOtherArena))
+			continue;
+		
+		iResult = GetArenaDefragHint(ptr, pOtherArena);
+		if (-1 != iResult)
+			return iResult;
+	}
+	
+	return -1;
+}
+
+// GetDefragHint() on one Thread Arena. The lock of the Arena is taken here.
+int GetArenaDefragHint(void* ptr, unsigned char* pThreadMetaData_)
+{
+	if (NULL == pThreadMetaData_)
+		return -1;
+	
+	sem_t* pLock = *(sem_t**)(pThreadMetaData_ + g_uiArenaLock_Offset);
+	sem_wait(pLock);
+	
+	int iResult = -1;
+	unsigned long int uiBinIndex = 0;
+	unsigned char* pCurrentMeta = FindBinOfAddress(ptr, pThreadMetaData_, &uiBinIndex);
+	if (pCurrentMeta)
+	{
+		uiBinIndex %= MAX_BIN_NUMS;
+		unsigned char* pBin = (unsigned char*)((unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN)))[uiBinIndex];
+		unsigned char* pMeta = (unsigned char*)((unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_META)))[uiBinIndex];
+		unsigned long int uiBinSize = SYSTEM_PAGE_SIZE * ((unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_PAGE_NUM)))[uiBinIndex];
+		unsigned long int uiMinBlockSize = ((unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_MIN_BLOCK)))[uiBinIndex];
+		unsigned long int uiUsedBytes = ((unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_USED_BYTES)))[uiBinIndex];
+		
+		unsigned long int uiBlockSize = GetAllocatedBlockSize((unsigned char*)ptr, pBin, pMeta, uiBinSize, uiMinBlockSize);
+		if (0 != uiBlockSize)
+		{
+			// A block that takes the whole Bin frees nothing by moving
+			unsigned long int uiArenaUsedBytes = 0;
+			unsigned long int uiArenaBytes = GetArenaUsage(pThreadMetaData_, &uiArenaUsedBytes);
+			iResult = uiBlockSize < uiBinSize && IsSparseBin(uiUsedBytes, uiBinSize, uiArenaUsedBytes, uiArenaBytes);
+		}
+	}
+	
+	sem_post(pLock);
+	
+	return iResult;
+}
+
+// Get the size of the block allocated at ptr by walking down the tree of its Bin, as FreeFromBin() does
+// 0 : ptr is not the start of an allocated block
+unsigned long int GetAllocatedBlockSize(unsigned char* ptr, unsigned char* pBin_, unsigned char* pMeta_, size_t uiBinSize_, size_t uiBlockMinSize_)
+{
+	unsigned long int uiNode = 0;
+	size_t uiNodeSize = uiBinSize_;
+	unsigned char* pBlock = pBin_;
+	
+	while (uiNodeSize >= uiBlockMinSize_)
+	{
+		unsigned char ucState = GetNodeState(uiNode, pMeta_);
+		if (EBBS_ALLOCATED_AT_ONCE == ucState)
+			return ptr == pBlock ? uiNodeSize : 0;
+		
+		if (EBBS_FREE == ucState)
+			return 0;
+		
+		uiNodeSize /= 2;
+		if (ptr < pBlock + uiNodeSize)
+		{
+			uiNode = (uiNode * 2) + 1;
+		}
+		else
+		{
+			uiNode = (uiNode * 2) + 2;
+			pBlock += uiNodeSize;
+		}
+	}
+	
+	return 0;
+}
+
+// Sum the used bytes and the sizes of the Bins of a Thread Arena that are in use
+// Empty Bins are left out, since they are what defragmentation is meant to produce.
+// Return the total size of those Bins, and their used bytes in *pUsedBytes_
+unsigned long int GetArenaUsage(unsigned char* pThreadMetaData_, unsigned long int* pUsedBytes_)
+{
+	unsigned long int uiBytes = 0;
+	unsigned long int uiUsedBytes = 0;
+	unsigned char* pCurrentMeta = pThreadMetaData_;
+	while (pCurrentMeta)
+	{
+		unsigned long int* pBinList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN));
+		unsigned long int* pBinPageNumList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_PAGE_NUM));
+		unsigned long int* pBinUsedBytes = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_USED_BYTES));
+		for (unsigned long int i = 0; i < MAX_BIN_NUMS && pBinList[i]; ++i)
+		{
+			if (0 == pBinUsedBytes[i])
+				continue;
+			
+			uiBytes += SYSTEM_PAGE_SIZE * pBinPageNumList[i];
+			uiUsedBytes += pBinUsedBytes[i];
+		}
+		
+		pCurrentMeta = (unsigned char*)*(((unsigned long int*)pCurrentMeta) + 1);
+	}
+	
+	*pUsedBytes_ = uiUsedBytes;
+	
+	return uiBytes;
+}
+
+// Get the share of uiBytes_ that uiUsedBytes_ takes, in units of 1 / USAGE_RATIO_SCALE ( uiUsedBytes_ <= uiBytes_ )
+// Byte counts of more than 16 TB are divided down first instead of scaled up, so that the result never overflows.
+unsigned long int GetUsageRatio(unsigned long int uiUsedBytes_, unsigned long int uiBytes_)
+{
+	if (0 == uiBytes_)
+		return 0;
+	
+	if (uiUsedBytes_ <= ULONG_MAX / USAGE_RATIO_SCALE)
+		return (uiUsedBytes_ * USAGE_RATIO_SCALE) / uiBytes_;
+	
+	return uiUsedBytes_ / (uiBytes_ / USAGE_RATIO_SCALE);
+}
+
+// A Bin is sparse if it is used less than the Bins in use of its Arena on average ( See GetArenaUsage() )
+// An empty Bin counts as sparse, so that AllocateMemoryDense() leaves it empty.
+int IsSparseBin(unsigned long int uiUsedBytes_, unsigned long int uiBinBytes_, unsigned long int uiArenaUsedBytes_, unsigned long int uiArenaBytes_)
+{
+	if (0 == uiUsedBytes_)
+		return 1;
+	
+	return GetUsageRatio(uiUsedBytes_, uiBinBytes_) < GetUsageRatio(uiArenaUsedBytes_, uiArenaBytes_);
+}
+
+// Print malloc statistics
+void MallocStats()
+{
+	// Process Metadata are read without the process lock ( See RegisterArena() )
+	unsigned long int uiRegisteredThreadCounts = __atomic_load_n(&g_uiRegisteredThreadCounts, __ATOMIC_ACQUIRE);
+	for (unsigned long int uiArenaIndex = 0; uiArenaIndex < uiRegisteredThreadCounts; ++uiArenaIndex)
+	{
+		unsigned char* pArena = GetRegisteredArena(uiArenaIndex);
+		if (NULL == pArena)
+			continue;
+		
+		sem_t* pLock = *(sem_t**)(pArena + g_uiArenaLock_Offset);
+		sem_wait(pLock);
+		fprintf(stderr, "===========================================\n");
+		fprintf(stderr, "Arena %lu Info\n", uiArenaIndex);
+		
+		MallocStatsThreadArena(pArena);
+		sem_post(pLock);
+	}
+}
+
+// Install the uiPageIndex_th page of Process Metadata in g_pProcessMetaDirectory
+// Threads that need the same page at once each map one, and the first to install it wins. The others unmap theirs and use that one.
+// The release order of the install makes the page ( zeros, and its header ) visible to the threads that find it. ( See GetProcessMetaPage() )
+// NULL : No memory for a new page, or the directory is full
+unsigned char* CreateNewProcessMetaPage(unsigned long int uiPageIndex_)
+{
+	if (uiPageIndex_ >= MAX_PROCESS_META_PAGES)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	
+	unsigned char* pNewAddr = (unsigned char*)mmap(NULL, SYSTEM_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ((void *)(-1) == pNewAddr)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	
+	*(unsigned long int*)pNewAddr = (unsigned long int)pNewAddr;
+	*(((unsigned long int*)(pNewAddr)) + 1) = uiPageIndex_;
+	
+	unsigned char* pInstalled = NULL;
+	if (__atomic_compare_exchange_n(&g_pProcessMetaDirectory[uiPageIndex_], &pInstalled, pNewAddr, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return pNewAddr;
+	
+	munmap(pNewAddr, SYSTEM_PAGE_SIZE);
+	return pInstalled;
+}
+
+// Create a new metadata page for the Thread Arena
+// If pNew_ are provided, then use the address as a new metata page.
+// If pThreadMetaData_ is NULL, the new page becomes the first page of a new Thread Arena.
+unsigned char* CreateNewThreadMeta(unsigned char* pThreadMetaData_, unsigned char* pNew_)
+{
+	unsigned char* pNewAddr = pNew_;
+	if (NULL == pNewAddr)
+	{
+		pNewAddr = (unsigned char*)mmap(NULL, SYSTEM_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if ((void *)(-1) == pNewAddr)
+		{
+			errno = ENOMEM;		
+			return NULL;
+		}
+	}
+	
+	*(unsigned long int*)pNewAddr = (unsigned long int)pNewAddr;
+
+	// If this is the first page of the ThreadMeta
+	if (NULL == pThreadMetaData_)
+	{
+		*(unsigned long int*)(pNewAddr + g_uiMetaPageNums_Offset) = 1;
+		*(unsigned long int*)(pNewAddr + g_uiArenaNextBinPageNums_Offset) = MIN_NEW_PAGE_NUMS;
+		return pNewAddr;
+	}
+	
+	// Otherwise, add the newly created page to the end of the list
+	unsigned char* pLastMeta = GetLastThreadMetaPage(pThreadMetaData_);
+	*(((unsigned long int*)(pLastMeta)) + 1) = (unsigned long int)pNewAddr;
+	++*(unsigned long int*)(pThreadMetaData_ + g_uiMetaPageNums_Offset); 
+	
+	return pNewAddr;
+}
+
+// Get the number of pages of the smallest Bin that holds a request of uiSize_ bytes
+// The smallest power of two that holds the request ( A new Bin can be larger. See GetNewBinPageNums() )
+unsigned long int GetBinPageNums(size_t uiSize_)
+{
+	unsigned long int uiPageNums = 1;
+	while (uiSize_ > SYSTEM_PAGE_SIZE * uiPageNums)
+		uiPageNums *= 2;
+	
+	return uiPageNums;
+}
+
+// Get the number of pages needed to store the Metadata of a new Bin of uiPageNums_ pages whose smallest block is uiMinBlockSize_
+unsigned long int GetBinMetaPageNums(unsigned long int uiPageNums_, unsigned long int uiMinBlockSize_)
+{
+	unsigned long int uiMetadataSize = (SYSTEM_PAGE_SIZE / uiMinBlockSize_) * uiPageNums_;
+	unsigned long int uiMetaPageNums = 1;
+	while (uiMetadataSize > SYSTEM_PAGE_SIZE * uiMetaPageNums)
+		++uiMetaPageNums;
+	
+	return uiMetaPageNums;
+}
+
+// Get the size of the smallest block a new Bin for requests of uiRequestPageNums_ pages tracks ( See GetBinPageNums() )
+// A Bin for large requests only serves large requests, so tracking it down to MIN_BLOCK_SIZE would spend 1/8 of its size on Metadata.
+// Instead, its leaves are a page, and its Metadata take a byte per page.
+unsigned long int GetBinMinBlockSize(unsigned long int uiRequestPageNums_)
+{
+	if (uiRequestPageNums_ >= COARSE_BIN_PAGE_NUMS)
+		return SYSTEM_PAGE_SIZE;
+	
+	return MIN_BLOCK_SIZE;
+}
+
+// Get the number of pages of a new Bin of a Thread Arena for requests of uiRequestPageNums_ pages ( See GetBinPageNums() )
+// A Bin for large requests is just large enough. A Bin for small requests has the size stored in the Arena,
+// which starts at MIN_NEW_PAGE_NUMS and doubles each time such a Bin is created, up to MAX_NEW_PAGE_NUMS. ( See CreateNewBin() )
+// An Arena that only holds a few blocks keeps small Bins, and a busy one soon has few large Bins to search.
+unsigned long int GetNewBinPageNums(unsigned char* pThreadMetaData_, unsigned long int uiRequestPageNums_)
+{
+	if (uiRequestPageNums_ >= COARSE_BIN_PAGE_NUMS)
+		return uiRequestPageNums_;
+	
+	unsigned long int uiPageNums = *(unsigned long int*)(pThreadMetaData_ + g_uiArenaNextBinPageNums_Offset);
+	return (uiPageNums > uiRequestPageNums_) ? uiPageNums : uiRequestPageNums_;
+}
+
+// Commit pages from the address space reserved for a Thread Arena
+// The space is reserved as PROT_NONE on the first call, and pages are handed out from it in order.
+// The Bins of an Arena are then next to each other, and the kernel merges them into a single mapping.
+// Pages the background thread has already made accessible ( See CommitArenaPagesAhead() ) are handed out without calling mprotect().
+// If the space cannot be reserved, reservation is turned off for the process, so that it is not tried again for every new Bin of every Arena.
+// NULL : Reservation is off, or the reserved space is used up ( The caller maps the pages on its own )
+unsigned char* CommitArenaPages(unsigned char* pThreadMetaData_, unsigned long int uiPageNums_, int bPopulate_)
+{
+	unsigned long int* pReserveStart = (unsigned long int*)(pThreadMetaData_ + g_uiArenaReserveStart_Offset);
+	unsigned long int* pReserveSize = (unsigned long int*)(pThreadMetaData_ + g_uiArenaReserveSize_Offset);
+	unsigned long int* pReserveUsed = (unsigned long int*)(pThreadMetaData_ + g_uiArenaReserveUsed_Offset);
+	unsigned long int* pReserveCommitted = (unsigned long int*)(pThreadMetaData_ + g_uiArenaReserveCommitted_Offset);
+	if (0 == *pReserveStart)
+	{
+		unsigned long int uiReserveSize = __atomic_load_n(&g_uiArenaReserveSize, __ATOMIC_RELAXED);
+		if (0 == uiReserveSize)
+			return NULL;
+		
+		CountArenaEvent(pThreadMetaData_, ASO_MAP_CALLS);
+		void* pReserved = mmap(NULL, uiReserveSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if ((void *)(-1) == pReserved)
+		{
+			__atomic_store_n(&g_uiArenaReserveSize, 0, __ATOMIC_RELAXED);
+			return NULL;
+		}
+		
+		// Threads freeing to other Arenas read the start and the size without the lock ( See IsInArenaRange() ). The start is stored last.
+		__atomic_store_n(pReserveSize, uiReserveSize, __ATOMIC_RELAXED);
+		*pReserveUsed = 0;
+		*pReserveCommitted = 0;
+		__atomic_store_n(pReserveStart, (unsigned long int)pReserved, __ATOMIC_RELEASE);
+	}
+	
+	unsigned long int uiSize = SYSTEM_PAGE_SIZE * uiPageNums_;
+	if (uiSize > *pReserveSize - *pReserveUsed)
+		return NULL;
+	
+	unsigned char* pCommitted = (unsigned char*)(*pReserveStart + *pReserveUsed);
+	if (*pReserveUsed + uiSize > *pReserveCommitted)
+	{
+		CountArenaEvent(pThreadMetaData_, ASO_MAP_CALLS);
+		if (-1 == mprotect((void*)(*pReserveStart + *pReserveCommitted), *pReserveUsed + uiSize - *pReserveCommitted, PROT_READ | PROT_WRITE))
+			return NULL;
+		
+		*pReserveCommitted = *pReserveUsed + uiSize;
+	}
+	
+	*pReserveUsed += uiSize;
+	
+	if (bPopulate_)
+	{
+#ifdef MADV_POPULATE_WRITE
+		if (-1 == madvise(pCommitted, uiSize, MADV_POPULATE_WRITE))
+#endif
+			PopulatePages(pCommitted, uiPageNums_);
+	}
+	
+	return pCommitted;
+}
+
+// Fault in pages by writing to each of them ( Reading would only map the shared zero page )
+void PopulatePages(unsigned char* pPages_, unsigned long int uiPageNums_)
+{
+	for (unsigned long int i = 0; i < uiPageNums_; ++i)
+		*(volatile unsigned char*)(pPages_ + (SYSTEM_PAGE_SIZE * i)) = 0;
+}
+
+// Whether ptr can be in a Bin of a Thread Arena
+// If all the Bins of the Arena are in its reserved address space, a single range compare tells.
+// The range never changes once reserved, so no lock is needed. It is read atomically, as the owner thread may be reserving it meanwhile. ( See CommitArenaPages() )
+// 0 : ptr is not in the Arena
+int IsInArenaRange(void* ptr, unsigned char* pThreadMetaData_)
+{
+	if (0 != __atomic_load_n((unsigned long int*)(pThreadMetaData_ + g_uiArenaOutsideBins_Offset), __ATOMIC_RELAXED))
+		return 1;
+	
+	unsigned long int uiReserveStart = __atomic_load_n((unsigned long int*)(pThreadMetaData_ + g_uiArenaReserveStart_Offset), __ATOMIC_ACQUIRE);
+	if (0 == uiReserveStart)
+		return 0;
+	
+	unsigned long int uiReserveSize = __atomic_load_n((unsigned long int*)(pThreadMetaData_ + g_uiArenaReserveSize_Offset), __ATOMIC_RELAXED);
+	return ((unsigned long int)ptr - uiReserveStart) < uiReserveSize;
+}
+
+// Create a new Bin and Meta for that bin, for requests of uiRequestPageNums_ pages ( See GetNewBinPageNums() )
+// If bPopulate_ is set, the pages are faulted in now rather than on first touch. ( See PrewarmArena() )
+unsigned char* CreateNewBin(unsigned char* pThreadMetaData_, unsigned long int uiRequestPageNums_, int bPopulate_)
+{
+	unsigned long int* pBinNums = (unsigned long int*)(pThreadMetaData_ + g_uiBinNums_Offset);
+	unsigned long int* pMetaPageNums = (unsigned long int*)(pThreadMetaData_ + g_uiMetaPageNums_Offset);
+	unsigned long int* pBinMetaNums = (unsigned long int*)(pThreadMetaData_ + g_uiBinMetaNums_Offset);
+	unsigned long int* pArenaSize = (unsigned long int*)(pThreadMetaData_ + g_uiArenaSize_Offset);
+	unsigned long int* pNextBinPageNums = (unsigned long int*)(pThreadMetaData_ + g_uiArenaNextBinPageNums_Offset);
+	
+	unsigned long int uiPageNums = GetNewBinPageNums(pThreadMetaData_, uiRequestPageNums_);
+	unsigned long int uiMinBlockSize = GetBinMinBlockSize(uiRequestPageNums_);
+	unsigned long int uiMetaPageNums = GetBinMetaPageNums(uiPageNums, uiMinBlockSize);
+	unsigned long int uiMetadataSize = (SYSTEM_PAGE_SIZE / uiMinBlockSize) * uiPageNums;
+	unsigned long int uiMetaPageIndex = *pBinNums  / MAX_BIN_NUMS;
+	
+	unsigned long int uiPageNeeded = uiPageNums;
+	if (uiMetaPageIndex >= *pMetaPageNums)
+		++uiPageNeeded;
+	
+	unsigned char* pBinMeta = GetLargeBinMetaPage(pThreadMetaData_, uiMetadataSize);
+	if (NULL == pBinMeta)
+		uiPageNeeded += uiMetaPageNums;
+
+	unsigned char* pNewAddr = CommitArenaPages(pThreadMetaData_, uiPageNeeded, bPopulate_);
+	if (NULL == pNewAddr)
+	{
+		int iFlags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_POPULATE
+		if (bPopulate_)
+			iFlags |= MAP_POPULATE;
+#endif
+		CountArenaEvent(pThreadMetaData_, ASO_MAP_CALLS);
+		pNewAddr = (unsigned char*)mmap(NULL, SYSTEM_PAGE_SIZE * uiPageNeeded, PROT_READ | PROT_WRITE, iFlags, -1, 0);
+		
+		if ((void *)(-1) == pNewAddr)
+		{
+			errno = ENOMEM;		
+			return NULL;
+		}
+		
+#ifndef MAP_POPULATE
+		if (bPopulate_)
+			PopulatePages(pNewAddr, uiPageNeeded);
+#endif
+		__atomic_add_fetch((unsigned long int*)(pThreadMetaData_ + g_uiArenaOutsideBins_Offset), 1, __ATOMIC_RELAXED);
+	}
+	
+	if (uiMetaPageIndex >= *pMetaPageNums)
+	{
+		CreateNewThreadMeta(pThreadMetaData_, pNewAddr);
+		pNewAddr += SYSTEM_PAGE_SIZE;
+	}
+	
+	unsigned char* pBin = pNewAddr;
+	unsigned long int uiNewBinIndex =  *pBinNums  % MAX_BIN_NUMS;
+	unsigned char* pCurrentThreadMeta = GetLastThreadMetaPage(pThreadMetaData_);
+	
+	
+	if (NULL == pBinMeta)
+	{
+		pBinMeta = pBin + (SYSTEM_PAGE_SIZE * uiPageNums);
+		unsigned long int uiPageIndex = *pBinMetaNums / MAX_BIN_NUMS;
+		unsigned long int uiBinMetaIndex = *pBinMetaNums % MAX_BIN_NUMS;
+		
+		unsigned char* pThreadMeta = GetThreadMetaPage(pThreadMetaData_, uiPageIndex);
+		unsigned long int* pBinMetaWholeList = (unsigned long int*)(pThreadMeta + TMO_OFFSET(TMO_BIN_META_POOL));
+		unsigned long int* pBinMetaPageNumList = (unsigned long int*)(pThreadMeta + TMO_OFFSET(TMO_BIN_META_PAGE_NUM));
+		unsigned long int* pBinMetaOffsetList = (unsigned long int*)(pThreadMeta + TMO_OFFSET(TMO_BIN_META_OFFSET));
+		pBinMetaWholeList[uiBinMetaIndex] = (unsigned long int)pBinMeta;
+		pBinMetaPageNumList[uiBinMetaIndex] = uiMetaPageNums;
+		pBinMetaOffsetList[uiBinMetaIndex] = uiMetadataSize;
+		
+		++*pBinMetaNums;	
+	}
+		
+
+	unsigned long int* pBinList = (unsigned long int*)(pCurrentThreadMeta + TMO_OFFSET(TMO_BIN));
+	unsigned long int* pBinMetaList = (unsigned long int*)(pCurrentThreadMeta + TMO_OFFSET(TMO_BIN_META));
+	unsigned long int* pBinPageNumList = (unsigned long int*)(pCurrentThreadMeta + TMO_OFFSET(TMO_BIN_PAGE_NUM));
+	unsigned long int* pBinMinBlockList = (unsigned long int*)(pCurrentThreadMeta + TMO_OFFSET(TMO_BIN_MIN_BLOCK));
+	
+
+	pBinList[uiNewBinIndex] = (unsigned long int)pBin;
+	pBinPageNumList[uiNewBinIndex] = uiPageNums;
+	pBinMetaList[uiNewBinIndex] = (unsigned long int)pBinMeta;
+	pBinMinBlockList[uiNewBinIndex] = uiMinBlockSize;
+
+	//memset(pBinMeta, 0, uiMetadataSize);
+		
+	MALLOC_PROBE4(new_bin, pThreadMetaData_, *pBinNums, pBin, uiPageNums);
+	
+	++*pBinNums;
+	*pArenaSize += (uiPageNums * SYSTEM_PAGE_SIZE);
+	CountArenaEvent(pThreadMetaData_, ASO_NEW_BINS);
+	
+	// The next Bin for small requests is twice as large
+	if (MIN_BLOCK_SIZE == uiMinBlockSize && uiPageNums >= *pNextBinPageNums)
+		*pNextBinPageNums = (uiPageNums * 2 < MAX_NEW_PAGE_NUMS) ? uiPageNums * 2 : MAX_NEW_PAGE_NUMS;
+	
+	return pBin;
+}
+
+
+// Memory allocation is only managed with its own Arena
+// Allocate memory from its own Arena
+void* MallocFromThreadArena(size_t uiSize_, unsigned long int uiMinBlackSize_, unsigned char* pThreadMetaData_)
+{
+	void* pAllocated = NULL;
+	MallocBatchFromThreadArena(uiSize_, uiMinBlackSize_, 1, &pAllocated, pThreadMetaData_, 0);
+	
+	return pAllocated;
+}
+
+// Allocate uiNums_ blocks of uiSize_ bytes from its own Arena and store their addresses in pOut_
+// Several blocks are carved from a Bin at once. ( See AllocateBatchFromBin() )
+// Under EPP_BEST_FIT, the fullest Bin that can hold the request is tried first, and the Bins are then tried in order as under EPP_FIRST_FIT.
+// If bAvoidSparse_ is set, Bins used less than the Arena on average are skipped ( See IsSparseBin() ), and no new Bin is created.
+// Return the number of blocks allocated ( Less than uiNums_ if memory runs out )
+unsigned long int MallocBatchFromThreadArena(size_t uiSize_, unsigned long int uiMinBlackSize_, unsigned long int uiNums_, void** pOut_, unsigned char* pThreadMetaData_, int bAvoidSparse_)
+{
+	if (0 == uiSize_ || 0 == uiNums_ || uiSize_ > MAX_REQUEST_SIZE)
+		return 0;
+	
+	if (uiSize_ < uiMinBlackSize_)
+		uiSize_ = uiMinBlackSize_;
+	
+	unsigned long int uiPageNums = GetBinPageNums(uiSize_);
+	
+	
+	unsigned char* pCurrentThreadMetaData = pThreadMetaData_;
+	unsigned long int* pBinList = (unsigned long int*)(pCurrentThreadMetaData + TMO_OFFSET(TMO_BIN));
+	unsigned long int* pBinPageNumList = (unsigned long int*)(pCurrentThreadMetaData + TMO_OFFSET(TMO_BIN_PAGE_NUM));
+	unsigned long int* pBinUsedBtyes = (unsigned long int*)(pCurrentThreadMetaData + TMO_OFFSET(TMO_BIN_USED_BYTES));
+	unsigned long int* pBinMinBlockList = (unsigned long int*)(pCurrentThreadMetaData + TMO_OFFSET(TMO_BIN_MIN_BLOCK));
+	unsigned long int* pBinPurging = (unsigned long int*)(pCurrentThreadMetaData + TMO_OFFSET(TMO_BIN_PURGING));
+	unsigned long int uiBinIndex = 0;
+	unsigned long int uiActualBinIndex = 0;
+	unsigned long int uiAllocNums = 0;
+	unsigned long int* pStats = GetArenaStats(pThreadMetaData_);
+	if (pStats)
+		__atomic_fetch_add(&pStats[ASO_ALLOC_CALLS], 1, __ATOMIC_RELAXED);
+	
+	unsigned long int uiArenaUsedBytes = 0;
+	unsigned long int uiArenaBytes = 0;
+	if (bAvoidSparse_)
+		uiArenaBytes = GetArenaUsage(pThreadMetaData_, &uiArenaUsedBytes);
+	
+	// A large request takes an empty large Bin of its own size before it splits a larger one
+	if (uiPageNums >= COARSE_BIN_PAGE_NUMS && 0 == bAvoidSparse_)
+	{
+		unsigned char* pCachedMetaPage = NULL;
+		unsigned long int uiCachedBinIndex = 0;
+		unsigned long int uiCachedActualBinIndex = 0;
+		if (SelectCachedLargeBin(pThreadMetaData_, uiPageNums, &pCachedMetaPage, &uiCachedBinIndex, &uiCachedActualBinIndex))
+		{
+			if (pStats)
+				__atomic_fetch_add(&pStats[ASO_BINS_SCANNED], 1, __ATOMIC_RELAXED);
+			
+			uiAllocNums = AllocateFromArenaBin(pCachedMetaPage, uiCachedBinIndex, uiCachedActualBinIndex, uiSize_, uiMinBlackSize_, uiNums_, pOut_, pThreadMetaData_);
+			if (uiAllocNums == uiNums_)
+				return uiAllocNums;
+		}
+	}
+	
+	if (EPP_BEST_FIT == g_iPlacementPolicy && 0 == bAvoidSparse_ && 0 == uiAllocNums)
+	{
+		unsigned char* pFullestMetaPage = NULL;
+		unsigned long int uiFullestBinIndex = 0;
+		unsigned long int uiFullestActualBinIndex = 0;
+		if (SelectFullestBin(pThreadMetaData_, uiSize_, uiPageNums, &pFullestMetaPage, &uiFullestBinIndex, &uiFullestActualBinIndex))
+		{
+			uiAllocNums = AllocateFromArenaBin(pFullestMetaPage, uiFullestBinIndex, uiFullestActualBinIndex, uiSize_, uiMinBlackSize_, uiNums_, pOut_, pThreadMetaData_);
+			if (uiAllocNums == uiNums_)
+				return uiAllocNums;
+		}
+	}
+	
+	do
+	{
+		if (pStats)
+			__atomic_fetch_add(&pStats[ASO_BINS_SCANNED], 1, __ATOMIC_RELAXED);
+		
+		if (uiBinIndex >= MAX_BIN_NUMS)
+		{
+			uiBinIndex = 0;
+			pCurrentThreadMetaData = (unsigned char*)*(((unsigned long int*)pCurrentThreadMetaData) + 1);
+			if (NULL == pCurrentThreadMetaData)
+			{
+				if (bAvoidSparse_ || NULL == CreateNewBin(pThreadMetaData_, uiPageNums, 0))
+					return uiAllocNums;
+				
+				pCurrentThreadMetaData = GetLastThreadMetaPage(pThreadMetaData_);
+			}
+				
+			pBinList = (unsigned long int*)(pCurrentThreadMetaData + TMO_OFFSET(TMO_BIN));
+			pBinPageNumList = (unsigned long int*)(pCurrentThreadMetaData + TMO_OFFSET(TMO_BIN_PAGE_NUM));
+			pBinUsedBtyes = (unsigned long int*)(pCurrentThreadMetaData + TMO_OFFSET(TMO_BIN_USED_BYTES));
+			pBinMinBlockList = (unsigned long int*)(pCurrentThreadMetaData + TMO_OFFSET(TMO_BIN_MIN_BLOCK));
+			pBinPurging = (unsigned long int*)(pCurrentThreadMetaData + TMO_OFFSET(TMO_BIN_PURGING));
+	
+		}
+
+		unsigned char* pBin = (unsigned char*)pBinList[uiBinIndex];
+		if (NULL == pBin)
+		{
+			if (bAvoidSparse_)
+				return uiAllocNums;
+			
+			pBin = CreateNewBin(pThreadMetaData_, uiPageNums, 0);
+			if (NULL == pBin)
+				return uiAllocNums;
+		}
+
+
+		// A Bin with coarse leaves would waste most of a block on a smaller request
+		unsigned long int uiCurrentBinPageNums = pBinPageNumList[uiBinIndex];
+		// Blocks moved out of sparse Bins must not land in another one
+		// The pages of a Bin the background thread is purging are left alone ( See MaintainArena() )
+		if (uiCurrentBinPageNums < uiPageNums || pBinMinBlockList[uiBinIndex] > uiSize_ || pBinPurging[uiBinIndex] ||
+			(bAvoidSparse_ && IsSparseBin(pBinUsedBtyes[uiBinIndex], SYSTEM_PAGE_SIZE * uiCurrentBinPageNums, uiArenaUsedBytes, uiArenaBytes)))
+		{
+			++uiBinIndex;
+			++uiActualBinIndex;
+			continue;
+		}
+		
+		uiAllocNums += AllocateFromArenaBin(pCurrentThreadMetaData, uiBinIndex, uiActualBinIndex, uiSize_, uiMinBlackSize_, uiNums_ - uiAllocNums, pOut_ + uiAllocNums, pThreadMetaData_);
+		if (uiAllocNums == uiNums_)
+			return uiAllocNums;
+
+		++uiBinIndex;
+		++uiActualBinIndex;
+	} while (pCurrentThreadMetaData);
+	
+	return uiAllocNums;
+}
+
+// Allocate up to uiNums_ blocks of uiSize_ bytes from one Bin of a Thread Arena and store their addresses in pOut_
+// The Bin is entry uiBinIndex_ of the Thread Metadata page pMetaPage_, and Bin uiActualBinIndex_ of the Arena. ( For the probes )
+// Return the number of blocks allocated
+unsigned long int AllocateFromArenaBin(unsigned char* pMetaPage_, unsigned long int uiBinIndex_, unsigned long int uiActualBinIndex_, size_t uiSize_, unsigned long int uiMinBlackSize_, unsigned long int uiNums_, void** pOut_, unsigned char* pThreadMetaData_)
+{
+	unsigned char* pBin = (unsigned char*)((unsigned long int*)(pMetaPage_ + TMO_OFFSET(TMO_BIN)))[uiBinIndex_];
+	unsigned char* pBinMeta = (unsigned char*)((unsigned long int*)(pMetaPage_ + TMO_OFFSET(TMO_BIN_META)))[uiBinIndex_];
+	size_t uiBinSize = SYSTEM_PAGE_SIZE * ((unsigned long int*)(pMetaPage_ + TMO_OFFSET(TMO_BIN_PAGE_NUM)))[uiBinIndex_];
+	unsigned long int* pBinUsedBtyes = (unsigned long int*)(pMetaPage_ + TMO_OFFSET(TMO_BIN_USED_BYTES)) + uiBinIndex_;
+	unsigned long int* pBinAllocReqs = (unsigned long int*)(pMetaPage_ + TMO_OFFSET(TMO_ALLOC_REQUESTS)) + uiBinIndex_;
+	unsigned long int* pBinScanHint = (unsigned long int*)(pMetaPage_ + TMO_OFFSET(TMO_BIN_SCAN_HINT)) + uiBinIndex_;
+	unsigned long int* pBinRequestedBytes = (unsigned long int*)(pMetaPage_ + TMO_OFFSET(TMO_BIN_REQUESTED_BYTES)) + uiBinIndex_;
+	unsigned long int* pBinRoundedBytes = (unsigned long int*)(pMetaPage_ + TMO_OFFSET(TMO_BIN_ROUNDED_BYTES)) + uiBinIndex_;
+	
+	unsigned long int uiBlockMinSize = uiMinBlackSize_;
+	unsigned long int uiBinMinBlock = ((unsigned long int*)(pMetaPage_ + TMO_OFFSET(TMO_BIN_MIN_BLOCK)))[uiBinIndex_];
+	if (uiBlockMinSize < uiBinMinBlock)
+		uiBlockMinSize = uiBinMinBlock;
+	
+	// The Bin cannot hold the block with what is left of it, so its tree is not walked
+	if (uiSize_ > uiBinSize - *pBinUsedBtyes)
+		return 0;
+	
+	unsigned long int uiAllocSize = 0;
+	if (1 == uiNums_)
+	{
+		unsigned char* pAllocated =  AllocateFromBin(pBin, pBinMeta, uiBinSize, uiSize_, uiBlockMinSize, pBinScanHint, &uiAllocSize);
+		if (NULL == pAllocated)
+			return 0;
+		
+		pOut_[0] = pAllocated;
+		*pBinUsedBtyes += uiAllocSize;
+		*pBinAllocReqs += 1;
+		*pBinRequestedBytes += uiSize_;
+		*pBinRoundedBytes += uiAllocSize;
+		MALLOC_PROBE4(bin_alloc, pThreadMetaData_, uiActualBinIndex_, pAllocated, uiAllocSize);
+		return 1;
+	}
+	
+	unsigned long int uiCarvedNums = AllocateBatchFromBin(pBin, pBinMeta, uiBinSize, uiSize_, uiBlockMinSize, uiNums_, pOut_, &uiAllocSize);
+	*pBinUsedBtyes += uiAllocSize;
+	*pBinAllocReqs += uiCarvedNums;
+	*pBinRequestedBytes += uiSize_ * uiCarvedNums;
+	*pBinRoundedBytes += uiAllocSize;
+	MALLOC_PROBE4(bin_alloc_batch, pThreadMetaData_, uiActualBinIndex_, uiCarvedNums, uiAllocSize);
+	return uiCarvedNums;
+}
+
+// Find the first empty large Bin of a Thread Arena that has uiPageNums_ pages ( A Bin created for requests of that many pages. See GetNewBinPageNums() )
+// Empty large Bins are kept as a cache of large blocks, looked up by their size. ( See MaintainArena() )
+// Taking one of the same size keeps a larger one whole for a larger request, which would otherwise create a new Bin.
+// The Bin is stored as in AllocateFromArenaBin() in *ppMetaPage_, *pBinIndex_ and *pActualBinIndex_
+// Return 1 if a Bin was found, 0 if not
+int SelectCachedLargeBin(unsigned char* pThreadMetaData_, unsigned long int uiPageNums_, unsigned char** ppMetaPage_, unsigned long int* pBinIndex_, unsigned long int* pActualBinIndex_)
+{
+	unsigned long int uiActualBinIndex = 0;
+	for (unsigned char* pMetaPage = pThreadMetaData_; pMetaPage; pMetaPage = (unsigned char*)*(((unsigned long int*)pMetaPage) + 1))
+	{
+		unsigned long int* pBinList = (unsigned long int*)(pMetaPage + TMO_OFFSET(TMO_BIN));
+		unsigned long int* pBinPageNumList = (unsigned long int*)(pMetaPage + TMO_OFFSET(TMO_BIN_PAGE_NUM));
+		unsigned long int* pBinUsedBtyes = (unsigned long int*)(pMetaPage + TMO_OFFSET(TMO_BIN_USED_BYTES));
+		unsigned long int* pBinMinBlockList = (unsigned long int*)(pMetaPage + TMO_OFFSET(TMO_BIN_MIN_BLOCK));
+		unsigned long int* pBinPurging = (unsigned long int*)(pMetaPage + TMO_OFFSET(TMO_BIN_PURGING));
+		for (unsigned long int i = 0; i < MAX_BIN_NUMS; ++i, ++uiActualBinIndex)
+		{
+			if (0 == pBinList[i])
+				return 0;
+			
+			if (pBinPageNumList[i] != uiPageNums_ || SYSTEM_PAGE_SIZE != pBinMinBlockList[i] || 0 != pBinUsedBtyes[i] || pBinPurging[i])
+				continue;
+			
+			*ppMetaPage_ = pMetaPage;
+			*pBinIndex_ = i;
+			*pActualBinIndex_ = uiActualBinIndex;
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+// Find the fullest Bin of a Thread Arena that can hold uiSize_ bytes ( For EPP_BEST_FIT )
+// Only Bins in use are considered, with the same conditions on their size and blocks as in MallocBatchFromThreadArena().
+// Allocating from them first lets the other Bins drain, so that they can be purged. ( See MaintainArena() )
+// The Bin is stored as in AllocateFromArenaBin() in *ppMetaPage_, *pBinIndex_ and *pActualBinIndex_
+// Return 1 if a Bin was found, 0 if not
+int SelectFullestBin(unsigned char* pThreadMetaData_, size_t uiSize_, unsigned long int uiPageNums_, unsigned char** ppMetaPage_, unsigned long int* pBinIndex_, unsigned long int* pActualBinIndex_)
+{
+	unsigned long int uiBestUsageRatio = 0;
+	unsigned long int uiActualBinIndex = 0;
+	int bFound = 0;
+	
+	for (unsigned char* pMetaPage = pThreadMetaData_; pMetaPage; pMetaPage = (unsigned char*)*(((unsigned long int*)pMetaPage) + 1))
+	{
+		unsigned long int* pBinList = (unsigned long int*)(pMetaPage + TMO_OFFSET(TMO_BIN));
+		unsigned long int* pBinPageNumList = (unsigned long int*)(pMetaPage + TMO_OFFSET(TMO_BIN_PAGE_NUM));
+		unsigned long int* pBinUsedBtyes = (unsigned long int*)(pMetaPage + TMO_OFFSET(TMO_BIN_USED_BYTES));
+		unsigned long int* pBinMinBlockList = (unsigned long int*)(pMetaPage + TMO_OFFSET(TMO_BIN_MIN_BLOCK));
+		unsigned long int* pBinPurging = (unsigned long int*)(pMetaPage + TMO_OFFSET(TMO_BIN_PURGING));
+		for (unsigned long int i = 0; i < MAX_BIN_NUMS; ++i, ++uiActualBinIndex)
+		{
+			if (0 == pBinList[i] || pBinPurging[i])
+				continue;
+			
+			unsigned long int uiBinBytes = SYSTEM_PAGE_SIZE * pBinPageNumList[i];
+			unsigned long int uiUsedBytes = pBinUsedBtyes[i];
+			if (pBinPageNumList[i] < uiPageNums_ || pBinMinBlockList[i] > uiSize_ || 0 == uiUsedBytes || uiUsedBytes + uiSize_ > uiBinBytes)
+				continue;
+			
+			unsigned long int uiUsageRatio = GetUsageRatio(uiUsedBytes, uiBinBytes);
+			if (bFound && uiUsageRatio <= uiBestUsageRatio)
+				continue;
+			
+			uiBestUsageRatio = uiUsageRatio;
+			*ppMetaPage_ = pMetaPage;
+			*pBinIndex_ = i;
+			*pActualBinIndex_ = uiActualBinIndex;
+			bFound = 1;
+		}
+	}
+	
+	return bFound;
+}
+
+// Choose the placement policy of all Arenas ( See PLACEMENT_POLICY )
+// Return the previous policy, or -1 if iPolicy_ is not a policy
+int SetPlacementPolicy(int iPolicy_)
+{
+	if (iPolicy_ < 0 || iPolicy_ >= EPP_MAX)
+		return -1;
+	
+	return __atomic_exchange_n(&g_iPlacementPolicy, iPolicy_, __ATOMIC_RELAXED);
+}
+
+// Create a new thread Arena
+// An Arena whose threads have all exited is taken over instead, if there is one. ( See AdoptOrphanedArena() )
+unsigned char* CreateNewThreadArena()
+{
+	unsigned char* pAdopted = AdoptOrphanedArena();
+	if (pAdopted)
+	{
+		t_pThreadMetaData = pAdopted;
+		pthread_setspecific(g_keyThreadArena, pAdopted);
+		return pAdopted;
+	}
+	
+	unsigned char* pNewArena = CreateNewThreadMeta(NULL, NULL);
+	if (NULL == pNewArena)
+		return NULL;
+	
+	*(unsigned long int*)(pNewArena + g_uiArenaThreadNums_Offset) = 1;
+	
+	// Registering takes no lock, so a burst of new threads does not queue up here
+	sem_t* pLock = RegisterArena(pNewArena);
+	if (NULL == pLock)
+	{
+		munmap(pNewArena, SYSTEM_PAGE_SIZE);
+		return NULL;
+	}
+	
+	t_pThreadMetaData = pNewArena;
+	if (g_iThreadArenaKeyCreated)
+		pthread_setspecific(g_keyThreadArena, pNewArena);
+	
+	PrewarmArena(pNewArena, g_uiPrewarmBins, 1, g_iPrewarmPopulate);
+	return t_pThreadMetaData;
+}
+
+// Take over a Thread Arena whose threads have all exited ( EAM_THREAD )
+// Its Bins, and the empty large Bins the background thread keeps for it ( See MaintainArena() ), are reused instead of mapping new ones.
+// So threads that come and go, each allocating large blocks, do not map and fault in new Bins each time.
+// Process Metadata are read without the process lock ( See RegisterArena() ), and the Arena is claimed by its thread count.
+// NULL : No Arena is orphaned ( Or exited threads cannot be told, because g_keyThreadArena could not be created )
+unsigned char* AdoptOrphanedArena()
+{
+	if (0 == g_iThreadArenaKeyCreated)
+		return NULL;
+	
+	unsigned long int uiRegisteredThreadCounts = __atomic_load_n(&g_uiRegisteredThreadCounts, __ATOMIC_ACQUIRE);
+	for (unsigned long int uiArenaIndex = 0; uiArenaIndex < uiRegisteredThreadCounts; ++uiArenaIndex)
+	{
+		unsigned char* pArena = GetRegisteredArena(uiArenaIndex);
+		if (NULL == pArena)
+			continue;
+		
+		unsigned long int uiExpected = 0;
+		if (__atomic_compare_exchange_n((unsigned long int*)(pArena + g_uiArenaThreadNums_Offset), &uiExpected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return pArena;
+	}
+	
+	return NULL;
+}
+
+// Create uiBinNums_ Bins for requests of uiRequestPageNums_ pages in a Thread Arena ahead of the allocations that would create them
+// They are the Bins those allocations would create, so Bins for small requests grow as usual. ( See GetNewBinPageNums() )
+// With bPopulate_ set, their pages are faulted in as well, so the first allocations from them do not take page faults either.
+// Return the number of Bins created
+unsigned long int PrewarmArena(unsigned char* pThreadMetaData_, unsigned long int uiBinNums_, unsigned long int uiRequestPageNums_, int bPopulate_)
+{
+	if (NULL == pThreadMetaData_ || 0 == uiBinNums_)
+		return 0;
+	
+	unsigned long int uiCreated = 0;
+	
+	sem_t* pLock = LockArena(pThreadMetaData_);
+	while (uiCreated < uiBinNums_ && CreateNewBin(pThreadMetaData_, uiRequestPageNums_, bPopulate_))
+		++uiCreated;
+	sem_post(pLock);
+	
+	return uiCreated;
+}
+
+// Create the Arena of the calling thread if it does not have one yet, and uiBinNums_ Bins that hold at least uiSize_ bytes each
+// Return the number of Bins created
+unsigned long int PrewarmMemory(unsigned long int uiBinNums_, size_t uiSize_, int bPopulate_)
+{
+	unsigned char* pArena = GetCurrentArena();
+	if (NULL == pArena)
+		return 0;
+	
+	return PrewarmArena(pArena, uiBinNums_, GetBinPageNums(uiSize_), bPopulate_);
+}
+
+// Create the Thread Arena of a CPU ( EAM_PER_CPU )
+// If another thread has already created it, return that one.
+unsigned char* CreateNewCpuArena(unsigned long int uiCpu_)
+{
+	///////////////////////////////////////////////////////////////////////////////////
+	sem_wait(&g_semProcessLock);
+	unsigned char* pArena = g_pCpuArenaList[uiCpu_];
+	if (NULL == pArena)
+	{
+		pArena = CreateNewThreadMeta(NULL, NULL);
+		if (pArena && NULL == RegisterArena(pArena))
+		{
+			munmap(pArena, SYSTEM_PAGE_SIZE);
+			pArena = NULL;
+		}
+		
+		// Threads on this CPU read the list without the process lock
+		if (pArena)
+		{
+			PrewarmArena(pArena, g_uiPrewarmBins, 1, g_iPrewarmPopulate);
+			__atomic_store_n(&g_pCpuArenaList[uiCpu_], pArena, __ATOMIC_RELEASE);
+		}
+	}
+	sem_post(&g_semProcessLock);
+	///////////////////////////////////////////////////////////////////////////////////////
+	
+	return pArena;
+}
+
+// Add a new Thread Arena to Process Metadata and set up its lock
+// No lock is taken. The slot is claimed by incrementing g_uiRegisteredThreadCounts, and its page is found in g_pProcessMetaDirectory,
+// or installed there by the first thread that needs it. The slot is filled in, and the address of the Arena is stored last with release order.
+// Readers load g_uiRegisteredThreadCounts and then the address of each Arena with acquire order ( See GetRegisteredArena() ),
+// so they either skip a slot that is not filled in yet, or see its lock and the Arena as they were set up here.
+// NULL : No memory for a new Process Metadata page ( The slot stays empty )
+sem_t* RegisterArena(unsigned char* pThreadMetaData_)
+{
+	unsigned long int uiThreadCounts = __atomic_fetch_add(&g_uiRegisteredThreadCounts, 1, __ATOMIC_RELAXED);
+	unsigned long int uiNewThreadIndex =  uiThreadCounts % g_uiMaxThreadNums;
+	unsigned long int uiProcessMetaPageIndex = uiThreadCounts / g_uiMaxThreadNums;
+	
+	unsigned char* pCurrentMetaPage = GetProcessMetaPage(uiProcessMetaPageIndex);
+	// Need a New Page for Process Metadata
+	if (NULL == pCurrentMetaPage)
+	{
+		pCurrentMetaPage = CreateNewProcessMetaPage(uiProcessMetaPageIndex);
+		if (NULL == pCurrentMetaPage)
+			return NULL;
+	}
+	
+	sem_t* pLock = (sem_t*)(pCurrentMetaPage + g_uiThreadLockList_Offset + (LOCK_SLOT_SIZE * uiNewThreadIndex));
+	sem_init(pLock, 1, 1);
+	*(sem_t**)(pThreadMetaData_ + g_uiArenaLock_Offset) = pLock;
+	
+	*(((pthread_t*)(pCurrentMetaPage + g_uiThreadList_Offset)) + uiNewThreadIndex) = pthread_self();
+	__atomic_store_n(((unsigned long int*)(pCurrentMetaPage + g_uiThreadMetaList_Offset)) + uiNewThreadIndex, (unsigned long int)pThreadMetaData_, __ATOMIC_RELEASE);
+	
+	MALLOC_PROBE2(new_arena, pThreadMetaData_, uiThreadCounts);
+	
+	return pLock;
+}
+
+// Get the uiArenaIndex_th registered Thread Arena ( uiArenaIndex_ < g_uiRegisteredThreadCounts )
+// NULL : Its slot is not filled in yet ( See RegisterArena() ), or it was never filled in because no page could be mapped for it
+unsigned char* GetRegisteredArena(unsigned long int uiArenaIndex_)
+{
+	unsigned char* pProcessMeta = GetProcessMetaPage(uiArenaIndex_ / g_uiMaxThreadNums);
+	if (NULL == pProcessMeta)
+		return NULL;
+	
+	unsigned long int* pThreadMetaList = (unsigned long int*)(pProcessMeta + g_uiThreadMetaList_Offset);
+	return (unsigned char*)__atomic_load_n(&pThreadMetaList[uiArenaIndex_ % g_uiMaxThreadNums], __ATOMIC_ACQUIRE);
+}
+
+// Get the Thread Arena the calling thread allocates memory from
+// EAM_THREAD : Its own Thread Arena. If this is the first time to functions of this library in this thread, create a new Arena for this thread.
+// EAM_PER_CPU : The Thread Arena of the CPU the thread runs on.
+//               The thread can move to another CPU right after this, but the lock of the Arena keeps that safe.
+// EAM_POOL : The Thread Arena of the pool assigned to this thread. If this is the first time, assign one.
+unsigned char* GetCurrentArena()
+{
+	if (EAM_PER_CPU == g_iArenaMode)
+	{
+		// sched_getcpu() reads the CPU number from the restartable sequence area when glibc has registered one
+		int iCpu = sched_getcpu();
+		unsigned long int uiCpu = (iCpu < 0) ? 0 : ((unsigned long int)iCpu % g_uiCpuArenaNums);
+		unsigned char* pArena = __atomic_load_n(&g_pCpuArenaList[uiCpu], __ATOMIC_ACQUIRE);
+		if (NULL == pArena)
+			pArena = CreateNewCpuArena(uiCpu);
+		
+		return pArena;
+	}
+	
+	if (NULL == t_pThreadMetaData)
+	{
+		// The constructor of another library ( ex) the C++ runtime ) can allocate before ours has run, when there is nothing to allocate from yet
+		if (0 == g_iPageSize)
+			return NULL;
+		
+		return (EAM_POOL == g_iArenaMode) ? AssignPoolArena(NULL) : CreateNewThreadArena();
+	}
+	
+	return t_pThreadMetaData;
+}
+
+// Acquire the lock of a Thread Arena
+// Each time the lock is found taken, the contention counter of the Arena and of the calling thread goes up.
+// Return the lock so that the caller can release it.
+sem_t* LockArena(unsigned char* pThreadMetaData_)
+{
+	sem_t* pLock = *(sem_t**)(pThreadMetaData_ + g_uiArenaLock_Offset);
+	++t_uiLockAcquires;
+	if (0 == sem_trywait(pLock))
+		return pLock;
+	
+	++t_uiLockContentions;
+	__atomic_fetch_add((unsigned long int*)(pThreadMetaData_ + g_uiArenaContentions_Offset), 1, __ATOMIC_RELAXED);
+	WaitArenaLock(pThreadMetaData_, pLock);
+	
+	return pLock;
+}
+
+// Block on the lock of a Thread Arena, and count the time spent waiting if instrumentation is on
+// Return the result of sem_wait()
+int WaitArenaLock(unsigned char* pThreadMetaData_, sem_t* pLock_)
+{
+	unsigned long int* pStats = GetArenaStats(pThreadMetaData_);
+	if (NULL == pStats)
+		return sem_wait(pLock_);
+	
+	unsigned long int uiStartCycles = ReadCycles();
+	int iResult = sem_wait(pLock_);
+	__atomic_fetch_add(&pStats[ASO_LOCK_WAITS], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&pStats[ASO_LOCK_WAIT_CYCLES], ReadCycles() - uiStartCycles, __ATOMIC_RELAXED);
+	
+	return iResult;
+}
+
+// Get the instrumentation counters of an Arena ( ASO_MAX values )
+// NULL : Instrumentation is off
+// The counters take a page of their own, mapped the first time the Arena is measured. Counters are added atomically, so no lock is needed.
+unsigned long int* GetArenaStats(unsigned char* pThreadMetaData_)
+{
+	if (0 == g_iInstrumentation)
+		return NULL;
+	
+	unsigned long int** pStatsField = (unsigned long int**)(pThreadMetaData_ + g_uiArenaStats_Offset);
+	unsigned long int* pStats = __atomic_load_n(pStatsField, __ATOMIC_ACQUIRE);
+	if (pStats)
+		return pStats;
+	
+	pStats = (unsigned long int*)mmap(NULL, SYSTEM_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ((void *)(-1) == pStats)
+		return NULL;
+	
+	// Another thread may have mapped them first
+	unsigned long int* pExpected = NULL;
+	if (0 == __atomic_compare_exchange_n(pStatsField, &pExpected, pStats, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		munmap(pStats, SYSTEM_PAGE_SIZE);
+		pStats = pExpected;
+	}
+	
+	return pStats;
+}
+
+// Add one to an instrumentation counter of an Arena
+void CountArenaEvent(unsigned char* pThreadMetaData_, unsigned long int uiCounter_)
+{
+	unsigned long int* pStats = GetArenaStats(pThreadMetaData_);
+	if (pStats)
+		__atomic_fetch_add(&pStats[uiCounter_], 1, __ATOMIC_RELAXED);
+}
+
+// Add the time since uiStartCycles_ to a latency histogram ( Bucket i counts [2^i, 2^(i+1)) cycles )
+void RecordLatency(unsigned long int* pHistogram_, unsigned long int uiStartCycles_)
+{
+	unsigned long int uiCycles = ReadCycles() - uiStartCycles_;
+	unsigned long int uiBucket = (sizeof(unsigned long int) * CHAR_BIT - 1) - __builtin_clzl(uiCycles | 1);
+	if (uiBucket >= STATS_HISTOGRAM_BUCKETS)
+		uiBucket = STATS_HISTOGRAM_BUCKETS - 1;
+	
+	__atomic_fetch_add(&pHistogram_[uiBucket], 1, __ATOMIC_RELAXED);
+}
+
+// Read the time stamp counter ( Nanoseconds of the monotonic clock where there is none )
+unsigned long int ReadCycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec tsNow;
+	clock_gettime(CLOCK_MONOTONIC, &tsNow);
+	return ((unsigned long int)tsNow.tv_sec * 1000000000) + tsNow.tv_nsec;
+#endif
+}
+
+// Turn instrumentation on or off for all Arenas. Counters gathered so far are kept.
+// Return the previous setting
+int SetInstrumentation(int bEnable_)
+{
+	return __atomic_exchange_n(&g_iInstrumentation, bEnable_ ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+// Add up the instrumentation counters of all registered Thread Arenas into pOut_ ( ASO_MAX values )
+void SumArenaStats(unsigned long int* pOut_)
+{
+	memset(pOut_, 0, sizeof(unsigned long int) * ASO_MAX);
+	
+	// Process Metadata are read without the process lock ( See RegisterArena() )
+	unsigned long int uiRegisteredThreadCounts = __atomic_load_n(&g_uiRegisteredThreadCounts, __ATOMIC_ACQUIRE);
+	for (unsigned long int uiArenaIndex = 0; uiArenaIndex < uiRegisteredThreadCounts; ++uiArenaIndex)
+	{
+		unsigned char* pArena = GetRegisteredArena(uiArenaIndex);
+		if (NULL == pArena)
+			continue;
+		
+		unsigned long int* pStats = __atomic_load_n((unsigned long int**)(pArena + g_uiArenaStats_Offset), __ATOMIC_ACQUIRE);
+		if (NULL == pStats)
+			continue;
+		
+		for (unsigned long int i = 0; i < ASO_MAX; ++i)
+			pOut_[i] += __atomic_load_n(&pStats[i], __ATOMIC_RELAXED);
+	}
+}
+
+// Assign a Thread Arena of the pool to the calling thread ( EAM_POOL )
+// While the pool has fewer than g_uiMaxArenaNums Arenas, a new Arena is created. Otherwise, the Arena with the fewest threads is taken.
+// pOldArena_ is the Arena the thread moves away from ( NULL for a new thread ), and it is not taken again.
+// If no other Arena is available, the thread stays on pOldArena_.
+unsigned char* AssignPoolArena(unsigned char* pOldArena_)
+{
+	unsigned char* pArena = NULL;
+	
+	///////////////////////////////////////////////////////////////////////////////////
+	sem_wait(&g_semProcessLock);
+	if (__atomic_load_n(&g_uiRegisteredThreadCounts, __ATOMIC_RELAXED) < g_uiMaxArenaNums)
+	{
+		pArena = CreateNewThreadMeta(NULL, NULL);
+		if (pArena && NULL == RegisterArena(pArena))
+		{
+			munmap(pArena, SYSTEM_PAGE_SIZE);
+			pArena = NULL;
+		}
+		
+		if (pArena)
+			PrewarmArena(pArena, g_uiPrewarmBins, 1, g_iPrewarmPopulate);
+	}
 	
-	unsigned long int uiMetadataSize = g_uiMetaDataUnitSize * uiPageNums;
-	unsigned long int uiMetaPageNums = 1;
-	while (uiMetadataSize > g_iPageSize * uiMetaPageNums)
-		++uiMetaPageNums;
+	if (NULL == pArena)
+		pArena = GetLeastLoadedArena(pOldArena_);
+	
+	if (pArena)
+	{
+		__atomic_fetch_add((unsigned long int*)(pArena + g_uiArenaThreadNums_Offset), 1, __ATOMIC_RELAXED);
+		if (pOldArena_)
+			__atomic_fetch_sub((unsigned long int*)(pOldArena_ + g_uiArenaThreadNums_Offset), 1, __ATOMIC_RELAXED);
+	}
+	sem_post(&g_semProcessLock);
+	///////////////////////////////////////////////////////////////////////////////////////
+	
+	if (NULL == pArena)
+		return pOldArena_;
+	
+	t_pThreadMetaData = pArena;
+	pthread_setspecific(g_keyThreadArena, pArena);
+	
+	return pArena;
+}
+
+// Find the Thread Arena with the fewest threads ( The fewer lock contentions, on a tie )
+// The caller must hold g_semProcessLock.
+// NULL : No Arena other than pSkipArena_
+unsigned char* GetLeastLoadedArena(unsigned char* pSkipArena_)
+{
+	unsigned char* pBestArena = NULL;
+	unsigned long int uiBestThreadNums = ULONG_MAX;
+	unsigned long int uiBestContentions = ULONG_MAX;
+	
+	unsigned long int uiRegisteredThreadCounts = __atomic_load_n(&g_uiRegisteredThreadCounts, __ATOMIC_ACQUIRE);
+	for (unsigned long int uiArenaIndex = 0; uiArenaIndex < uiRegisteredThreadCounts; ++uiArenaIndex)
+	{
+		unsigned char* pArena = GetRegisteredArena(uiArenaIndex);
+		if (NULL == pArena || pSkipArena_ == pArena)
+			continue;
+		
+		unsigned long int uiThreadNums = __atomic_load_n((unsigned long int*)(pArena + g_uiArenaThreadNums_Offset), __ATOMIC_RELAXED);
+		unsigned long int uiContentions = __atomic_load_n((unsigned long int*)(pArena + g_uiArenaContentions_Offset), __ATOMIC_RELAXED);
+		if (uiThreadNums < uiBestThreadNums || (uiThreadNums == uiBestThreadNums && uiContentions < uiBestContentions))
+		{
+			pBestArena = pArena;
+			uiBestThreadNums = uiThreadNums;
+			uiBestContentions = uiContentions;
+		}
+	}
+	
+	return pBestArena;
+}
+
+// Move the calling thread to another Thread Arena of the pool if most of its recent lock acquisitions had to wait ( EAM_POOL )
+// Called every ARENA_REBALANCE_INTERVAL lock acquisitions.
+void RebalancePoolArena()
+{
+	if (EAM_POOL == g_iArenaMode && t_pThreadMetaData && t_uiLockContentions >= ARENA_REBALANCE_CONTENTIONS)
+		AssignPoolArena(t_pThreadMetaData);
+	
+	t_uiLockAcquires = 0;
+	t_uiLockContentions = 0;
+}
+
+// Detach an exiting thread from its Thread Arena ( Destructor of g_keyThreadArena )
+// An Arena left with no thread is orphaned, and the background thread purges its empty Bins right away, except the large ones it keeps. ( See MaintainArena() )
+// In EAM_THREAD, the next new thread takes it over. ( See AdoptOrphanedArena() )
+// The thread no longer counts in the Arena, so it forgets it. If a later destructor allocates or frees, the thread acquires an Arena again
+// through GetCurrentArena(), which sets g_keyThreadArena again, so that this destructor runs once more. ( Up to PTHREAD_DESTRUCTOR_ITERATIONS )
+void ReleaseThreadArena(void* pArena_)
+{
+	if (pArena_)
+		__atomic_fetch_sub((unsigned long int*)((unsigned char*)pArena_ + g_uiArenaThreadNums_Offset), 1, __ATOMIC_RELAXED);
+	
+	t_pThreadMetaData = NULL;
+}
+
+// Start the background thread that purges and provisions Bins off the allocation path
+// All signals are blocked in it, so that the handlers of the user program never run there.
+void StartBackgroundThread()
+{
+	const char* pInterval = getenv(ENV_BACKGROUND_INTERVAL_MS);
+	if (pInterval && strtoul(pInterval, NULL, 10) > 0)
+		g_uiBackgroundIntervalMs = strtoul(pInterval, NULL, 10);
+	
+	unsigned long int uiDecayMs = DEFAULT_DECAY_MS;
+	const char* pDecay = getenv(ENV_DECAY_MS);
+	if (pDecay)
+		uiDecayMs = strtoul(pDecay, NULL, 10);
+	
+	g_uiDecayTicks = uiDecayMs / g_uiBackgroundIntervalMs;
+	if (0 == g_uiDecayTicks)
+		g_uiDecayTicks = 1;
+	
+	const char* pReserve = getenv(ENV_BIN_RESERVE);
+	if (pReserve)
+		g_uiBinReserveNums = strtoul(pReserve, NULL, 10);
+	
+	const char* pLargeCache = getenv(ENV_LARGE_CACHE_MB);
+	if (pLargeCache)
+		g_uiLargeCacheSize = strtoul(pLargeCache, NULL, 10) * 1024 * 1024;
+	
+	const char* pLargeCacheOverflow = getenv(ENV_LARGE_CACHE_OVERFLOW_MB);
+	if (pLargeCacheOverflow)
+		g_uiLargeCacheOverflowSize = strtoul(pLargeCacheOverflow, NULL, 10) * 1024 * 1024;
+	
+	if (-1 == sem_init(&g_semBackgroundWake, 0, 0))
+		return;
+	
+	sigset_t setAll;
+	sigset_t setOld;
+	sigfillset(&setAll);
+	pthread_sigmask(SIG_SETMASK, &setAll, &setOld);
+	if (0 == pthread_create(&g_thBackground, NULL, BackgroundThreadMain, NULL))
+		g_iBackgroundRunning = 1;
+	pthread_sigmask(SIG_SETMASK, &setOld, NULL);
+	
+	// The thread does not exist in a child process
+	if (g_iBackgroundRunning)
+		pthread_atfork(NULL, NULL, ForgetBackgroundThread);
+}
+
+// Ask the background thread to finish its current round and wait for it
+void StopBackgroundThread()
+{
+	if (0 == g_iBackgroundRunning)
+		return;
+	
+	__atomic_store_n(&g_iBackgroundStop, 1, __ATOMIC_RELEASE);
+	sem_post(&g_semBackgroundWake);
+	pthread_join(g_thBackground, NULL);
+	g_iBackgroundRunning = 0;
+}
+
+// Forget the background thread in the child process of fork() ( It was not copied )
+void ForgetBackgroundThread()
+{
+	g_iBackgroundRunning = 0;
+}
+
+// Every g_uiBackgroundIntervalMs, go through the registered Thread Arenas ( See MaintainArena() )
+// Explicit Arenas are not registered, so they are left to their owners.
+void* BackgroundThreadMain(void* pArg_)
+{
+	(void)pArg_;
+	
+	while (0 == __atomic_load_n(&g_iBackgroundStop, __ATOMIC_ACQUIRE))
+	{
+		struct timespec tsWake;
+		clock_gettime(CLOCK_REALTIME, &tsWake);
+		tsWake.tv_sec += g_uiBackgroundIntervalMs / 1000;
+		tsWake.tv_nsec += (g_uiBackgroundIntervalMs % 1000) * 1000000;
+		if (tsWake.tv_nsec >= 1000000000)
+		{
+			tsWake.tv_sec += 1;
+			tsWake.tv_nsec -= 1000000000;
+		}
+		
+		// Woken up early only to stop
+		if (0 == sem_timedwait(&g_semBackgroundWake, &tsWake))
+			continue;
+		
+		// The empty large Bins of orphaned Arenas share a single cache, kept for the threads that take them over ( See AdoptOrphanedArena() )
+		unsigned long int uiOrphanedLargeCacheBytes = g_uiLargeCacheSize;
+		
+		// The Bins that do not fit in the cache of their Arena are kept in what is left of a cache for all Arenas, in the order the Arenas are gone through
+		unsigned long int uiOverflowBytes = g_uiLargeCacheOverflowSize;
+		
+		// Process Metadata are read without the process lock ( See RegisterArena() )
+		unsigned long int uiRegisteredThreadCounts = __atomic_load_n(&g_uiRegisteredThreadCounts, __ATOMIC_ACQUIRE);
+		for (unsigned long int uiArenaIndex = 0; uiArenaIndex < uiRegisteredThreadCounts; ++uiArenaIndex)
+		{
+			unsigned char* pArena = GetRegisteredArena(uiArenaIndex);
+			if (NULL == pArena)
+				continue;
+			
+			// Only in EAM_THREAD is an Arena with no thread left for good. A pool Arena gets the next thread assigned to it.
+			int bOrphaned = (EAM_THREAD == g_iArenaMode && g_iThreadArenaKeyCreated
+				&& 0 == __atomic_load_n((unsigned long int*)(pArena + g_uiArenaThreadNums_Offset), __ATOMIC_RELAXED));
+			unsigned long int uiLargeCacheBytes = g_uiLargeCacheSize;
+			MaintainArena(pArena, bOrphaned, bOrphaned ? &uiOrphanedLargeCacheBytes : &uiLargeCacheBytes, &uiOverflowBytes);
+		}
+	}
+	
+	return NULL;
+}
+
+// One round of background work on a Thread Arena
+// 1. Purge the pages of each Bin that has stayed empty for g_uiDecayTicks rounds ( Right away in an orphaned Arena ).
+//    A Bin counts as idle only if no block was allocated from it since the last round, so a Bin emptied and refilled in between is left alone.
+//    The Bin stays mapped and in the Arena, so allocating from it again only takes page faults.
+//    Empty large Bins are a cache of large blocks ( See SelectCachedLargeBin() ). They decay as above, in an orphaned Arena too,
+//    as long as they fit in *pLargeCacheBytes_, or else in *pOverflowBytes_, which each of them kept takes its size off. The ones that fit in neither are purged right away.
+// 2. Keep g_uiBinReserveNums empty Bins of the default size, so that allocations find one instead of calling mmap().
+// No system call is made under the lock of the Arena, so its threads never wait on one.
+// The Bins are gone through MAINTAIN_BIN_BATCH at a time under the lock. The ones to purge are marked ( TMO_BIN_PURGING ) so that no thread allocates from them,
+// then the lock is released for madvise(), and taken again to clear the marks and go on with the next Bins.
+// The pages of the reserve Bins are made accessible without the lock ( See CommitArenaPagesAhead() ), and the Bins are only created under it.
+// Only an Arena with reserved address space left gets reserve Bins. Otherwise, creating them would have to call mmap().
+// If the lock of the Arena is taken, the Arena is skipped until the next round rather than making its threads wait.
+void MaintainArena(unsigned char* pThreadMetaData_, int bOrphaned_, unsigned long int* pLargeCacheBytes_, unsigned long int* pOverflowBytes_)
+{
+	sem_t* pLock = *(sem_t**)(pThreadMetaData_ + g_uiArenaLock_Offset);
+	if (0 != sem_trywait(pLock))
+		return;
+	
+	unsigned char* pPurgeMeta[MAINTAIN_BIN_BATCH];
+	unsigned long int uiPurgeIndex[MAINTAIN_BIN_BATCH];
+	
+	unsigned long int uiEmptyBins = 0;
+	unsigned char* pCurrentMeta = pThreadMetaData_;
+	unsigned long int i = 0;
+	while (pCurrentMeta)
+	{
+		unsigned long int uiPurgeNums = 0;
+		unsigned long int uiBinNums = *(unsigned long int*)(pThreadMetaData_ + g_uiBinNums_Offset);
+		unsigned long int uiBatchEnd = i + MAINTAIN_BIN_BATCH;
+		for (; i < uiBinNums && i < uiBatchEnd; ++i)
+		{
+			unsigned long int uiBinIndex = i % MAX_BIN_NUMS;
+			if (0 != i && 0 == uiBinIndex)
+			{
+				pCurrentMeta = (unsigned char*)*(((unsigned long int*)pCurrentMeta) + 1);
+				if (NULL == pCurrentMeta)
+					break;
+			}
+			
+			unsigned long int* pBinPageNumList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_PAGE_NUM));
+			unsigned long int* pBinUsedBytes = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_USED_BYTES));
+			unsigned long int* pBinAllocReqs = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_ALLOC_REQUESTS));
+			unsigned long int* pBinIdleTicks = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_IDLE_TICKS));
+			unsigned long int* pBinIdleAllocs = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_IDLE_ALLOCS));
+			unsigned long int* pBinPurging = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_PURGING));
+			unsigned long int* pBinMinBlockList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_MIN_BLOCK));
+			
+			if (0 != pBinUsedBytes[uiBinIndex] || pBinIdleAllocs[uiBinIndex] != pBinAllocReqs[uiBinIndex])
+			{
+				pBinIdleTicks[uiBinIndex] = 0;
+				pBinIdleAllocs[uiBinIndex] = pBinAllocReqs[uiBinIndex];
+				continue;
+			}
+			
+			// Only Bins that can serve small requests count toward the reserve
+			if (MIN_BLOCK_SIZE == pBinMinBlockList[uiBinIndex])
+				++uiEmptyBins;
+			
+			// Already purged
+			if (ULONG_MAX == pBinIdleTicks[uiBinIndex])
+				continue;
+			
+			unsigned long int uiBinBytes = SYSTEM_PAGE_SIZE * pBinPageNumList[uiBinIndex];
+			int bPurgeNow = bOrphaned_;
+			if ((unsigned long int)SYSTEM_PAGE_SIZE == pBinMinBlockList[uiBinIndex])
+			{
+				bPurgeNow = 0;
+				if (uiBinBytes <= *pLargeCacheBytes_)
+					*pLargeCacheBytes_ -= uiBinBytes;
+				else if (uiBinBytes <= *pOverflowBytes_)
+					*pOverflowBytes_ -= uiBinBytes;
+				else
+					bPurgeNow = 1;
+			}
+			
+			++pBinIdleTicks[uiBinIndex];
+			if (0 == bPurgeNow && pBinIdleTicks[uiBinIndex] < g_uiDecayTicks)
+				continue;
+			
+			// The Bin is empty, so no thread frees to it, and the mark keeps allocations out of it while its pages are purged
+			pBinPurging[uiBinIndex] = 1;
+			pBinIdleTicks[uiBinIndex] = ULONG_MAX;
+			pPurgeMeta[uiPurgeNums] = pCurrentMeta;
+			uiPurgeIndex[uiPurgeNums] = uiBinIndex;
+			++uiPurgeNums;
+		}
+		
+		if (i >= uiBinNums && 0 == uiPurgeNums)
+			break;
+		
+		sem_post(pLock);
+		
+		for (unsigned long int j = 0; j < uiPurgeNums; ++j)
+		{
+			unsigned long int* pBinList = (unsigned long int*)(pPurgeMeta[j] + TMO_OFFSET(TMO_BIN));
+			unsigned long int* pBinPageNumList = (unsigned long int*)(pPurgeMeta[j] + TMO_OFFSET(TMO_BIN_PAGE_NUM));
+			madvise((void*)pBinList[uiPurgeIndex[j]], SYSTEM_PAGE_SIZE * pBinPageNumList[uiPurgeIndex[j]], MADV_DONTNEED);
+		}
+		
+		sem_wait(pLock);
+		
+		for (unsigned long int j = 0; j < uiPurgeNums; ++j)
+			((unsigned long int*)(pPurgeMeta[j] + TMO_OFFSET(TMO_BIN_PURGING)))[uiPurgeIndex[j]] = 0;
+	}
+	
+	// The pages the missing reserve Bins take at most, each twice as large as the one before ( See CreateNewBin() )
+	unsigned long int uiAheadBytes = 0;
+	if (0 == bOrphaned_)
+	{
+		uiEmptyBins = CreateReserveBins(pThreadMetaData_, uiEmptyBins);
+		
+		unsigned long int uiPageNums = GetNewBinPageNums(pThreadMetaData_, 1);
+		for (unsigned long int j = uiEmptyBins; j < g_uiBinReserveNums; ++j)
+		{
+			uiAheadBytes += SYSTEM_PAGE_SIZE * GetNewBinPageBound(uiPageNums);
+			uiPageNums = (uiPageNums * 2 < MAX_NEW_PAGE_NUMS) ? uiPageNums * 2 : MAX_NEW_PAGE_NUMS;
+		}
+	}
+	
+	unsigned long int uiCommittedEnd = GetArenaPagesAhead(pThreadMetaData_, uiAheadBytes);
+	unsigned long int uiCommittedStart = *(unsigned long int*)(pThreadMetaData_ + g_uiArenaReserveCommitted_Offset);
+	sem_post(pLock);
+	
+	if (0 == CommitArenaPagesAhead(pThreadMetaData_, uiCommittedStart, uiCommittedEnd))
+		return;
+	
+	sem_wait(pLock);
+	
+	unsigned long int* pReserveCommitted = (unsigned long int*)(pThreadMetaData_ + g_uiArenaReserveCommitted_Offset);
+	if (uiCommittedEnd > *pReserveCommitted)
+		*pReserveCommitted = uiCommittedEnd;
+	
+	CreateReserveBins(pThreadMetaData_, uiEmptyBins);
+	
+	sem_post(pLock);
+}
+
+// Create empty Bins for small requests until a Thread Arena has g_uiBinReserveNums of them, from pages of its reserved address space already made accessible
+// Must be called under the lock of the Arena. No system call is made. ( See CommitArenaPagesAhead() )
+// Threads may have taken some of those pages since they were made accessible. The Bins that no longer fit are left for the next round.
+// Return the number of empty Bins for small requests the Arena has now
+unsigned long int CreateReserveBins(unsigned char* pThreadMetaData_, unsigned long int uiEmptyBins_)
+{
+	unsigned long int* pReserveUsed = (unsigned long int*)(pThreadMetaData_ + g_uiArenaReserveUsed_Offset);
+	unsigned long int* pReserveCommitted = (unsigned long int*)(pThreadMetaData_ + g_uiArenaReserveCommitted_Offset);
+	while (uiEmptyBins_ < g_uiBinReserveNums
+		&& SYSTEM_PAGE_SIZE * GetNewBinPageBound(GetNewBinPageNums(pThreadMetaData_, 1)) <= *pReserveCommitted - *pReserveUsed
+		&& CreateNewBin(pThreadMetaData_, 1, 0))
+		++uiEmptyBins_;
+	
+	return uiEmptyBins_;
+}
+
+// Get the most pages CreateNewBin() takes for a Bin of uiPageNums_ pages for small requests
+// The Bin, a new page of Thread Arena Metadata and the Bin Metadata, when none of them fit in pages the Arena already has
+unsigned long int GetNewBinPageBound(unsigned long int uiPageNums_)
+{
+	return uiPageNums_ + 1 + GetBinMetaPageNums(uiPageNums_, MIN_BLOCK_SIZE);
+}
+
+// Get where the accessible part of the reserved address space of a Thread Arena should end, for uiBytes_ more to be handed out without mprotect()
+// Must be called under the lock of the Arena
+// 0 : The Arena has no reserved address space, or not enough of it left
+unsigned long int GetArenaPagesAhead(unsigned char* pThreadMetaData_, unsigned long int uiBytes_)
+{
+	unsigned long int uiReserveStart = *(unsigned long int*)(pThreadMetaData_ + g_uiArenaReserveStart_Offset);
+	unsigned long int uiReserveSize = *(unsigned long int*)(pThreadMetaData_ + g_uiArenaReserveSize_Offset);
+	unsigned long int uiReserveUsed = *(unsigned long int*)(pThreadMetaData_ + g_uiArenaReserveUsed_Offset);
+	if (0 == uiReserveStart || 0 == uiBytes_ || uiBytes_ > uiReserveSize - uiReserveUsed)
+		return 0;
+	
+	return uiReserveUsed + uiBytes_;
+}
+
+// Make the pages of the reserved address space of a Thread Arena from uiStart_ to uiEnd_ accessible, ahead of the Bins that will take them
+// Called without the lock of the Arena. A thread committing the same pages at the same time ( See CommitArenaPages() ) only sets the same protection.
+// The caller records uiEnd_ under the lock afterwards. The space stays reserved until the process exits, so the range cannot go away meanwhile.
+// 0 : Nothing was made accessible
+int CommitArenaPagesAhead(unsigned char* pThreadMetaData_, unsigned long int uiStart_, unsigned long int uiEnd_)
+{
+	if (uiEnd_ <= uiStart_)
+		return 0;
+	
+	unsigned long int uiReserveStart = __atomic_load_n((unsigned long int*)(pThreadMetaData_ + g_uiArenaReserveStart_Offset), __ATOMIC_ACQUIRE);
+	CountArenaEvent(pThreadMetaData_, ASO_MAP_CALLS);
+	return (0 == mprotect((void*)(uiReserveStart + uiStart_), uiEnd_ - uiStart_, PROT_READ | PROT_WRITE));
+}
+
+// Free memory from another Thread Arena
+// pSkipArena_ is the Thread Arena the caller has already searched
+// 0 : trying to free an address when that address has not been allocated yet
+// ULONG_MAX : The given ptr is invalid because it is not allocated from the arenas
+// Otherwise, return the size of the freed memmory
+unsigned long int FreeFromAllArenas(void *ptr, unsigned char* pSkipArena_)
+{
+	// Process Metadata are read without the process lock ( See RegisterArena() )
+	// A slot that is not filled in yet is skipped. ptr cannot have been allocated from an Arena that is not registered yet.
+	unsigned long int uiRegisteredThreadCounts = __atomic_load_n(&g_uiRegisteredThreadCounts, __ATOMIC_ACQUIRE);
+	for (unsigned long int uiArenaIndex = 0; uiArenaIndex < uiRegisteredThreadCounts; ++uiArenaIndex)
+	{
+		unsigned char* pArena = GetRegisteredArena(uiArenaIndex);
+		if (NULL == pArena || pSkipArena_ == pArena || 0 == IsInArenaRange(ptr, pArena))
+			continue;
+		
+		// Acquire a Thread Arena lock
+		sem_t* pLock = *(sem_t**)(pArena + g_uiArenaLock_Offset);
+		if (0 != sem_trywait(pLock) && -1 == WaitArenaLock(pArena, pLock))
+			continue;
+		
+		unsigned long int uiResult = FreeFromThreadArena(ptr, pArena);
+		sem_post(pLock);
+		
+		if (ULONG_MAX != uiResult)
+		{
+			MALLOC_PROBE3(free_remote, ptr, pArena, uiResult);
+			return uiResult;
+		}
+	}
+	
+	return ULONG_MAX;
+}
+
+
+
+// Free memory from its own Arena
+// 0 : trying to free an address when that address has not been allocated yet
+// ULONG_MAX : The given ptr is invalid because it is not allocated from the arena
+// Otherwise, return the size of the freed memmory
+unsigned long int FreeFromThreadArena(void* ptr, unsigned char* pThreadMetaData_)
+{
+	unsigned long int uiBinIndex = 0;
+	unsigned char* pCurrentMeta = FindBinOfAddress(ptr, pThreadMetaData_, &uiBinIndex);
+	if (NULL == pCurrentMeta)
+		return ULONG_MAX;
+	
+	unsigned long int uiResult = FreeFromArenaBin(ptr, pCurrentMeta, uiBinIndex, 0);
+	MALLOC_PROBE4(bin_free, pThreadMetaData_, uiBinIndex, ptr, uiResult);
 	
+	return uiResult;
+}
+
+// Free memory from a Bin of an Arena, and update the statistics of the Bin
+// pCurrentMeta_ is the Thread Arena Metadata page that has the uiBinIndex_th Bin of the Arena ( See FindBinOfAddress() )
+// If the size the block was allocated with is known, uiSize_ is that size ( See FreeSizedFromBin() ). Otherwise, it is 0.
+// ULONG_MAX : The given ptr is not the start address of a block allocated from the Bin
+// Otherwise, return the size of the freed memmory
+unsigned long int FreeFromArenaBin(void* ptr, unsigned char* pCurrentMeta_, unsigned long int uiBinIndex_, size_t uiSize_)
+{
+	uiBinIndex_ %= MAX_BIN_NUMS;
+	
+	unsigned long int* pBinList = (unsigned long int*)(pCurrentMeta_ + TMO_OFFSET(TMO_BIN));
+	unsigned long int* pBinMetaList = (unsigned long int*)(pCurrentMeta_ + TMO_OFFSET(TMO_BIN_META));
+	unsigned long int* pBinPageNumList = (unsigned long int*)(pCurrentMeta_ + TMO_OFFSET(TMO_BIN_PAGE_NUM));
+	unsigned long int* pBinUsedBytes = (unsigned long int*)(pCurrentMeta_ + TMO_OFFSET(TMO_BIN_USED_BYTES));
+	unsigned long int* pBinFreeReqs = (unsigned long int*)(pCurrentMeta_ + TMO_OFFSET(TMO_FREE_REQUESTS));
+	unsigned long int* pBinMinBlockList = (unsigned long int*)(pCurrentMeta_ + TMO_OFFSET(TMO_BIN_MIN_BLOCK));
+	
+	unsigned long int uiResult = ULONG_MAX;
+	if (uiSize_)
+		uiResult = FreeSizedFromBin((unsigned char*)ptr, (unsigned char*)pBinList[uiBinIndex_], (unsigned char*)(pBinMetaList[uiBinIndex_]), SYSTEM_PAGE_SIZE * pBinPageNumList[uiBinIndex_], pBinMinBlockList[uiBinIndex_], uiSize_);
+	else
+		uiResult = FreeFromBin((unsigned char*)ptr, (unsigned char*)pBinList[uiBinIndex_], (unsigned char*)(pBinMetaList[uiBinIndex_]), SYSTEM_PAGE_SIZE * pBinPageNumList[uiBinIndex_], pBinMinBlockList[uiBinIndex_]);
+	
+	if (ULONG_MAX != uiResult)
+	{
+		pBinUsedBytes[uiBinIndex_] -= uiResult;
+		pBinFreeReqs[uiBinIndex_] += 1;
+	}
 	
-	unsigned char* pCurrentThreadMetaData = t_pThreadMetaData;
-	unsigned long int* pBinList = (unsigned long int*)(pCurrentThreadMetaData + g_uiOffset[TMO_BIN]);
-	unsigned long int* pBinPageNumList = (unsigned long int*)(pCurrentThreadMetaData + g_uiOffset[TMO_BIN_PAGE_NUM]);
-	unsigned long int* pBinMetaList = (unsigned long int*)(pCurrentThreadMetaData + g_uiOffset[TMO_BIN_META]);
-	unsigned long int* pBinUsedBtyes = (unsigned long int*)(pCurrentThreadMetaData + g_uiOffset[TMO_BIN_USED_BYTES]);
-	unsigned long int* pBinAllocReqs = (unsigned long int*)(pCurrentThreadMetaData + g_uiOffset[TMO_ALLOC_REQUESTS]);	
+	return uiResult;
+}
+
+// Find the Bin of a Thread Arena that contains ptr
+// Return the Thread Arena Metadata page that has the Bin, and the index of the Bin in the Arena in *pBinIndex_ ( On that page, it is at *pBinIndex_ % MAX_BIN_NUMS )
+// NULL : ptr is not in any Bin of the Arena
+unsigned char* FindBinOfAddress(void* ptr, unsigned char* pThreadMetaData_, unsigned long int* pBinIndex_)
+{
+	if (NULL == pThreadMetaData_ || 0 == IsInArenaRange(ptr, pThreadMetaData_))
+		return NULL;
+		
+	unsigned char* pCurrentMeta = pThreadMetaData_;
+	unsigned long int* pBinList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN));
+	unsigned long int* pBinPageNumList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_PAGE_NUM));
+	unsigned long int uiTargetAddr = (unsigned long int)ptr;
 	unsigned long int uiBinIndex = 0;
-	unsigned long int uiActualBinIndex = 0;
+	unsigned long int uiMetaPageIndex = 0;
+	
 	do
 	{
-		if (uiBinIndex >= g_uiMaxBinNums)
+		if (uiBinIndex >= MAX_BIN_NUMS)
 		{
 			uiBinIndex = 0;
-			pCurrentThreadMetaData = (unsigned char*)*(((unsigned long int*)pCurrentThreadMetaData) + 1);
-			if (NULL == pCurrentThreadMetaData)
+			++uiMetaPageIndex;
+			pCurrentMeta = (unsigned char*)*(((unsigned long int*)pCurrentMeta) + 1);
+			if (NULL == pCurrentMeta)
+				return NULL;
+			
+			pBinList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN));
+			pBinPageNumList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_PAGE_NUM));
+		}
+			
+		if (0 == pBinList[uiBinIndex])
+			return NULL;
+		
+		if (uiTargetAddr >= pBinList[uiBinIndex] &&
+			uiTargetAddr < pBinList[uiBinIndex] + (SYSTEM_PAGE_SIZE * pBinPageNumList[uiBinIndex]))
+		{
+			*pBinIndex_ = (uiMetaPageIndex * MAX_BIN_NUMS) + uiBinIndex;
+			return pCurrentMeta;
+		}
+		
+		++uiBinIndex;
+	} while (pCurrentMeta);	
+	
+	return NULL;
+}
+
+// Allocate memory from a Bin (Binary Search)
+// Small blocks are first looked for next to blocks in use around *pScanHint_. ( See AllocateNextToUsedBlock() )
+// The state of the root is checked first. A full Bin is left at once, and an empty one has no block in use to scan around.
+unsigned char* AllocateFromBin(unsigned char* pBin_, unsigned char* pMeta_, size_t uiBinSize_, size_t uiRequestedSize_, size_t uiBlockMinSize_, unsigned long int* pScanHint_, unsigned long int* pAllocSize_)
+{
+	if (uiBinSize_ < uiBlockMinSize_ || uiBinSize_ < uiRequestedSize_)
+		return NULL;
+	
+	unsigned char ucRootState = GetNodeState(0, pMeta_);
+	if (EBBS_BOTH_FULL == ucRootState || EBBS_ALLOCATED_AT_ONCE == ucRootState)
+		return NULL;
+	
+	size_t uiTargetSize = GetBlockSize(uiBinSize_, uiRequestedSize_, uiBlockMinSize_);
+	int bSmallBlock = (NULL != pScanHint_ && uiTargetSize <= SCAN_MAX_BLOCK_SIZE && uiTargetSize < uiBinSize_);
+	if (bSmallBlock && EBBS_FREE != ucRootState)
+	{
+		unsigned char* pAllocated = AllocateNextToUsedBlock(pBin_, pMeta_, uiBinSize_, uiTargetSize, pScanHint_, pAllocSize_);
+		if (pAllocated)
+			return pAllocated;
+	}
+	
+	unsigned char ucPathState[MAX_TREE_DEPTH];
+	unsigned long int uiDepth = 0;
+	size_t uiOffset = 0;
+	unsigned long int uiNode = FindFreeBlock(pMeta_, uiBinSize_, uiTargetSize, ucPathState, &uiDepth, &uiOffset, EPP_BEST_FIT == g_iPlacementPolicy);
+	if (ULONG_MAX == uiNode)
+		return NULL;
+	
+	SetNodeState(uiNode, pMeta_, EBBS_ALLOCATED_AT_ONCE);
+	UpdateParentStates(uiNode, EBBS_ALLOCATED_AT_ONCE, pMeta_, ucPathState, uiDepth);
+	
+	if (bSmallBlock)
+		*pScanHint_ = uiOffset;
+	
+	*pAllocSize_ = uiTargetSize;
+	return pBin_ + uiOffset;
+}
+
+// Allocate up to uiNums_ blocks of the same size from a Bin and store their addresses in pOut_
+// Instead of one tree walk per block, a free block that holds a power of two of them is found and split in one go.
+// The nodes inside it are written a level at a time ( See SetNodeStateRange() ), and its parents are updated once.
+// The blocks of a group are adjacent in memory.
+// Return the number of blocks allocated, and their total size in *pAllocSize_
+unsigned long int AllocateBatchFromBin(unsigned char* pBin_, unsigned char* pMeta_, size_t uiBinSize_, size_t uiRequestedSize_, size_t uiBlockMinSize_, unsigned long int uiNums_, void** pOut_, unsigned long int* pAllocSize_)
+{
+	*pAllocSize_ = 0;
+	if (uiBinSize_ < uiBlockMinSize_ || uiBinSize_ < uiRequestedSize_)
+		return 0;
+	
+	size_t uiTargetSize = GetBlockSize(uiBinSize_, uiRequestedSize_, uiBlockMinSize_);
+	unsigned long int uiGroupNums = uiBinSize_ / uiTargetSize;
+	unsigned long int uiAllocNums = 0;
+	
+	while (uiAllocNums < uiNums_)
+	{
+		while (uiGroupNums > uiNums_ - uiAllocNums)
+			uiGroupNums /= 2;
+		
+		unsigned char ucPathState[MAX_TREE_DEPTH];
+		unsigned long int uiDepth = 0;
+		size_t uiOffset = 0;
+		size_t uiGroupSize = uiTargetSize * uiGroupNums;
+		unsigned long int uiNode = FindFreeBlock(pMeta_, uiBinSize_, uiGroupSize, ucPathState, &uiDepth, &uiOffset, EPP_BEST_FIT == g_iPlacementPolicy);
+		if (ULONG_MAX == uiNode)
+		{
+			// No free block of any size fits a single block
+			if (1 == uiGroupNums)
+				break;
+			
+			uiGroupNums /= 2;
+			continue;
+		}
+		
+		// Every node above the blocks of the group is fully used
+		unsigned long int uiFirstNode = uiNode;
+		unsigned long int uiNodeNums = 1;
+		while (uiNodeNums < uiGroupNums)
+		{
+			SetNodeStateRange(pMeta_, uiFirstNode, uiNodeNums, EBBS_BOTH_FULL);
+			uiFirstNode = (uiFirstNode * 2) + 1;
+			uiNodeNums *= 2;
+		}
+		
+		SetNodeStateRange(pMeta_, uiFirstNode, uiNodeNums, EBBS_ALLOCATED_AT_ONCE);
+		UpdateParentStates(uiNode, (1 == uiGroupNums) ? EBBS_ALLOCATED_AT_ONCE : EBBS_BOTH_FULL, pMeta_, ucPathState, uiDepth);
+		
+		for (unsigned long int i = 0; i < uiGroupNums; ++i)
+		{
+			pOut_[uiAllocNums] = pBin_ + uiOffset + (i * uiTargetSize);
+			++uiAllocNums;
+		}
+		
+		*pAllocSize_ += uiGroupSize;
+	}
+	
+	return uiAllocNums;
+}
+
+// Get the size of the block a request is allocated at
+// The smallest block in the Bin that is at least uiRequestedSize_ and uiBlockMinSize_
+size_t GetBlockSize(size_t uiBinSize_, size_t uiRequestedSize_, size_t uiBlockMinSize_)
+{
+	size_t uiTargetSize = uiBinSize_;
+	while (uiTargetSize / 2 >= uiRequestedSize_ && uiTargetSize / 2 >= uiBlockMinSize_)
+		uiTargetSize /= 2;
+	
+	return uiTargetSize;
+}
+
+// Find the first free block of uiTargetSize_ in a Bin (Binary Search)
+// The tree is walked iteratively, left child first. With bPreferSplit_ set, a child in use is walked before a free sibling,
+// so that the block is carved from a subtree already split by blocks in use rather than from a free one.
+// This is not a smallest fit. The states do not tell the size of the largest free block under a node, so a deeper hole elsewhere can be missed. The states read on the way down are stored in pPathState_,
+// so that the parents can be updated with table lookups on the way back up instead of being read again. ( See UpdateParentStates() )
+// The state of a node already tells whether each child is free, used or full, so full children are skipped without being read.
+// At the lowest level, a free child is taken directly from the state of its parent.
+// The depth of the block is stored in *pDepth_ and its offset in the Bin in *pOffset_
+// ULONG_MAX : No free block of that size
+unsigned long int FindFreeBlock(unsigned char* pMeta_, size_t uiBinSize_, size_t uiTargetSize_, unsigned char* pPathState_, unsigned long int* pDepth_, size_t* pOffset_, int bPreferSplit_)
+{
+	unsigned char ucFirstSide[MAX_TREE_DEPTH]; // The child walked first at each depth
+	unsigned long int uiDepth = 0;
+	unsigned long int uiNode = 0;
+	size_t uiNodeSize = uiBinSize_;
+	size_t uiOffset = 0;
+	unsigned char ucState = GetNodeState(uiNode, pMeta_);
+	
+	while (1)
+	{
+		if (uiNodeSize == uiTargetSize_)
+		{
+			if (EBBS_FREE == ucState)
+				break;
+		}
+		else if (uiNodeSize == uiTargetSize_ * 2)
+		{
+			// Both children are blocks of the target size
+			unsigned long int uiSide = ECS_MAX;
+			if (EBCS_FREE == g_ucChildStatus[ucState][ECS_LEFT])
+				uiSide = ECS_LEFT;
+			else if (EBCS_FREE == g_ucChildStatus[ucState][ECS_RIGHT])
+				uiSide = ECS_RIGHT;
+			
+			if (ECS_MAX != uiSide)
 			{
-				CreateNewBin(uiPageNums, uiMetaPageNums);
-				pCurrentThreadMetaData = GetLastThreadMetaPage();
+				pPathState_[uiDepth++] = ucState;
+				uiNode = (uiNode * 2) + 1 + uiSide;
+				uiNodeSize = uiTargetSize_;
+				uiOffset += uiSide * uiTargetSize_;
+				break;
 			}
-				
-			pBinList = (unsigned long int*)(pCurrentThreadMetaData + g_uiOffset[TMO_BIN]);
-			pBinPageNumList = (unsigned long int*)(pCurrentThreadMetaData + g_uiOffset[TMO_BIN_PAGE_NUM]);
-			pBinMetaList = (unsigned long int*)(pCurrentThreadMetaData + g_uiOffset[TMO_BIN_META]);
-			pBinUsedBtyes = (unsigned long int*)(pCurrentThreadMetaData + g_uiOffset[TMO_BIN_USED_BYTES]);
-			pBinAllocReqs = (unsigned long int*)(pCurrentThreadMetaData + g_uiOffset[TMO_ALLOC_REQUESTS]);	
-	
 		}
-
-		unsigned char* pBin = (unsigned char*)pBinList[uiBinIndex];
-		if (NULL == pBin)
-			pBin = CreateNewBin(uiPageNums, uiMetaPageNums);
-
-
-		unsigned long int uiCurrentBinPageNums = pBinPageNumList[uiBinIndex];
-		if (uiCurrentBinPageNums < uiPageNums)
+		else if (EBCS_FULL != g_ucChildStatus[ucState][ECS_LEFT] || EBCS_FULL != g_ucChildStatus[ucState][ECS_RIGHT])
 		{
-			++uiBinIndex;
+			unsigned long int uiSide = ECS_LEFT;
+			if (EBCS_FULL == g_ucChildStatus[ucState][ECS_LEFT] ||
+				(bPreferSplit_ && EBCS_FREE == g_ucChildStatus[ucState][ECS_LEFT] && EBCS_USED == g_ucChildStatus[ucState][ECS_RIGHT]))
+				uiSide = ECS_RIGHT;
+			
+			ucFirstSide[uiDepth] = uiSide;
+			pPathState_[uiDepth++] = ucState;
+			uiNode = (uiNode * 2) + 1 + uiSide;
+			uiNodeSize /= 2;
+			uiOffset += uiSide * uiNodeSize;
+			ucState = GetNodeState(uiNode, pMeta_);
 			continue;
 		}
 		
-		unsigned char* pBinMeta = (unsigned char*)pBinMetaList[uiBinIndex];
-		unsigned long int uiAllocSize = 0;
-		unsigned char* pAllocated =  AllocateFromBin(0, pBin, pBinMeta, g_iPageSize * uiCurrentBinPageNums, uiSize_, uiMinBlackSize_, &uiAllocSize);
-		if (pAllocated)
+		// Nothing fits in this node, so go back up to the closest child walked first whose sibling is not full
+		int bMoved = 0;
+		while (uiDepth > 0)
 		{
-			pBinUsedBtyes[uiBinIndex] += uiAllocSize;
-			pBinAllocReqs[uiBinIndex] += 1;
+			// Left children always have odd indexes
+			unsigned long int uiSide = (uiNode & 1) ? ECS_LEFT : ECS_RIGHT;
+			if (uiSide == ucFirstSide[uiDepth - 1] && EBCS_FULL != g_ucChildStatus[pPathState_[uiDepth - 1]][ECS_RIGHT - uiSide])
+			{
+				if (ECS_LEFT == uiSide)
+				{
+					++uiNode;
+					uiOffset += uiNodeSize;
+				}
+				else
+				{
+					--uiNode;
+					uiOffset -= uiNodeSize;
+				}
+				
+				ucState = GetNodeState(uiNode, pMeta_);
+				bMoved = 1;
+				break;
+			}
+			
+			if (ECS_RIGHT == uiSide)
+				uiOffset -= uiNodeSize;
 			
-			return (void*)pAllocated; 
+			uiNode = (uiNode - 1) / 2;
+			uiNodeSize *= 2;
+			--uiDepth;
 		}
-			       
-
-		++uiBinIndex;
-		++uiActualBinIndex;
-	} while (pCurrentThreadMetaData);
+		
+		if (0 == bMoved)
+			return ULONG_MAX;
+	}
 	
-	return NULL;
+	*pDepth_ = uiDepth;
+	*pOffset_ = uiOffset;
+	return uiNode;
 }
 
-// Create a new thread Arena
-unsigned char* CreateNewThreadArena()
+// Allocate a free block whose buddy is in use (Scan)
+// The states of the parents of uiTargetSize_ blocks are scanned around *pScanHint_ for a parent with one free child and one child in use.
+// A state other than EBBS_FREE only exists under blocks that are split, so such a free child is always a valid block.
+// Filling these holes first also keeps larger free blocks intact.
+// NULL : No such block is near *pScanHint_
+unsigned char* AllocateNextToUsedBlock(unsigned char* pBin_, unsigned char* pMeta_, size_t uiBinSize_, size_t uiTargetSize_, unsigned long int* pScanHint_, unsigned long int* pAllocSize_)
 {
-	if (NULL == CreateNewThreadMeta(NULL))
+	size_t uiParentSize = uiTargetSize_ * 2;
+	unsigned long int uiParentNums = uiBinSize_ / uiParentSize;
+	unsigned long int uiFirstNode = uiParentNums - 1;
+	unsigned long int uiStartNode = uiFirstNode + ((*pScanHint_ / uiParentSize) % uiParentNums);
+	
+	unsigned long int uiNode = FindFreeBuddyNode(pMeta_, uiFirstNode, uiFirstNode + uiParentNums - 1, uiStartNode);
+	if (ULONG_MAX == uiNode)
 		return NULL;
 	
-	pthread_t self = pthread_self();
-	sem_t newLock;
-	sem_init(&newLock, 1, 1);
+	unsigned char ucState = GetNodeState(uiNode, pMeta_);
+	unsigned long int uiChild = (uiNode * 2) + ((EBCS_FREE == g_ucChildStatus[ucState][ECS_LEFT]) ? 1 : 2);
 	
-	///////////////////////////////////////////////////////////////////////////////////
-	sem_wait(&g_semProcessLock);
-	unsigned long int uiThreadCounts = g_uiRegisteredThreadCounts;
-	unsigned long int uiNewThreadIndex =  uiThreadCounts % g_uiMaxThreadNums;
-	unsigned long int uiProcessMetaPageIndex = uiThreadCounts / g_uiMaxThreadNums;
+	// The number of parents is a power of two, and the children are one level below them
+	SetNodeState(uiChild, pMeta_, EBBS_ALLOCATED_AT_ONCE);
+	UpdateParentStates(uiChild, EBBS_ALLOCATED_AT_ONCE, pMeta_, NULL, __builtin_ctzl(uiParentNums) + 1);
 	
+	size_t uiOffset = (uiChild - ((uiParentNums * 2) - 1)) * uiTargetSize_;
+	*pScanHint_ = uiOffset;
+	*pAllocSize_ = uiTargetSize_;
+	return pBin_ + uiOffset;
+}
 
-	unsigned char* pCurrentMetaPage = GetProcessMetaPage(uiProcessMetaPageIndex);
-	// Need a New Page for Process Metadata
-	if (NULL == pCurrentMetaPage)
+// Find a node, in one level of the tree, that has one free child and one child in use
+// Nodes from uiFirstNode_ to uiLastNode_ make up the level. 
+// SCAN_WINDOW_BYTES bytes of Bin Metadata around uiStartNode_ are scanned with g_pfnScanFreeBuddies.
+// ULONG_MAX : No such node in the scanned bytes
+unsigned long int FindFreeBuddyNode(unsigned char* pMeta_, unsigned long int uiFirstNode_, unsigned long int uiLastNode_, unsigned long int uiStartNode_)
+{
+	unsigned long int uiFirstByte = uiFirstNode_ / BLOCKS_IN_ONE_BYTE;
+	unsigned long int uiLastByte = uiLastNode_ / BLOCKS_IN_ONE_BYTE;
+	
+	unsigned long int uiStartByte = (uiStartNode_ / BLOCKS_IN_ONE_BYTE) & ~(unsigned long int)(SCAN_WINDOW_BYTES - 1);
+	if (uiStartByte + SCAN_WINDOW_BYTES > uiLastByte + 1)
+		uiStartByte = (uiLastByte + 1 > SCAN_WINDOW_BYTES) ? (uiLastByte + 1 - SCAN_WINDOW_BYTES) : 0;
+	
+	if (uiStartByte < uiFirstByte)
+		uiStartByte = uiFirstByte;
+	
+	unsigned long int uiEndByte = uiStartByte + SCAN_WINDOW_BYTES;
+	if (uiEndByte > uiLastByte + 1)
+		uiEndByte = uiLastByte + 1;
+	
+	for (unsigned long int uiByte = uiStartByte; uiByte < uiEndByte; uiByte += SCAN_CHUNK_BYTES)
 	{
-		pCurrentMetaPage = CreateNewProcessMetaPage(NULL);
-		if (NULL == pCurrentMetaPage)
+		unsigned int uiHighMask = 0;
+		unsigned int uiLowMask = 0;
+		if (uiByte + SCAN_CHUNK_BYTES <= uiEndByte)
 		{
-			// Mmeory Allocation for the nee page failed
-			sem_post(&g_semProcessLock);
-			return NULL;
+			g_pfnScanFreeBuddies(pMeta_ + uiByte, &uiHighMask, &uiLowMask);
+		}
+		else
+		{
+			// A state of 0 is never a match, so the rest of the chunk is filled with 0
+			unsigned char ucChunk[SCAN_CHUNK_BYTES] = { 0 };
+			memcpy(ucChunk, pMeta_ + uiByte, uiEndByte - uiByte);
+			g_pfnScanFreeBuddies(ucChunk, &uiHighMask, &uiLowMask);
 		}
-	}
 		
-	*(((pthread_t*)(pCurrentMetaPage + g_uiThreadList_Offset)) + uiNewThreadIndex) = self;
-	*(((unsigned long int*)(pCurrentMetaPage + g_uiThreadMetaList_Offset)) + uiNewThreadIndex) = (unsigned long int)t_pThreadMetaData;
-	t_pThreadLock = ((sem_t*)(pCurrentMetaPage + g_uiThreadLockList_Offset) + uiNewThreadIndex);
-	memcpy(t_pThreadLock, &newLock, sizeof(sem_t));	
-	
-	++uiThreadCounts;
-	g_uiRegisteredThreadCounts = uiThreadCounts;
+		// The first and the last byte can be shared with the level above and below
+		if (uiFirstByte >= uiByte && uiFirstByte < uiByte + SCAN_CHUNK_BYTES && (uiFirstNode_ & 1))
+			uiHighMask &= ~(1u << (uiFirstByte - uiByte));
+		
+		if (uiLastByte >= uiByte && uiLastByte < uiByte + SCAN_CHUNK_BYTES && 0 == (uiLastNode_ & 1))
+			uiLowMask &= ~(1u << (uiLastByte - uiByte));
+		
+		if (0 == (uiHighMask | uiLowMask))
+			continue;
+		
+		unsigned long int uiHighNode = uiHighMask ? ((uiByte + __builtin_ctz(uiHighMask)) * BLOCKS_IN_ONE_BYTE) : ULONG_MAX;
+		unsigned long int uiLowNode = uiLowMask ? ((uiByte + __builtin_ctz(uiLowMask)) * BLOCKS_IN_ONE_BYTE + 1) : ULONG_MAX;
+		return (uiHighNode < uiLowNode) ? uiHighNode : uiLowNode;
+	}
 	
-	sem_post(&g_semProcessLock);
-	///////////////////////////////////////////////////////////////////////////////////////
+	return ULONG_MAX;
+}
+
+// Scan kernel without SIMD ( One table lookup per byte )
+void ScanFreeBuddiesScalar(const unsigned char* pMeta_, unsigned int* pHighMask_, unsigned int* pLowMask_)
+{
+	unsigned int uiHighMask = 0;
+	unsigned int uiLowMask = 0;
+	for (int i = 0; i < SCAN_CHUNK_BYTES; ++i)
+	{
+		unsigned char ucMask = g_ucFreeBuddyMask[pMeta_[i]];
+		uiHighMask |= (unsigned int)(ucMask & 1) << i;
+		uiLowMask |= (unsigned int)(ucMask >> 1) << i;
+	}
 	
-	return t_pThreadMetaData;
+	*pHighMask_ = uiHighMask;
+	*pLowMask_ = uiLowMask;
 }
 
-// Free memory from another Thread Arena
-// 0 : trying to free an address when that address has not been allocated yet
-// ULONG_MAX : The given ptr is invalid because it is not allocated from the arenas
-// Otherwise, return the size of the freed memmory
-unsigned long int FreeFromAllArenas(void *ptr)
+#if defined(__x86_64__) || defined(__i386__)
+// Scan kernel with SSE2 ( 16 bytes at a time )
+// The states with one free child and one child in use are 
+// EBBS_RIGHT_USED_LEFT_FREE, EBBS_LEFT_USED_RIGHT_FREE, EBBS_RIGHT_FULL_LEFT_FREE and EBBS_LEFT_FULL_RIGHT_FREE
+__attribute__((target("sse2")))
+void ScanFreeBuddiesSSE2(const unsigned char* pMeta_, unsigned int* pHighMask_, unsigned int* pLowMask_)
 {
-	if (NULL == g_pProcessMetaData)
-		return ULONG_MAX;
-		
-	// Process Metadata are accessed with read-only operations here, so this function does not acquire a lock for Process Metadata.
-	// A new Thread Arena Creation is done inside the process lock, so g_uiRegisteredThreadCounts is correctly incremented by one.
-	// It is possible that when this funcion loads g_uiRegisteredThreadCounts, other information of the new Thread Arena has not been updated to memory yet ( Because of Memory ordering)
-	// However, that means, memory pointed to by ptr was not allocated from the Thread Arena being created.
-	// Thus, even if the new value of g_uiRegisteredThreadCounts is loaded, freeing ptr will be successfully done before this function searches on that new Thread Arena.
-	// Also, this function does not search on the new Thread Arena if all the information of that new Arena has not been updated ( In case, user program provides an incorrect ptr)
-
-	unsigned long int uiRegisteredThreadCounts = g_uiRegisteredThreadCounts;
-	pthread_t self = pthread_self();
-	unsigned char* pCurrentMeta = g_pProcessMetaData;
-	pthread_t* pThreadList = (pthread_t*)(pCurrentMeta + g_uiThreadList_Offset);
-	unsigned long* pThreadMetaList = (unsigned long int*)(pCurrentMeta + g_uiThreadMetaList_Offset);
-	sem_t* pThreadLockList = (sem_t*)(pCurrentMeta + g_uiThreadLockList_Offset);
-	unsigned long int uiThreadIndex = 0;
-	unsigned long int uiCounts = 0;
-	
-	while (uiCounts < uiRegisteredThreadCounts)
-	{
-		if (uiThreadIndex >= g_uiMaxThreadNums)
-		{
-			uiThreadIndex = 0;
-			pCurrentMeta = (unsigned char*)*(((unsigned long int*)pCurrentMeta) + 1);
-			if (NULL == pCurrentMeta)
-				return ULONG_MAX;
-			
-			pThreadList = (pthread_t*)(pCurrentMeta + g_uiThreadList_Offset);
-			pThreadMetaList = (unsigned long int*)(pCurrentMeta + g_uiThreadMetaList_Offset);
-			pThreadLockList = (sem_t*)(pCurrentMeta + g_uiThreadLockList_Offset);
-		}
-		
-		unsigned long int uiResult = ULONG_MAX;
-		
-		// Old value Checking
-		if (pthread_equal(0, pThreadList[uiThreadIndex]))
-			continue;
+	const __m128i vNibble = _mm_set1_epi8(0x0f);
+	const __m128i vState1 = _mm_set1_epi8(EBBS_RIGHT_USED_LEFT_FREE);
+	const __m128i vState2 = _mm_set1_epi8(EBBS_LEFT_USED_RIGHT_FREE);
+	const __m128i vState3 = _mm_set1_epi8(EBBS_RIGHT_FULL_LEFT_FREE);
+	const __m128i vState4 = _mm_set1_epi8(EBBS_LEFT_FULL_RIGHT_FREE);
+	unsigned int uiHighMask = 0;
+	unsigned int uiLowMask = 0;
+	
+	for (int i = 0; i < SCAN_CHUNK_BYTES; i += 16)
+	{
+		__m128i vBytes = _mm_loadu_si128((const __m128i*)(pMeta_ + i));
+		__m128i vHigh = _mm_and_si128(_mm_srli_epi16(vBytes, BITS_PER_BLOCK_METADATA), vNibble);
+		__m128i vLow = _mm_and_si128(vBytes, vNibble);
 		
-		if (0 == pthread_equal(self, pThreadList[uiThreadIndex]))
-		{
-			// Old Value checking
-			// Acquire a Thread Arena lock 
-			if (-1 == sem_wait(pThreadLockList + uiThreadIndex))
-				continue;
-			
-			uiResult = FreeFromThreadArena(ptr, (unsigned char*)(pThreadMetaList[uiThreadIndex]));
-			sem_post(pThreadLockList + uiThreadIndex);
-		}
-			
-		if (ULONG_MAX != uiResult)
-			return uiResult; 
+		__m128i vHighMatch = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(vHigh, vState1), _mm_cmpeq_epi8(vHigh, vState2)),
+										  _mm_or_si128(_mm_cmpeq_epi8(vHigh, vState3), _mm_cmpeq_epi8(vHigh, vState4)));
+		__m128i vLowMatch = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(vLow, vState1), _mm_cmpeq_epi8(vLow, vState2)),
+										 _mm_or_si128(_mm_cmpeq_epi8(vLow, vState3), _mm_cmpeq_epi8(vLow, vState4)));
 		
-		++uiThreadIndex;
-		++uiCounts;
+		uiHighMask |= (unsigned int)_mm_movemask_epi8(vHighMatch) << i;
+		uiLowMask |= (unsigned int)_mm_movemask_epi8(vLowMatch) << i;
 	}
 	
-	return ULONG_MAX;
+	*pHighMask_ = uiHighMask;
+	*pLowMask_ = uiLowMask;
 }
 
+// Scan kernel with AVX2 ( 32 bytes at a time )
+__attribute__((target("avx2")))
+void ScanFreeBuddiesAVX2(const unsigned char* pMeta_, unsigned int* pHighMask_, unsigned int* pLowMask_)
+{
+	const __m256i vNibble = _mm256_set1_epi8(0x0f);
+	const __m256i vState1 = _mm256_set1_epi8(EBBS_RIGHT_USED_LEFT_FREE);
+	const __m256i vState2 = _mm256_set1_epi8(EBBS_LEFT_USED_RIGHT_FREE);
+	const __m256i vState3 = _mm256_set1_epi8(EBBS_RIGHT_FULL_LEFT_FREE);
+	const __m256i vState4 = _mm256_set1_epi8(EBBS_LEFT_FULL_RIGHT_FREE);
+	
+	__m256i vBytes = _mm256_loadu_si256((const __m256i*)pMeta_);
+	__m256i vHigh = _mm256_and_si256(_mm256_srli_epi16(vBytes, BITS_PER_BLOCK_METADATA), vNibble);
+	__m256i vLow = _mm256_and_si256(vBytes, vNibble);
+	
+	__m256i vHighMatch = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(vHigh, vState1), _mm256_cmpeq_epi8(vHigh, vState2)),
+										 _mm256_or_si256(_mm256_cmpeq_epi8(vHigh, vState3), _mm256_cmpeq_epi8(vHigh, vState4)));
+	__m256i vLowMatch = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(vLow, vState1), _mm256_cmpeq_epi8(vLow, vState2)),
+										_mm256_or_si256(_mm256_cmpeq_epi8(vLow, vState3), _mm256_cmpeq_epi8(vLow, vState4)));
+	
+	*pHighMask_ = (unsigned int)_mm256_movemask_epi8(vHighMatch);
+	*pLowMask_ = (unsigned int)_mm256_movemask_epi8(vLowMatch);
+}
+#endif
 
 
-// Free memory from its own Arena
-// 0 : trying to free an address when that address has not been allocated yet
-// ULONG_MAX : The given ptr is invalid because it is not allocated from the arena
+// Free from a Bin (Binary Search)
+// ULONG_MAX : The given ptr is not the start address of a block allocated from the Bin
 // Otherwise, return the size of the freed memmory
-unsigned long int FreeFromThreadArena(void* ptr, unsigned char* pThreadMetaData_)
+unsigned long int FreeFromBin(unsigned char* pAddrTobeFreed_, unsigned char* pBin_, unsigned char* pMeta_, size_t uiBinSize_, size_t uiBlockMinSize_)
 {
-	if (NULL == pThreadMetaData_)
+	unsigned char ucPathState[MAX_TREE_DEPTH];
+	unsigned long int uiDepth = 0;
+	size_t uiNodeSize = 0;
+	unsigned long int uiNode = FindAllocatedNode(pAddrTobeFreed_, pBin_, pMeta_, uiBinSize_, uiBlockMinSize_, ucPathState, &uiDepth, &uiNodeSize);
+	if (ULONG_MAX == uiNode)
 		return ULONG_MAX;
-		
-	unsigned char* pCurrentMeta = pThreadMetaData_;
-	unsigned long int* pBinList = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN]);
-	unsigned long int* pBinMetaList = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN_META]);
-	unsigned long int* pBinPageNumList = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN_PAGE_NUM]);
 	
-	unsigned long int* pBinUsedBytes = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN_USED_BYTES]);
-	unsigned long int* pBinFreeReqs = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_FREE_REQUESTS]);
+	SetNodeState(uiNode, pMeta_, EBBS_FREE);
+	UpdateParentStates(uiNode, EBBS_FREE, pMeta_, ucPathState, uiDepth);
+	return uiNodeSize;
+}
 
+// Find the node of the block allocated at once that starts at pAddr_, without changing the tree ( See FreeFromBin() )
+// The states of its parents are stored in pPathState_, their number in *pDepth_, and the size of the block in *pNodeSize_.
+// ULONG_MAX : pAddr_ is not the start address of a block allocated from the Bin
+unsigned long int FindAllocatedNode(unsigned char* pAddr_, unsigned char* pBin_, unsigned char* pMeta_, size_t uiBinSize_, size_t uiBlockMinSize_, unsigned char* pPathState_, unsigned long int* pDepth_, size_t* pNodeSize_)
+{
+	unsigned long int uiDepth = 0;
+	unsigned long int uiNode = 0;
+	size_t uiNodeSize = uiBinSize_;
+	unsigned char* pBlock = pBin_;
 	
-	unsigned long int uiBinIndex = 0;
-	unsigned long int uiBinPageNums;
-	
-	do
+	while (uiNodeSize >= uiBlockMinSize_)
 	{
-		if (uiBinIndex >= g_uiMaxBinNums)
+		unsigned char ucState = GetNodeState(uiNode, pMeta_);
+		if (EBBS_ALLOCATED_AT_ONCE == ucState)
 		{
-			uiBinIndex = 0;
-			pCurrentMeta = (unsigned char*)*(((unsigned long int*)pCurrentMeta) + 1);
-			if (NULL == pCurrentMeta)
+			// ptr points to the middle of an allocated block
+			if (pAddr_ != pBlock)
 				return ULONG_MAX;
 			
-			pBinList = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN]);
-			pBinMetaList = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN_META]);
-			pBinPageNumList = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN_PAGE_NUM]);
-			pBinUsedBytes = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN_USED_BYTES]);
-			pBinFreeReqs = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_FREE_REQUESTS]);
+			*pDepth_ = uiDepth;
+			*pNodeSize_ = uiNodeSize;
+			return uiNode;
 		}
-			
-		if (0 == pBinList[uiBinIndex])
+		
+		// Nothing has been allocated in this block
+		if (EBBS_FREE == ucState)
 			return ULONG_MAX;
-
-		uiBinPageNums = pBinPageNumList[uiBinIndex];
-
-			
-		unsigned long int uiTargetAddr = (unsigned long int)ptr;
-		if (uiTargetAddr < pBinList[uiBinIndex]  ||
-			(pBinList[uiBinIndex] + (g_iPageSize * uiBinPageNums) <= uiTargetAddr))
+		
+		pPathState_[uiDepth++] = ucState;
+		uiNodeSize /= 2;
+		if (pAddr_ < pBlock + uiNodeSize)
 		{
-			++uiBinIndex;
-			continue;
+			uiNode = (uiNode * 2) + 1;
 		}
-			
-		unsigned char* pActualBinMetaData;
-
-		pActualBinMetaData = (unsigned char*)(pBinMetaList[uiBinIndex]);
-		unsigned long int uiResult = FreeFromBin(0, (unsigned char*)ptr, (unsigned char*)pBinList[uiBinIndex], pActualBinMetaData, g_iPageSize * uiBinPageNums, MIN_BLOCK_SIZE);
-		if (ULONG_MAX != uiResult)
+		else
 		{
-			pBinUsedBytes[uiBinIndex] -= uiResult;
-			pBinFreeReqs[uiBinIndex] += 1;
+			uiNode = (uiNode * 2) + 2;
+			pBlock += uiNodeSize;
 		}
-		
-		return uiResult;
-	
-	} while (pCurrentMeta);	
+	}
 	
 	return ULONG_MAX;
 }
 
-// Allocate memory from a Bin (Binary Search)
-unsigned char* AllocateFromBin(unsigned long int uiNode_, unsigned char* pBin_, unsigned char* pMeta_, size_t uiCurrentNodeSize_, size_t uiRequestedSize_, size_t uiBlockMinSize_, unsigned long int* pAllocSize_)
+// Free memory from a Bin when the size it was allocated with is known
+// The block is the smallest power of two holding uiSize_ ( See GetBlockSize() ), so its node follows from its offset without walking down the tree.
+// Below a node allocated at once, every node is left free, so finding that state at the computed node proves the block is there.
+// Otherwise ( ex) memalign() gave a larger block, or uiSize_ is wrong ), the tree is walked as FreeFromBin() does.
+unsigned long int FreeSizedFromBin(unsigned char* pAddrTobeFreed_, unsigned char* pBin_, unsigned char* pMeta_, size_t uiBinSize_, size_t uiBlockMinSize_, size_t uiSize_)
 {
-	if (uiCurrentNodeSize_ < uiBlockMinSize_)
-		return NULL;
-	
-	if (uiCurrentNodeSize_ < uiRequestedSize_)
-		return NULL;
-	
-	char cState = GetNodeState(uiNode_, pMeta_);
-	char cNewState = cState;
-	
-	if (EBBS_BOTH_FULL == cState || EBBS_ALLOCATED_AT_ONCE == cState)
-		return NULL;
+	size_t uiBlockSize = uiBlockMinSize_;
+	if (uiSize_ > uiBlockSize)
+		uiBlockSize = 1UL << ((sizeof(unsigned long int) * CHAR_BIT) - __builtin_clzl(uiSize_ - 1));
 	
-	// 0 : Free 
-	// 1 : Right is used and Left is free
-	// 2 : Left is used and Right is free
-	// 3 : Both are used
-	// 4 : Right is fully used and Left is free
-	// 5 : Left is fully used and Right is free
-	// 6 : Right is fully used and Left is used
-	// 7 : Left is fully used and Right is used
-	// 8 : Both are fully used
-	// 9 : Allocated at this level ( For Free Function )
+	unsigned long int uiOffset = pAddrTobeFreed_ - pBin_;
+	if (uiBlockSize <= uiBinSize_ && 0 == (uiOffset & (uiBlockSize - 1)))
+	{
+		unsigned long int uiDepth = __builtin_ctzl(uiBinSize_) - __builtin_ctzl(uiBlockSize);
+		unsigned long int uiNode = ((1UL << uiDepth) - 1) + (uiOffset >> __builtin_ctzl(uiBlockSize));
+		if (EBBS_ALLOCATED_AT_ONCE == GetNodeState(uiNode, pMeta_))
+		{
+			SetNodeState(uiNode, pMeta_, EBBS_FREE);
+			UpdateParentStates(uiNode, EBBS_FREE, pMeta_, NULL, uiDepth);
+			return uiBlockSize;
+		}
+	}
 	
-	size_t uiHalfNodeSize = uiCurrentNodeSize_ / 2;
+	return FreeFromBin(pAddrTobeFreed_, pBin_, pMeta_, uiBinSize_, uiBlockMinSize_);
+}
 
-	if (uiHalfNodeSize < uiRequestedSize_ || uiHalfNodeSize < uiBlockMinSize_)
+// Propagate the new state of a Node (Block) to its parents
+// pPathState_ contains the states of the parents read on the way down. ( pPathState_[0] is the root, and the Node is at uiDepth_ )
+// If pPathState_ is NULL, the states of the parents are read from the Bin Metadata.
+// If a parent keeps its state, nothing above it changes either, so the walk stops there.
+void UpdateParentStates(unsigned long int uiNode_, unsigned char ucNodeState_, unsigned char* pMeta_, unsigned char* pPathState_, unsigned long int uiDepth_)
+{
+	unsigned long int uiNode = uiNode_;
+	unsigned char ucNodeState = ucNodeState_;
+	unsigned long int uiDepth = uiDepth_;
+	
+	while (uiDepth > 0)
 	{
-		if (0 != cState)
-			return NULL;
+		--uiDepth;
+		unsigned long int uiSide = (uiNode & 1) ? ECS_LEFT : ECS_RIGHT;
+		uiNode = (uiNode - 1) / 2;
 		
-		cNewState = EBBS_ALLOCATED_AT_ONCE;
-		SetNodeState(uiNode_, pMeta_, cNewState);
-			
-		*pAllocSize_ = uiCurrentNodeSize_;
-		return pBin_;
+		unsigned char ucParentState = pPathState_ ? pPathState_[uiDepth] : GetNodeState(uiNode, pMeta_);
+		unsigned char ucNewState = g_ucParentState[ucParentState][uiSide][ucNodeState];
+		if (ucNewState == ucParentState)
+			return;
+		
+		SetNodeState(uiNode, pMeta_, ucNewState);
+		ucNodeState = ucNewState;
 	}
-	else
+}
+
+// Set the states of the parents of a node again from those of their children, up to the root
+// Unlike UpdateParentStates(), the states they had are not trusted. ( See RecoverPersistentArena() )
+void RebuildParentStates(unsigned long int uiNode_, unsigned char* pMeta_)
+{
+	unsigned long int uiNode = uiNode_;
+	while (uiNode > 0)
 	{
-		unsigned long int uiLeftNode = (uiNode_ * 2) + 1;
-		unsigned char* pAllocatedAddr = AllocateFromBin(uiLeftNode, pBin_, pMeta_, uiHalfNodeSize, uiRequestedSize_, uiBlockMinSize_, pAllocSize_);
-		if (pAllocatedAddr)
-		{
-			unsigned char ucLeftNodeState = GetNodeState(uiLeftNode, pMeta_);
-			switch (cState)
-			{
-			// Right is free
-			case EBBS_FREE:
-			case EBBS_LEFT_USED_RIGHT_FREE:
-			case EBBS_LEFT_FULL_RIGHT_FREE:
-				if (EBBS_BOTH_FULL == ucLeftNodeState || EBBS_ALLOCATED_AT_ONCE == ucLeftNodeState) // Left is fully used
-					cNewState = EBBS_LEFT_FULL_RIGHT_FREE;
-				else // Part of Left is used 
-					cNewState = EBBS_LEFT_USED_RIGHT_FREE;
-				break;
-			// Right is used
-			case EBBS_RIGHT_USED_LEFT_FREE:
-			case EBBS_BOTH_USED:
-			case EBBS_LEFT_FULL_RIGHT_USED:
-				if (EBBS_BOTH_FULL == ucLeftNodeState || EBBS_ALLOCATED_AT_ONCE == ucLeftNodeState) // Left is fully used
-					cNewState = EBBS_LEFT_FULL_RIGHT_USED;
-				else // Part of Left is used 
-					cNewState = EBBS_BOTH_USED;
-					
-				break;
-			// Right is fully used
-			case EBBS_RIGHT_FULL_LEFT_FREE:
-			case EBBS_RIGHT_FULL_LEFT_USED:
-				if (EBBS_BOTH_FULL == ucLeftNodeState || EBBS_ALLOCATED_AT_ONCE == ucLeftNodeState) // Left is fully used
-					cNewState = EBBS_BOTH_FULL;
-				else // Part of Left is used 
-					cNewState = EBBS_RIGHT_FULL_LEFT_USED;
-				
-				break;
-			}
-			
-			SetNodeState(uiNode_, pMeta_, cNewState);
-			return pAllocatedAddr;
-		}
-		else
-		{
-			unsigned long int uiRightNode = (uiNode_ * 2) + 2;
-			pAllocatedAddr = AllocateFromBin(uiRightNode, pBin_ + uiHalfNodeSize, pMeta_, uiHalfNodeSize, uiRequestedSize_, uiBlockMinSize_, pAllocSize_);
-			
-			if (pAllocatedAddr)
-			{
-				unsigned char ucRightNodeState = GetNodeState(uiRightNode, pMeta_);
-				switch (cState)
-				{
-				// Left is free
-				case EBBS_FREE:
-				case EBBS_RIGHT_USED_LEFT_FREE:
-				case EBBS_RIGHT_FULL_LEFT_FREE:
-					if (EBBS_BOTH_FULL == ucRightNodeState || EBBS_ALLOCATED_AT_ONCE == ucRightNodeState) // Right is fully used
-						cNewState = EBBS_RIGHT_FULL_LEFT_FREE;
-					else // Part of Right is used 
-						cNewState = EBBS_RIGHT_USED_LEFT_FREE;
-					break;
-				// Left is used
-				case EBBS_LEFT_USED_RIGHT_FREE:
-				case EBBS_BOTH_USED:
-				case EBBS_RIGHT_FULL_LEFT_USED:
-					if (EBBS_BOTH_FULL == ucRightNodeState || EBBS_ALLOCATED_AT_ONCE == ucRightNodeState) // Right is fully used
-						cNewState = EBBS_RIGHT_FULL_LEFT_USED;
-					else // Part of Right is used 
-						cNewState = EBBS_BOTH_USED;
-					break;
-				// Left is fully used
-				case EBBS_LEFT_FULL_RIGHT_FREE:
-				case EBBS_LEFT_FULL_RIGHT_USED:
-					if (EBBS_BOTH_FULL == ucRightNodeState || EBBS_ALLOCATED_AT_ONCE == ucRightNodeState) // Right is fully used
-						cNewState = EBBS_BOTH_FULL;
-					else // Part of Right is used 
-						cNewState = EBBS_LEFT_FULL_RIGHT_USED;
-					break;
-				}
-				
-				SetNodeState(uiNode_, pMeta_, cNewState);
-				
-			}
-				
-			return pAllocatedAddr;
-		}
+		uiNode = (uiNode - 1) / 2;
+		
+		unsigned char ucState = g_ucParentState[EBBS_FREE][ECS_LEFT][GetNodeState((uiNode * 2) + 1, pMeta_)];
+		ucState = g_ucParentState[ucState][ECS_RIGHT][GetNodeState((uiNode * 2) + 2, pMeta_)];
+		SetNodeState(uiNode, pMeta_, ucState);
 	}
-	
-	return NULL;
 }
 
-
-// Free from a Bin (Binary Search)
-// 0 : trying to free an address when that address has not been allocated yet
-// ULONG_MAX : The given ptr is in the current Block of the Bin (for reculsive call)
-//             This does not mean the given ptr is not allocated from the Bin 
-// Otherwise, return the size of the freed memmory
-unsigned long int FreeFromBin(unsigned long int uiNode_, unsigned char* pAddrTobeFreed_, unsigned char* pBin_, unsigned char* pMeta_, size_t uiCurrentNodeSize_, size_t uiBlockMinSize_)
+// Build the state transition tables of the binary tree
+// Every state except EBBS_ALLOCATED_AT_ONCE is a pair of (the status of the left child, the status of the right child),
+// so the new state of a parent is the pair with the status of one child replaced.
+void InitBuddyStateTables()
 {
-	if (uiCurrentNodeSize_ < uiBlockMinSize_)
-		return ULONG_MAX;
+	unsigned char ucComposedState[EBCS_MAX][EBCS_MAX] =
+	{
+		// Right : Free               Used                       Full
+		{ EBBS_FREE,                 EBBS_RIGHT_USED_LEFT_FREE, EBBS_RIGHT_FULL_LEFT_FREE }, // Left : Free
+		{ EBBS_LEFT_USED_RIGHT_FREE, EBBS_BOTH_USED,            EBBS_RIGHT_FULL_LEFT_USED }, // Left : Used
+		{ EBBS_LEFT_FULL_RIGHT_FREE, EBBS_LEFT_FULL_RIGHT_USED, EBBS_BOTH_FULL            }, // Left : Full
+	};
 	
-	char cState = GetNodeState(uiNode_, pMeta_);
-	char cNewState;
-	if (pAddrTobeFreed_ == pBin_)
-	{
-		// 0 : Free 
-		// 1 : Right is used and Left is free
-		// 2 : Left is used and Right is free
-		// 3 : Both are used
-		// 4 : Right is fully used and Left is free
-		// 5 : Left is fully used and Right is free
-		// 6 : Right is fully used and Left is used
-		// 7 : Left is fully used and Right is used
-		// 8 : Both are fully used
-		// 9 : Allocated at this level ( For Free Function )
-		
-		if (EBBS_ALLOCATED_AT_ONCE == cState)
+	for (int iLeft = 0; iLeft < EBCS_MAX; ++iLeft)
+	{
+		for (int iRight = 0; iRight < EBCS_MAX; ++iRight)
 		{
-			cNewState = EBBS_FREE;
-			SetNodeState(uiNode_, pMeta_, cNewState);
-			return uiCurrentNodeSize_;
+			unsigned char ucState = ucComposedState[iLeft][iRight];
+			g_ucChildStatus[ucState][ECS_LEFT] = iLeft;
+			g_ucChildStatus[ucState][ECS_RIGHT] = iRight;
 		}
+	}
+	
+	// Nothing can be allocated from the children of a block allocated at once
+	g_ucChildStatus[EBBS_ALLOCATED_AT_ONCE][ECS_LEFT] = EBCS_FULL;
+	g_ucChildStatus[EBBS_ALLOCATED_AT_ONCE][ECS_RIGHT] = EBCS_FULL;
+	
+	for (int iState = 0; iState < EBBS_MAX; ++iState)
+	{
+		if (EBBS_FREE == iState)
+			g_ucNodeStatus[iState] = EBCS_FREE;
+		else if (EBBS_BOTH_FULL == iState || EBBS_ALLOCATED_AT_ONCE == iState)
+			g_ucNodeStatus[iState] = EBCS_FULL;
 		else
+			g_ucNodeStatus[iState] = EBCS_USED;
+	}
+	
+	for (int iParent = 0; iParent < EBBS_MAX; ++iParent)
+	{
+		for (int iSide = 0; iSide < ECS_MAX; ++iSide)
 		{
-			unsigned long int uiLeftNode = (uiNode_ * 2) + 1;
-			size_t uiChildNodeSize = uiCurrentNodeSize_ / 2;
-			unsigned long int uiResult = FreeFromBin(uiLeftNode, pAddrTobeFreed_, pBin_, pMeta_, uiChildNodeSize, uiBlockMinSize_);
-			if (ULONG_MAX != uiResult)
+			for (int iChild = 0; iChild < EBBS_MAX; ++iChild)
 			{
-				unsigned char ucLeftNodeState = GetNodeState(uiLeftNode, pMeta_);
-				switch (cState)
-				{
-				// Right is free
-				case EBBS_LEFT_USED_RIGHT_FREE:
-				case EBBS_LEFT_FULL_RIGHT_FREE:
-					if (EBBS_FREE == ucLeftNodeState) // Left is free
-						cNewState = EBBS_FREE;
-					else// Part of Left is used 
-						cNewState = EBBS_LEFT_USED_RIGHT_FREE;
-					break;
-				// Right is used
-				case EBBS_RIGHT_USED_LEFT_FREE:
-				case EBBS_BOTH_USED:
-				case EBBS_LEFT_FULL_RIGHT_USED:
-					if (EBBS_FREE == ucLeftNodeState) // Left is free
-						cNewState = EBBS_RIGHT_USED_LEFT_FREE;
-					else // Part of Left is used 
-						cNewState = EBBS_BOTH_USED;
-					
-					break;
-				// Right is fully used
-				case EBBS_RIGHT_FULL_LEFT_FREE:
-				case EBBS_RIGHT_FULL_LEFT_USED:
-				case EBBS_BOTH_FULL:
-					if (EBBS_FREE == ucLeftNodeState) // Left is free
-						cNewState = EBBS_RIGHT_FULL_LEFT_FREE;
-					else // Part of Left is used 
-						cNewState = EBBS_RIGHT_FULL_LEFT_USED;
-				
-					break;
-				}
-			
-				SetNodeState(uiNode_, pMeta_, cNewState);
+				unsigned char ucStatus[ECS_MAX];
+				ucStatus[ECS_LEFT] = g_ucChildStatus[iParent][ECS_LEFT];
+				ucStatus[ECS_RIGHT] = g_ucChildStatus[iParent][ECS_RIGHT];
+				ucStatus[iSide] = g_ucNodeStatus[iChild];
+				g_ucParentState[iParent][iSide][iChild] = ucComposedState[ucStatus[ECS_LEFT]][ucStatus[ECS_RIGHT]];
 			}
-	
-			return uiResult;
 		}
 	}
-	else
+	
+	// A node with one free child and one child in use ( See AllocateNextToUsedBlock() )
+	for (int iByte = 0; iByte <= UCHAR_MAX; ++iByte)
 	{
-		size_t uiChildNodeSize = uiCurrentNodeSize_ / 2;
-		if (pAddrTobeFreed_ < pBin_ + uiChildNodeSize)
+		unsigned char ucStates[BLOCKS_IN_ONE_BYTE] = { iByte >> BITS_PER_BLOCK_METADATA, iByte & 0x0f };
+		g_ucFreeBuddyMask[iByte] = 0;
+		for (int i = 0; i < BLOCKS_IN_ONE_BYTE; ++i)
 		{
-			unsigned long int uiLeftNode = (uiNode_ * 2) + 1;
-			unsigned long int uiResult = FreeFromBin(uiLeftNode, pAddrTobeFreed_, pBin_, pMeta_, uiChildNodeSize, uiBlockMinSize_);
-			if (ULONG_MAX != uiResult)
-			{
-				unsigned char ucLeftNodeState = GetNodeState(uiLeftNode, pMeta_);
-				switch (cState)
-				{
-				// Right is free
-				case EBBS_LEFT_USED_RIGHT_FREE:
-				case EBBS_LEFT_FULL_RIGHT_FREE:
-					if (EBBS_FREE == ucLeftNodeState) // Left is free
-						cNewState = EBBS_FREE;
-					else// Part of Left is used 
-						cNewState = EBBS_LEFT_USED_RIGHT_FREE;
-					break;
-				// Right is used
-				case EBBS_RIGHT_USED_LEFT_FREE:
-				case EBBS_BOTH_USED:
-				case EBBS_LEFT_FULL_RIGHT_USED:
-					if (EBBS_FREE == ucLeftNodeState) // Left is free
-						cNewState = EBBS_RIGHT_USED_LEFT_FREE;
-					else // Part of Left is used 
-						cNewState = EBBS_BOTH_USED;
-					
-					break;
-				// Right is fully used
-				case EBBS_RIGHT_FULL_LEFT_FREE:
-				case EBBS_RIGHT_FULL_LEFT_USED:
-				case EBBS_BOTH_FULL:
-					if (EBBS_FREE == ucLeftNodeState) // Left is free
-						cNewState = EBBS_RIGHT_FULL_LEFT_FREE;
-					else // Part of Left is used 
-						cNewState = EBBS_RIGHT_FULL_LEFT_USED;
-				
-					break;
-				}
+			if (ucStates[i] >= EBBS_MAX || EBBS_FREE == ucStates[i])
+				continue;
 			
-				SetNodeState(uiNode_, pMeta_, cNewState);
-			}
-	
-			return uiResult;
-		}
-		else
-		{
-			unsigned long int uiRightNode = (uiNode_ * 2) + 2;
-	
-			unsigned long int uiResult = FreeFromBin(uiRightNode, pAddrTobeFreed_, pBin_ + uiChildNodeSize, pMeta_, uiChildNodeSize, uiBlockMinSize_);
-			if (ULONG_MAX != uiResult)
-			{
-				unsigned char ucRightNodeState = GetNodeState(uiRightNode, pMeta_);
-				switch (cState)
-				{
-				// Left is free
-				case EBBS_RIGHT_USED_LEFT_FREE:
-				case EBBS_RIGHT_FULL_LEFT_FREE:
-					if (EBBS_FREE == ucRightNodeState) // Right is free
-						cNewState = EBBS_FREE;
-					else // Part of Right is used 
-						cNewState = EBBS_RIGHT_USED_LEFT_FREE;
-					break;
-				// Left is used
-				case EBBS_LEFT_USED_RIGHT_FREE:
-				case EBBS_BOTH_USED:
-				case EBBS_RIGHT_FULL_LEFT_USED:
-					if (EBBS_FREE == ucRightNodeState) // Right is free
-						cNewState = EBBS_LEFT_USED_RIGHT_FREE;
-					else // Part of Right is used 
-						cNewState = EBBS_BOTH_USED;
-					break;
-				// Left is fully used
-				case EBBS_LEFT_FULL_RIGHT_FREE:
-				case EBBS_LEFT_FULL_RIGHT_USED:
-				case EBBS_BOTH_FULL:
-					if (EBBS_FREE == ucRightNodeState) // Right is free
-						cNewState = EBBS_LEFT_FULL_RIGHT_FREE;
-					else // Part of Right is used 
-						cNewState = EBBS_LEFT_FULL_RIGHT_USED;
-					break;
-				}
-				
-				SetNodeState(uiNode_, pMeta_, cNewState);
-			}
-
-			return uiResult;
+			if (EBCS_FREE == g_ucChildStatus[ucStates[i]][ECS_LEFT] || EBCS_FREE == g_ucChildStatus[ucStates[i]][ECS_RIGHT])
+				g_ucFreeBuddyMask[iByte] |= (1 << i);
 		}
-		
 	}
-	
-	return ULONG_MAX;
 }
 
 // Set a new state value to a Node (Block)
+// Nodes with even indexes are stored in the high 4 bits of a byte, and nodes with odd indexes in the low 4 bits.
 void SetNodeState(unsigned long int uiNodeIndex_, unsigned char* pMeta_, unsigned char ucState_)
 {
-	int iIndex = uiNodeIndex_ / BLOCKS_IN_ONE_BYTE;
-	int iOffset = (uiNodeIndex_ % BLOCKS_IN_ONE_BYTE) * BITS_PER_BLOCK_METADATA;
-	int iReverseOffset = BITS_PER_BLOCK_METADATA  - iOffset;
+	unsigned int uiShift = (~uiNodeIndex_ & 1) * BITS_PER_BLOCK_METADATA;
+	unsigned char* pByte = pMeta_ + (uiNodeIndex_ / BLOCKS_IN_ONE_BYTE);
+	*pByte = (*pByte & ~(0x0f << uiShift)) | (ucState_ << uiShift);
+}
+
+// Set the same state value to uiNodeNums_ Nodes (Blocks) next to each other in one level of the tree
+// Whole bytes in the middle are written with memset.
+void SetNodeStateRange(unsigned char* pMeta_, unsigned long int uiFirstNode_, unsigned long int uiNodeNums_, unsigned char ucState_)
+{
+	unsigned long int uiNode = uiFirstNode_;
+	unsigned long int uiEndNode = uiFirstNode_ + uiNodeNums_;
+	
+	// An odd node is the low 4 bits of a byte shared with the node before it
+	if ((uiNode & 1) && uiNode < uiEndNode)
+	{
+		SetNodeState(uiNode, pMeta_, ucState_);
+		++uiNode;
+	}
 	
-	unsigned char cNewState = ucState_ << iReverseOffset;
-	unsigned char cBuddyMask = 0xf0 >> iReverseOffset;
-	unsigned char cBuddyState = (*(pMeta_ + iIndex) & cBuddyMask);
-	*(pMeta_ + iIndex) = cBuddyState | cNewState;
+	unsigned long int uiByteNums = (uiEndNode - uiNode) / BLOCKS_IN_ONE_BYTE;
+	memset(pMeta_ + (uiNode / BLOCKS_IN_ONE_BYTE), (ucState_ << BITS_PER_BLOCK_METADATA) | ucState_, uiByteNums);
+	uiNode += uiByteNums * BLOCKS_IN_ONE_BYTE;
+	
+	if (uiNode < uiEndNode)
+		SetNodeState(uiNode, pMeta_, ucState_);
 }
 
 // Get the state value of a Node (Block)
 unsigned char GetNodeState(unsigned long int  uiNodeIndex_, unsigned char* pMeta_)
 {
-	int iIndex = uiNodeIndex_ / BLOCKS_IN_ONE_BYTE;
-	int iOffset = (uiNodeIndex_ % BLOCKS_IN_ONE_BYTE) * BITS_PER_BLOCK_METADATA;
-	int iReverseOffset = BITS_PER_BLOCK_METADATA  - iOffset;
-	unsigned char mask = 0xf0 >> iOffset;
-	unsigned char cState = (*(pMeta_ + iIndex) & mask) >> iReverseOffset;
-	
-	return cState;
+	unsigned int uiShift = (~uiNodeIndex_ & 1) * BITS_PER_BLOCK_METADATA;
+	return (*(pMeta_ + (uiNodeIndex_ / BLOCKS_IN_ONE_BYTE)) >> uiShift) & 0x0f;
 }
 
 
 // Get the ith page of the Process Metadata
+// NULL : The page is not installed yet ( See CreateNewProcessMetaPage() )
 unsigned char* GetProcessMetaPage(unsigned long int uiPageIndex)
 {
-	unsigned char* pCurrentMetaPage = g_pProcessMetaData;
-	
-	unsigned long int i = 0;
-	while (pCurrentMetaPage)
-	{
-		if (i >= uiPageIndex)
-			return pCurrentMetaPage;
-		
-		++i;
-		pCurrentMetaPage = (unsigned char*)*(((unsigned long int*)pCurrentMetaPage) + 1);
-	}
+	if (uiPageIndex >= MAX_PROCESS_META_PAGES)
+		return NULL;
 	
-	return pCurrentMetaPage;
+	return __atomic_load_n(&g_pProcessMetaDirectory[uiPageIndex], __ATOMIC_ACQUIRE);
 }
 
 // Get the ith page of the Thread Arena Metadata
-unsigned char* GetThreadMetaPage(unsigned long int uiPageIndex)
+unsigned char* GetThreadMetaPage(unsigned char* pThreadMetaData_, unsigned long int uiPageIndex)
 {
-	unsigned char* pCurrentMetaPage = t_pThreadMetaData;
+	unsigned char* pCurrentMetaPage = pThreadMetaData_;
 	
 	unsigned long int i = 0;
 	while (pCurrentMetaPage)
@@ -1022,26 +3989,11 @@ unsigned char* GetThreadMetaPage(unsigned long int uiPageIndex)
 	return pCurrentMetaPage;
 }
 
-// Get the last page of the Process Metadata
-unsigned char* GetLastProcessMetaPage()
-{
-	unsigned char* pCurrentMetaPage = g_pProcessMetaData;
-	unsigned char* pPrevMetaPage = g_pProcessMetaData;
-
-	while (pCurrentMetaPage)
-	{
-		pPrevMetaPage = pCurrentMetaPage;
-		pCurrentMetaPage = (unsigned char*)*(((unsigned long int*)pCurrentMetaPage) + 1);
-	}
-	
-	return pPrevMetaPage;
-}
-
 // Get the last page of the Thread Arena Metadata
-unsigned char* GetLastThreadMetaPage()
+unsigned char* GetLastThreadMetaPage(unsigned char* pThreadMetaData_)
 {
-	unsigned char* pCurrentMetaPage = t_pThreadMetaData;
-	unsigned char* pPrevMetaPage = t_pThreadMetaData;
+	unsigned char* pCurrentMetaPage = pThreadMetaData_;
+	unsigned char* pPrevMetaPage = pThreadMetaData_;
 
 	while (pCurrentMetaPage)
 	{
@@ -1054,40 +4006,40 @@ unsigned char* GetLastThreadMetaPage()
 
 // To avoid allocating a new page for every new Bin
 // Find available space among Metadata page pool, which are already in use, but has some space.
-unsigned char* GetLargeBinMetaPage(unsigned long int uiMetaSize_)
+unsigned char* GetLargeBinMetaPage(unsigned char* pThreadMetaData_, unsigned long int uiMetaSize_)
 {
-	if (NULL == t_pThreadMetaData)
+	if (NULL == pThreadMetaData_)
 		return NULL;
 	
-	unsigned char* pCurrentMeta = t_pThreadMetaData;
-	unsigned long int* pBinMetaPageList = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN_META_POOL]);
+	unsigned char* pCurrentMeta = pThreadMetaData_;
+	unsigned long int* pBinMetaPageList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_META_POOL));
 	if (0 == (*pBinMetaPageList))
 		return NULL;
 	
-	unsigned long int* pBinMetaPageNumsList = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN_META_PAGE_NUM]);
-	unsigned long int* pBinMetaPageOffsetLists = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN_META_OFFSET]);
+	unsigned long int* pBinMetaPageNumsList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_META_PAGE_NUM));
+	unsigned long int* pBinMetaPageOffsetLists = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_META_OFFSET));
 	
 	unsigned long int uiMetaIndex = 0;
 	unsigned long int uiTotalMetaIndex = 0;
 	do
 	{
-		if (uiMetaIndex >= g_uiMaxBinNums)
+		if (uiMetaIndex >= MAX_BIN_NUMS)
 		{
 			uiMetaIndex = 0;
 			pCurrentMeta = (unsigned char*)*(((unsigned long int*)pCurrentMeta) + 1);
 			if (0 == pCurrentMeta)
 				return NULL;
 			
-			pBinMetaPageList = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN_META_POOL]);		
-			pBinMetaPageNumsList = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN_META_PAGE_NUM]);
-			pBinMetaPageOffsetLists = (unsigned long int*)(pCurrentMeta + g_uiOffset[TMO_BIN_META_OFFSET]);
+			pBinMetaPageList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_META_POOL));		
+			pBinMetaPageNumsList = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_META_PAGE_NUM));
+			pBinMetaPageOffsetLists = (unsigned long int*)(pCurrentMeta + TMO_OFFSET(TMO_BIN_META_OFFSET));
 		}
 		
 		if (0 == pBinMetaPageList[uiMetaIndex])
 			return NULL;
 		
 		unsigned long int uiPreviousOffset = pBinMetaPageOffsetLists[uiMetaIndex];
-		unsigned long int uiRemainSize = (g_iPageSize * pBinMetaPageNumsList[uiMetaIndex]) - uiPreviousOffset;
+		unsigned long int uiRemainSize = (SYSTEM_PAGE_SIZE * pBinMetaPageNumsList[uiMetaIndex]) - uiPreviousOffset;
 		if (uiRemainSize >= uiMetaSize_)
 		{
 			pBinMetaPageOffsetLists[uiMetaIndex] = pBinMetaPageOffsetLists[uiMetaIndex] + uiMetaSize_;
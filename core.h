@@ -1,15 +1,75 @@
 #include <stddef.h>
+#include <semaphore.h>
+#include <signal.h>
 
 #define DEFAULT_PAGE_SIZE 4096		// Default Page Size
 #define BITS_PER_BLOCK_METADATA 4	// The number of bits used to describe the state of a block in a Bin
 #define BLOCKS_IN_ONE_BYTE 2		// The number of blocks that one byte can describe
 #define MIN_MEMORY_ALIGNMENT 8		// The minimun boundary of memory allocation. (ex) malloc(1) still allocates 8 bytes internally)
 #define MIN_BLOCK_SIZE 8			// The size of the smallest block (in Byte) 
+#define CACHE_LINE_SIZE 64			// Data written by different threads is kept at least this far apart
+#define ROUND_UP_TO_CACHE_LINE(n) ((((n) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE) * CACHE_LINE_SIZE)
+#define LOCK_SLOT_SIZE ROUND_UP_TO_CACHE_LINE(sizeof(sem_t))	// The space each Thread Arena lock takes in Process Metadata
+#define MAX_PROCESS_META_PAGES 4096	// The number of Process Metadata pages g_pProcessMetaDirectory can hold
+#define MAX_REQUEST_SIZE (1UL << 47)	// The largest request that can be served ( The user address space of x86-64 ). Larger ones fail at once.
 
 // When no bins are available, malloc() will internally allocate new memory for a new bin.
 // A bin consists of a certain number of pages.
 // If this number is too small, mmap will be called more often, which lowers the performance.
-#define MIN_NEW_PAGE_NUMS 128		// The minimun number of pages a Bin occupies
+// If it is too large, a thread that allocates a few small blocks holds far more memory than it uses.
+// So each Thread Arena starts with small Bins, and each Bin it creates for small requests is twice as large as the last one, up to a cap.
+#define MIN_NEW_PAGE_NUMS 16		// The number of pages of the first Bin of a Thread Arena
+#define MAX_NEW_PAGE_NUMS 1024		// The number of pages Bins for small requests grow to at most ( See GetNewBinPageNums() )
+#define COARSE_BIN_PAGE_NUMS 256	// A Bin for requests of at least this many pages tracks blocks of a page at the smallest
+
+// Environment variables read in the Constructor of this library
+#define ENV_ARENA_MODE "MALLOC_ARENA_MODE"	// "thread" (default), "percpu" or "pool" ( See ARENA_MODE )
+#define ENV_ARENA_MAX_PER_CPU "MALLOC_ARENA_MAX_PER_CPU"	// For "pool", the maximum number of Thread Arenas per CPU
+#define ENV_GUARD_SAMPLE_RATE "MALLOC_GUARD_SAMPLE_RATE"	// On average, one in this many allocations is served from the Guarded Pool ( 0 or unset : Off )
+#define ENV_GUARD_SLOTS "MALLOC_GUARD_SLOTS"	// The number of allocations the Guarded Pool can hold at once
+#define ENV_ARENA_RESERVE_MB "MALLOC_ARENA_RESERVE_MB"	// The size of the address space each Thread Arena reserves for its Bins, in MB ( 0 : Off )
+#define ENV_BACKGROUND_THREAD "MALLOC_BACKGROUND_THREAD"	// "1" : Purge and provision Bins in a background thread ( See MaintainArena() )
+#define ENV_BACKGROUND_INTERVAL_MS "MALLOC_BACKGROUND_INTERVAL_MS"	// How often the background thread runs, in milliseconds
+#define ENV_DECAY_MS "MALLOC_DECAY_MS"	// How long a Bin stays empty before the background thread purges its pages, in milliseconds
+#define ENV_BIN_RESERVE "MALLOC_BIN_RESERVE"	// The number of empty Bins the background thread keeps in each Thread Arena
+#define ENV_LARGE_CACHE_MB "MALLOC_LARGE_CACHE_MB"	// How much of its empty large Bins each Thread Arena keeps in memory until they decay, in MB
+#define ENV_LARGE_CACHE_OVERFLOW_MB "MALLOC_LARGE_CACHE_OVERFLOW_MB"	// How much more of them all Thread Arenas keep together, once their own share is used up, in MB
+#define ENV_INSTRUMENT "MALLOC_INSTRUMENT"	// "1" : Measure allocations, releases and lock waits from the start ( See GetArenaStats() )
+#define ENV_FRAG_DUMP "MALLOC_FRAG_DUMP"	// "1" : Print the fragmentation report when the process exits ( See DumpFragmentation() )
+#define ENV_PREWARM_BINS "MALLOC_PREWARM_BINS"	// The number of Bins created along with each new Thread Arena
+#define ENV_PREWARM_POPULATE "MALLOC_PREWARM_POPULATE"	// "1" : The pages of those Bins are faulted in when they are created
+#define ENV_PLACEMENT "MALLOC_PLACEMENT"	// "first" (default) or "best" ( See PLACEMENT_POLICY )
+
+#define DEFAULT_ARENA_MAX_PER_CPU 2		// The default value of MALLOC_ARENA_MAX_PER_CPU
+#define DEFAULT_GUARD_SLOTS 64			// The default value of MALLOC_GUARD_SLOTS
+#define DEFAULT_ARENA_RESERVE_MB 0		// The default value of MALLOC_ARENA_RESERVE_MB
+#define DEFAULT_BACKGROUND_INTERVAL_MS 100	// The default value of MALLOC_BACKGROUND_INTERVAL_MS
+#define DEFAULT_DECAY_MS 10000			// The default value of MALLOC_DECAY_MS
+#define DEFAULT_BIN_RESERVE 1			// The default value of MALLOC_BIN_RESERVE
+#define DEFAULT_LARGE_CACHE_MB 256		// The default value of MALLOC_LARGE_CACHE_MB
+#define DEFAULT_LARGE_CACHE_OVERFLOW_MB 256	// The default value of MALLOC_LARGE_CACHE_OVERFLOW_MB
+
+// For "pool", a thread moves to another Thread Arena if at least ARENA_REBALANCE_CONTENTIONS of 
+// its last ARENA_REBALANCE_INTERVAL lock acquisitions had to wait for another thread.
+#define ARENA_REBALANCE_INTERVAL 256
+#define ARENA_REBALANCE_CONTENTIONS 128
+
+// How Thread Arenas are assigned to threads
+enum ARENA_MODE
+{
+	EAM_THREAD                = 0, // 0 : Each thread has its own Thread Arena
+	EAM_PER_CPU,				// 1 : Each CPU has a Thread Arena shared by the threads running on it. ( The number of Arenas follows the number of cores )
+	EAM_POOL,					// 2 : A bounded pool of Thread Arenas. Each thread is assigned the least loaded one and moves under sustained lock contention.
+	EAM_MAX,					// 3
+};
+
+// Which free block an allocation is carved from
+enum PLACEMENT_POLICY
+{
+	EPP_FIRST_FIT             = 0, // 0 : The first Bin with room, in the order the Bins were created, and the leftmost free block in it
+	EPP_BEST_FIT,				// 1 : The fullest Bin with room ( See SelectFullestBin() ), and in it a free block in a split subtree ( See FindFreeBlock() )
+	EPP_MAX,					// 2
+};
 
 // Metadata are managed in three levels: Process, Thread, and Bin
 // Process Metadata contain information of threads. (Per-thread entry data)to access Metadata of each Thread Arena . ( Each thread has its own Arena)
@@ -20,7 +80,7 @@
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Process MetaData 
 // The Current address of itself. (for validity checking) 
-// The Address of the next Metadata. ( like a list for unlimited expansion)
+// The index of the page in g_pProcessMetaDirectory.
 // Below sections are arrays because there could be multiple threads.
 // The ID of each thread.
 // The address of first page of each Thread Arena Metadata.
@@ -29,20 +89,28 @@
 // In most cases, one page is enough to store Process Metadata.
 // For example, let's assume that this library runs on a 64 bit machine.
 // The current address requires 8 bytes 
-// The next address requires 8 bytes
+// The page index requires 8 bytes
 // sizeof(pthread_t) requires 8 bytes
 // The address of first page of each Thread Arena Metadata requires 8 bytes..
-// sizeof(sem_t) requires 32 bytes long
-
-// Except the first 16 bytes, there remain 4080 bytes assuming the page size is 4096 bytes.
-// 48 (8 + 32 +8) bytes are required per thread, so one page can store information of 85 (4080 / 48) Thread Arenas. 
-// If user program creats 100 threads, another page is allocated to store information of the rest 25 threads.
-// Then, two pages are used to store Process MetaData and managed as a list.
-// That's why Process MetaData stores the address of next Metadata page.
-// 85 is just an example. The number varies depending on a system.
-
-// In short, Process Metadata are stored and managed in a list of arrays.
-// Process Metadata itself is managed in a list. ( Unlimited expansion not requiring large coninuous memory space)
+// sizeof(sem_t) requires 32 bytes long, but each lock takes a cache line of its own ( LOCK_SLOT_SIZE, 64 bytes )
+// A lock is written on every allocation by the threads of its Arena, while the thread IDs and the addresses are only read by other threads.
+// Packed together, the locks of two Arenas would share a cache line, and each lock operation would take the line away from the other Arena's threads.
+// So the locks start on a cache line after the two arrays, one per line.
+
+// Except the first 16 bytes and up to a cache line of padding, there remain 4016 bytes assuming the page size is 4096 bytes.
+// 80 (8 + 8 + 64) bytes are required per thread, so one page can store information of 50 (4016 / 80) Thread Arenas. 
+// If user program creats 100 threads, another page is allocated to store information of the rest 50 threads.
+// 50 is just an example. The number varies depending on a system.
+
+// The pages are not linked to each other. The address of each page is stored in g_pProcessMetaDirectory by its index,
+// so the slot of the Nth Thread Arena is found at once: page N / g_uiMaxThreadNums, entry N % g_uiMaxThreadNums.
+// A thread claims the next slot by incrementing g_uiRegisteredThreadCounts, and installs the page of that slot if it is the first one there,
+// so Thread Arenas are registered without the process lock. ( See RegisterArena() and CreateNewProcessMetaPage() )
+// The directory has MAX_PROCESS_META_PAGES entries, which caps the number of Thread Arenas at MAX_PROCESS_META_PAGES * g_uiMaxThreadNums.
+// ( 204800 with 4096-byte pages ) Beyond that, a new thread can only take over the Arena of an exited thread, and its allocations fail otherwise.
+
+// In short, Process Metadata are stored and managed in a directory of arrays.
+// Process Metadata pages are found through a fixed directory. ( No large contiguous memory space, and no lock to grow it )
 // Contents of Process Metadata are managed in an array. ( Fast traversing/ Better performance )
 
 
@@ -75,6 +143,18 @@
 // 6: The number of bytes currently allocated to the user program from each Bin. 
 // 7: The number of memory allocation reqeusts on each Bin
 // 8: The number of memory release requests on each Bin
+
+// 9: The offset in each Bin where the last small block was allocated ( Where AllocateNextToUsedBlock() starts scanning )
+// 10: The size of the smallest block each Bin tracks ( The leaves of its tree. See GetBinMinBlockSize() )
+
+// For the background thread ( See MaintainArena() )
+// 11: The number of rounds each Bin has been empty ( ULONG_MAX : Its pages have been purged )
+// 12: The number of allocation requests on each Bin when the background thread last saw it
+// 13: 1 while the background thread purges the pages of each Bin without the lock of the Arena. Allocations skip the Bin meanwhile.
+
+// For the fragmentation analyzer ( See AnalyzeArena() )
+// 14: The bytes requested by all allocations from each Bin so far
+// 15: The bytes of the blocks those allocations were rounded up to
 enum THREAD_METADATA_OFFSET
 {
 	TMO_BIN               = 0,	
@@ -86,10 +166,39 @@ enum THREAD_METADATA_OFFSET
 	TMO_BIN_USED_BYTES,			
 	TMO_ALLOC_REQUESTS,			
 	TMO_FREE_REQUESTS,			
+	TMO_BIN_SCAN_HINT,
+	TMO_BIN_MIN_BLOCK,
+	TMO_BIN_IDLE_TICKS,
+	TMO_BIN_IDLE_ALLOCS,
+	TMO_BIN_PURGING,
+	TMO_BIN_REQUESTED_BYTES,
+	TMO_BIN_ROUNDED_BYTES,
 	TMO_MAX,
 };
 
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Fixed page size build ( libmalloc-4k.so )
+// With FIXED_PAGE_SIZE defined, the page size and the layout derived from it are compile-time constants,
+// so sizes and offsets become immediates, and divisions by them become shifts or multiplications.
+// The constructor checks the page size of the system. If it differs, every call goes to the generic build linked into the library. ( See malloc.c )
+#ifdef FIXED_PAGE_SIZE
+// Must match the header of Thread Arena Metadata built in the constructor ( 15 fields, then Contentions + Own Lock on cache lines of their own )
+#define ARENA_HEADER_LENGTH (ROUND_UP_TO_CACHE_LINE(sizeof(unsigned long int) * 15) + ROUND_UP_TO_CACHE_LINE(sizeof(unsigned long int) + sizeof(sem_t)))
+#define SYSTEM_PAGE_SIZE ((long int)FIXED_PAGE_SIZE)
+#define META_DATA_UNIT_SIZE ((unsigned long int)(FIXED_PAGE_SIZE / MIN_BLOCK_SIZE))
+#define MAX_BIN_NUMS ((unsigned long int)(((FIXED_PAGE_SIZE - ARENA_HEADER_LENGTH) / (sizeof(unsigned long int) * TMO_MAX)) & ~(CACHE_LINE_SIZE / sizeof(unsigned long int) - 1)))
+#define TMO_OFFSET(i) (ARENA_HEADER_LENGTH + (sizeof(unsigned long int) * MAX_BIN_NUMS * (i)))
+
+extern int g_iUseGenericBuild;
+#else
+#define SYSTEM_PAGE_SIZE g_iPageSize
+#define META_DATA_UNIT_SIZE g_uiMetaDataUnitSize
+#define MAX_BIN_NUMS g_uiMaxBinNums
+#define TMO_OFFSET(i) g_uiOffset[i]
+#endif
+
+
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Bin Metadata 
 // Bin Metadata for a Bin is managed in an array that contain each node's state
@@ -112,38 +221,494 @@ enum BUDDY_BLOCK_STATE
 	EBBS_MAX,					// 10
 };
 
+// Each of the states above is a pair of statuses, one for the left child and one for the right child.
+// How a node looks to its parent is also one of these statuses.
+// Transitions between states are precomputed from these statuses in the Constructor of this library. ( See InitBuddyStateTables() )
+enum BUDDY_CHILD_STATUS
+{
+	EBCS_FREE                 = 0, // 0 : No block is used in the child
+	EBCS_USED,					// 1 : Part of the child is used
+	EBCS_FULL,					// 2 : The child is fully used
+	EBCS_MAX,					// 3
+};
+
+// Left and right child of a node ( Index to the second dimension of the transition tables )
+enum BUDDY_CHILD_SIDE
+{
+	ECS_LEFT                  = 0,
+	ECS_RIGHT,
+	ECS_MAX,
+};
+
+// The maximum depth of the binary tree of a Bin ( The size of a Bin never exceeds 2^64 bytes )
+#define MAX_TREE_DEPTH 64
+
+// Blocks up to this size ( the smallest block, a pair and a quad ) are first looked for by scanning the states of their parents
+// The states of one level of the tree are stored next to each other, so a run of them can be checked at once
+#define SCAN_MAX_BLOCK_SIZE (MIN_BLOCK_SIZE * 4)
+#define SCAN_WINDOW_BYTES 64		// The number of bytes of Bin Metadata scanned for one allocation
+#define SCAN_CHUNK_BYTES 32			// The number of bytes of Bin Metadata a scan kernel checks at once
+
+// The number of pointers free_batch() handles under one lock acquisition
+#define FREE_BATCH_CHUNK 256
+
+// How finely the share of a Bin in use is measured ( See GetUsageRatio() )
+#define USAGE_RATIO_SCALE (1UL << 20)
+
+// The number of Bins the background thread goes through under one hold of the lock of an Arena, and so purges at most before releasing it ( See MaintainArena() )
+#define MAINTAIN_BIN_BATCH 64
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Guarded Pool ( MALLOC_GUARD_SAMPLE_RATE )
+// A few sampled allocations are each placed at the end of their own page, with a PROT_NONE guard page on both sides.
+// Slot i is the page at index (2 * i) + 1 of the pool, so guard pages have even indexes.
+// A freed slot is made PROT_NONE as well, so an overflow, an underflow or a use after free faults right away,
+// and the SIGSEGV handler prints where the block was allocated and freed.
+
+// The number of return addresses stored for the allocation and the release of a sampled block
+#define GUARD_STACK_DEPTH 16
+
+// The record of each slot is an array of GSO_MAX values
+enum GUARD_SLOT_OFFSET
+{
+	GSO_ADDR                  = 0, // 0 : The address of the block
+	GSO_SIZE,					// 1 : The size requested
+	GSO_STATE,					// 2 : GUARD_SLOT_STATE
+	GSO_ALLOC_DEPTH,			// 3 : The number of return addresses in GSO_ALLOC_STACK
+	GSO_FREE_DEPTH,				// 4 : The number of return addresses in GSO_FREE_STACK
+	GSO_ALLOC_STACK,			// 5 : Where the block was allocated
+	GSO_FREE_STACK            = GSO_ALLOC_STACK + GUARD_STACK_DEPTH, // Where the block was freed
+	GSO_MAX                   = GSO_FREE_STACK + GUARD_STACK_DEPTH,
+};
+
+enum GUARD_SLOT_STATE
+{
+	EGS_EMPTY                 = 0, // 0 : Never used
+	EGS_ALLOCATED,				// 1 : Holds a block in use
+	EGS_FREED,					// 2 : Holds a block freed ( Not accessible until reused )
+};
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Static probes
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// USDT probes of the provider "libmalloc", which perf, bpftrace and SystemTap attach to. Each is a nop until a tracer enables it.
+// Arenas are identified by the address of their first Metadata page, and Bins by their index in the Arena.
+//   alloc(size, alignment, ptr, arena)           bin_alloc(arena, bin, ptr, block size)
+//   free(ptr, arena, freed size)                 bin_alloc_batch(arena, bin, count, bytes)
+//   free_remote(ptr, arena, freed size)          bin_free(arena, bin, ptr, freed size)
+//   new_bin(arena, bin, address, pages)          new_arena(arena, index)
+// A freed size of ULONG_MAX means the pointer was not found. Without <sys/sdt.h>, or with NO_MALLOC_PROBES defined, the probes compile to nothing.
+#if !defined(NO_MALLOC_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define MALLOC_HAS_PROBES
+#endif
+#endif
+
+#ifdef MALLOC_HAS_PROBES
+#define MALLOC_PROBE2(name, a1, a2) STAP_PROBE2(libmalloc, name, a1, a2)
+#define MALLOC_PROBE3(name, a1, a2, a3) STAP_PROBE3(libmalloc, name, a1, a2, a3)
+#define MALLOC_PROBE4(name, a1, a2, a3, a4) STAP_PROBE4(libmalloc, name, a1, a2, a3, a4)
+#else
+#define MALLOC_PROBE2(name, a1, a2) do { (void)(a1); (void)(a2); } while (0)
+#define MALLOC_PROBE3(name, a1, a2, a3) do { (void)(a1); (void)(a2); (void)(a3); } while (0)
+#define MALLOC_PROBE4(name, a1, a2, a3, a4) do { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } while (0)
+#endif
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Instrumentation
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// While instrumentation is on, each Thread Arena counts where its time goes in a page of ASO_MAX counters.
+// Latencies are in cycles of the time stamp counter, and bucketed by powers of two. ( See RecordLatency() )
+
+// The number of buckets of a latency histogram ( The last one also counts anything slower )
+#define STATS_HISTOGRAM_BUCKETS 32
+
+enum ARENA_STATS_OFFSET
+{
+	ASO_MALLOC_HISTOGRAM      = 0, // malloc() latency
+	ASO_FREE_HISTOGRAM        = ASO_MALLOC_HISTOGRAM + STATS_HISTOGRAM_BUCKETS, // free() latency
+	ASO_LOCK_WAITS            = ASO_FREE_HISTOGRAM + STATS_HISTOGRAM_BUCKETS, // The number of times the lock of the Arena was waited for
+	ASO_LOCK_WAIT_CYCLES,		// The cycles spent waiting for it
+	ASO_NEW_BINS,				// The number of Bins created
+	ASO_MAP_CALLS,				// The number of mmap() and mprotect() calls made to create them
+	ASO_ALLOC_CALLS,			// The number of searches for free blocks
+	ASO_BINS_SCANNED,			// The number of Bins those searches went through
+	ASO_MAX,
+};
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Fragmentation analyzer
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// The analyzer walks the tree of each Bin and adds up what it finds in FSO_MAX counters. ( See AnalyzeBin() )
+// External fragmentation is 1 - (the largest free block / all free bytes).
+// Internal fragmentation is 1 - (requested bytes / rounded bytes) over all allocations made so far, because a block does not remember the size requested.
+
+// The number of block orders tracked ( Order i is a block of 2^i bytes )
+#define FRAG_ORDER_NUMS 64
+
+// The number of pages whose residency is read with one mincore() call
+#define FRAG_MINCORE_CHUNK 256
+
+enum FRAG_STATS_OFFSET
+{
+	FSO_BINS                  = 0, // The number of Bins analyzed
+	FSO_EMPTY_BINS,				// The number of those with no block allocated
+	FSO_TOTAL_BYTES,			// Their size
+	FSO_USED_BYTES,				// The bytes of the allocated blocks
+	FSO_FREE_BYTES,				// The bytes of the free blocks
+	FSO_LARGEST_FREE,			// The size of the largest free block
+	FSO_REQUESTED_BYTES,		// TMO_BIN_REQUESTED_BYTES
+	FSO_ROUNDED_BYTES,			// TMO_BIN_ROUNDED_BYTES
+	FSO_TOTAL_PAGES,			// The number of pages of the Bins
+	FSO_RESIDENT_PAGES,			// The number of those in memory
+	FSO_FREE_BY_ORDER,			// The number of free blocks of each order
+	FSO_ALLOCATED_BY_ORDER    = FSO_FREE_BY_ORDER + FRAG_ORDER_NUMS, // The number of blocks allocated at once ( EBBS_ALLOCATED_AT_ONCE ) of each order
+	FSO_MAX                   = FSO_ALLOCATED_BY_ORDER + FRAG_ORDER_NUMS,
+};
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Heap snapshot
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// A snapshot file is a header ( SSH_MAX values ) followed by records ( SSR_MAX values each ), all unsigned long int in the byte order of the machine.
+// Each Arena record is followed by the records of its Bins, and each Bin record by SSR_BIN_META_SIZE bytes of the Bin Metadata as it is in memory.
+// The last record is ESR_END. snapview reads these files. ( See snapview.c )
+
+#define SNAPSHOT_MAGIC 0x50414e53434c4c4dUL	// "MLLCSNAP" in little endian ( MALLOC_SNAPSHOT_MAGIC in malloc.h )
+#define SNAPSHOT_VERSION 1
+
+enum SNAPSHOT_HEADER
+{
+	SSH_MAGIC                 = 0, // SNAPSHOT_MAGIC
+	SSH_VERSION,				// SNAPSHOT_VERSION
+	SSH_PAGE_SIZE,				// The page size of the process
+	SSH_TIME,					// When the snapshot was taken ( Seconds since the Epoch )
+	SSH_PID,					// The process
+	SSH_MAX,
+};
+
+enum SNAPSHOT_RECORD
+{
+	SSR_TYPE                  = 0, // SNAPSHOT_RECORD_TYPE
+	SSR_ARENA_ADDR            = 1, // Arena : The address of its first Metadata page
+	SSR_ARENA_INDEX           = 2, // Arena : The index in Process Metadata
+	SSR_ARENA_BIN_NUMS        = 3, // Arena : The number of Bin records that follow
+	SSR_BIN_INDEX             = 1, // Bin : The index in the Arena
+	SSR_BIN_ADDR              = 2, // Bin : The start address
+	SSR_BIN_PAGE_NUMS         = 3, // Bin : The number of pages
+	SSR_BIN_MIN_BLOCK         = 4, // Bin : The size of the smallest block ( TMO_BIN_MIN_BLOCK )
+	SSR_BIN_USED_BYTES        = 5, // Bin : TMO_BIN_USED_BYTES
+	SSR_BIN_META_SIZE         = 6, // Bin : The size of the Bin Metadata that follows
+	SSR_MAX                   = 7,
+};
+
+enum SNAPSHOT_RECORD_TYPE
+{
+	ESR_END                   = 0,
+	ESR_ARENA,
+	ESR_BIN,
+};
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Shared Arenas
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// An explicit Arena in a shared memory file ( memfd or POSIX shared memory ), which each process maps wherever it likes.
+// The file is a header page, then the Metadata of a single Bin, then the Bin. ( The Bin is a power of two pages as any other )
+// The header only stores offsets from the start of the file, and the Metadata of a Bin only stores the states of its blocks,
+// so nothing in the file depends on where it is mapped. Processes pass the offsets of blocks to each other instead of copying them.
+// The header is SAO_MAX values, then the lock of the Arena ( Process-shared ) on a cache line of its own.
+// A process finds a Shared Arena by its first value. ( That of any other Arena is its own address, which is never SHARED_ARENA_MAGIC )
+// A Persistent Arena has the same layout in a regular file, which one process at a time has open, and which outlives it.
+// A file laid out with another SHARED_ARENA_VERSION is not taken for an Arena.
+
+#define SHARED_ARENA_MAGIC 0x414e455241444853UL	// "SHDARENA" in little endian
+#define SHARED_ARENA_VERSION 2UL	// The version of the layout of the file. Changed whenever the header or the Metadata change
+#define SHARED_ARENA_LOCK_OFFSET ROUND_UP_TO_CACHE_LINE(sizeof(unsigned long int) * SAO_MAX)
+#define MAX_PERSISTENT_ARENAS 64	// The number of Persistent Arenas a process can have open at once ( See g_pPersistentArenaList )
+
+enum SHARED_ARENA_OFFSET
+{
+	SAO_MAGIC                 = 0, // SHARED_ARENA_MAGIC once the header has been set up
+	SAO_FILE_SIZE,				// The size of the file
+	SAO_PAGE_SIZE,				// The page size the file was laid out with
+	SAO_META,					// The offset of the Metadata of the Bin
+	SAO_BIN,					// The offset of the Bin
+	SAO_BIN_PAGE_NUMS,			// The number of pages of the Bin
+	SAO_MIN_BLOCK,				// The size of the smallest block of the Bin ( MIN_BLOCK_SIZE. See LayOutSharedArena() )
+	SAO_USED_BYTES,				// The bytes of the blocks in use
+	SAO_SCAN_HINT,				// See AllocateNextToUsedBlock()
+	SAO_REQUESTED_BYTES,		// The bytes requested by all allocations so far ( For the fragmentation analyzer )
+	SAO_ROUNDED_BYTES,			// The bytes of the blocks those allocations were rounded up to
+	SAO_PERSISTENT,				// 1 : A Persistent Arena ( See OpenPersistentArena() ), 0 : A Shared Arena
+	SAO_ROOT,					// The offset of the root block ( 0 : None. See SetArenaRoot() )
+	SAO_VERSION,				// SHARED_ARENA_VERSION
+	SAO_PENDING_NODE,			// The node of the tree of the Bin being changed ( See JournalTreeChange() )
+	SAO_PENDING_OP,				// What is being done to it ( PENDING_TREE_OP )
+	SAO_MAX,
+};
+
+// The change to the tree of the Bin of a Persistent Arena that is under way, stored in its header while the tree is changed
+// If the process is killed in the middle of it, the change is undone or finished when the Arena is opened again. ( See RecoverPersistentArena() )
+enum PENDING_TREE_OP
+{
+	EPTO_NONE                 = 0,
+	EPTO_ALLOCATE,				// The node is being allocated at once
+	EPTO_FREE,					// The node is being freed
+};
+
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Functions
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Memory allocation is only managed with its own Arena
 // Allocate memory from its own Arena
-void* MallocFromThreadArena(size_t size, unsigned long int uiMinBlackSize_);
+void* MallocFromThreadArena(size_t size, unsigned long int uiMinBlackSize_, unsigned char* pThreadMetaData_);
+
+// Allocate several blocks of the same size from its own Arena
+unsigned long int MallocBatchFromThreadArena(size_t uiSize_, unsigned long int uiMinBlackSize_, unsigned long int uiNums_, void** pOut_, unsigned char* pThreadMetaData_, int bAvoidSparse_);
+
+// Allocate several blocks of the same size from one Bin of a Thread Arena, and update the counters of the Bin
+unsigned long int AllocateFromArenaBin(unsigned char* pMetaPage_, unsigned long int uiBinIndex_, unsigned long int uiActualBinIndex_, size_t uiSize_, unsigned long int uiMinBlackSize_, unsigned long int uiNums_, void** pOut_, unsigned char* pThreadMetaData_);
+
+// Find an empty large Bin of a Thread Arena of the size a new Bin for a request would have
+int SelectCachedLargeBin(unsigned char* pThreadMetaData_, unsigned long int uiPageNums_, unsigned char** ppMetaPage_, unsigned long int* pBinIndex_, unsigned long int* pActualBinIndex_);
+
+// Find the fullest Bin of a Thread Arena that can hold a request ( For EPP_BEST_FIT )
+int SelectFullestBin(unsigned char* pThreadMetaData_, size_t uiSize_, unsigned long int uiPageNums_, unsigned char** ppMetaPage_, unsigned long int* pBinIndex_, unsigned long int* pActualBinIndex_);
+
+// Choose the placement policy of all Arenas
+int SetPlacementPolicy(int iPolicy_);
 
 // Allocate memory from a Bin (Binary Search)
-unsigned char* AllocateFromBin(unsigned long int uiNode_, unsigned char* pBin_, unsigned char* pMeta_, size_t uiCurrentNodeSize_, size_t uiRequestedSize_, size_t uiBlockMinSize_, unsigned long int* pAllocSize_);
+unsigned char* AllocateFromBin(unsigned char* pBin_, unsigned char* pMeta_, size_t uiBinSize_, size_t uiRequestedSize_, size_t uiBlockMinSize_, unsigned long int* pScanHint_, unsigned long int* pAllocSize_);
+
+// Allocate several blocks of the same size from a Bin
+unsigned long int AllocateBatchFromBin(unsigned char* pBin_, unsigned char* pMeta_, size_t uiBinSize_, size_t uiRequestedSize_, size_t uiBlockMinSize_, unsigned long int uiNums_, void** pOut_, unsigned long int* pAllocSize_);
+
+// Get the size of the block a request is allocated at
+size_t GetBlockSize(size_t uiBinSize_, size_t uiRequestedSize_, size_t uiBlockMinSize_);
+
+// Find the first free block of a given size in a Bin (Binary Search)
+unsigned long int FindFreeBlock(unsigned char* pMeta_, size_t uiBinSize_, size_t uiTargetSize_, unsigned char* pPathState_, unsigned long int* pDepth_, size_t* pOffset_, int bPreferSplit_);
+
+// Allocate a free block whose buddy is in use (Scan)
+unsigned char* AllocateNextToUsedBlock(unsigned char* pBin_, unsigned char* pMeta_, size_t uiBinSize_, size_t uiTargetSize_, unsigned long int* pScanHint_, unsigned long int* pAllocSize_);
+
+// Find a node, in one level of the tree, that has one free child and one child in use
+unsigned long int FindFreeBuddyNode(unsigned char* pMeta_, unsigned long int uiFirstNode_, unsigned long int uiLastNode_, unsigned long int uiStartNode_);
+
+// Scan kernels for FindFreeBuddyNode(). Each checks SCAN_CHUNK_BYTES bytes of Bin Metadata.
+// Bit i of *pHighMask_ and *pLowMask_ is set if the high or low 4 bits of the ith byte are a node with one free child.
+void ScanFreeBuddiesScalar(const unsigned char* pMeta_, unsigned int* pHighMask_, unsigned int* pLowMask_);
+#if defined(__x86_64__) || defined(__i386__)
+void ScanFreeBuddiesSSE2(const unsigned char* pMeta_, unsigned int* pHighMask_, unsigned int* pLowMask_);
+void ScanFreeBuddiesAVX2(const unsigned char* pMeta_, unsigned int* pHighMask_, unsigned int* pLowMask_);
+#endif
 
 // Free memory from other Threads' Arenas
-unsigned long int FreeFromAllArenas(void *ptr);
+unsigned long int FreeFromAllArenas(void *ptr, unsigned char* pSkipArena_);
 
 // Free memory from its own Arena
 unsigned long int FreeFromThreadArena(void* ptr, unsigned char* pThreadMetaData_);
 
+// Free memory from a Bin of an Arena, and update the statistics of the Bin
+unsigned long int FreeFromArenaBin(void* ptr, unsigned char* pCurrentMeta_, unsigned long int uiBinIndex_, size_t uiSize_);
+
+// Find the Bin of a Thread Arena that contains ptr
+unsigned char* FindBinOfAddress(void* ptr, unsigned char* pThreadMetaData_, unsigned long int* pBinIndex_);
+
 // Free from a Bin (Binary Search)
-unsigned long int FreeFromBin(unsigned long int uiNode_, unsigned char* pAddrTobeFreed_, unsigned char* pBin_, unsigned char* pMeta_, size_t uiCurrentNodeSize_, size_t uiBlockMinSize_);
+unsigned long int FreeFromBin(unsigned char* pAddrTobeFreed_, unsigned char* pBin_, unsigned char* pMeta_, size_t uiBinSize_, size_t uiBlockMinSize_);
+
+// Free from a Bin when the size of the block is known
+unsigned long int FreeSizedFromBin(unsigned char* pAddrTobeFreed_, unsigned char* pBin_, unsigned char* pMeta_, size_t uiBinSize_, size_t uiBlockMinSize_, size_t uiSize_);
+
+// Find the node of the block allocated at once that starts at an address of a Bin, without changing the tree
+unsigned long int FindAllocatedNode(unsigned char* pAddr_, unsigned char* pBin_, unsigned char* pMeta_, size_t uiBinSize_, size_t uiBlockMinSize_, unsigned char* pPathState_, unsigned long int* pDepth_, size_t* pNodeSize_);
+
+// Set the states of the parents of a node again from those of their children, up to the root
+void RebuildParentStates(unsigned long int uiNode_, unsigned char* pMeta_);
+
+// Propagate the new state of a Node (Block) to its parents
+void UpdateParentStates(unsigned long int uiNode_, unsigned char ucNodeState_, unsigned char* pMeta_, unsigned char* pPathState_, unsigned long int uiDepth_);
+
+// Build the state transition tables of the binary tree
+void InitBuddyStateTables();
 
 // Print Malloc Statistics of each Arena
 void MallocStatsThreadArena(unsigned char* pThreadMetaData_);
 
+// Print the instrumentation counters of an Arena
+void MallocStatsArenaCounters(unsigned long int* pStats_);
+
+// Walk the tree of a Bin for the fragmentation analyzer
+void AnalyzeBin(unsigned char* pBin_, unsigned char* pMeta_, unsigned long int uiPageNums_, size_t uiBlockMinSize_, unsigned long int* pOut_);
+
+// Add the blocks under a Node of a Bin to the results of the fragmentation analyzer
+void AnalyzeBuddyNode(unsigned char* pMeta_, unsigned long int uiNode_, size_t uiNodeSize_, size_t uiBlockMinSize_, unsigned long int* pOut_);
+
+// Analyze a range of Bins of an Arena
+unsigned long int AnalyzeArena(unsigned char* pThreadMetaData_, unsigned long int uiFirstBin_, unsigned long int uiBinNums_, unsigned long int* pOut_);
+
+// Analyze all registered Thread Arenas
+unsigned long int AnalyzeAllArenas(unsigned long int* pOut_);
+
+// Print the results of the fragmentation analyzer
+void PrintFragmentation(const unsigned long int* pStats_);
+
+// Print the fragmentation report of the process, each Thread Arena and each Bin
+void DumpFragmentation();
+
+// Write a snapshot of all Thread Arenas to a file
+int WriteSnapshot(const char* pPath_);
+
+// Write the records of a Thread Arena to a snapshot file
+int WriteArenaSnapshot(int iFd_, unsigned char* pThreadMetaData_, unsigned long int uiArenaIndex_);
+
+// Write a buffer to a file completely
+int WriteAll(int iFd_, const void* pData_, unsigned long int uiSize_);
+
+// Tell whether the block at ptr is worth moving to consolidate the heap
+int GetDefragHint(void* ptr);
+
+// Tell whether the block at ptr is worth moving, if it was allocated from a given Thread Arena
+int GetArenaDefragHint(void* ptr, unsigned char* pThreadMetaData_);
+
+// Get the size of the block allocated at ptr from its Bin
+unsigned long int GetAllocatedBlockSize(unsigned char* ptr, unsigned char* pBin_, unsigned char* pMeta_, size_t uiBinSize_, size_t uiBlockMinSize_);
+
+// Sum the used bytes and the sizes of the Bins of a Thread Arena that are in use
+unsigned long int GetArenaUsage(unsigned char* pThreadMetaData_, unsigned long int* pUsedBytes_);
+
+// Get the share of bytes in use, in units of 1 / USAGE_RATIO_SCALE
+unsigned long int GetUsageRatio(unsigned long int uiUsedBytes_, unsigned long int uiBytes_);
+
+// Tell whether a Bin is used less than its Arena on average
+int IsSparseBin(unsigned long int uiUsedBytes_, unsigned long int uiBinBytes_, unsigned long int uiArenaUsedBytes_, unsigned long int uiArenaBytes_);
+
 // Allocates uiSize_ bytes. The returned memory address will be a multiple of uiAlignment_, which must be a power of two.
 void* AllocateMemory(size_t uiAlignment_, size_t uiSize_);
 
 // Free the memory space pointed to by ptr.
 void FreeMemory(void* ptr);
 
+// Free the memory space pointed to by ptr, which was allocated with uiSize_ bytes.
+void FreeMemorySized(void* ptr, size_t uiSize_);
+
+// Allocates uiNums_ blocks of uiSize_ bytes and stores their addresses in pOut_.
+unsigned long int AllocateMemoryBatch(size_t uiSize_, unsigned long int uiNums_, void** pOut_);
+
+// Allocates uiSize_ bytes away from sparse Bins, for a block being moved by defragmentation.
+void* AllocateMemoryDense(size_t uiSize_);
+
+// Free uiNums_ memory spaces pointed to by pPtrs_.
+void FreeMemoryBatch(void** pPtrs_, unsigned long int uiNums_);
+
+// Create an explicit Arena
+unsigned char* CreateUserArena();
+
+// Allocates uiSize_ bytes from an explicit Arena. The returned memory address will be a multiple of uiAlignment_, which must be a power of two.
+void* AllocateMemoryFromArena(unsigned char* pArena_, size_t uiAlignment_, size_t uiSize_);
+
+// Free memory allocated from an explicit Arena back to it
+unsigned long int FreeMemoryToArena(unsigned char* pArena_, void* ptr, size_t uiSize_);
+
+// Destroy an explicit Arena and release all the memory allocated from it at once
+void DestroyUserArena(unsigned char* pArena_);
+
+// Lay out a Shared Arena or a Persistent Arena of uiSize_ bytes in an empty file
+int LayOutSharedArena(int iFd_, size_t uiSize_, int bPersistent_);
+
+// Create a Shared Arena of uiSize_ bytes in a new shared memory file, and return the file descriptor
+int CreateSharedArena(const char* pName_, size_t uiSize_);
+
+// Map the Shared Arena ( or the Persistent Arena ) of a file into the calling process
+unsigned char* AttachSharedArena(int iFd_, int bPersistent_);
+
+// Open the Persistent Arena of a file, or create it
+unsigned char* OpenPersistentArena(const char* pPath_, size_t uiSize_);
+
+// Remember a block of a Shared Arena or a Persistent Arena as its root
+int SetArenaRoot(unsigned char* pArena_, void* ptr);
+
+// Get the root block of a Shared Arena or a Persistent Arena
+void* GetArenaRoot(unsigned char* pArena_);
+
+// Write a Shared Arena or a Persistent Arena back to its file
+int SyncSharedArena(unsigned char* pArena_);
+
+// Unmap a Shared Arena from the calling process
+void DetachSharedArena(unsigned char* pArena_);
+
+// Remember the descriptor of the file of a Persistent Arena the calling process has opened
+int AddPersistentArena(unsigned char* pArena_, int iFd_);
+
+// Forget a Persistent Arena the calling process closes, and return the descriptor of its file
+int RemovePersistentArena(unsigned char* pArena_);
+
+// Whether an explicit Arena is a Shared Arena
+int IsSharedArena(unsigned char* pArena_);
+
+// Allocates uiSize_ bytes from a Shared Arena. The returned memory address will be a multiple of uiAlignment_.
+void* AllocateFromSharedArena(unsigned char* pArena_, size_t uiAlignment_, size_t uiSize_);
+
+// Free memory allocated from a Shared Arena back to it
+unsigned long int FreeToSharedArena(unsigned char* pArena_, void* ptr, size_t uiSize_);
+
+// Allocate a block from the Bin of a Persistent Arena, journaling the change to its tree
+unsigned char* AllocateFromPersistentBin(unsigned char* pArena_, size_t uiRequestedSize_, size_t uiBlockMinSize_, unsigned long int* pAllocSize_);
+
+// Free a block to the Bin of a Persistent Arena, journaling the change to its tree
+unsigned long int FreeToPersistentBin(unsigned char* pArena_, unsigned char* pAddr_);
+
+// Store the change to the tree of the Bin of a Persistent Arena that is under way in its header ( EPTO_NONE : It is done )
+void JournalTreeChange(unsigned long int* pHeader_, unsigned long int uiNode_, unsigned long int uiOp_);
+
+// Undo or finish the change to the tree of a Persistent Arena its last process was killed in the middle of
+void RecoverPersistentArena(unsigned char* pArena_);
+
+// Analyze the Bin of a Shared Arena
+unsigned long int AnalyzeSharedArena(unsigned char* pArena_, unsigned long int uiFirstBin_, unsigned long int uiBinNums_, unsigned long int* pOut_);
+
 // Print malloc statistics
 void MallocStats();
 
+// Set up the Guarded Pool and the SIGSEGV handler that reports faults in it
+void InitGuardedPool();
+
+// Allocate a sampled block from the Guarded Pool
+void* AllocateGuarded(size_t uiAlignment_, size_t uiSize_);
+
+// Free a block of the Guarded Pool
+int FreeGuarded(void* ptr);
+
+// Get the size requested for a block of the Guarded Pool
+size_t GetGuardedSize(void* ptr);
+
+// Get the number of allocations until the next sampled one
+unsigned long int NextGuardCountdown();
+
+// Print what a fault, an invalid free or a double free in the Guarded Pool hit
+void ReportGuardError(const char* pError_, unsigned long int uiAddr_, unsigned long int* pSlot_);
+
+// Copy a string to a buffer, and return where it ends ( Async-signal-safe )
+char* AppendString(char* pOut_, const char* pString_);
+
+// Write a number in base 10 or 16 to a buffer, and return where it ends ( Async-signal-safe )
+char* AppendNumber(char* pOut_, unsigned long int uiValue_, unsigned int uiBase_);
+
+// SIGSEGV handler for the Guarded Pool
+void GuardFaultHandler(int iSignal_, siginfo_t* pInfo_, void* pContext_);
+
+// Set the same state value to Nodes (Blocks) next to each other in one level of the tree
+void SetNodeStateRange(unsigned char* pMeta_, unsigned long int uiFirstNode_, unsigned long int uiNodeNums_, unsigned char ucState_);
+
 // Get the state value of a Node (Block)
 unsigned char GetNodeState(unsigned long int uiNodeIndex_, unsigned char* pMeta_);
 
@@ -152,30 +717,132 @@ void SetNodeState(unsigned long int uiNodeIndex_, unsigned char* pMeta_, unsigne
 
 // To avoid allocating a new page for every new Bin
 // Find available space among Metadata page pool, which are already in use, but has some space.
-unsigned char* GetLargeBinMetaPage(unsigned long int uiMetaSize_);
+unsigned char* GetLargeBinMetaPage(unsigned char* pThreadMetaData_, unsigned long int uiMetaSize_);
 
 // Get the ith page of the Process Metadata
 unsigned char* GetProcessMetaPage(unsigned long int uiPageIndex);
 
-// Get the last page of the Process Metadata
-unsigned char* GetLastProcessMetaPage();
-
-// Create a new metadata page for the Thread Arena
-unsigned char* CreateNewProcessMetaPage(unsigned char* pNew_);
+// Install the ith page of the Process Metadata
+unsigned char* CreateNewProcessMetaPage(unsigned long int uiPageIndex_);
 
 // Create a new thread Arena
 unsigned char* CreateNewThreadArena();
 
+// Take over a Thread Arena whose threads have all exited
+unsigned char* AdoptOrphanedArena();
+
+// Create Bins in a Thread Arena ahead of the allocations that would create them
+unsigned long int PrewarmArena(unsigned char* pThreadMetaData_, unsigned long int uiBinNums_, unsigned long int uiRequestPageNums_, int bPopulate_);
+
+// Create the Arena of the calling thread and Bins in it ahead of its first allocations
+unsigned long int PrewarmMemory(unsigned long int uiBinNums_, size_t uiSize_, int bPopulate_);
+
+// Create the Thread Arena of a CPU ( EAM_PER_CPU )
+unsigned char* CreateNewCpuArena(unsigned long int uiCpu_);
+
+// Add a new Thread Arena to Process Metadata and set up its lock
+sem_t* RegisterArena(unsigned char* pThreadMetaData_);
+
+// Get the ith registered Thread Arena
+unsigned char* GetRegisteredArena(unsigned long int uiArenaIndex_);
+
+// Get the Thread Arena the calling thread allocates memory from
+unsigned char* GetCurrentArena();
+
+// Acquire the lock of a Thread Arena
+sem_t* LockArena(unsigned char* pThreadMetaData_);
+
+// Assign a Thread Arena of the pool to the calling thread ( EAM_POOL )
+unsigned char* AssignPoolArena(unsigned char* pOldArena_);
+
+// Find the Thread Arena with the fewest threads
+unsigned char* GetLeastLoadedArena(unsigned char* pSkipArena_);
+
+// Move the calling thread to another Thread Arena of the pool under sustained lock contention ( EAM_POOL )
+void RebalancePoolArena();
+
+// Detach an exiting thread from its Thread Arena
+void ReleaseThreadArena(void* pArena_);
+
+// Block on the lock of a Thread Arena
+int WaitArenaLock(unsigned char* pThreadMetaData_, sem_t* pLock_);
+
+// Get the instrumentation counters of an Arena
+unsigned long int* GetArenaStats(unsigned char* pThreadMetaData_);
+
+// Add one to an instrumentation counter of an Arena
+void CountArenaEvent(unsigned char* pThreadMetaData_, unsigned long int uiCounter_);
+
+// Add a latency to a histogram
+void RecordLatency(unsigned long int* pHistogram_, unsigned long int uiStartCycles_);
+
+// Read the time stamp counter
+unsigned long int ReadCycles();
+
+// Turn instrumentation on or off
+int SetInstrumentation(int bEnable_);
+
+// Add up the instrumentation counters of all Thread Arenas
+void SumArenaStats(unsigned long int* pOut_);
+
+// Start the background thread
+void StartBackgroundThread();
+
+// Stop the background thread and wait for it
+void StopBackgroundThread();
+
+// Forget the background thread in a child process
+void ForgetBackgroundThread();
+
+// The loop of the background thread
+void* BackgroundThreadMain(void* pArg_);
+
+// One round of background work on a Thread Arena ( Purging and provisioning Bins )
+void MaintainArena(unsigned char* pThreadMetaData_, int bOrphaned_, unsigned long int* pLargeCacheBytes_, unsigned long int* pOverflowBytes_);
+
+// Create empty Bins for small requests until a Thread Arena has g_uiBinReserveNums of them, without a system call
+unsigned long int CreateReserveBins(unsigned char* pThreadMetaData_, unsigned long int uiEmptyBins_);
+
+// Get the most pages CreateNewBin() takes for a Bin of uiPageNums_ pages for small requests
+unsigned long int GetNewBinPageBound(unsigned long int uiPageNums_);
+
+// Get where the accessible part of the reserved address space of a Thread Arena should end, for uiBytes_ more
+unsigned long int GetArenaPagesAhead(unsigned char* pThreadMetaData_, unsigned long int uiBytes_);
+
+// Make pages of the reserved address space of a Thread Arena accessible without its lock
+int CommitArenaPagesAhead(unsigned char* pThreadMetaData_, unsigned long int uiStart_, unsigned long int uiEnd_);
+
 // Get the ith page of the Thread Arena Metadata
-unsigned char* GetThreadMetaPage(unsigned long int uiPageIndex);
+unsigned char* GetThreadMetaPage(unsigned char* pThreadMetaData_, unsigned long int uiPageIndex);
 
 // Get the last page of the Thread Arena Metadata
-unsigned char* GetLastThreadMetaPage();
+unsigned char* GetLastThreadMetaPage(unsigned char* pThreadMetaData_);
 
 // Create a new metadata page for the Thread Arena
-unsigned char* CreateNewThreadMeta(unsigned char* pNew_);
+unsigned char* CreateNewThreadMeta(unsigned char* pThreadMetaData_, unsigned char* pNew_);
+
+// Get the size of the smallest block a new Bin tracks
+unsigned long int GetBinMinBlockSize(unsigned long int uiRequestPageNums_);
+
+// Get the number of pages of the next Bin of a Thread Arena
+unsigned long int GetNewBinPageNums(unsigned char* pThreadMetaData_, unsigned long int uiRequestPageNums_);
 
 // Create a new Bin
-unsigned char* CreateNewBin(unsigned long int uiPageNums_, unsigned long int uiMetaPagesNums_);
+unsigned char* CreateNewBin(unsigned char* pThreadMetaData_, unsigned long int uiRequestPageNums_, int bPopulate_);
+
+// Commit pages from the address space reserved for a Thread Arena
+unsigned char* CommitArenaPages(unsigned char* pThreadMetaData_, unsigned long int uiPageNums_, int bPopulate_);
+
+// Fault in pages by writing to each of them
+void PopulatePages(unsigned char* pPages_, unsigned long int uiPageNums_);
+
+// Whether ptr can be in a Bin of a Thread Arena
+int IsInArenaRange(void* ptr, unsigned char* pThreadMetaData_);
+
+// Get the number of pages of a new Bin for a request
+unsigned long int GetBinPageNums(size_t uiSize_);
+
+// Get the number of pages needed to store the Metadata of a new Bin
+unsigned long int GetBinMetaPageNums(unsigned long int uiPageNums_, unsigned long int uiMinBlockSize_);
 
 
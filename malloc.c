@@ -1,10 +1,78 @@
 #include "malloc.h"
 #include "core.h"
 #include <string.h>
+#include <limits.h>
+
+#ifdef FIXED_PAGE_SIZE
+// The generic build linked into this library with its symbols prefixed ( See Makefile )
+void* generic_malloc(size_t size);
+void* generic_memalign(size_t alignment, size_t size);
+void generic_free(void* ptr);
+void generic_free_sized(void* ptr, size_t size);
+void generic_free_aligned_sized(void* ptr, size_t alignment, size_t size);
+void generic_malloc_stats(void);
+size_t generic_malloc_batch(size_t size, size_t n, void** out);
+void generic_free_batch(void** ptrs, size_t n);
+void* generic_arena_create(void);
+void* generic_arena_malloc(void* arena, size_t size);
+void* generic_arena_memalign(void* arena, size_t alignment, size_t size);
+int generic_arena_free(void* arena, void* ptr, size_t size);
+void generic_arena_destroy(void* arena);
+int generic_arena_create_shared(const char* name, size_t size);
+void* generic_arena_attach(int fd);
+size_t generic_arena_offset(void* arena, const void* ptr);
+void* generic_arena_address(void* arena, size_t offset);
+void* generic_arena_open(const char* path, size_t size);
+int generic_arena_set_root(void* arena, void* ptr);
+void* generic_arena_get_root(void* arena);
+int generic_arena_sync(void* arena);
+size_t generic_malloc_prewarm(size_t nbins, size_t size, int populate);
+int generic_malloc_instrument(int enable);
+void generic_malloc_instrument_read(struct malloc_instrument_stats* stats);
+int generic_malloc_frag_bin(void* arena, size_t bin, struct malloc_frag_stats* stats);
+int generic_malloc_frag_arena(void* arena, struct malloc_frag_stats* stats);
+void generic_malloc_frag_process(struct malloc_frag_stats* stats);
+void generic_malloc_frag_dump(void);
+int generic_malloc_snapshot(const char* path);
+int generic_malloc_defrag_hint(void* ptr);
+void* generic_malloc_defrag(size_t size);
+int generic_malloc_placement(int policy);
+
+// Go to the generic build if the system does not match this build ( realloc() and calloc() go through malloc() and free() )
+#define FALLBACK_TO_GENERIC(call) if (g_iUseGenericBuild) return generic_##call
+#define FALLBACK_TO_GENERIC_VOID(call) if (g_iUseGenericBuild) { generic_##call; return; }
+#else
+#define FALLBACK_TO_GENERIC(call)
+#define FALLBACK_TO_GENERIC_VOID(call)
+#endif
+
+// Copy the results of the fragmentation analyzer into stats
+void CopyFragStats(const unsigned long int* pStats_, struct malloc_frag_stats* stats)
+{
+	stats->bins = pStats_[FSO_BINS];
+	stats->empty_bins = pStats_[FSO_EMPTY_BINS];
+	stats->total_bytes = pStats_[FSO_TOTAL_BYTES];
+	stats->used_bytes = pStats_[FSO_USED_BYTES];
+	stats->free_bytes = pStats_[FSO_FREE_BYTES];
+	stats->largest_free = pStats_[FSO_LARGEST_FREE];
+	stats->requested_bytes = pStats_[FSO_REQUESTED_BYTES];
+	stats->rounded_bytes = pStats_[FSO_ROUNDED_BYTES];
+	stats->total_pages = pStats_[FSO_TOTAL_PAGES];
+	stats->resident_pages = pStats_[FSO_RESIDENT_PAGES];
+	for (unsigned long int i = 0; i < MALLOC_FRAG_ORDERS && i < FRAG_ORDER_NUMS; ++i)
+	{
+		stats->free_blocks[i] = pStats_[FSO_FREE_BY_ORDER + i];
+		stats->allocated_blocks[i] = pStats_[FSO_ALLOCATED_BY_ORDER + i];
+	}
+	
+	stats->external_fragmentation = stats->free_bytes ? 1.0 - ((double)stats->largest_free / stats->free_bytes) : 0.0;
+	stats->internal_fragmentation = stats->rounded_bytes ? 1.0 - ((double)stats->requested_bytes / stats->rounded_bytes) : 0.0;
+}
 
 // Allocates size bytes
 void* malloc(size_t size)
 {
+	FALLBACK_TO_GENERIC(malloc(size));
 	return AllocateMemory(MIN_MEMORY_ALIGNMENT, size);
 }
 
@@ -12,9 +80,24 @@ void* malloc(size_t size)
 // Free the memory space pointed to by ptr.
 void free(void* ptr)
 {
+	FALLBACK_TO_GENERIC_VOID(free(ptr));
 	FreeMemory(ptr);
 }
 
+// Free the memory space pointed to by ptr, which was allocated with size bytes.
+void free_sized(void* ptr, size_t size)
+{
+	FALLBACK_TO_GENERIC_VOID(free_sized(ptr, size));
+	FreeMemorySized(ptr, size);
+}
+
+// Free the memory space pointed to by ptr, which was allocated with size bytes aligned to alignment.
+void free_aligned_sized(void* ptr, size_t alignment, size_t size)
+{
+	FALLBACK_TO_GENERIC_VOID(free_aligned_sized(ptr, alignment, size));
+	FreeMemorySized(ptr, (alignment > size) ? alignment : size);
+}
+
 // Change the size of the memory block pointed to by ptr to size bytes.
 void* realloc(void *ptr, size_t size)
 {
@@ -30,7 +113,12 @@ void* realloc(void *ptr, size_t size)
 		void* pNewAddr = malloc(size);
 		if (pNewAddr)
 		{	
-			memcpy(pNewAddr, ptr, size);
+			// A block of the Guarded Pool ends right before a guard page
+			size_t uiCopySize = GetGuardedSize(ptr);
+			if (0 == uiCopySize || uiCopySize > size)
+				uiCopySize = size;
+			
+			memcpy(pNewAddr, ptr, uiCopySize);
 			free(ptr);
 		}
 		else
@@ -56,6 +144,7 @@ void* calloc(size_t nmemb, size_t size)
 // Allocates size bytes. The returned memory address will be a multiple of alignment, which must be a power of two.
 void* memalign(size_t alignment, size_t size)
 {
+	FALLBACK_TO_GENERIC(memalign(alignment, size));
 	if (alignment < MIN_MEMORY_ALIGNMENT ||
 		(alignment & (alignment - 1)))
 		return NULL;
@@ -66,5 +155,243 @@ void* memalign(size_t alignment, size_t size)
 // Print malloc statistics
 void malloc_stats(void)
 {
+	FALLBACK_TO_GENERIC_VOID(malloc_stats());
 	MallocStats();
-}
\ No newline at end of file
+}
+
+// Allocate n blocks of size bytes each and store their addresses in out.
+size_t malloc_batch(size_t size, size_t n, void** out)
+{
+	FALLBACK_TO_GENERIC(malloc_batch(size, n, out));
+	if (NULL == out)
+		return 0;
+	
+	return AllocateMemoryBatch(size, n, out);
+}
+
+// Free the n memory spaces pointed to by ptrs.
+void free_batch(void** ptrs, size_t n)
+{
+	FALLBACK_TO_GENERIC_VOID(free_batch(ptrs, n));
+	FreeMemoryBatch(ptrs, n);
+}
+
+// Create an arena that is not tied to any thread.
+void* arena_create(void)
+{
+	FALLBACK_TO_GENERIC(arena_create());
+	return CreateUserArena();
+}
+
+// Allocates size bytes from arena.
+void* arena_malloc(void* arena, size_t size)
+{
+	FALLBACK_TO_GENERIC(arena_malloc(arena, size));
+	return AllocateMemoryFromArena((unsigned char*)arena, MIN_MEMORY_ALIGNMENT, size);
+}
+
+// Allocates size bytes from arena. The returned memory address will be a multiple of alignment, which must be a power of two.
+void* arena_memalign(void* arena, size_t alignment, size_t size)
+{
+	FALLBACK_TO_GENERIC(arena_memalign(arena, alignment, size));
+	if (alignment < MIN_MEMORY_ALIGNMENT ||
+		(alignment & (alignment - 1)))
+		return NULL;
+	
+	return AllocateMemoryFromArena((unsigned char*)arena, alignment, size);
+}
+
+// Free the memory space pointed to by ptr back to arena.
+int arena_free(void* arena, void* ptr, size_t size)
+{
+	FALLBACK_TO_GENERIC(arena_free(arena, ptr, size));
+	if (ULONG_MAX == FreeMemoryToArena((unsigned char*)arena, ptr, size))
+		return -1;
+	
+	return 0;
+}
+
+// Release all the memory allocated from arena at once, and destroy arena.
+void arena_destroy(void* arena)
+{
+	FALLBACK_TO_GENERIC_VOID(arena_destroy(arena));
+	DestroyUserArena((unsigned char*)arena);
+}
+
+// Create an arena of size bytes in a new shared memory file. Return the file descriptor.
+int arena_create_shared(const char* name, size_t size)
+{
+	FALLBACK_TO_GENERIC(arena_create_shared(name, size));
+	return CreateSharedArena(name, size);
+}
+
+// Map the shared arena of the file fd into the calling process.
+void* arena_attach(int fd)
+{
+	FALLBACK_TO_GENERIC(arena_attach(fd));
+	return AttachSharedArena(fd, 0);
+}
+
+// The offset of ptr in the shared arena arena.
+size_t arena_offset(void* arena, const void* ptr)
+{
+	FALLBACK_TO_GENERIC(arena_offset(arena, ptr));
+	return (const unsigned char*)ptr - (unsigned char*)arena;
+}
+
+// The address of the block at offset in the shared arena arena.
+void* arena_address(void* arena, size_t offset)
+{
+	FALLBACK_TO_GENERIC(arena_address(arena, offset));
+	return (unsigned char*)arena + offset;
+}
+
+// Open the persistent arena of the file at path, or create it with size bytes.
+void* arena_open(const char* path, size_t size)
+{
+	FALLBACK_TO_GENERIC(arena_open(path, size));
+	return OpenPersistentArena(path, size);
+}
+
+// Make ptr the root block of a shared or persistent arena.
+int arena_set_root(void* arena, void* ptr)
+{
+	FALLBACK_TO_GENERIC(arena_set_root(arena, ptr));
+	return SetArenaRoot((unsigned char*)arena, ptr);
+}
+
+// The root block of a shared or persistent arena.
+void* arena_get_root(void* arena)
+{
+	FALLBACK_TO_GENERIC(arena_get_root(arena));
+	return GetArenaRoot((unsigned char*)arena);
+}
+
+// Write a shared or persistent arena back to its file.
+int arena_sync(void* arena)
+{
+	FALLBACK_TO_GENERIC(arena_sync(arena));
+	return SyncSharedArena((unsigned char*)arena);
+}
+
+// Create the arena of the calling thread if it does not have one yet, and nbins bins that hold at least size bytes each.
+size_t malloc_prewarm(size_t nbins, size_t size, int populate)
+{
+	FALLBACK_TO_GENERIC(malloc_prewarm(nbins, size, populate));
+	return PrewarmMemory(nbins, size, populate);
+}
+
+// Turn instrumentation on or off.
+int malloc_instrument(int enable)
+{
+	FALLBACK_TO_GENERIC(malloc_instrument(enable));
+	return SetInstrumentation(enable);
+}
+
+// Add up the instrumentation counters of all arenas into stats.
+void malloc_instrument_read(struct malloc_instrument_stats* stats)
+{
+	FALLBACK_TO_GENERIC_VOID(malloc_instrument_read(stats));
+	if (NULL == stats)
+		return;
+	
+	unsigned long int uiSums[ASO_MAX];
+	SumArenaStats(uiSums);
+	for (unsigned long int i = 0; i < MALLOC_HISTOGRAM_BUCKETS && i < STATS_HISTOGRAM_BUCKETS; ++i)
+	{
+		stats->malloc_latency[i] = uiSums[ASO_MALLOC_HISTOGRAM + i];
+		stats->free_latency[i] = uiSums[ASO_FREE_HISTOGRAM + i];
+	}
+	
+	stats->lock_waits = uiSums[ASO_LOCK_WAITS];
+	stats->lock_wait_cycles = uiSums[ASO_LOCK_WAIT_CYCLES];
+	stats->new_bins = uiSums[ASO_NEW_BINS];
+	stats->map_calls = uiSums[ASO_MAP_CALLS];
+	stats->alloc_calls = uiSums[ASO_ALLOC_CALLS];
+	stats->bins_scanned = uiSums[ASO_BINS_SCANNED];
+}
+
+// Analyze the bin of index bin of arena.
+int malloc_frag_bin(void* arena, size_t bin, struct malloc_frag_stats* stats)
+{
+	FALLBACK_TO_GENERIC(malloc_frag_bin(arena, bin, stats));
+	unsigned char* pArena = arena ? (unsigned char*)arena : GetCurrentArena();
+	if (NULL == pArena || NULL == stats)
+		return -1;
+	
+	unsigned long int uiStats[FSO_MAX];
+	memset(uiStats, 0, sizeof(uiStats));
+	if (0 == AnalyzeArena(pArena, bin, 1, uiStats))
+		return -1;
+	
+	CopyFragStats(uiStats, stats);
+	return 0;
+}
+
+// Analyze all the bins of arena.
+int malloc_frag_arena(void* arena, struct malloc_frag_stats* stats)
+{
+	FALLBACK_TO_GENERIC(malloc_frag_arena(arena, stats));
+	unsigned char* pArena = arena ? (unsigned char*)arena : GetCurrentArena();
+	if (NULL == pArena || NULL == stats)
+		return -1;
+	
+	unsigned long int uiStats[FSO_MAX];
+	memset(uiStats, 0, sizeof(uiStats));
+	AnalyzeArena(pArena, 0, ULONG_MAX, uiStats);
+	
+	CopyFragStats(uiStats, stats);
+	return 0;
+}
+
+// Analyze all the bins of all the arenas except the explicit ones.
+void malloc_frag_process(struct malloc_frag_stats* stats)
+{
+	FALLBACK_TO_GENERIC_VOID(malloc_frag_process(stats));
+	if (NULL == stats)
+		return;
+	
+	unsigned long int uiStats[FSO_MAX];
+	memset(uiStats, 0, sizeof(uiStats));
+	AnalyzeAllArenas(uiStats);
+	
+	CopyFragStats(uiStats, stats);
+}
+
+// Print the fragmentation report of the process, of each arena and of each bin to stderr.
+void malloc_frag_dump(void)
+{
+	FALLBACK_TO_GENERIC_VOID(malloc_frag_dump());
+	DumpFragmentation();
+}
+
+// Write the bins and the block state trees of all the arenas except the explicit ones to the file at path.
+int malloc_snapshot(const char* path)
+{
+	FALLBACK_TO_GENERIC(malloc_snapshot(path));
+	if (NULL == path)
+		return -1;
+	
+	return WriteSnapshot(path);
+}
+
+// Tell whether the block at ptr is worth moving to consolidate the heap.
+int malloc_defrag_hint(void* ptr)
+{
+	FALLBACK_TO_GENERIC(malloc_defrag_hint(ptr));
+	return GetDefragHint(ptr);
+}
+
+// Allocate size bytes away from sparse bins, for an object moved after malloc_defrag_hint().
+void* malloc_defrag(size_t size)
+{
+	FALLBACK_TO_GENERIC(malloc_defrag(size));
+	return AllocateMemoryDense(size);
+}
+
+// Choose where all arenas place new blocks.
+int malloc_placement(int policy)
+{
+	FALLBACK_TO_GENERIC(malloc_placement(policy));
+	return SetPlacementPolicy(policy);
+}
@@ -1,5 +1,26 @@
 #include <stddef.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The number of buckets of each latency histogram of struct malloc_instrument_stats
+#define MALLOC_HISTOGRAM_BUCKETS 32
+
+// Counters added up over all arenas while instrumentation is on ( See malloc_instrument() )
+// Latencies are in cycles of the time stamp counter. Bucket i counts the calls that took [2^i, 2^(i+1)) cycles.
+struct malloc_instrument_stats
+{
+	unsigned long malloc_latency[MALLOC_HISTOGRAM_BUCKETS];
+	unsigned long free_latency[MALLOC_HISTOGRAM_BUCKETS];
+	unsigned long lock_waits;			// The number of times an arena lock was waited for
+	unsigned long lock_wait_cycles;		// The cycles spent waiting for arena locks
+	unsigned long new_bins;				// The number of bins created
+	unsigned long map_calls;			// The number of mmap() and mprotect() calls made to create them
+	unsigned long alloc_calls;			// The number of searches for free blocks
+	unsigned long bins_scanned;			// The number of bins those searches went through
+};
+
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Functions
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -12,6 +33,13 @@ void* memalign(size_t alignment, size_t size);
 // Free the memory space pointed to by ptr.
 void free(void* ptr); 
 
+// Free the memory space pointed to by ptr, which was allocated with size bytes.
+// The block is found from its size instead of being searched for. A wrong size is still handled, only more slowly.
+void free_sized(void* ptr, size_t size);
+
+// Free the memory space pointed to by ptr, which was allocated with size bytes aligned to alignment.
+void free_aligned_sized(void* ptr, size_t alignment, size_t size);
+
 // Allocate memory for an array of nmemb elements of size bytes each.
 void* calloc(size_t nmemb, size_t size);
 
@@ -19,4 +47,133 @@ void* calloc(size_t nmemb, size_t size);
 void* realloc(void *ptr, size_t size);
 
 // Print malloc statistics
-void malloc_stats(void); 
\ No newline at end of file
+void malloc_stats(void);
+
+// Allocate n blocks of size bytes each and store their addresses in out.
+// Return the number of blocks allocated. If it is less than n, the rest of out is left untouched.
+size_t malloc_batch(size_t size, size_t n, void** out);
+
+// Free the n memory spaces pointed to by ptrs.
+void free_batch(void** ptrs, size_t n);
+
+// Create an arena that is not tied to any thread. Return NULL on failure.
+void* arena_create(void);
+
+// Allocates size bytes from arena.
+void* arena_malloc(void* arena, size_t size);
+
+// Allocates size bytes from arena. The returned memory address will be a multiple of alignment, which must be a power of two.
+void* arena_memalign(void* arena, size_t alignment, size_t size);
+
+// Free the memory space pointed to by ptr back to arena. size is the size it was allocated with ( The larger of the size and
+// the alignment for arena_memalign() ), or 0 if it is not known. Return -1 if ptr was not allocated from arena.
+int arena_free(void* arena, void* ptr, size_t size);
+
+// Release all the memory allocated from arena at once, and destroy arena.
+// Memory allocated from arena must not be passed to free() or realloc().
+void arena_destroy(void* arena);
+
+// Create an arena of size bytes in a new shared memory file, which cooperating processes map with arena_attach().
+// name is the name of a POSIX shared memory object to create ( See shm_open() ), or NULL for an anonymous file ( See memfd_create() ).
+// Return the file descriptor, or -1 on failure. The arena never grows.
+// Blocks as small as 8 bytes are tracked whatever the size, so the block states take another eighth of size in the file.
+int arena_create_shared(const char* name, size_t size);
+
+// Map the shared arena of the file fd into the calling process. Return the arena, or NULL if fd is not a shared arena.
+// arena_malloc(), arena_memalign() and arena_free() work on it as on any arena, from any process. arena_destroy() only unmaps it.
+// Each process maps the file at its own address, so processes pass blocks to each other as offsets ( See arena_offset() ).
+void* arena_attach(int fd);
+
+// The offset of ptr in the shared arena arena, which is the same in every process.
+size_t arena_offset(void* arena, const void* ptr);
+
+// The address of the block at offset in the shared arena arena, in the calling process.
+void* arena_address(void* arena, size_t offset);
+
+// Open the persistent arena of the file at path, or create it with size bytes if the file does not exist. Return NULL on failure,
+// if another process has it open, or if 64 of them are open in the process already. Blocks allocated from it are still there when a process opens the file again.
+// arena_destroy() closes it without freeing them.
+void* arena_open(const char* path, size_t size);
+
+// Make ptr, a block of a shared or persistent arena ( NULL : none ), the root of arena. Return -1 on failure.
+int arena_set_root(void* arena, void* ptr);
+
+// The root of a shared or persistent arena, at its address in the calling process. NULL if there is none.
+void* arena_get_root(void* arena);
+
+// Write a shared or persistent arena back to its file and wait for it. Return -1 on failure.
+int arena_sync(void* arena);
+
+// Create the arena of the calling thread if it does not have one yet, and nbins bins that hold at least size bytes each.
+// If populate is not 0, their pages are faulted in as well. Return the number of bins created.
+size_t malloc_prewarm(size_t nbins, size_t size, int populate);
+
+// The number of block orders of struct malloc_frag_stats ( Order i is a block of 2^i bytes )
+#define MALLOC_FRAG_ORDERS 64
+
+// What the fragmentation analyzer found in a set of bins ( See malloc_frag_bin() )
+struct malloc_frag_stats
+{
+	unsigned long bins;				// The number of bins analyzed
+	unsigned long empty_bins;		// The number of those with no block allocated
+	unsigned long total_bytes;		// Their size
+	unsigned long used_bytes;		// The bytes of the allocated blocks
+	unsigned long free_bytes;		// The bytes of the free blocks
+	unsigned long largest_free;		// The size of the largest free block
+	unsigned long requested_bytes;	// The bytes requested by all allocations from these bins so far
+	unsigned long rounded_bytes;	// The bytes of the blocks those allocations were rounded up to
+	unsigned long total_pages;		// The number of pages of the bins
+	unsigned long resident_pages;	// The number of those in memory ( mincore() )
+	unsigned long free_blocks[MALLOC_FRAG_ORDERS];		// The number of free blocks of each order
+	unsigned long allocated_blocks[MALLOC_FRAG_ORDERS];	// The number of allocated blocks of each order
+	double external_fragmentation;	// 1 - largest_free / free_bytes
+	double internal_fragmentation;	// 1 - requested_bytes / rounded_bytes
+};
+
+// Turn instrumentation on ( enable is not 0 ) or off. Counters gathered so far are kept. Return the previous setting.
+// malloc_stats() prints the counters of each arena.
+int malloc_instrument(int enable);
+
+// Add up the instrumentation counters of all arenas into stats.
+void malloc_instrument_read(struct malloc_instrument_stats* stats);
+
+// Analyze the bin of index bin of arena ( NULL : the arena of the calling thread ). Return -1 if there is no such bin.
+int malloc_frag_bin(void* arena, size_t bin, struct malloc_frag_stats* stats);
+
+// Analyze all the bins of arena ( NULL : the arena of the calling thread ). Return -1 if there is no such arena.
+int malloc_frag_arena(void* arena, struct malloc_frag_stats* stats);
+
+// Analyze all the bins of all the arenas except the explicit ones.
+void malloc_frag_process(struct malloc_frag_stats* stats);
+
+// Print the fragmentation report of the process, of each arena and of each bin to stderr.
+// MALLOC_FRAG_DUMP=1 prints it when the process exits.
+void malloc_frag_dump(void);
+
+// The first 8 bytes of a file written by malloc_snapshot() ( SNAPSHOT_MAGIC in core.h )
+#define MALLOC_SNAPSHOT_MAGIC 0x50414e53434c4c4dUL
+
+// Write the bins and the block state trees of all the arenas except the explicit ones to the file at path, without allocating memory.
+// Return -1 with errno set on failure. snapview prints or diffs such files.
+int malloc_snapshot(const char* path);
+
+// Return 1 if the block at ptr sits in a bin used less than its arena on average, so that moving it helps to empty the bin.
+// Return 0 if it is better left where it is, and -1 if ptr is not the start of a block from an arena ( Explicit arenas are not searched ).
+int malloc_defrag_hint(void* ptr);
+
+// Allocate size bytes for an object moved after malloc_defrag_hint() returned 1.
+// Unlike malloc(), this does not place it in a sparse or empty bin unless no other bin has room.
+void* malloc_defrag(size_t size);
+
+// Placement policies of malloc_placement()
+#define MALLOC_PLACEMENT_FIRST_FIT 0	// The first bin with room, in the order the bins were created ( Default )
+#define MALLOC_PLACEMENT_BEST_FIT 1		// The fullest bin with room, and in it a free block in a part already split by blocks in use
+
+// Choose where all arenas place new blocks. MALLOC_PLACEMENT=best chooses MALLOC_PLACEMENT_BEST_FIT at startup.
+// Best fit keeps live data in fewer bins so that the others empty out and can be purged, at the cost of looking at every bin of the arena.
+// Return the previous policy, or -1 if policy is not one of them.
+int malloc_placement(int policy);
+
+#ifdef __cplusplus
+}
+#endif
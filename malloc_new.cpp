@@ -0,0 +1,188 @@
+// Replacements of the C++ allocation functions ( operator new and operator delete in all their forms )
+// They call the C functions of this library directly, so that sized and aligned deletes keep what they know.
+// ( A sized delete goes to free_sized(), which finds the block from its size instead of searching the tree of its Bin )
+#include <new>
+#include "malloc.h"
+
+// This library is not linked against the C++ runtime, so that C programs can load it without it.
+// What is used of the runtime here ( including what the compiler calls for try and catch ) is made weak references :
+// They are resolved in any program that can call operator new, and never used in any other.
+namespace std
+{
+	// Throws std::bad_alloc
+	void __throw_bad_alloc() __attribute__((__noreturn__));
+}
+
+__asm__(".weak _ZSt15get_new_handlerv\n"
+		".weak _ZSt17__throw_bad_allocv\n"
+		".weak __cxa_begin_catch\n"
+		".weak __cxa_end_catch\n"
+		".weak __gxx_personality_v0");
+
+// The alignment malloc() gives at least
+#define NEW_MIN_ALIGNMENT sizeof(void*)
+
+// Allocate memory for operator new, or return NULL
+void* AllocateForNew(std::size_t uiSize_, std::size_t uiAlignment_);
+
+// Called when an allocation for operator new fails : call the new-handler and try again, as the standard operator new does
+// If there is no new-handler, throw std::bad_alloc, or return NULL if bNothrow_ is set.
+void* HandleNewFailure(std::size_t uiSize_, std::size_t uiAlignment_, bool bNothrow_);
+
+// Allocate memory for operator new, or return NULL
+void* AllocateForNew(std::size_t uiSize_, std::size_t uiAlignment_)
+{
+	// Each call must return a distinct pointer, even for 0 bytes
+	if (0 == uiSize_)
+		uiSize_ = 1;
+	
+	if (uiAlignment_ <= NEW_MIN_ALIGNMENT)
+		return malloc(uiSize_);
+	
+	return memalign(uiAlignment_, uiSize_);
+}
+
+// Called when an allocation for operator new fails
+void* HandleNewFailure(std::size_t uiSize_, std::size_t uiAlignment_, bool bNothrow_)
+{
+	for (;;)
+	{
+		std::new_handler pHandler = std::get_new_handler();
+		if (nullptr == pHandler)
+		{
+			if (bNothrow_)
+				return nullptr;
+			
+			std::__throw_bad_alloc();
+		}
+		
+		if (bNothrow_)
+		{
+			try
+			{
+				pHandler();
+			}
+			catch (...)
+			{
+				return nullptr;
+			}
+		}
+		else
+		{
+			pHandler();
+		}
+		
+		void* pAllocated = AllocateForNew(uiSize_, uiAlignment_);
+		if (pAllocated)
+			return pAllocated;
+	}
+}
+
+void* operator new(std::size_t size)
+{
+	void* pAllocated = AllocateForNew(size, 0);
+	return pAllocated ? pAllocated : HandleNewFailure(size, 0, false);
+}
+
+void* operator new[](std::size_t size)
+{
+	void* pAllocated = AllocateForNew(size, 0);
+	return pAllocated ? pAllocated : HandleNewFailure(size, 0, false);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+	void* pAllocated = AllocateForNew(size, 0);
+	return pAllocated ? pAllocated : HandleNewFailure(size, 0, true);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+	void* pAllocated = AllocateForNew(size, 0);
+	return pAllocated ? pAllocated : HandleNewFailure(size, 0, true);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+	void* pAllocated = AllocateForNew(size, static_cast<std::size_t>(alignment));
+	return pAllocated ? pAllocated : HandleNewFailure(size, static_cast<std::size_t>(alignment), false);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+	void* pAllocated = AllocateForNew(size, static_cast<std::size_t>(alignment));
+	return pAllocated ? pAllocated : HandleNewFailure(size, static_cast<std::size_t>(alignment), false);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	void* pAllocated = AllocateForNew(size, static_cast<std::size_t>(alignment));
+	return pAllocated ? pAllocated : HandleNewFailure(size, static_cast<std::size_t>(alignment), true);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	void* pAllocated = AllocateForNew(size, static_cast<std::size_t>(alignment));
+	return pAllocated ? pAllocated : HandleNewFailure(size, static_cast<std::size_t>(alignment), true);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t size) noexcept
+{
+	free_sized(ptr, size);
+}
+
+void operator delete[](void* ptr, std::size_t size) noexcept
+{
+	free_sized(ptr, size);
+}
+
+// An aligned block was allocated with memalign(), so it is at least as large as its alignment ( See free_aligned_sized() )
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t size, std::align_val_t alignment) noexcept
+{
+	free_aligned_sized(ptr, static_cast<std::size_t>(alignment), size);
+}
+
+void operator delete[](void* ptr, std::size_t size, std::align_val_t alignment) noexcept
+{
+	free_aligned_sized(ptr, static_cast<std::size_t>(alignment), size);
+}
@@ -0,0 +1,132 @@
+// C++ interfaces to explicit arenas ( See arena_create() in malloc.h )
+// arena_resource : A std::pmr::memory_resource that owns an explicit arena
+// arena_allocator : An allocator for the standard containers that allocates from an explicit arena directly
+#ifndef MALLOC_PMR_H
+#define MALLOC_PMR_H
+
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include "malloc.h"
+
+// The smallest alignment arena_memalign() accepts
+#define ARENA_MIN_ALIGNMENT sizeof(void*)
+
+// A std::pmr::memory_resource that allocates from an explicit arena of its own
+// Memory is given back to the arena with the size it was allocated with ( See arena_free() ),
+// and whatever is left is released at once when the resource is destroyed.
+// The arena has its own lock, so a resource can be shared by threads.
+class arena_resource : public std::pmr::memory_resource
+{
+public:
+	arena_resource() : m_pArena(arena_create())
+	{
+		if (nullptr == m_pArena)
+			throw std::bad_alloc();
+	}
+	
+	~arena_resource()
+	{
+		arena_destroy(m_pArena);
+	}
+	
+	arena_resource(const arena_resource&) = delete;
+	arena_resource& operator=(const arena_resource&) = delete;
+	
+	// The explicit arena of this resource
+	void* arena() const noexcept
+	{
+		return m_pArena;
+	}
+
+protected:
+	void* do_allocate(std::size_t bytes, std::size_t alignment) override
+	{
+		if (alignment < ARENA_MIN_ALIGNMENT)
+			alignment = ARENA_MIN_ALIGNMENT;
+		
+		void* pAllocated = arena_memalign(m_pArena, alignment, bytes ? bytes : 1);
+		if (nullptr == pAllocated)
+			throw std::bad_alloc();
+		
+		return pAllocated;
+	}
+	
+	void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override
+	{
+		arena_free(m_pArena, p, (alignment > bytes) ? alignment : bytes);
+	}
+	
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+	{
+		return this == &other;
+	}
+
+private:
+	void* m_pArena;
+};
+
+// An allocator for the standard containers that allocates from an explicit arena
+// Unlike std::pmr::polymorphic_allocator over an arena_resource, no virtual function is called on the way to the arena.
+// The arena must outlive every container using it.
+template <class T>
+class arena_allocator
+{
+public:
+	using value_type = T;
+	
+	explicit arena_allocator(void* arena) noexcept : m_pArena(arena)
+	{
+	}
+	
+	explicit arena_allocator(const arena_resource& resource) noexcept : m_pArena(resource.arena())
+	{
+	}
+	
+	template <class U>
+	arena_allocator(const arena_allocator<U>& other) noexcept : m_pArena(other.arena())
+	{
+	}
+	
+	T* allocate(std::size_t n)
+	{
+		if (n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+			throw std::bad_array_new_length();
+		
+		std::size_t uiAlignment = (alignof(T) < ARENA_MIN_ALIGNMENT) ? ARENA_MIN_ALIGNMENT : alignof(T);
+		void* pAllocated = arena_memalign(m_pArena, uiAlignment, n ? n * sizeof(T) : 1);
+		if (nullptr == pAllocated)
+			throw std::bad_alloc();
+		
+		return static_cast<T*>(pAllocated);
+	}
+	
+	void deallocate(T* p, std::size_t n) noexcept
+	{
+		arena_free(m_pArena, p, (alignof(T) > n * sizeof(T)) ? alignof(T) : n * sizeof(T));
+	}
+	
+	// The explicit arena this allocator allocates from
+	void* arena() const noexcept
+	{
+		return m_pArena;
+	}
+	
+	template <class U>
+	bool operator==(const arena_allocator<U>& other) const noexcept
+	{
+		return m_pArena == other.arena();
+	}
+	
+	template <class U>
+	bool operator!=(const arena_allocator<U>& other) const noexcept
+	{
+		return m_pArena != other.arena();
+	}
+
+private:
+	void* m_pArena;
+};
+
+#endif
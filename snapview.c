@@ -0,0 +1,356 @@
+// snapview : Print or diff heap snapshots written by malloc_snapshot()
+//
+// snapview [-w width] snapshot             : An occupancy map of each Bin, one line per Bin
+// snapview [-w width] -pgm snapshot        : The same maps as a PGM image ( One row per Bin ) on stdout
+// snapview [-w width] -diff old new        : What changed from one snapshot to the other, Bin by Bin
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "core.h"
+
+#define DEFAULT_MAP_WIDTH 64	// The default number of slices a Bin is divided into
+
+// A Bin record of a snapshot and the Bin Metadata following it
+struct SnapshotBin
+{
+	unsigned long int uiArenaIndex;
+	unsigned long int* pRecord;		// SSR_MAX values
+	unsigned char* pMeta;
+	double* pSlices;				// The used ratio of each slice
+};
+
+// A snapshot read into memory
+struct Snapshot
+{
+	unsigned char* pData;
+	unsigned long int* pHeader;		// SSH_MAX values
+	struct SnapshotBin* pBins;
+	unsigned long int uiBinNums;
+};
+
+// Read a snapshot file and find its Bin records
+// -1 : The file could not be read or is not a snapshot
+int LoadSnapshot(const char* pPath_, struct Snapshot* pSnapshot_);
+
+// Compute the used ratio of each slice of each Bin
+void ComputeSlices(struct Snapshot* pSnapshot_, unsigned long int uiWidth_);
+
+// Mark the blocks allocated under a node of a Bin in the slices of the Bin
+void MarkNode(unsigned long int* pRecord_, unsigned char* pMeta_, unsigned long int uiNode_, unsigned long int uiStart_, unsigned long int uiNodeSize_, unsigned long int uiBinSize_, double* pSlices_, unsigned long int uiWidth_);
+
+// Get the state of a node from Bin Metadata ( The same layout as in core.c )
+unsigned char SnapshotNodeState(unsigned long int uiNodeIndex_, unsigned char* pMeta_);
+
+// Get the character for the used ratio of a slice
+char SliceChar(double dUsed_);
+
+// Print the occupancy map of each Bin
+void PrintMaps(struct Snapshot* pSnapshot_, unsigned long int uiWidth_);
+
+// Write the occupancy maps of all Bins as a PGM image
+void PrintPgm(struct Snapshot* pSnapshot_, unsigned long int uiWidth_);
+
+// Print the differences between two snapshots
+void PrintDiff(struct Snapshot* pOld_, struct Snapshot* pNew_, unsigned long int uiWidth_);
+
+// Find the Bin of a snapshot at the address of another Bin
+struct SnapshotBin* FindSnapshotBin(struct Snapshot* pSnapshot_, struct SnapshotBin* pBin_);
+
+int main(int argc, char** argv)
+{
+	unsigned long int uiWidth = DEFAULT_MAP_WIDTH;
+	int iPgm = 0;
+	int iDiff = 0;
+	int i = 1;
+	for (; i < argc && '-' == argv[i][0]; ++i)
+	{
+		if (0 == strcmp(argv[i], "-w") && i + 1 < argc)
+			uiWidth = strtoul(argv[++i], NULL, 10);
+		else if (0 == strcmp(argv[i], "-pgm"))
+			iPgm = 1;
+		else if (0 == strcmp(argv[i], "-diff"))
+			iDiff = 1;
+		else
+			break;
+	}
+	
+	if (0 == uiWidth || i + 1 + iDiff != argc)
+	{
+		fprintf(stderr, "usage: %s [-w width] [-pgm] snapshot\n", argv[0]);
+		fprintf(stderr, "       %s [-w width] -diff old new\n", argv[0]);
+		return 2;
+	}
+	
+	struct Snapshot snapshot[2];
+	for (int j = 0; j <= iDiff; ++j)
+	{
+		if (-1 == LoadSnapshot(argv[i + j], &snapshot[j]))
+		{
+			fprintf(stderr, "%s: cannot read snapshot %s\n", argv[0], argv[i + j]);
+			return 1;
+		}
+		
+		ComputeSlices(&snapshot[j], uiWidth);
+	}
+	
+	if (iDiff)
+		PrintDiff(&snapshot[0], &snapshot[1], uiWidth);
+	else if (iPgm)
+		PrintPgm(&snapshot[0], uiWidth);
+	else
+		PrintMaps(&snapshot[0], uiWidth);
+		
+	return 0;
+}
+
+// Read a snapshot file and find its Bin records
+int LoadSnapshot(const char* pPath_, struct Snapshot* pSnapshot_)
+{
+	memset(pSnapshot_, 0, sizeof(struct Snapshot));
+	
+	FILE* pFile = fopen(pPath_, "rb");
+	if (NULL == pFile)
+		return -1;
+		
+	fseek(pFile, 0, SEEK_END);
+	long iSize = ftell(pFile);
+	fseek(pFile, 0, SEEK_SET);
+	if (iSize < (long)(sizeof(unsigned long int) * SSH_MAX))
+	{
+		fclose(pFile);
+		return -1;
+	}
+	
+	pSnapshot_->pData = (unsigned char*)malloc(iSize);
+	if (NULL == pSnapshot_->pData || 1 != fread(pSnapshot_->pData, iSize, 1, pFile))
+	{
+		fclose(pFile);
+		return -1;
+	}
+	
+	fclose(pFile);
+	
+	pSnapshot_->pHeader = (unsigned long int*)pSnapshot_->pData;
+	if (SNAPSHOT_MAGIC != pSnapshot_->pHeader[SSH_MAGIC] || SNAPSHOT_VERSION != pSnapshot_->pHeader[SSH_VERSION])
+		return -1;
+		
+	// Walk the records twice: once to count the Bins and once to fill them in
+	for (int iPass = 0; iPass < 2; ++iPass)
+	{
+		unsigned long int uiOffset = sizeof(unsigned long int) * SSH_MAX;
+		unsigned long int uiArenaIndex = 0;
+		unsigned long int uiBinNums = 0;
+		while (uiOffset + sizeof(unsigned long int) * SSR_MAX <= (unsigned long int)iSize)
+		{
+			unsigned long int* pRecord = (unsigned long int*)(pSnapshot_->pData + uiOffset);
+			uiOffset += sizeof(unsigned long int) * SSR_MAX;
+			
+			if (ESR_END == pRecord[SSR_TYPE])
+				break;
+				
+			if (ESR_ARENA == pRecord[SSR_TYPE])
+			{
+				uiArenaIndex = pRecord[SSR_ARENA_INDEX];
+				continue;
+			}
+			
+			if (ESR_BIN != pRecord[SSR_TYPE] || uiOffset + pRecord[SSR_BIN_META_SIZE] > (unsigned long int)iSize)
+				return -1;
+				
+			if (iPass)
+			{
+				pSnapshot_->pBins[uiBinNums].uiArenaIndex = uiArenaIndex;
+				pSnapshot_->pBins[uiBinNums].pRecord = pRecord;
+				pSnapshot_->pBins[uiBinNums].pMeta = pSnapshot_->pData + uiOffset;
+			}
+			
+			uiOffset += pRecord[SSR_BIN_META_SIZE];
+			++uiBinNums;
+		}
+		
+		if (0 == iPass)
+		{
+			pSnapshot_->uiBinNums = uiBinNums;
+			pSnapshot_->pBins = (struct SnapshotBin*)calloc(uiBinNums + 1, sizeof(struct SnapshotBin));
+			if (NULL == pSnapshot_->pBins)
+				return -1;
+		}
+	}
+	
+	return 0;
+}
+
+// Compute the used ratio of each slice of each Bin
+void ComputeSlices(struct Snapshot* pSnapshot_, unsigned long int uiWidth_)
+{
+	for (unsigned long int i = 0; i < pSnapshot_->uiBinNums; ++i)
+	{
+		struct SnapshotBin* pBin = &pSnapshot_->pBins[i];
+		pBin->pSlices = (double*)calloc(uiWidth_, sizeof(double));
+		if (NULL == pBin->pSlices)
+		{
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		
+		unsigned long int uiBinSize = pBin->pRecord[SSR_BIN_PAGE_NUMS] * pSnapshot_->pHeader[SSH_PAGE_SIZE];
+		if (0 == uiBinSize || 0 == pBin->pRecord[SSR_BIN_META_SIZE])
+			continue;
+			
+		MarkNode(pBin->pRecord, pBin->pMeta, 0, 0, uiBinSize, uiBinSize, pBin->pSlices, uiWidth_);
+		
+		double dSliceSize = (double)uiBinSize / uiWidth_;
+		for (unsigned long int j = 0; j < uiWidth_; ++j)
+			pBin->pSlices[j] /= dSliceSize;
+	}
+}
+
+// Mark the blocks allocated under a node of a Bin in the slices of the Bin
+// pSlices_ accumulates the allocated bytes of each slice
+void MarkNode(unsigned long int* pRecord_, unsigned char* pMeta_, unsigned long int uiNode_, unsigned long int uiStart_, unsigned long int uiNodeSize_, unsigned long int uiBinSize_, double* pSlices_, unsigned long int uiWidth_)
+{
+	if (uiNode_ / BLOCKS_IN_ONE_BYTE >= pRecord_[SSR_BIN_META_SIZE])
+		return;
+		
+	unsigned char ucState = SnapshotNodeState(uiNode_, pMeta_);
+	if (EBBS_FREE == ucState)
+		return;
+		
+	if (EBBS_ALLOCATED_AT_ONCE == ucState)
+	{
+		// Spread the block over the slices it overlaps
+		double dSliceSize = (double)uiBinSize_ / uiWidth_;
+		double dStart = uiStart_;
+		double dEnd = uiStart_ + uiNodeSize_;
+		unsigned long int uiFirst = (unsigned long int)(dStart / dSliceSize);
+		for (unsigned long int j = uiFirst; j < uiWidth_; ++j)
+		{
+			double dSliceStart = j * dSliceSize;
+			double dSliceEnd = dSliceStart + dSliceSize;
+			if (dSliceStart >= dEnd)
+				break;
+				
+			double dFrom = dStart > dSliceStart ? dStart : dSliceStart;
+			double dTo = dEnd < dSliceEnd ? dEnd : dSliceEnd;
+			pSlices_[j] += dTo - dFrom;
+		}
+		
+		return;
+	}
+	
+	if (uiNodeSize_ / 2 < pRecord_[SSR_BIN_MIN_BLOCK])
+		return;
+		
+	MarkNode(pRecord_, pMeta_, (uiNode_ * 2) + 1, uiStart_, uiNodeSize_ / 2, uiBinSize_, pSlices_, uiWidth_);
+	MarkNode(pRecord_, pMeta_, (uiNode_ * 2) + 2, uiStart_ + uiNodeSize_ / 2, uiNodeSize_ / 2, uiBinSize_, pSlices_, uiWidth_);
+}
+
+// Get the state of a node from Bin Metadata ( The same layout as in core.c )
+unsigned char SnapshotNodeState(unsigned long int uiNodeIndex_, unsigned char* pMeta_)
+{
+	unsigned int uiShift = (~uiNodeIndex_ & 1) * BITS_PER_BLOCK_METADATA;
+	return (*(pMeta_ + (uiNodeIndex_ / BLOCKS_IN_ONE_BYTE)) >> uiShift) & 0x0f;
+}
+
+// Get the character for the used ratio of a slice
+char SliceChar(double dUsed_)
+{
+	if (dUsed_ <= 0.0)
+		return ' ';
+	if (dUsed_ >= 1.0)
+		return '#';
+	if (dUsed_ < 0.25)
+		return '.';
+	if (dUsed_ < 0.5)
+		return ':';
+	if (dUsed_ < 0.75)
+		return 'o';
+		
+	return 'O';
+}
+
+// Print the occupancy map of each Bin
+void PrintMaps(struct Snapshot* pSnapshot_, unsigned long int uiWidth_)
+{
+	printf("Snapshot of process %lu : %lu Bins, page size %lu\n", pSnapshot_->pHeader[SSH_PID], pSnapshot_->uiBinNums, pSnapshot_->pHeader[SSH_PAGE_SIZE]);
+	printf("' ' empty  '.' < 25%%  ':' < 50%%  'o' < 75%%  'O' < 100%%  '#' full\n");
+	for (unsigned long int i = 0; i < pSnapshot_->uiBinNums; ++i)
+	{
+		struct SnapshotBin* pBin = &pSnapshot_->pBins[i];
+		printf("Arena %3lu Bin %4lu 0x%012lx %5lu pages %10lu used |", pBin->uiArenaIndex, pBin->pRecord[SSR_BIN_INDEX], pBin->pRecord[SSR_BIN_ADDR], pBin->pRecord[SSR_BIN_PAGE_NUMS], pBin->pRecord[SSR_BIN_USED_BYTES]);
+		for (unsigned long int j = 0; j < uiWidth_; ++j)
+			putchar(SliceChar(pBin->pSlices[j]));
+			
+		printf("|\n");
+	}
+}
+
+// Write the occupancy maps of all Bins as a PGM image ( Black : Used, White : Free )
+void PrintPgm(struct Snapshot* pSnapshot_, unsigned long int uiWidth_)
+{
+	printf("P5\n%lu %lu\n255\n", uiWidth_, pSnapshot_->uiBinNums);
+	for (unsigned long int i = 0; i < pSnapshot_->uiBinNums; ++i)
+	{
+		for (unsigned long int j = 0; j < uiWidth_; ++j)
+		{
+			double dUsed = pSnapshot_->pBins[i].pSlices[j];
+			putchar(255 - (int)(255 * (dUsed > 1.0 ? 1.0 : dUsed)));
+		}
+	}
+}
+
+// Find the Bin of a snapshot at the address of another Bin
+struct SnapshotBin* FindSnapshotBin(struct Snapshot* pSnapshot_, struct SnapshotBin* pBin_)
+{
+	for (unsigned long int i = 0; i < pSnapshot_->uiBinNums; ++i)
+	{
+		struct SnapshotBin* pBin = &pSnapshot_->pBins[i];
+		if (pBin->pRecord[SSR_BIN_ADDR] == pBin_->pRecord[SSR_BIN_ADDR] && pBin->pRecord[SSR_BIN_PAGE_NUMS] == pBin_->pRecord[SSR_BIN_PAGE_NUMS])
+			return pBin;
+	}
+	
+	return NULL;
+}
+
+// Print the differences between two snapshots
+// '+' : More is used  '-' : Less is used  '=' : Used in both and unchanged  ' ' : Free in both
+void PrintDiff(struct Snapshot* pOld_, struct Snapshot* pNew_, unsigned long int uiWidth_)
+{
+	printf("'+' more used  '-' less used  '=' unchanged  ' ' free in both\n");
+	
+	long iTotalDelta = 0;
+	for (unsigned long int i = 0; i < pNew_->uiBinNums; ++i)
+	{
+		struct SnapshotBin* pBin = &pNew_->pBins[i];
+		struct SnapshotBin* pOldBin = FindSnapshotBin(pOld_, pBin);
+		long iDelta = (long)pBin->pRecord[SSR_BIN_USED_BYTES] - (pOldBin ? (long)pOldBin->pRecord[SSR_BIN_USED_BYTES] : 0);
+		iTotalDelta += iDelta;
+		
+		printf("%s Arena %3lu Bin %4lu 0x%012lx %+11ld used |", pOldBin ? " " : "+", pBin->uiArenaIndex, pBin->pRecord[SSR_BIN_INDEX], pBin->pRecord[SSR_BIN_ADDR], iDelta);
+		for (unsigned long int j = 0; j < uiWidth_; ++j)
+		{
+			double dOld = pOldBin ? pOldBin->pSlices[j] : 0.0;
+			double dNew = pBin->pSlices[j];
+			if (dNew > dOld)
+				putchar('+');
+			else if (dNew < dOld)
+				putchar('-');
+			else
+				putchar(dNew > 0.0 ? '=' : ' ');
+		}
+		
+		printf("|\n");
+	}
+	
+	for (unsigned long int i = 0; i < pOld_->uiBinNums; ++i)
+	{
+		struct SnapshotBin* pOldBin = &pOld_->pBins[i];
+		if (FindSnapshotBin(pNew_, pOldBin))
+			continue;
+			
+		iTotalDelta -= (long)pOldBin->pRecord[SSR_BIN_USED_BYTES];
+		printf("- Arena %3lu Bin %4lu 0x%012lx %+11ld used ( Removed )\n", pOldBin->uiArenaIndex, pOldBin->pRecord[SSR_BIN_INDEX], pOldBin->pRecord[SSR_BIN_ADDR], -(long)pOldBin->pRecord[SSR_BIN_USED_BYTES]);
+	}
+	
+	printf("Total used : %+ld bytes\n", iTotalDelta);
+}
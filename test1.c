@@ -1,6 +1,17 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <string.h>
 #include <pthread.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
 #include "malloc.h"
 
 #define MAX_THREAD_NUM 2
@@ -8,6 +19,18 @@
 // The minimun boundary of memory allocation. (ex) malloc(1) still allocates 8 bytes internally)
 #define MIN_MEMORY_ALIGNMENT sizeof(void*)	
 
+// Two arenas never share a bin, and a bin has at least 128 pages. ( See MIN_NEW_PAGE_NUMS in core.h )
+// The first blocks of two arenas are thus at least half that far apart, and those of one arena much closer. ( See RunInArenaMode() )
+#define MODE_TEST_NEAR_BYTES (64 * 4096UL)
+
+// The address space each arena reserves in the tests run in another arena mode ( MALLOC_ARENA_RESERVE_MB, See RunInArenaMode() )
+#define MODE_TEST_RESERVE_MB 64
+
+// The cache of empty large bins of each arena, the one all arenas share beyond that, and the blocks that fill them ( See LargeCacheDecayTest() )
+#define CACHE_TEST_ARENA_MB 4
+#define CACHE_TEST_OVERFLOW_MB 2
+#define CACHE_TEST_BLOCK_MB 2
+
 // This function is invoked on creation of a new thread
 void* ThreadFunc(void* pArg_);
 	
@@ -26,9 +49,131 @@ int ReallocTest();
 // Test free()
 int FreeTest();
 
+// Test that libmalloc-4k.so uses its own layout on a system with 4096-byte pages instead of falling back to the generic build
+int FixedBuildTest();
+
+// Set by libmalloc-4k.so when it hands every call over to the generic build ( NULL with libmalloc.so )
+extern int g_iUseGenericBuild __attribute__((weak));
+
+// Run a test in a new process of this program with MALLOC_ARENA_MODE set to pMode_
+// The arena mode is chosen when the library is loaded, so the test runs in a program started anew. ( See main() )
+int RunInArenaMode(const char* pMode_, const char* pTest_);
+
+// Test that threads on the same CPU share an arena, and threads on different CPUs do not ( MALLOC_ARENA_MODE=percpu )
+int PerCpuArenaTest();
+
+// Allocate a block on the CPU given by pArg_, and return it ( For PerCpuArenaTest() )
+void* PinnedThreadFunc(void* pArg_);
+
+// Test that the pool creates arenas up to its cap, and then assigns each new thread the arena with the fewest threads ( MALLOC_ARENA_MODE=pool )
+int PoolArenaTest();
+
+// Allocate a block, and stay alive until PoolArenaTest() is done ( For PoolArenaTest() )
+void* PoolThreadFunc(void* pArg_);
+
+// Test malloc_batch() and free_batch()
+int BatchTest();
+
+// Test arena_create(), arena_malloc(), arena_memalign() and arena_destroy()
+int ArenaTest();
+
+// Test that a bin for a large request tracks page-sized blocks, and frees and reuses them
+int CoarseBinTest();
+
+// Test that the Guarded Pool catches a use after free ( MALLOC_GUARD_SAMPLE_RATE )
+int GuardedPoolTest();
+
+// Write to a freed block ( For GuardedPoolTest() )
+int UseAfterFree();
+
+// Test malloc_prewarm()
+int PrewarmTest();
+
+// Test that the bins of an arena are committed from the address space it reserves, and what happens past it or without it ( MALLOC_ARENA_RESERVE_MB )
+int ReserveTest();
+
+// Free each block of the NULL-terminated array pArg_ ( For ReserveTest() )
+void* FreeBlocksThreadFunc(void* pArg_);
+
+// Allocate and free a few large blocks in the arena of a new thread, and return NULL if one cannot be allocated ( For ReserveTest() )
+void* ReserveThreadFunc(void* pArg_);
+
+// Test malloc_instrument() and malloc_instrument_read()
+int InstrumentTest();
+
+// Test malloc_frag_bin(), malloc_frag_arena() and malloc_frag_process()
+int FragTest();
+
+// Test malloc_snapshot(), and that snapview reads the file it writes
+int SnapshotTest();
+
+// Test malloc_defrag_hint() and malloc_defrag()
+int DefragTest();
+
+// Test free_sized(), free_aligned_sized() and arena_free()
+int SizedFreeTest();
+
+// Test that the Bins of an arena start small and grow
+int BinGrowthTest();
+
+// Test malloc_placement()
+// The policy is shared by all threads, so this runs in the main thread after the others are done.
+int PlacementTest();
+
+// Test that empty large bins are reused by their size
+int LargeCacheTest();
+
+// Run a test in a child process with the background thread on ( MALLOC_BACKGROUND_THREAD )
+int RunWithBackgroundThread(const char* pTest_);
+
+// Test that the background thread keeps empty large bins up to the cache of their arena, then the one all arenas share, and purges them once they decay
+int LargeCacheDecayTest();
+
+// Get the number of pages of a range that are in memory
+unsigned long int CountResidentPages(unsigned long int uiAddr_, unsigned long int uiSize_);
+
+// Test arena_create_shared(), arena_attach(), arena_offset() and arena_address()
+int SharedArenaTest();
+
+// Test that a new thread takes over the arena of a thread that has exited
+// Other threads must not exit meanwhile, so this runs in the main thread after the others are done.
+int ArenaAdoptionTest();
+
+// Test arena_open(), arena_set_root(), arena_get_root() and arena_sync()
+// Another process opens the arena first, so this runs in the main thread after the others are done.
+int PersistentArenaTest();
+
+// Test that a persistent arena is consistent when opened again after a process was killed while allocating and freeing from it
+int PersistentKillTest();
+
+// Test that threads created at once each register an Arena of their own, and that blocks from all of them can be freed elsewhere
+int ArenaRegistryTest();
+
+// Allocate a block while all the threads of ArenaRegistryTest() are alive, and return it
+void* RegistryThreadFunc(void* pArg_);
+
+// Allocate and free a large block, and return its address ( For ArenaAdoptionTest() )
+void* LargeBlockThreadFunc(void* pArg_);
+
 // Main Function
 int main(int argc, char* argv[])
 {
+	// A test started by RunInArenaMode()
+	if (argc > 1 && 0 == strcmp(argv[1], "percpu"))
+		return (-1 == PerCpuArenaTest()) ? 1 : 0;
+	
+	if (argc > 1 && 0 == strcmp(argv[1], "pool"))
+		return (-1 == PoolArenaTest()) ? 1 : 0;
+	
+	if (argc > 1 && 0 == strcmp(argv[1], "guard"))
+		return UseAfterFree();
+	
+	if (argc > 1 && 0 == strcmp(argv[1], "reserve"))
+		return (-1 == ReserveTest()) ? 1 : 0;
+	
+	if (argc > 1 && 0 == strcmp(argv[1], "decay"))
+		return (-1 == LargeCacheDecayTest()) ? 1 : 0;
+	
 	pthread_t uiThread[MAX_THREAD_NUM];
 
 	// Create new threads
@@ -65,6 +210,72 @@ int main(int argc, char* argv[])
 		
 	}
 	
+	if (-1 == RunInArenaMode("percpu", "percpu"))
+	{
+		printf("PerCpuArenaTest() Failed\n");
+		return -1;
+	}
+	
+	if (-1 == RunInArenaMode("pool", "pool"))
+	{
+		printf("PoolArenaTest() Failed\n");
+		return -1;
+	}
+	
+	if (-1 == GuardedPoolTest())
+	{
+		printf("GuardedPoolTest() Failed\n");
+		return -1;
+	}
+	
+	if (-1 == RunInArenaMode("thread", "reserve"))
+	{
+		printf("ReserveTest() Failed\n");
+		return -1;
+	}
+	
+	if (-1 == PlacementTest())
+	{
+		printf("PlacementTest() Failed\n");
+		return -1;
+	}
+	
+	if (-1 == RunWithBackgroundThread("decay"))
+	{
+		printf("LargeCacheDecayTest() Failed\n");
+		return -1;
+	}
+	
+	if (-1 == FixedBuildTest())
+	{
+		printf("FixedBuildTest() Failed\n");
+		return -1;
+	}
+	
+	if (-1 == ArenaAdoptionTest())
+	{
+		printf("ArenaAdoptionTest() Failed\n");
+		return -1;
+	}
+	
+	if (-1 == PersistentArenaTest())
+	{
+		printf("PersistentArenaTest() Failed\n");
+		return -1;
+	}
+	
+	if (-1 == PersistentKillTest())
+	{
+		printf("PersistentKillTest() Failed\n");
+		return -1;
+	}
+	
+	if (-1 == ArenaRegistryTest())
+	{
+		printf("ArenaRegistryTest() Failed\n");
+		return -1;
+	}
+	
 	// The main thread does not allocate any memory explicitly, but GLIBC calls calloc() for each thread's TLS.
 	// Thus, the main thread arena has some space in use in the output from malloc_stats() with two allocation requests (two threads)
 	// However, used space on other thread arenas must be 0 in the output.
@@ -109,6 +320,78 @@ void* ThreadFunc(void* pArg_)
 		return NULL;
 	}
 	
+	if (-1 == BatchTest())
+	{
+		printf("BatchTest() Failed\n");
+		return NULL;
+	}
+	
+	if (-1 == ArenaTest())
+	{
+		printf("ArenaTest() Failed\n");
+		return NULL;
+	}
+	
+	if (-1 == CoarseBinTest())
+	{
+		printf("CoarseBinTest() Failed\n");
+		return NULL;
+	}
+	
+	if (-1 == PrewarmTest())
+	{
+		printf("PrewarmTest() Failed\n");
+		return NULL;
+	}
+	
+	if (-1 == InstrumentTest())
+	{
+		printf("InstrumentTest() Failed\n");
+		return NULL;
+	}
+	
+	if (-1 == FragTest())
+	{
+		printf("FragTest() Failed\n");
+		return NULL;
+	}
+	
+	if (-1 == SnapshotTest())
+	{
+		printf("SnapshotTest() Failed\n");
+		return NULL;
+	}
+	
+	if (-1 == DefragTest())
+	{
+		printf("DefragTest() Failed\n");
+		return NULL;
+	}
+	
+	if (-1 == SizedFreeTest())
+	{
+		printf("SizedFreeTest() Failed\n");
+		return NULL;
+	}
+	
+	if (-1 == BinGrowthTest())
+	{
+		printf("BinGrowthTest() Failed\n");
+		return NULL;
+	}
+	
+	if (-1 == LargeCacheTest())
+	{
+		printf("LargeCacheTest() Failed\n");
+		return NULL;
+	}
+	
+	if (-1 == SharedArenaTest())
+	{
+		printf("SharedArenaTest() Failed\n");
+		return NULL;
+	}
+	
 	
 	unsigned char* pMem = malloc(4);
 	return pMem;
@@ -295,3 +578,1489 @@ int FreeTest()
 	
 	return 0;
 }
+
+// Run a test in a new process of this program with MALLOC_ARENA_MODE set to pMode_
+// For "pool", the pool is capped at two arenas per CPU. Each arena reserves MODE_TEST_RESERVE_MB of address space.
+// Return -1 on Failure
+// Return 0 on Success
+int RunInArenaMode(const char* pMode_, const char* pTest_)
+{
+	char szReserve[16];
+	snprintf(szReserve, sizeof(szReserve), "%d", MODE_TEST_RESERVE_MB);
+	
+	pid_t iChild = fork();
+	if (0 == iChild)
+	{
+		setenv("MALLOC_ARENA_MODE", pMode_, 1);
+		setenv("MALLOC_ARENA_MAX_PER_CPU", "2", 1);
+		setenv("MALLOC_ARENA_RESERVE_MB", szReserve, 1);
+		execl("/proc/self/exe", "test1", pTest_, (char*)NULL);
+		_exit(1);
+	}
+	
+	int iStatus = 0;
+	if (-1 == iChild || iChild != waitpid(iChild, &iStatus, 0) || 0 == WIFEXITED(iStatus) || 0 != WEXITSTATUS(iStatus))
+		return -1;
+	
+	return 0;
+}
+
+// Test that threads on the same CPU share an arena, and threads on different CPUs do not ( MALLOC_ARENA_MODE=percpu )
+// Blocks of different arenas are in different bins, so they are told apart by their distance.
+// Return -1 on Failure
+// Return 0 on Success
+int PerCpuArenaTest()
+{
+	// Two threads on the first CPU this process may run on, and one on the next, if there is one
+	// The threads run one after the other, so that each has its CPU to itself.
+	cpu_set_t cpuSet;
+	if (0 != sched_getaffinity(0, sizeof(cpuSet), &cpuSet))
+		return -1;
+	
+	unsigned long int uiCpus[3] = { 0, 0, 0 };
+	int iThreadNums = 0;
+	for (unsigned long int uiCpu = 0; uiCpu < CPU_SETSIZE && iThreadNums < 3; ++uiCpu)
+	{
+		if (0 == CPU_ISSET(uiCpu, &cpuSet))
+			continue;
+		
+		uiCpus[iThreadNums++] = uiCpu;
+		if (1 == iThreadNums)
+			uiCpus[iThreadNums++] = uiCpu;
+	}
+	
+	unsigned long int uiAddr[3] = { 0, 0, 0 };
+	for (int i = 0; i < iThreadNums; ++i)
+	{
+		pthread_t thread;
+		void* pBlock = NULL;
+		if (0 != pthread_create(&thread, NULL, PinnedThreadFunc, (void*)uiCpus[i]) || 0 != pthread_join(thread, &pBlock) || NULL == pBlock)
+		{
+			printf("A thread could not allocate on CPU %lu\n", uiCpus[i]);
+			return -1;
+		}
+		
+		uiAddr[i] = (unsigned long int)pBlock;
+	}
+	
+	unsigned long int uiNear = MODE_TEST_NEAR_BYTES;
+	unsigned long int uiSameCpu = (uiAddr[0] > uiAddr[1]) ? uiAddr[0] - uiAddr[1] : uiAddr[1] - uiAddr[0];
+	unsigned long int uiOtherCpu = (uiAddr[0] > uiAddr[2]) ? uiAddr[0] - uiAddr[2] : uiAddr[2] - uiAddr[0];
+	if (uiSameCpu >= uiNear || (3 == iThreadNums && uiOtherCpu < uiNear))
+	{
+		printf("Per-CPU arenas do not work correctly\n");
+		return -1;
+	}
+	
+	return 0;
+}
+
+// Allocate a block on the CPU given by pArg_, and return it ( For PerCpuArenaTest() )
+void* PinnedThreadFunc(void* pArg_)
+{
+	cpu_set_t cpuSet;
+	CPU_ZERO(&cpuSet);
+	CPU_SET((unsigned long int)pArg_, &cpuSet);
+	if (0 != pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet))
+		return NULL;
+	
+	return malloc(64);
+}
+
+// The blocks the threads of PoolArenaTest() allocated, by thread
+unsigned long int* g_pPoolBlocks = NULL;
+
+// Posted by each thread of PoolArenaTest() once it has allocated
+sem_t g_semPoolAllocated;
+
+// The threads of PoolArenaTest() wait on this until the test is done, so that none leaves its arena
+sem_t g_semPoolRelease;
+
+// Test that the pool creates arenas up to its cap, and then assigns each new thread the arena with the fewest threads ( MALLOC_ARENA_MODE=pool )
+// The cap is two arenas per CPU ( See RunInArenaMode() ). The main thread and the first threads take one arena each, up to the cap.
+// As many threads again then join them, one per arena, because the arena a thread joins has more threads than the others afterwards.
+// Blocks of different arenas are in different bins, so they are told apart by their distance.
+// Return -1 on Failure
+// Return 0 on Success
+int PoolArenaTest()
+{
+	unsigned long int uiArenaNums = sysconf(_SC_NPROCESSORS_CONF) * 2;
+	unsigned long int uiThreadNums = (uiArenaNums * 2) - 1;
+	unsigned long int uiNear = MODE_TEST_NEAR_BYTES;
+	pthread_t* pThreads = (pthread_t*)malloc(sizeof(pthread_t) * uiThreadNums);
+	g_pPoolBlocks = (unsigned long int*)calloc(uiThreadNums + 1, sizeof(unsigned long int));
+	if (NULL == pThreads || NULL == g_pPoolBlocks)
+		return -1;
+	
+	// The main thread takes the first arena
+	g_pPoolBlocks[0] = (unsigned long int)malloc(64);
+	
+	sem_init(&g_semPoolAllocated, 0, 0);
+	sem_init(&g_semPoolRelease, 0, 0);
+	int iResult = 0;
+	unsigned long int uiCreated = 0;
+	for (; uiCreated < uiThreadNums; ++uiCreated)
+	{
+		if (0 != pthread_create(&pThreads[uiCreated], NULL, PoolThreadFunc, (void*)(uiCreated + 1)))
+		{
+			printf("pthread_create() failed in PoolArenaTest()\n");
+			iResult = -1;
+			break;
+		}
+		
+		// One at a time, so that each thread is assigned an arena after the previous one was
+		sem_wait(&g_semPoolAllocated);
+	}
+	
+	// Threads up to the cap have arenas of their own, and each thread after them shares the arena of one of those
+	for (unsigned long int i = 0; i <= uiThreadNums && 0 == iResult; ++i)
+	{
+		unsigned long int uiSharing = 0;
+		for (unsigned long int j = 0; j <= uiThreadNums; ++j)
+		{
+			unsigned long int uiDistance = (g_pPoolBlocks[i] > g_pPoolBlocks[j]) ? g_pPoolBlocks[i] - g_pPoolBlocks[j] : g_pPoolBlocks[j] - g_pPoolBlocks[i];
+			if (i != j && uiDistance < uiNear)
+				++uiSharing;
+		}
+		
+		if (0 == g_pPoolBlocks[i] || 1 != uiSharing)
+			iResult = -1;
+	}
+	
+	if (-1 == iResult && uiCreated == uiThreadNums)
+		printf("The arena pool does not work correctly\n");
+	
+	for (unsigned long int i = 0; i < uiCreated; ++i)
+		sem_post(&g_semPoolRelease);
+	
+	for (unsigned long int i = 0; i < uiCreated; ++i)
+		pthread_join(pThreads[i], NULL);
+	
+	sem_destroy(&g_semPoolRelease);
+	sem_destroy(&g_semPoolAllocated);
+	return iResult;
+}
+
+// Allocate a block, and stay alive until PoolArenaTest() is done ( For PoolArenaTest() )
+void* PoolThreadFunc(void* pArg_)
+{
+	g_pPoolBlocks[(unsigned long int)pArg_] = (unsigned long int)malloc(64);
+	sem_post(&g_semPoolAllocated);
+	
+	sem_wait(&g_semPoolRelease);
+	return NULL;
+}
+
+// Test malloc_batch() and free_batch()
+// Return -1 on Failure
+// Return 0 on Success
+int BatchTest()
+{
+	void* pMem1[1000];
+	if (1000 != malloc_batch(24, 1000, pMem1))
+	{
+		printf("malloc_batch() does not work correctly\n");
+		return -1;
+	}
+	
+	// Blocks of a batch are carved next to each other
+	if ((unsigned char*)pMem1[0] + 32 != (unsigned char*)pMem1[1])
+	{
+		printf("malloc_batch() does not work correctly\n");
+		return -1;
+	}
+	
+	for (int i = 0; i < 1000; ++i)
+		memset(pMem1[i], i & 0xFF, 24);
+	
+	// No block must overlap another
+	for (int i = 0; i < 1000; ++i)
+	{
+		unsigned char* pByte = (unsigned char*)pMem1[i];
+		for (int j = 0; j < 24; ++j)
+		{
+			if (pByte[j] != (i & 0xFF))
+			{
+				printf("malloc_batch() does not work correctly\n");
+				return -1;
+			}
+		}
+	}
+	
+	free_batch(pMem1, 1000);
+	
+	// If memory were free correctly, the same blocks will be allocated again
+	void* pMem2[1000];
+	if (1000 != malloc_batch(24, 1000, pMem2) || pMem1[0] != pMem2[0])
+	{
+		printf("free_batch() does not work correctly\n");
+		return -1;
+	}
+	
+	free_batch(pMem2, 1000);
+	
+	return 0;
+}
+
+// Test arena_create(), arena_malloc(), arena_memalign() and arena_destroy()
+// Return -1 on Failure
+// Return 0 on Success
+int ArenaTest()
+{
+	void* pArena = arena_create();
+	if (NULL == pArena)
+	{
+		printf("arena_create() does not work correctly\n");
+		return -1;
+	}
+	
+	// A new arena starts from an empty Bin, just like a new thread
+	unsigned char* pMem1 = (unsigned char*)arena_malloc(pArena, 16);
+	unsigned char* pMem2 = (unsigned char*)arena_malloc(pArena, 16);
+	if (NULL == pMem1 || pMem1 + 16 != pMem2)
+	{
+		printf("arena_malloc() does not work correctly\n");
+		return -1;
+	}
+	
+	unsigned char* pMem3 = (unsigned char*)arena_memalign(pArena, 256, 8);
+	if (NULL == pMem3 || 0 != ((unsigned long int)pMem3 % 256))
+	{
+		printf("arena_memalign() does not work correctly\n");
+		return -1;
+	}
+	
+	// Allocate more than a Bin holds to get several Bins
+	for (int i = 0; i < 64; ++i)
+	{
+		unsigned char* pMem4 = (unsigned char*)arena_malloc(pArena, 64 * 1024);
+		if (NULL == pMem4)
+		{
+			printf("arena_malloc() does not work correctly\n");
+			return -1;
+		}
+		
+		memset(pMem4, 0xFF, 64 * 1024);
+	}
+	
+	arena_destroy(pArena);
+	
+	pArena = arena_create();
+	if (NULL == pArena || NULL == arena_malloc(pArena, 16))
+	{
+		printf("arena_destroy() does not work correctly\n");
+		return -1;
+	}
+	
+	arena_destroy(pArena);
+	
+	return 0;
+}
+
+// Test that a bin for a request of 256 pages or more tracks page-sized blocks, and frees and reuses them
+// Return -1 on Failure
+// Return 0 on Success
+int CoarseBinTest()
+{
+	unsigned long int uiPageSize = sysconf(_SC_PAGESIZE);
+	unsigned long int uiBinSize = 256 * uiPageSize;
+	void* pArena = arena_create();
+	if (NULL == pArena)
+	{
+		printf("arena_create() does not work correctly\n");
+		return -1;
+	}
+	
+	// The first request creates the bin, just large enough for it
+	int iResult = 0;
+	struct malloc_frag_stats stBin;
+	unsigned char* pBin = (unsigned char*)arena_malloc(pArena, uiBinSize);
+	if (NULL == pBin || -1 == malloc_frag_bin(pArena, 0, &stBin) || uiBinSize != stBin.total_bytes || -1 == arena_free(pArena, pBin, uiBinSize))
+	{
+		printf("A bin for a large request does not work correctly\n");
+		arena_destroy(pArena);
+		return -1;
+	}
+	
+	// Page-sized blocks fill it one after another
+	unsigned long int uiPageOrder = __builtin_ctzl(uiPageSize);
+	for (unsigned long int i = 0; i < 256; ++i)
+	{
+		if (pBin + (i * uiPageSize) != arena_malloc(pArena, uiPageSize))
+			iResult = -1;
+	}
+	
+	if (-1 == malloc_frag_bin(pArena, 0, &stBin) || 256 != stBin.allocated_blocks[uiPageOrder] || uiBinSize != stBin.used_bytes)
+		iResult = -1;
+	
+	// A request smaller than a page does not take a page of it
+	unsigned char* pSmall = (unsigned char*)arena_malloc(pArena, 64);
+	if (NULL == pSmall || (pSmall >= pBin && pSmall < pBin + uiBinSize))
+		iResult = -1;
+	
+	// Once all its blocks are freed, the bin is whole again
+	for (unsigned long int i = 0; i < 256; ++i)
+	{
+		if (-1 == arena_free(pArena, pBin + (i * uiPageSize), uiPageSize))
+			iResult = -1;
+	}
+	
+	if (-1 == malloc_frag_bin(pArena, 0, &stBin) || 0 != stBin.used_bytes || uiBinSize != stBin.largest_free || pBin != arena_malloc(pArena, uiBinSize))
+		iResult = -1;
+	
+	if (-1 == iResult)
+		printf("A bin with page-sized blocks does not work correctly\n");
+	
+	arena_destroy(pArena);
+	
+	return iResult;
+}
+
+// Test that the Guarded Pool catches a use after free ( MALLOC_GUARD_SAMPLE_RATE )
+// A new process of this program is started with every allocation guarded. It must die of SIGSEGV on the access, after reporting it.
+// Return -1 on Failure
+// Return 0 on Success
+int GuardedPoolTest()
+{
+	int iPipe[2];
+	if (-1 == pipe(iPipe))
+		return -1;
+	
+	pid_t iChild = fork();
+	if (-1 == iChild)
+		return -1;
+	
+	if (0 == iChild)
+	{
+		dup2(iPipe[1], STDERR_FILENO);
+		close(iPipe[0]);
+		close(iPipe[1]);
+		setenv("MALLOC_GUARD_SAMPLE_RATE", "1", 1);
+		execl("/proc/self/exe", "test1", "guard", (char*)NULL);
+		_exit(1);
+	}
+	
+	// The report is far smaller than the pipe buffer, so the child never waits for this to read it
+	close(iPipe[1]);
+	char szReport[4096];
+	unsigned long int uiLength = 0;
+	ssize_t iRead = 0;
+	while (uiLength < sizeof(szReport) - 1 && (iRead = read(iPipe[0], szReport + uiLength, sizeof(szReport) - 1 - uiLength)) > 0)
+		uiLength += iRead;
+	
+	szReport[uiLength] = 0;
+	close(iPipe[0]);
+	
+	int iStatus = 0;
+	if (iChild != waitpid(iChild, &iStatus, 0) || 0 == WIFSIGNALED(iStatus) || SIGSEGV != WTERMSIG(iStatus) || NULL == strstr(szReport, "use-after-free"))
+	{
+		printf("The Guarded Pool does not catch a use after free\n");
+		return -1;
+	}
+	
+	return 0;
+}
+
+// Write to a freed block ( For GuardedPoolTest() )
+// Return 0 if the access did not fault
+int UseAfterFree()
+{
+	// The first allocation of a thread is never sampled
+	free(malloc(64));
+	
+	void* pMem = malloc(64);
+	if (NULL == pMem)
+		return 0;
+	
+	unsigned long int uiAddr = (unsigned long int)pMem;
+	free(pMem);
+	*(volatile unsigned char*)uiAddr = 1;
+	
+	return 0;
+}
+
+// Test malloc_prewarm()
+// Return -1 on Failure
+// Return 0 on Success
+int PrewarmTest()
+{
+	if (2 != malloc_prewarm(2, 1024 * 1024, 1))
+	{
+		printf("malloc_prewarm() does not work correctly\n");
+		return -1;
+	}
+	
+	// Each prewarmed Bin holds a block of that size
+	unsigned char* pMem1 = (unsigned char*)malloc(1024 * 1024);
+	unsigned char* pMem2 = (unsigned char*)malloc(1024 * 1024);
+	if (NULL == pMem1 || NULL == pMem2)
+	{
+		printf("malloc_prewarm() does not work correctly\n");
+		return -1;
+	}
+	
+	memset(pMem1, 0xFF, 1024 * 1024);
+	memset(pMem2, 0xFF, 1024 * 1024);
+	free(pMem1);
+	free(pMem2);
+	
+	return 0;
+}
+
+// Test that the bins of an arena are committed from the address space it reserves, and what happens past it or without it ( MALLOC_ARENA_RESERVE_MB )
+// Bins for the first large blocks are in the MODE_TEST_RESERVE_MB the arena reserves, and bins past that are mapped on their own.
+// Blocks from both can be freed from another thread. Then the address space is limited so that the arena of a new thread cannot reserve any.
+// Its bins are mapped on their own, and the failed reservation must not be tried again for each of them.
+// Return -1 on Failure
+// Return 0 on Success
+int ReserveTest()
+{
+	enum { RESERVE_BLOCK_NUMS = MODE_TEST_RESERVE_MB + 32 };
+	const unsigned long int uiBlockSize = 1024 * 1024;
+	unsigned char* pBlocks[RESERVE_BLOCK_NUMS + 1];
+	
+	int iResult = 0;
+	for (int i = 0; i < RESERVE_BLOCK_NUMS; ++i)
+	{
+		pBlocks[i] = (unsigned char*)malloc(uiBlockSize);
+		if (NULL == pBlocks[i])
+			iResult = -1;
+	}
+	pBlocks[RESERVE_BLOCK_NUMS] = NULL;
+	
+	for (int i = 1; i < MODE_TEST_RESERVE_MB / 4 && 0 == iResult; ++i)
+	{
+		unsigned long int uiDistance = (pBlocks[i] > pBlocks[0]) ? pBlocks[i] - pBlocks[0] : pBlocks[0] - pBlocks[i];
+		if (uiDistance >= MODE_TEST_RESERVE_MB * 1024UL * 1024)
+			iResult = -1;
+	}
+	
+	if (-1 == iResult)
+	{
+		printf("Bins are not committed from the reserved address space\n");
+		return -1;
+	}
+	
+	// None of the blocks is left in use, so as many blocks again fit in the same bins
+	pthread_t thread;
+	if (0 != pthread_create(&thread, NULL, FreeBlocksThreadFunc, pBlocks) || 0 != pthread_join(thread, NULL))
+		return -1;
+	
+	unsigned char* pAgain[RESERVE_BLOCK_NUMS + 1];
+	for (int i = 0; i < RESERVE_BLOCK_NUMS; ++i)
+	{
+		pAgain[i] = (unsigned char*)malloc(uiBlockSize);
+		
+		int bFound = 0;
+		for (int j = 0; j < RESERVE_BLOCK_NUMS && 0 == bFound; ++j)
+			bFound = (pAgain[i] == pBlocks[j]);
+		
+		if (0 == bFound)
+			iResult = -1;
+	}
+	pAgain[RESERVE_BLOCK_NUMS] = NULL;
+	FreeBlocksThreadFunc(pAgain);
+	
+	if (-1 == iResult)
+	{
+		printf("Blocks in and past the reserved address space cannot be freed from another thread\n");
+		return -1;
+	}
+	
+	// Leave room for the stack of the new thread and its bins, but not for MODE_TEST_RESERVE_MB more
+	unsigned long int uiVmPages = 0;
+	FILE* pStatm = fopen("/proc/self/statm", "r");
+	if (NULL == pStatm || 1 != fscanf(pStatm, "%lu", &uiVmPages))
+	{
+		if (pStatm)
+			fclose(pStatm);
+		
+		return -1;
+	}
+	fclose(pStatm);
+	
+	struct rlimit rlimitOld;
+	struct rlimit rlimitNew;
+	getrlimit(RLIMIT_AS, &rlimitOld);
+	rlimitNew = rlimitOld;
+	rlimitNew.rlim_cur = (uiVmPages * sysconf(_SC_PAGESIZE)) + ((MODE_TEST_RESERVE_MB / 2) * 1024UL * 1024);
+	if (-1 == setrlimit(RLIMIT_AS, &rlimitNew))
+		return -1;
+	
+	struct malloc_instrument_stats instrumentBefore;
+	struct malloc_instrument_stats instrumentAfter;
+	malloc_instrument(1);
+	malloc_instrument_read(&instrumentBefore);
+	
+	void* pReturn = NULL;
+	if (0 != pthread_create(&thread, NULL, ReserveThreadFunc, NULL) || 0 != pthread_join(thread, &pReturn))
+		pReturn = NULL;
+	
+	malloc_instrument_read(&instrumentAfter);
+	malloc_instrument(0);
+	setrlimit(RLIMIT_AS, &rlimitOld);
+	
+	// One call for the failed reservation, then one for each bin
+	unsigned long int uiNewBins = instrumentAfter.new_bins - instrumentBefore.new_bins;
+	unsigned long int uiMapCalls = instrumentAfter.map_calls - instrumentBefore.map_calls;
+	if (NULL == pReturn || 0 == uiNewBins || uiMapCalls > uiNewBins + 1)
+	{
+		printf("An arena that cannot reserve address space does not work correctly\n");
+		return -1;
+	}
+	
+	return 0;
+}
+
+// Free each block of the NULL-terminated array pArg_ ( For ReserveTest() )
+void* FreeBlocksThreadFunc(void* pArg_)
+{
+	for (unsigned char** ppBlock = (unsigned char**)pArg_; *ppBlock; ++ppBlock)
+		free(*ppBlock);
+	
+	return NULL;
+}
+
+// Allocate and free a few large blocks in the arena of a new thread, and return NULL if one cannot be allocated ( For ReserveTest() )
+void* ReserveThreadFunc(void* pArg_)
+{
+	enum { RESERVE_THREAD_BLOCK_NUMS = 4 };
+	void* pBlocks[RESERVE_THREAD_BLOCK_NUMS];
+	void* pResult = pBlocks;
+	for (int i = 0; i < RESERVE_THREAD_BLOCK_NUMS; ++i)
+	{
+		pBlocks[i] = malloc(1024 * 1024);
+		if (NULL == pBlocks[i])
+			pResult = NULL;
+	}
+	
+	for (int i = 0; i < RESERVE_THREAD_BLOCK_NUMS; ++i)
+		free(pBlocks[i]);
+	
+	return pResult;
+}
+
+// Test malloc_instrument() and malloc_instrument_read()
+// Return -1 on Failure
+// Return 0 on Success
+int InstrumentTest()
+{
+	int iPrevious = malloc_instrument(1);
+	
+	void* pMem = malloc(64);
+	free(pMem);
+	
+	struct malloc_instrument_stats stStats;
+	malloc_instrument_read(&stStats);
+	malloc_instrument(iPrevious);
+	
+	unsigned long uiMallocCalls = 0;
+	unsigned long uiFreeCalls = 0;
+	for (int i = 0; i < MALLOC_HISTOGRAM_BUCKETS; ++i)
+	{
+		uiMallocCalls += stStats.malloc_latency[i];
+		uiFreeCalls += stStats.free_latency[i];
+	}
+	
+	if (NULL == pMem || 0 == uiMallocCalls || 0 == uiFreeCalls || stStats.bins_scanned < stStats.alloc_calls)
+	{
+		printf("malloc_instrument() does not work correctly\n");
+		return -1;
+	}
+	
+	return 0;
+}
+
+// Test malloc_frag_bin(), malloc_frag_arena() and malloc_frag_process()
+// Return -1 on Failure
+// Return 0 on Success
+int FragTest()
+{
+	// 100 bytes are rounded up to a block of 128 bytes
+	unsigned char* pMem = (unsigned char*)malloc(100);
+	memset(pMem, 0xFF, 100);
+	
+	struct malloc_frag_stats stArena;
+	struct malloc_frag_stats stBin;
+	struct malloc_frag_stats stProcess;
+	if (NULL == pMem || -1 == malloc_frag_arena(NULL, &stArena) || -1 == malloc_frag_bin(NULL, 0, &stBin))
+	{
+		printf("malloc_frag_arena() does not work correctly\n");
+		return -1;
+	}
+	
+	malloc_frag_process(&stProcess);
+	free(pMem);
+	
+	if (0 == stArena.bins || 0 == stArena.allocated_blocks[7] || stArena.used_bytes + stArena.free_bytes != stArena.total_bytes ||
+		stArena.requested_bytes >= stArena.rounded_bytes || 0 == stArena.resident_pages)
+	{
+		printf("malloc_frag_arena() does not work correctly\n");
+		return -1;
+	}
+	
+	if (1 != stBin.bins || stBin.total_bytes > stArena.total_bytes || stProcess.total_bytes < stArena.total_bytes)
+	{
+		printf("malloc_frag_bin() does not work correctly\n");
+		return -1;
+	}
+	
+	if (-1 != malloc_frag_bin(NULL, 1000000, &stBin))
+	{
+		printf("malloc_frag_bin() does not work correctly\n");
+		return -1;
+	}
+	
+	return 0;
+}
+
+// Test malloc_snapshot(), and that snapview reads the file it writes
+// Return -1 on Failure
+// Return 0 on Success
+int SnapshotTest()
+{
+	// Write under /tmp so that an interrupted run leaves nothing in the working directory
+	char szPath[] = "/tmp/libmalloc-test-XXXXXX.snap";
+	int iFd = mkstemps(szPath, 5);
+	if (-1 == iFd)
+	{
+		printf("mkstemps() failed\n");
+		return -1;
+	}
+	
+	close(iFd);
+	
+	unsigned char* pMem = malloc(100);
+	int iResult = malloc_snapshot(szPath);
+	free(pMem);
+	
+	FILE* pFile = fopen(szPath, "rb");
+	unsigned long int uiHeader[2] = { 0, 0 };
+	if (-1 == iResult || NULL == pFile || 1 != fread(uiHeader, sizeof(uiHeader), 1, pFile) || MALLOC_SNAPSHOT_MAGIC != uiHeader[0])
+	{
+		printf("malloc_snapshot() does not work correctly\n");
+		if (pFile)
+			fclose(pFile);
+		
+		unlink(szPath);
+		return -1;
+	}
+	
+	fclose(pFile);
+	
+	// snapview is built next to test1 ( See Makefile )
+	pid_t iChild = fork();
+	if (0 == iChild)
+	{
+		int iNull = open("/dev/null", O_WRONLY);
+		dup2(iNull, STDOUT_FILENO);
+		execl("./snapview", "snapview", szPath, (char*)NULL);
+		_exit(127);
+	}
+	
+	int iStatus = 0;
+	if (-1 == iChild || iChild != waitpid(iChild, &iStatus, 0) || 0 == WIFEXITED(iStatus) || 0 != WEXITSTATUS(iStatus))
+	{
+		printf("snapview cannot read the file written by malloc_snapshot()\n");
+		unlink(szPath);
+		return -1;
+	}
+	
+	unlink(szPath);
+	
+	if (-1 != malloc_snapshot("/nonexistent/test1.snap"))
+	{
+		printf("malloc_snapshot() does not work correctly\n");
+		return -1;
+	}
+	
+	return 0;
+}
+
+// Test malloc_defrag_hint() and malloc_defrag()
+// Return -1 on Failure
+// Return 0 on Success
+int DefragTest()
+{
+	const int iNums = 24576;
+	const int iTail = 8192;
+	void** pMem = malloc(sizeof(void*) * iNums);
+	if (NULL == pMem)
+		return -1;
+	
+	for (int i = 0; i < iNums; ++i)
+		pMem[i] = malloc(64);
+	
+	// Leave three blocks in four at the beginning, and only one block in sixteen at the end, so that the last Bin becomes sparse
+	for (int i = 0; i < iNums; ++i)
+	{
+		if ((i < iNums - iTail) ? (3 == i % 4) : (0 != i % 16))
+		{
+			free(pMem[i]);
+			pMem[i] = NULL;
+		}
+	}
+	
+	int iSparse = 0;
+	for (int i = iNums - iTail; i < iNums; i += 16)
+		iSparse += malloc_defrag_hint(pMem[i]);
+	
+	int iResult = 0;
+	if (0 == iSparse || 0 != malloc_defrag_hint(pMem[0]) || -1 != malloc_defrag_hint((unsigned char*)pMem[0] + 8) || -1 != malloc_defrag_hint(&iResult))
+	{
+		printf("malloc_defrag_hint() does not work correctly\n");
+		iResult = -1;
+	}
+	
+	// An object moved out of a sparse Bin must not land in a sparse Bin again
+	for (int i = iNums - iTail; 0 == iResult && i < iNums; i += 16)
+	{
+		if (1 != malloc_defrag_hint(pMem[i]))
+			continue;
+		
+		void* pMoved = malloc_defrag(64);
+		if (NULL == pMoved || 0 != malloc_defrag_hint(pMoved))
+		{
+			printf("malloc_defrag() does not work correctly\n");
+			iResult = -1;
+		}
+		
+		free(pMem[i]);
+		pMem[i] = pMoved;
+	}
+	
+	for (int i = 0; i < iNums; ++i)
+		free(pMem[i]);
+	
+	free(pMem);
+	
+	return iResult;
+}
+
+// Test free_sized(), free_aligned_sized() and arena_free()
+// Return -1 on Failure
+// Return 0 on Success
+int SizedFreeTest()
+{
+	int iResult = 0;
+	
+	// A block freed with its size can be allocated again
+	unsigned char* pMem1 = (unsigned char*)malloc(100);
+	memset(pMem1, 0xFF, 100);
+	free_sized(pMem1, 100);
+	unsigned char* pMem2 = (unsigned char*)malloc(100);
+	if (pMem1 != pMem2)
+	{
+		printf("free_sized() does not work correctly\n");
+		iResult = -1;
+	}
+	
+	free_sized(pMem2, 100);
+	
+	unsigned char* pMem3 = (unsigned char*)memalign(256, 40);
+	free_aligned_sized(pMem3, 256, 40);
+	unsigned char* pMem4 = (unsigned char*)memalign(256, 40);
+	if (pMem3 != pMem4)
+	{
+		printf("free_aligned_sized() does not work correctly\n");
+		iResult = -1;
+	}
+	
+	free_aligned_sized(pMem4, 256, 40);
+	free_sized(NULL, 100);
+	
+	void* pArena = arena_create();
+	if (NULL == pArena)
+	{
+		printf("arena_create() does not work correctly\n");
+		return -1;
+	}
+	
+	unsigned char* pArenaMem1 = (unsigned char*)arena_malloc(pArena, 16);
+	unsigned char* pArenaMem2 = (unsigned char*)arena_malloc(pArena, 16);
+	if (NULL == pArenaMem1 || NULL == pArenaMem2 || 0 != arena_free(pArena, pArenaMem1, 16) || pArenaMem1 != arena_malloc(pArena, 16))
+	{
+		printf("arena_free() does not work correctly\n");
+		iResult = -1;
+	}
+	
+	// A wrong size must not free more than the block
+	if (0 != arena_free(pArena, pArenaMem1, 4096) || pArenaMem1 != arena_malloc(pArena, 16) || pArenaMem2 + 16 != arena_malloc(pArena, 16))
+	{
+		printf("arena_free() does not work correctly with a wrong size\n");
+		iResult = -1;
+	}
+	
+	// Memory from another arena is left alone
+	unsigned char* pMem5 = (unsigned char*)malloc(16);
+	if (-1 != arena_free(pArena, pMem5, 16))
+	{
+		printf("arena_free() does not work correctly with memory of another arena\n");
+		iResult = -1;
+	}
+	
+	free(pMem5);
+	arena_destroy(pArena);
+	
+	return iResult;
+}
+
+// Test malloc_placement()
+// Return -1 on Failure
+// Return 0 on Success
+int PlacementTest()
+{
+	const size_t uiBlockSize = 8 * 1024;
+	int iPrevious = malloc_placement(MALLOC_PLACEMENT_FIRST_FIT);
+	if (-1 == iPrevious || -1 != malloc_placement(100))
+	{
+		printf("malloc_placement() does not work correctly\n");
+		return -1;
+	}
+	
+	void* pArena = arena_create();
+	if (NULL == pArena)
+	{
+		printf("arena_create() does not work correctly\n");
+		return -1;
+	}
+	
+	// The first Bin of an arena holds 8 blocks, and the second one 16
+	unsigned char* pMem[24];
+	for (int i = 0; i < 24; ++i)
+	{
+		pMem[i] = (unsigned char*)arena_malloc(pArena, uiBlockSize);
+		if (NULL == pMem[i] || (0 != i && 8 != i && pMem[i] != pMem[i - 1] + uiBlockSize))
+		{
+			printf("arena_malloc() does not work correctly\n");
+			arena_destroy(pArena);
+			return -1;
+		}
+	}
+	
+	// The first Bin keeps 3 blocks at its end, and the second one 15
+	for (int i = 0; i < 4; ++i)
+		arena_free(pArena, pMem[i], uiBlockSize);
+	
+	arena_free(pArena, pMem[7], uiBlockSize);
+	arena_free(pArena, pMem[23], uiBlockSize);
+	
+	int iResult = 0;
+	malloc_placement(MALLOC_PLACEMENT_BEST_FIT);
+	
+	// The fullest Bin first
+	if (pMem[23] != arena_malloc(pArena, uiBlockSize))
+	{
+		printf("malloc_placement() does not choose the fullest bin\n");
+		iResult = -1;
+	}
+	
+	// Then the hole between the blocks in use rather than the free half of the first Bin
+	if (pMem[7] != arena_malloc(pArena, uiBlockSize))
+	{
+		printf("malloc_placement() does not choose the smallest free block\n");
+		iResult = -1;
+	}
+	
+	malloc_placement(MALLOC_PLACEMENT_FIRST_FIT);
+	if (pMem[0] != arena_malloc(pArena, uiBlockSize))
+	{
+		printf("malloc_placement() does not restore first fit\n");
+		iResult = -1;
+	}
+	
+	malloc_placement(iPrevious);
+	arena_destroy(pArena);
+	
+	return iResult;
+}
+
+// Test that the Bins of an arena start small and grow
+// Return -1 on Failure
+// Return 0 on Success
+int BinGrowthTest()
+{
+	void* pArena = arena_create();
+	if (NULL == pArena)
+	{
+		printf("arena_create() does not work correctly\n");
+		return -1;
+	}
+	
+	int iResult = 0;
+	struct malloc_frag_stats stArena;
+	
+	// A few small blocks only take a small Bin
+	if (NULL == arena_malloc(pArena, 16) || 0 != malloc_frag_arena(pArena, &stArena) || 1 != stArena.bins || stArena.total_bytes > 16 * (unsigned long)sysconf(_SC_PAGESIZE))
+	{
+		printf("The first bin of an arena is not small\n");
+		iResult = -1;
+	}
+	
+	// 4 MB in 64 KB blocks take a few Bins, each twice as large as the last one
+	for (int i = 0; 0 == iResult && i < 64; ++i)
+	{
+		if (NULL == arena_malloc(pArena, 64 * 1024))
+		{
+			printf("arena_malloc() does not work correctly\n");
+			iResult = -1;
+		}
+	}
+	
+	if (0 == iResult && (0 != malloc_frag_arena(pArena, &stArena) || stArena.bins > 8))
+	{
+		printf("The bins of an arena do not grow\n");
+		iResult = -1;
+	}
+	
+	arena_destroy(pArena);
+	
+	return iResult;
+}
+
+// Test that empty large bins are reused by their size
+// Return -1 on Failure
+// Return 0 on Success
+int LargeCacheTest()
+{
+	void* pArena = arena_create();
+	if (NULL == pArena)
+	{
+		printf("arena_create() does not work correctly\n");
+		return -1;
+	}
+	
+	// Each takes a bin of its own size
+	void* pLarge = arena_malloc(pArena, 64 * 1024 * 1024);
+	void* pSmall = arena_malloc(pArena, 4 * 1024 * 1024);
+	if (NULL == pLarge || NULL == pSmall)
+	{
+		printf("arena_malloc() does not work correctly\n");
+		arena_destroy(pArena);
+		return -1;
+	}
+	
+	arena_free(pArena, pLarge, 64 * 1024 * 1024);
+	arena_free(pArena, pSmall, 4 * 1024 * 1024);
+	
+	// The smaller request does not split the larger bin, even though it comes first
+	int iResult = 0;
+	if (pSmall != arena_malloc(pArena, 4 * 1024 * 1024) || pLarge != arena_malloc(pArena, 64 * 1024 * 1024))
+	{
+		printf("Empty large bins are not reused by their size\n");
+		iResult = -1;
+	}
+	
+	arena_destroy(pArena);
+	
+	return iResult;
+}
+
+// Run a test in a child process with the background thread on ( MALLOC_BACKGROUND_THREAD )
+// The thread is only started when the library is loaded, so the settings are passed down in the environment. ( See RunInArenaMode() )
+// It runs every 10 ms, and empty bins decay after a second. It keeps no empty bins of its own, so that the test only sees the bins it creates.
+// Return -1 on Failure
+// Return 0 on Success
+int RunWithBackgroundThread(const char* pTest_)
+{
+	char szArenaCache[16];
+	char szOverflowCache[16];
+	snprintf(szArenaCache, sizeof(szArenaCache), "%d", CACHE_TEST_ARENA_MB);
+	snprintf(szOverflowCache, sizeof(szOverflowCache), "%d", CACHE_TEST_OVERFLOW_MB);
+	
+	setenv("MALLOC_BACKGROUND_THREAD", "1", 1);
+	setenv("MALLOC_BACKGROUND_INTERVAL_MS", "10", 1);
+	setenv("MALLOC_DECAY_MS", "1000", 1);
+	setenv("MALLOC_BIN_RESERVE", "0", 1);
+	setenv("MALLOC_LARGE_CACHE_MB", szArenaCache, 1);
+	setenv("MALLOC_LARGE_CACHE_OVERFLOW_MB", szOverflowCache, 1);
+	
+	int iResult = RunInArenaMode("thread", pTest_);
+	
+	unsetenv("MALLOC_BACKGROUND_THREAD");
+	unsetenv("MALLOC_BACKGROUND_INTERVAL_MS");
+	unsetenv("MALLOC_DECAY_MS");
+	unsetenv("MALLOC_BIN_RESERVE");
+	unsetenv("MALLOC_LARGE_CACHE_MB");
+	unsetenv("MALLOC_LARGE_CACHE_OVERFLOW_MB");
+	
+	return iResult;
+}
+
+// Test that the background thread keeps empty large bins up to the cache of their arena, then the one all arenas share, and purges them once they decay
+// Each block gets a large bin of its own size, and the background thread goes through the bins in the order they were created.
+// The first blocks fill CACHE_TEST_ARENA_MB, the next ones CACHE_TEST_OVERFLOW_MB, and the last one fits in neither.
+// Return -1 on Failure
+// Return 0 on Success
+int LargeCacheDecayTest()
+{
+	enum { CACHE_BLOCK_NUMS = (CACHE_TEST_ARENA_MB + CACHE_TEST_OVERFLOW_MB) / CACHE_TEST_BLOCK_MB + 1 };
+	const unsigned long int uiBlockSize = CACHE_TEST_BLOCK_MB * 1024UL * 1024;
+	const unsigned long int uiPageNums = uiBlockSize / sysconf(_SC_PAGESIZE);
+	
+	// The addresses are only looked at after the blocks are freed
+	unsigned long int uiBlocks[CACHE_BLOCK_NUMS];
+	for (int i = 0; i < CACHE_BLOCK_NUMS; ++i)
+	{
+		void* pBlock = malloc(uiBlockSize);
+		if (NULL == pBlock)
+			return -1;
+		
+		memset(pBlock, 1, uiBlockSize);
+		uiBlocks[i] = (unsigned long int)pBlock;
+	}
+	
+	for (int i = 0; i < CACHE_BLOCK_NUMS; ++i)
+		free((void*)uiBlocks[i]);
+	
+	// Many rounds, but well before the bins decay
+	usleep(200 * 1000);
+	for (int i = 0; i < CACHE_BLOCK_NUMS; ++i)
+	{
+		unsigned long int uiResident = CountResidentPages(uiBlocks[i], uiBlockSize);
+		if (i < CACHE_BLOCK_NUMS - 1 && uiResident != uiPageNums)
+		{
+			printf("An empty large bin that fits in the cache is purged\n");
+			return -1;
+		}
+		
+		if (i == CACHE_BLOCK_NUMS - 1 && 0 != uiResident)
+		{
+			printf("An empty large bin that does not fit in the cache is kept\n");
+			return -1;
+		}
+	}
+	
+	// Every bin decays after MALLOC_DECAY_MS ( See RunWithBackgroundThread() )
+	for (int iWait = 0; iWait < 100; ++iWait)
+	{
+		usleep(50 * 1000);
+		
+		unsigned long int uiResident = 0;
+		for (int i = 0; i < CACHE_BLOCK_NUMS; ++i)
+			uiResident += CountResidentPages(uiBlocks[i], uiBlockSize);
+		
+		if (0 == uiResident)
+			return 0;
+	}
+	
+	printf("Empty large bins in the cache do not decay\n");
+	return -1;
+}
+
+// Get the number of pages of a range that are in memory
+unsigned long int CountResidentPages(unsigned long int uiAddr_, unsigned long int uiSize_)
+{
+	unsigned long int uiPageSize = sysconf(_SC_PAGESIZE);
+	unsigned long int uiStart = uiAddr_ & ~(uiPageSize - 1);
+	unsigned long int uiPageNums = (uiAddr_ + uiSize_ - uiStart + uiPageSize - 1) / uiPageSize;
+	unsigned char ucResident[uiPageNums];
+	if (-1 == mincore((void*)uiStart, uiPageNums * uiPageSize, ucResident))
+		return 0;
+	
+	unsigned long int uiResident = 0;
+	for (unsigned long int i = 0; i < uiPageNums; ++i)
+		uiResident += (ucResident[i] & 1);
+	
+	return uiResident;
+}
+
+// Test that a new thread takes over the arena of a thread that has exited
+// Return -1 on Failure
+// Return 0 on Success
+int ArenaAdoptionTest()
+{
+	// Only threads with arenas of their own take them over
+	const char* pArenaMode = getenv("MALLOC_ARENA_MODE");
+	if (pArenaMode && 0 != strcmp(pArenaMode, "thread"))
+		return 0;
+	
+	void* pBlock[2];
+	for (int i = 0; i < 2; ++i)
+	{
+		pthread_t uiThread;
+		if (0 != pthread_create(&uiThread, NULL, LargeBlockThreadFunc, NULL) || 0 != pthread_join(uiThread, &pBlock[i]) || NULL == pBlock[i])
+		{
+			printf("malloc() does not work correctly\n");
+			return -1;
+		}
+	}
+	
+	// The second thread finds the bin the first one left
+	if (pBlock[0] != pBlock[1])
+	{
+		printf("The arena of an exited thread is not taken over\n");
+		return -1;
+	}
+	
+	return 0;
+}
+
+// Allocate and free a large block, and return its address ( For ArenaAdoptionTest() )
+void* LargeBlockThreadFunc(void* pArg_)
+{
+	(void)pArg_;
+	
+	void* pMem = malloc(8 * 1024 * 1024);
+	unsigned long int uiAddr = (unsigned long int)pMem;
+	free(pMem);
+	
+	return (void*)uiAddr;
+}
+
+// Test arena_create_shared(), arena_attach(), arena_offset() and arena_address()
+// Return -1 on Failure
+// Return 0 on Success
+int SharedArenaTest()
+{
+	int iFd = arena_create_shared(NULL, 64 * 1024);
+	if (-1 == iFd)
+	{
+		printf("arena_create_shared() does not work correctly\n");
+		return -1;
+	}
+	
+	// Two mappings of the same file stand for two processes
+	void* pArena1 = arena_attach(iFd);
+	void* pArena2 = arena_attach(iFd);
+	if (NULL == pArena1 || NULL == pArena2 || pArena1 == pArena2)
+	{
+		printf("arena_attach() does not work correctly\n");
+		close(iFd);
+		return -1;
+	}
+	
+	int iResult = 0;
+	char* pMessage = (char*)arena_malloc(pArena1, 100);
+	if (NULL == pMessage)
+	{
+		printf("arena_malloc() does not work correctly\n");
+		iResult = -1;
+	}
+	else
+	{
+		// The block is read in place through the other mapping, and freed there
+		strcpy(pMessage, "shared");
+		size_t uiOffset = arena_offset(pArena1, pMessage);
+		char* pReceived = (char*)arena_address(pArena2, uiOffset);
+		if (0 != strcmp(pReceived, "shared") || -1 == arena_free(pArena2, pReceived, 100) || pMessage != arena_malloc(pArena1, 100))
+		{
+			printf("A block of a shared arena is not shared\n");
+			iResult = -1;
+		}
+	}
+	
+	// Another process frees the block and allocates one of its own
+	pid_t iChild = (0 == iResult) ? fork() : -1;
+	if (0 == iChild)
+	{
+		void* pArena = arena_attach(iFd);
+		if (NULL == pArena || -1 == arena_free(pArena, arena_address(pArena, arena_offset(pArena1, pMessage)), 100))
+			_exit(1);
+		
+		char* pReply = (char*)arena_malloc(pArena, 100);
+		if (NULL == pReply)
+			_exit(1);
+		
+		strcpy(pReply, "reply");
+		_exit(0);
+	}
+	
+	int iStatus = 0;
+	if (0 == iResult && (-1 == iChild || iChild != waitpid(iChild, &iStatus, 0) || 0 == WIFEXITED(iStatus) || 0 != WEXITSTATUS(iStatus) || 0 != strcmp(pMessage, "reply")))
+	{
+		printf("A shared arena is not shared with another process\n");
+		iResult = -1;
+	}
+	
+	if (0 == iResult && -1 != arena_free(pArena1, (char*)pArena2 + 100, 0))
+	{
+		printf("arena_free() does not work correctly\n");
+		iResult = -1;
+	}
+	
+	arena_destroy(pArena1);
+	arena_destroy(pArena2);
+	close(iFd);
+	
+	// A large shared arena still packs small blocks next to each other, unlike a coarse bin
+	iFd = (0 == iResult) ? arena_create_shared(NULL, 1024 * 1024) : -1;
+	void* pArena = (-1 != iFd) ? arena_attach(iFd) : NULL;
+	if (0 == iResult && NULL != pArena)
+	{
+		unsigned char* pSmall1 = (unsigned char*)arena_malloc(pArena, 16);
+		unsigned char* pSmall2 = (unsigned char*)arena_malloc(pArena, 16);
+		if (NULL == pSmall1 || NULL == pSmall2 || 16 != ((pSmall1 < pSmall2) ? pSmall2 - pSmall1 : pSmall1 - pSmall2))
+		{
+			printf("A large shared arena does not track small blocks\n");
+			iResult = -1;
+		}
+	}
+	else if (0 == iResult)
+	{
+		printf("arena_create_shared() does not work correctly\n");
+		iResult = -1;
+	}
+	
+	if (pArena)
+		arena_destroy(pArena);
+	
+	if (-1 != iFd)
+		close(iFd);
+	
+	return iResult;
+}
+
+// Test arena_open(), arena_set_root(), arena_get_root() and arena_sync()
+// Return -1 on Failure
+// Return 0 on Success
+int PersistentArenaTest()
+{
+	char szPath[64];
+	snprintf(szPath, sizeof(szPath), "/tmp/libmalloc-test-%d.arena", (int)getpid());
+	unlink(szPath);
+	
+	// A process creates the arena, leaves a string as its root and dies without closing it
+	pid_t iChild = fork();
+	if (0 == iChild)
+	{
+		void* pArena = arena_open(szPath, 64 * 1024);
+		if (NULL == pArena || NULL != arena_get_root(pArena))
+			_exit(1);
+		
+		char* pRoot = (char*)arena_malloc(pArena, 100);
+		if (NULL == pRoot)
+			_exit(1);
+		
+		strcpy(pRoot, "persistent");
+		if (-1 == arena_set_root(pArena, pRoot) || -1 == arena_sync(pArena))
+			_exit(1);
+		
+		_exit(0);
+	}
+	
+	int iStatus = 0;
+	if (-1 == iChild || iChild != waitpid(iChild, &iStatus, 0) || 0 == WIFEXITED(iStatus) || 0 != WEXITSTATUS(iStatus))
+	{
+		printf("arena_open() does not work correctly\n");
+		unlink(szPath);
+		return -1;
+	}
+	
+	// The next process finds the root, and the block stays allocated
+	int iResult = 0;
+	void* pArena = arena_open(szPath, 0);
+	char* pRoot = pArena ? (char*)arena_get_root(pArena) : NULL;
+	if (NULL == pRoot || 0 != strcmp(pRoot, "persistent"))
+	{
+		printf("A persistent arena does not keep its root\n");
+		iResult = -1;
+	}
+	else
+	{
+		char* pOther = (char*)arena_malloc(pArena, 100);
+		if (NULL == pOther || pOther == pRoot || -1 == arena_free(pArena, pOther, 100) || -1 != arena_set_root(pArena, szPath))
+		{
+			printf("A persistent arena does not keep its blocks\n");
+			iResult = -1;
+		}
+	}
+	
+	// Only one process has the arena open at a time
+	iChild = (0 == iResult) ? fork() : -1;
+	if (0 == iChild)
+		_exit((NULL == arena_open(szPath, 0)) ? 0 : 1);
+	
+	if (0 == iResult && (-1 == iChild || iChild != waitpid(iChild, &iStatus, 0) || 0 == WIFEXITED(iStatus) || 0 != WEXITSTATUS(iStatus)))
+	{
+		printf("A persistent arena is opened twice\n");
+		iResult = -1;
+	}
+	
+	if (pArena)
+		arena_destroy(pArena);
+	
+	unlink(szPath);
+	return iResult;
+}
+
+// Test that a persistent arena is consistent when opened again after a process was killed while allocating and freeing from it
+// The process is killed at a different time in each round, so some rounds stop it in the middle of a change to the block states.
+// All its blocks have the same size, so the blocks in use and the ones that can still be allocated must add up to the whole arena.
+// Return -1 on Failure
+// Return 0 on Success
+int PersistentKillTest()
+{
+	enum { KILL_ROUNDS = 20, KILL_ARENA_SIZE = 128 * 1024, KILL_BLOCK_SIZE = 4096, KILL_BLOCK_NUMS = KILL_ARENA_SIZE / KILL_BLOCK_SIZE };
+	char szPath[64];
+	snprintf(szPath, sizeof(szPath), "/tmp/libmalloc-test-%d.arena", (int)getpid());
+	
+	int iResult = 0;
+	for (int iRound = 0; iRound < KILL_ROUNDS && 0 == iResult; ++iRound)
+	{
+		unlink(szPath);
+		void* pArena = arena_open(szPath, KILL_ARENA_SIZE);
+		if (NULL == pArena)
+			return -1;
+		arena_destroy(pArena);
+		
+		pid_t iChild = fork();
+		if (0 == iChild)
+		{
+			pArena = arena_open(szPath, 0);
+			if (NULL == pArena)
+				_exit(1);
+			
+			void* pBlocks[KILL_BLOCK_NUMS] = { NULL };
+			unsigned long int uiRandom = iRound + 1;
+			for (;;)
+			{
+				uiRandom = (uiRandom * 6364136223846793005UL) + 1442695040888963407UL;
+				unsigned long int i = (uiRandom >> 33) % KILL_BLOCK_NUMS;
+				if (pBlocks[i])
+				{
+					arena_free(pArena, pBlocks[i], KILL_BLOCK_SIZE);
+					pBlocks[i] = NULL;
+				}
+				else
+				{
+					pBlocks[i] = arena_malloc(pArena, KILL_BLOCK_SIZE);
+				}
+			}
+		}
+		
+		if (-1 == iChild)
+			return -1;
+		
+		usleep(5000 + (iRound * 1000));
+		kill(iChild, SIGKILL);
+		waitpid(iChild, NULL, 0);
+		
+		struct malloc_frag_stats stats;
+		pArena = arena_open(szPath, 0);
+		if (NULL == pArena || -1 == malloc_frag_arena(pArena, &stats))
+		{
+			printf("A persistent arena cannot be opened after its process was killed\n");
+			iResult = -1;
+			break;
+		}
+		
+		unsigned long int uiFreeBlocks = 0;
+		while (arena_malloc(pArena, KILL_BLOCK_SIZE))
+			++uiFreeBlocks;
+		
+		if (stats.used_bytes + (uiFreeBlocks * KILL_BLOCK_SIZE) != KILL_ARENA_SIZE)
+		{
+			printf("A persistent arena is not consistent after its process was killed\n");
+			iResult = -1;
+		}
+		
+		arena_destroy(pArena);
+	}
+	
+	unlink(szPath);
+	return iResult;
+}
+
+// Posted by each thread of ArenaRegistryTest() once it has allocated
+sem_t g_semRegistryAllocated;
+
+// The threads of ArenaRegistryTest() wait on this until all of them have allocated
+sem_t g_semRegistryRelease;
+
+// Test that threads created at once each register an Arena of their own, and that blocks from all of them can be freed elsewhere
+// More threads are created than one page of Process Metadata holds, so its pages are installed while threads register.
+// Each Arena maps Bins of its own, so blocks from two Arenas are at least a page apart,
+// while two threads sharing an Arena would get blocks next to each other.
+// Return -1 on Failure
+// Return 0 on Success
+int ArenaRegistryTest()
+{
+	enum { REGISTRY_THREAD_NUMS = 128 };
+	pthread_t threads[REGISTRY_THREAD_NUMS];
+	unsigned long int* pBlocks[REGISTRY_THREAD_NUMS];
+	int iResult = 0;
+	
+	sem_init(&g_semRegistryAllocated, 0, 0);
+	sem_init(&g_semRegistryRelease, 0, 0);
+	unsigned long int uiThreadNums = 0;
+	for (; uiThreadNums < REGISTRY_THREAD_NUMS; ++uiThreadNums)
+	{
+		if (0 != pthread_create(&threads[uiThreadNums], NULL, RegistryThreadFunc, (void*)uiThreadNums))
+		{
+			printf("pthread_create() failed in ArenaRegistryTest()\n");
+			iResult = -1;
+			break;
+		}
+	}
+	
+	// No thread exits before all have allocated, so none of them takes over the Arena of another ( Only the threads created are waited for )
+	for (unsigned long int i = 0; i < uiThreadNums; ++i)
+		sem_wait(&g_semRegistryAllocated);
+	
+	for (unsigned long int i = 0; i < uiThreadNums; ++i)
+		sem_post(&g_semRegistryRelease);
+	
+	for (unsigned long int i = 0; i < uiThreadNums; ++i)
+	{
+		pthread_join(threads[i], (void**)&pBlocks[i]);
+		if (NULL == pBlocks[i] || i != *pBlocks[i])
+		{
+			printf("Arenas registered at once do not work correctly\n");
+			iResult = -1;
+		}
+	}
+	
+	unsigned long int uiPageSize = sysconf(_SC_PAGESIZE);
+	for (unsigned long int i = 0; i < uiThreadNums && 0 == iResult; ++i)
+	{
+		for (unsigned long int j = i + 1; j < uiThreadNums; ++j)
+		{
+			unsigned long int uiAddr1 = (unsigned long int)pBlocks[i];
+			unsigned long int uiAddr2 = (unsigned long int)pBlocks[j];
+			if (((uiAddr1 > uiAddr2) ? uiAddr1 - uiAddr2 : uiAddr2 - uiAddr1) < uiPageSize)
+			{
+				printf("Threads registered at once share an Arena\n");
+				iResult = -1;
+				break;
+			}
+		}
+	}
+	
+	// Each block is freed from the main thread, through the Arena it came from
+	for (unsigned long int i = 0; i < uiThreadNums; ++i)
+		free(pBlocks[i]);
+	
+	sem_destroy(&g_semRegistryAllocated);
+	sem_destroy(&g_semRegistryRelease);
+	return iResult;
+}
+
+// Allocate a block while all the threads of ArenaRegistryTest() are alive, and return it
+// The block holds the index of the thread.
+void* RegistryThreadFunc(void* pArg_)
+{
+	unsigned long int* pBlock = (unsigned long int*)malloc(sizeof(unsigned long int));
+	if (pBlock)
+		*pBlock = (unsigned long int)pArg_;
+	
+	sem_post(&g_semRegistryAllocated);
+	sem_wait(&g_semRegistryRelease);
+	return pBlock;
+}
+
+// Test that libmalloc-4k.so uses its own layout on a system with 4096-byte pages instead of falling back to the generic build
+// The fallback is only meant for other page sizes. On a 4096-byte page system it means that ARENA_HEADER_LENGTH
+// no longer matches the header the constructor lays out.
+// Return -1 on Failure
+// Return 0 on Success
+int FixedBuildTest()
+{
+	if (&g_iUseGenericBuild && g_iUseGenericBuild && 4096 == sysconf(_SC_PAGESIZE))
+	{
+		printf("libmalloc-4k.so falls back to the generic build on a system it was built for\n");
+		return -1;
+	}
+	
+	return 0;
+}
\ No newline at end of file